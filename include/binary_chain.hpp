@@ -0,0 +1,91 @@
+#ifndef COSMO_PP_BINARY_CHAIN_HPP
+#define COSMO_PP_BINARY_CHAIN_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+
+/// The binary format of the Markov chain files.
+/// The file starts with a header: the 8 byte magic string "CPPCHAIN", the number of parameters and the size of the header in bytes (as 32 bit integers), and the names of the parameters as null terminated strings, padded with zeros to a multiple of 8 bytes.
+/// The header is followed by fixed size records, one per chain element, each consisting of (2 + number of parameters) doubles in the native format: the weight of the element, -2ln(likelihood), and the values of the parameters. This is the same as one line of the text format.
+/// An incomplete record at the end of the file (e.g. after a crash) is ignored by the reader.
+class BinaryChainWriter
+{
+public:
+    /// Constructor. Opens the file.
+    /// \param fileName The name of the file.
+    /// \param paramNames The names of the parameters.
+    /// \param bufferSize The number of elements kept in memory before they are written into the file.
+    /// \param append If true and the file already exists with the same number of parameters, the new elements are appended to it. Otherwise the file is started from scratch.
+    /// \param keep When appending, the file is first truncated to at most this many elements. This removes the elements written after a checkpoint (and an incomplete element at the end, if any).
+    BinaryChainWriter(const char* fileName, const std::vector<std::string>& paramNames, unsigned long bufferSize = 1000, bool append = false, unsigned long keep = (unsigned long)(-1));
+
+    /// Destructor. Writes the buffered elements and closes the file. If the writing fails the error is printed, no exception is thrown (call flush before to get the exception).
+    ~BinaryChainWriter();
+
+    /// Add an element. It is written into the file when the buffer is full or flush is called.
+    /// \param prob The weight of the element.
+    /// \param like -2ln(likelihood).
+    /// \param params The values of the parameters (passed as a pointer to the first element).
+    void write(double prob, double like, const double* params);
+
+    /// Write the buffered elements into the file.
+    void flush();
+
+    /// Check if a file is in the binary format.
+    /// \param fileName The name of the file.
+    /// \return true if the file exists and starts with the binary format magic string.
+    static bool isBinary(const char* fileName);
+
+    /// Convert a chain in the binary format into the text format written by MetropolisHastings.
+    /// \param binaryFileName The name of the binary file.
+    /// \param textFileName The name of the text file to write.
+    static void convertToText(const char* binaryFileName, const char* textFileName);
+
+private:
+    // not copyable
+    BinaryChainWriter(const BinaryChainWriter&);
+    BinaryChainWriter& operator=(const BinaryChainWriter&);
+
+private:
+    std::string fileName_;
+    int nParams_;
+    unsigned long bufferSize_;
+    std::vector<double> buffer_;
+    std::ofstream out_;
+};
+
+/// A reader for the binary Markov chain format (see BinaryChainWriter).
+class BinaryChainReader
+{
+public:
+    /// Constructor. Opens the file and reads the header. An exception is thrown if the file cannot be opened or is not in the binary format.
+    /// \param fileName The name of the file.
+    BinaryChainReader(const char* fileName);
+
+    /// Get the number of parameters.
+    int nParams() const { return paramNames_.size(); }
+
+    /// Get the names of the parameters.
+    const std::vector<std::string>& paramNames() const { return paramNames_; }
+
+    /// Get the size of the header.
+    /// \return The size in bytes.
+    unsigned long headerSize() const { return headerSize_; }
+
+    /// Read the next element.
+    /// \param prob The weight of the element will be returned here.
+    /// \param like -2ln(likelihood) will be returned here.
+    /// \param params The values of the parameters will be returned here.
+    /// \return false if there are no more complete elements in the file.
+    bool read(double* prob, double* like, std::vector<double>* params);
+
+private:
+    std::string fileName_;
+    std::vector<std::string> paramNames_;
+    unsigned long headerSize_;
+    std::vector<double> record_;
+    std::ifstream in_;
+};
+
+#endif
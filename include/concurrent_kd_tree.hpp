@@ -0,0 +1,137 @@
+#ifndef COSMO_PP_CONCURRENT_KD_TREE_HPP
+#define COSMO_PP_CONCURRENT_KD_TREE_HPP
+
+#include <vector>
+#include <atomic>
+#include <ostream>
+
+#include <kd_tree.hpp>
+
+/// A k-d tree that can be searched from many threads while new points are being inserted.
+/// There is a single writer (one thread at a time calling insert, merge, reBalance, reset, or setApproximation) and any number of concurrent readers (the search functions).
+/// The readers search an immutable base tree together with a delta buffer holding the points inserted after the base tree was built (the delta is searched by brute force).
+/// An insertion appends the point to the delta buffer, which is allocated once and never moved, and publishes it with an atomic counter, so the point is visible to the readers as soon as insert returns.
+/// As soon as the delta buffer is full (by the insertion that fills it) it is merged into a new base tree (a copy of the old one with the delta points inserted), which then replaces the old one with an atomic pointer swap.
+/// The old base tree is deleted by the writer once all of the readers that could be using it are done (a read-copy-update scheme with two reader counters). The searches never lock or wait.
+/// A merge copies the whole tree, so by default the delta buffer holds sqrt(N) points, which makes both the amortized cost of an insertion and the cost of searching the delta O(sqrt(N)).
+class ConcurrentKDTree
+{
+public:
+    /// Constructor.
+    /// \param dim The dimensionality of the space.
+    /// \param points The points to build the tree on.
+    /// \param singlePrecision If true, the coordinates are stored in single precision (see KDTree).
+    /// \param mergeCount The delta buffer is merged into the base tree after this many insertions. 0 (default) means sqrt of the size of the tree (at least 64).
+    ConcurrentKDTree(int dim, const std::vector<std::vector<double> >& points, bool singlePrecision = false, unsigned long mergeCount = 0);
+
+    /// Constructor from a KDTree snapshot (see KDTree::writeSnapshot), which is used in place as the base tree. The snapshot must stay in memory and unchanged for the lifetime of the tree.
+    /// \param snapshot A pointer to the beginning of the snapshot. Must be aligned to 8 bytes.
+    /// \param size The number of bytes available at snapshot.
+    /// \param mergeCount The size of the delta buffer (see above).
+    ConcurrentKDTree(const char* snapshot, unsigned long size, unsigned long mergeCount = 0);
+
+    /// Destructor. There should be no readers left.
+    ~ConcurrentKDTree();
+
+    /// Get the dimensionality of the space.
+    int dim() const { return dim_; }
+
+    /// Check if the coordinates are stored in single precision.
+    bool singlePrecision() const { return single_; }
+
+    /// Rebuild the tree from scratch with new points. Writer only.
+    /// \param points The new points.
+    void reset(const std::vector<std::vector<double> >& points);
+
+    /// Insert a new point. Writer only. The index of the new point follows the highest index already in the tree (see KDTree::insert).
+    /// \param point The point to insert.
+    void insert(const std::vector<double>& point);
+
+    /// Merge the delta buffer into the base tree now. Writer only.
+    void merge();
+
+    /// Merge the delta buffer and rebalance the tree (see KDTree::reBalance). Writer only.
+    void reBalance();
+
+    /// Set the approximation parameters for the searches (see KDTree::setApproximation). Writer only. Only the base tree is searched approximately, the delta is always searched exactly.
+    void setApproximation(double epsilon = 0, unsigned long maxVisits = 0);
+
+    /// Get the number of elements.
+    /// \return The number of elements.
+    unsigned long nElements() const;
+
+    /// Get the number of elements in the delta buffer, i.e. inserted since the last merge.
+    /// \return The number of elements.
+    unsigned long nDelta() const;
+
+    /// Write a snapshot of the whole tree, including the delta (see KDTree::writeSnapshot). Writer only.
+    /// \param out The stream to write to. It should be opened in binary mode.
+    void writeSnapshot(std::ostream& out) const;
+
+    /// Find k nearest neighbors of a given point (see KDTree::findNearestNeighbors). Can be called from any thread.
+    void findNearestNeighbors(const std::vector<double> &point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL) const { findNearestNeighbors(point, k, indices, distanceSquares, NULL); }
+
+    /// Find k nearest neighbors of a given point, returning both their indices and their coordinates (see KDTree::findNearestNeighbors). Can be called from any thread. neighbors can be NULL.
+    void findNearestNeighbors(const std::vector<double> &point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares, std::vector<std::vector<double> > *neighbors) const;
+
+    /// Find k nearest neighbors for many points at once, returning their indices, and optionally the squared distances and the coordinates, in the layout of KDTree::findNearestNeighborsBatch. Can be called from any thread.
+    /// The base tree is searched with KDTree::findNearestNeighborsBatch, then the delta is searched for all of the points in parallel. All of the points see the same state of the tree.
+    void findNearestNeighborsBatch(const std::vector<std::vector<double> > &points, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL, std::vector<double> *neighbors = NULL) const;
+
+    /// Find all of the points within a given distance from a point, ordered by increasing distance (see KDTree::findWithinRadius). Can be called from any thread.
+    void findWithinRadius(const std::vector<double> &point, double radius, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL) const;
+
+private:
+    // the state seen by the readers
+    struct State
+    {
+        State(KDTree* b, unsigned long capacity, int dim) : base(b), delta(capacity * dim), deltaCount(0) {}
+
+        const KDTree* base;
+        // the coordinates of the points inserted after base was built, row by row, the size is fixed
+        std::vector<double> delta;
+        std::atomic<unsigned long> deltaCount;
+    };
+
+    // marks the current reader for the duration of a search so that the state it uses is not deleted
+    class ReadGuard
+    {
+    public:
+        ReadGuard(const ConcurrentKDTree& tree);
+        ~ReadGuard();
+
+        const State& state() const { return *state_; }
+
+    private:
+        std::atomic<unsigned long>& counter_;
+        const State* state_;
+    };
+
+    // replaces the state by a new one with the given base tree and an empty delta, and deletes the old one once the readers are done
+    void publish(KDTree* base);
+
+    // a copy of the base tree with the delta points inserted
+    KDTree* mergedTree() const;
+
+    // waits until all of the readers that started before the call are done
+    void synchronize();
+
+    // not copyable
+    ConcurrentKDTree(const ConcurrentKDTree&);
+    ConcurrentKDTree& operator=(const ConcurrentKDTree&);
+
+private:
+    int dim_;
+    bool single_;
+    unsigned long mergeCount_;
+    double epsilon_;
+    unsigned long maxVisits_;
+
+    std::atomic<State*> state_;
+
+    // the readers increment the counter with the index equal to the parity of the epoch while searching
+    std::atomic<unsigned long> epoch_;
+    mutable std::atomic<unsigned long> readers_[2];
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef COSMO_PP_DURATION_HISTOGRAM_HPP
+#define COSMO_PP_DURATION_HISTOGRAM_HPP
+
+#include <vector>
+
+#include <macros.hpp>
+
+/// A histogram of durations with logarithmically spaced bins.
+/// The bins are fixed (4 per factor of 2, from 100 nanoseconds to about half an hour, the durations outside of the range going into the first or the last bin), so adding a duration takes constant time and memory, and histograms can be merged. The quantiles are estimated from the bins, with a relative accuracy of about 20%.
+class DurationHistogram
+{
+public:
+    /// Constructor. Creates an empty histogram.
+    DurationHistogram();
+
+    /// Add a duration.
+    /// \param seconds The duration in seconds.
+    void add(double seconds);
+
+    /// Add all of the durations of another histogram.
+    /// \param other The other histogram.
+    void merge(const DurationHistogram& other);
+
+    /// Remove all of the durations.
+    void clear();
+
+    /// Get the number of durations added.
+    unsigned long count() const { return count_; }
+
+    /// Get the sum of the durations.
+    /// \return The sum in seconds.
+    double total() const { return total_; }
+
+    /// Get the mean duration.
+    /// \return The mean in seconds, 0 if the histogram is empty.
+    double mean() const { return count_ ? total_ / count_ : 0; }
+
+    /// Get the smallest duration.
+    /// \return The smallest duration in seconds, 0 if the histogram is empty.
+    double min() const { return count_ ? min_ : 0; }
+
+    /// Get the largest duration.
+    /// \return The largest duration in seconds, 0 if the histogram is empty.
+    double max() const { return max_; }
+
+    /// Estimate a quantile of the durations.
+    /// \param q The quantile, between 0 and 1 (e.g. 0.5 for the median).
+    /// \return The estimated quantile in seconds, 0 if the histogram is empty.
+    double quantile(double q) const;
+
+    /// Get the number of bins.
+    int nBins() const { return bins_.size(); }
+
+    /// Get the lower edge of a bin.
+    /// \param i The bin index.
+    /// \return The lower edge in seconds.
+    double binLower(int i) const;
+
+    /// Get the number of durations in a bin.
+    /// \param i The bin index.
+    /// \return The number of durations.
+    unsigned long binCount(int i) const { check(i >= 0 && i < bins_.size(), "invalid bin " << i); return bins_[i]; }
+
+private:
+    std::vector<unsigned long> bins_;
+    unsigned long count_;
+    double total_;
+    double min_, max_;
+};
+
+#endif
@@ -3,12 +3,17 @@
 
 #include <cmath>
 #include <vector>
+#include <iostream>
+#include <atomic>
+#include <mutex>
 
 #include <macros.hpp>
 #include <kd_tree.hpp>
+#include <concurrent_kd_tree.hpp>
 #include <timer.hpp>
 #include <matrix.hpp>
 #include <progress_meter.hpp>
+#include <row_table.hpp>
 
 /// A class that can be used to find approximate values of a function at a given point by using a training set with exact input and output values of the function.
 /// There are training input and output points of certain dimensions. We call the inputs of the function "points" and the outputs "data".
@@ -16,11 +21,57 @@
 /// The input space is linearly transformed to decorrelate the input parameters, i.e. the covariance matrix of the input parameters is calculated on the training set, the Cholesky decomposed, and this matrix is used to linearly transform the space to another basis where the input parameters are uncorrelated for the training set.
 /// This is important because different input parameters may have different magnitudes, and there may be significant correlations between them. Since the algorithm uses k nearest neighbors for the approximation, it is important that different input parameters contribute to the distance equally.
 /// This class is in fact a machine learning regression class.
+/// The trained state (the linear transformation, the output values and the kd tree) can be written out as a snapshot and later used in place from memory, e.g. from a memory mapped file shared between processes, without being recalculated.
+/// The const query functions keep all of their scratch data in a Workspace supplied by the caller, so one approximator can be queried from many threads at the same time, each thread using its own workspace. The other query functions use a workspace owned by the approximator and can only be called from one thread at a time.
+/// One thread can also keep adding new points with addPoint while the others are querying (the kd tree is a ConcurrentKDTree and the output values of the new points are stored in memory that is never moved), unless the output values are in a table shared with the caller. All of the other modifying functions need exclusive access.
 class FastApproximator
 {
 public:
     /// The interpolation method.
-    enum InterpolationMethod { LINEAR_INTERPOLATION = 0, QUADRATIC_INTERPOLATION, INTERPOLATION_METHOD_MAX };
+    /// The linear and quadratic methods fit a polynomial to the nearest neighbors with weighted least squares.
+    /// The Gaussian process method does a Gaussian process regression over the nearest neighbors, with a squared exponential kernel whose length scale is fitted on the training set (the first time the method is used after the training set is reset, so the other methods do not pay for it). It needs no polynomial terms, so it can be more accurate for the same k, especially in higher dimensions.
+    enum InterpolationMethod { LINEAR_INTERPOLATION = 0, QUADRATIC_INTERPOLATION, GP_INTERPOLATION, INTERPOLATION_METHOD_MAX };
+
+    /// The scratch data for one approximation query. It is sized automatically on first use, and can be reused for any number of queries (also with different approximators).
+    class Workspace
+    {
+    public:
+        Workspace();
+        ~Workspace();
+
+    private:
+        friend class FastApproximator;
+
+        // resizes the buffers if the dimensions are different from the current ones
+        void resize(int nIn, int k);
+
+    private:
+        int nIn_;
+        int k_;
+
+        std::vector<double> pointTransformed_;
+
+        // the nearest neighbors found in the linearly transformed space
+        std::vector<std::vector<double> > neighbors_;
+        std::vector<unsigned long> indices_;
+        std::vector<double> dists_;
+
+        // for the least squares fit
+        Math::Matrix<double> x_, xLin_;
+        Math::Matrix<double> xT_, xTLin_;
+        Math::Matrix<double> prod_, prodLin_;
+        Math::SymmetricMatrix<double> normal_, normalLin_;
+        std::vector<double> solution_;
+        std::vector<double> weights_, coefficients_;
+
+        // for the Gaussian process regression, the factorized kernel matrix and the weights are kept for the last neighborhood
+        // consecutive queries often have the same neighbors, then only the kernel vector of the new point is calculated
+        Math::SymmetricMatrix<double> kernel_;
+        std::vector<std::vector<double> > gpNeighbors_;
+        std::vector<unsigned long> gpIndices_, sortedIndices_;
+        std::vector<double> gpMean_, gpWeights_, gpRhs_;
+        unsigned long gpVersion_;
+    };
 
 public:
     /// Constructor.
@@ -30,7 +81,26 @@ public:
     /// \param points A vector containing all of the input points. Each point should be a vector of dimension nIn. There needs to be at least dataSize points here. If the size of this vector is larger than dataSize then only the first dataSize points will be used.
     /// \param values A vector containing all of the output points. Each point should be a vector of dimension nOut. There needs to be at least dataSize points here. If the size of this vector is larger than dataSize then only the first dataSize points will be used. The indices of values should exactly match the indices of points.
     /// \param k The number of nearest neighbors to use in the approximation.
-    FastApproximator(int nIn, int nOut, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& values, int k);
+    /// \param singlePrecision If true, the linearly transformed points in the kd tree and the output values are stored in single precision, which halves the memory needed. The interpolation is still done in double precision.
+    FastApproximator(int nIn, int nOut, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& values, int k, bool singlePrecision = false);
+
+    /// Constructor with the output values in a table that is shared with the caller and not copied. The table must outlive the approximator, and the rows must not be modified (but new rows can be added, see addPoint) until the next reset.
+    /// \param nIn The dimensionality of the input space, i.e. the number of the input parameters.
+    /// \param nOut The dimensionality of the output space, i.e. the number of the output parameters.
+    /// \param dataSize The number of data points to use.
+    /// \param points A vector containing all of the input points (see above).
+    /// \param values A table containing all of the output values, with nOut columns. There needs to be at least dataSize rows. The precision of the values is the precision of the table.
+    /// \param k The number of nearest neighbors to use in the approximation.
+    /// \param singlePrecision If true, the linearly transformed points in the kd tree are stored in single precision.
+    FastApproximator(int nIn, int nOut, unsigned long dataSize, const std::vector<std::vector<double> >& points, const RowTable& values, int k, bool singlePrecision = false);
+
+    /// Constructor from a snapshot (see writeSnapshot). The output values and the kd tree are used in place, without copying, so the snapshot must stay in memory and unchanged for the lifetime of the approximator.
+    /// Calling addPoint or reset is still allowed, in which case the approximator will first make its own copy of the data.
+    /// An exception is thrown if the snapshot is shorter than implied by its header, e.g. if the file it was mapped from is truncated.
+    /// \param snapshot A pointer to the beginning of the snapshot. Must be aligned to 8 bytes.
+    /// \param size The number of bytes available at snapshot. Can be more than the size of the snapshot.
+    /// \param k The number of nearest neighbors to use in the approximation.
+    FastApproximator(const char* snapshot, unsigned long size, int k);
 
     /// Destructor.
     ~FastApproximator();
@@ -39,25 +109,62 @@ public:
     /// \param dataSize The number of data points to use.
     /// \param points A vector containing all of the input points. Each point should be a vector of dimension nPoints. There needs to be at least dataSize points here. If the size of this vector is larger than dataSize then only the first dataSize points will be used.
     /// \param values A vector containing all of the output points. Each point should be a vector of dimension nOut. There needs to be at least dataSize points here. If the size of this vector is larger than dataSize then only the first dataSize points will be used. The indices of values should exactly match the indices of points.
-    /// \param updateCovariance If this is set to true (by default) then the covariance matrix of the input parameters is recalculated for the new training set, and the linear transformation matrix is updated. It is important to keep in mind that if this step is performed then the distances to previously existing points will change. For example, if the training set is updated by just adding some new points and we want to keep the distances to the old points unchanged then this parameter should be set to false.
-    void reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& values, bool updateCovariance = true);
+    /// \param updateCovariance If this is set to true (by default) then the covariance matrix of the input parameters is recalculated for the new training set, and the linear transformation matrix is updated (unless the change is within the tolerance, see setCovarianceTolerance). It is important to keep in mind that if this step is performed then the distances to previously existing points will change. For example, if the training set is updated by just adding some new points and we want to keep the distances to the old points unchanged then this parameter should be set to false.
+    /// \param previousSize If positive, the current training set of the approximator is the first previousSize points (in any order), e.g. after they have been shuffled. The running mean and covariance of the input points are then updated by removing the points from dataSize to previousSize instead of being recalculated from all of the points. Must be 0 (by default) or at least dataSize. It is ignored if the statistics are not available (after constructing from a snapshot) or do not match previousSize.
+    void reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& values, bool updateCovariance = true, unsigned long previousSize = 0);
 
-    /// Add a new point. This procedure simply adds the new point to the kd tree without recalculating the covariance matrix. Only if the kd tree has become very unbalanced (the depth is more than 4 times log of the number of elements), the kd tree is rebalanced.
+    /// Reset the training set, with the output values in a shared table (see the constructor above).
+    /// \param dataSize The number of data points to use.
+    /// \param points A vector containing all of the input points (see above).
+    /// \param values A table containing all of the output values, with nOut columns. There needs to be at least dataSize rows.
+    /// \param updateCovariance Whether or not to recalculate the linear transformation (see above).
+    /// \param previousSize The size of the current training set if the new one is part of it (see above).
+    void reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const RowTable& values, bool updateCovariance = true, unsigned long previousSize = 0);
+
+    /// Add a new point. This procedure simply adds the new point to the kd tree without recalculating the covariance matrix. The kd tree never needs to be fully rebuilt here (see ConcurrentKDTree::insert).
+    /// The point is visible to the queries as soon as this function returns. It can be called while other threads are querying the approximator with the thread safe functions, unless the output values are in a shared table.
+    /// If the output values are in a shared table, the new row needs to be added to the table by the caller before calling this function, and val is ignored.
     /// \param p The input value.
     /// \param val The output value.
     void addPoint(const std::vector<double>& p, const std::vector<double>& val);
 
+    /// Switch to another shared table of output values with the same rows as the current one, e.g. after the contents of the table have been moved into another table (see RowTable::swap).
+    /// \param values The new table. Needs to have at least as many rows as the training set, in the same order.
+    void setValues(const RowTable& values);
+
     /// Find the nearest neighbors to a given point. This step needs to be always performed before calling getApproximation.
     /// \param point The input point.
     /// \param distances The distances to the nearest neighbors squared will be returned in this vector. This can be set to NULL if the distances are not needed (by default). Keep in mind that the distances are the Euclidean distances in a linearly transformed space where the input training parameters are decorrelated.
     /// \param nearestNeighbors The nearest neighbors RELATIVE to the input point in the linearly transformed space will be returned here. This can be set to NULL if not needed (by default).
     /// \param indices The indices of the nearest neighbors will be returned here. Set to NULL if not needed (by default).
-    void findNearestNeighbors(const std::vector<double>& point, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL);
+    void findNearestNeighbors(const std::vector<double>& point, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL) { findNearestNeighbors(point, &workspace_, distances, nearestNeighbors, indices); }
+
+    /// Find the nearest neighbors to a given point, thread safe version. This step needs to be always performed before calling getApproximation with the same workspace.
+    /// \param point The input point.
+    /// \param workspace The scratch data, the neighbors found are kept here. Each thread needs its own workspace.
+    /// \param distances The distances to the nearest neighbors (see above).
+    /// \param nearestNeighbors The nearest neighbors RELATIVE to the input point (see above).
+    /// \param indices The indices of the nearest neighbors (see above).
+    void findNearestNeighbors(const std::vector<double>& point, Workspace* workspace, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL) const;
+
+    /// Find all of the training points within a given distance from a point. This can be used for example to detect near-duplicate points or to estimate the local density of the training set.
+    /// \param point The input point.
+    /// \param radius The distance. Keep in mind that this is the Euclidean distance in the linearly transformed space where the input training parameters are decorrelated.
+    /// \param indices The indices of the training points found will be returned here, ordered by increasing distance.
+    /// \param distances The distances to the training points found will be returned here. This can be set to NULL if not needed (by default).
+    void findWithinRadius(const std::vector<double>& point, double radius, std::vector<unsigned long>* indices, std::vector<double>* distances = NULL) const;
 
     /// Get the approximation of the output for the input point given to findNearestNeighbors. This function should be called after findNearestNeighbors.
+    /// If the least squares fit cannot be solved even with an increased ridge (or for the Gaussian process method the kernel matrix cannot be factorized even with an increased noise term) the output is filled with NaN, meaning that the approximation is unusable and the exact function should be called.
     /// \param val The output will be returned here.
     /// \param method The interpolation method to be used.
-    void getApproximation(std::vector<double>& val, InterpolationMethod method = QUADRATIC_INTERPOLATION);
+    void getApproximation(std::vector<double>& val, InterpolationMethod method = QUADRATIC_INTERPOLATION) { getApproximation(val, &workspace_, method); }
+
+    /// Get the approximation of the output, thread safe version. This function should be called after findNearestNeighbors with the same workspace.
+    /// \param val The output will be returned here.
+    /// \param workspace The scratch data, containing the nearest neighbors found.
+    /// \param method The interpolation method to be used.
+    void getApproximation(std::vector<double>& val, Workspace* workspace, InterpolationMethod method = QUADRATIC_INTERPOLATION) const;
     
     /// Find the approximate output for a given input point. This function is equivalent to calling findNearestNeighbors followed by getApproximation.
     /// \param point The input point.
@@ -66,7 +173,45 @@ public:
     /// \param distances The distances to the nearest neighbors squared will be returned in this vector. This can be set to NULL if the distances are not needed (by default). Keep in mind that the distances are the Euclidean distances in a linearly transformed space where the input training parameters are decorrelated.
     /// \param nearestNeighbors The nearest neighbors RELATIVE to the input point in the linearly transformed space will be returned here. This can be set to NULL if not needed (by default).
     /// \param indices The indices of the nearest neighbors will be returned here. Set to NULL if not needed (by default).
-    void approximate(const std::vector<double>& point, std::vector<double>& val, InterpolationMethod = QUADRATIC_INTERPOLATION, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL);
+    void approximate(const std::vector<double>& point, std::vector<double>& val, InterpolationMethod method = QUADRATIC_INTERPOLATION, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL) { approximate(point, val, &workspace_, method, distances, nearestNeighbors, indices); }
+
+    /// Find the approximate output for a given input point, thread safe version. Many threads can call this function at the same time, as long as each one uses its own workspace and the approximator is not being modified (other than by addPoint, see above).
+    /// \param point The input point.
+    /// \param val The output will be returned here.
+    /// \param workspace The scratch data. Each thread needs its own workspace.
+    /// \param method The interpolation method to be used.
+    /// \param distances The distances to the nearest neighbors (see above).
+    /// \param nearestNeighbors The nearest neighbors RELATIVE to the input point (see above).
+    /// \param indices The indices of the nearest neighbors (see above).
+    void approximate(const std::vector<double>& point, std::vector<double>& val, Workspace* workspace, InterpolationMethod method = QUADRATIC_INTERPOLATION, std::vector<double>* distances = NULL, std::vector<std::vector<double> >* nearestNeighbors = NULL, std::vector<unsigned long>* indices = NULL) const;
+
+    /// Find the approximate outputs for many input points. This is faster than calling approximate for each point separately: the points are linearly transformed together with one matrix product, the nearest neighbors of all of the points are found with one batch search (see ConcurrentKDTree::findNearestNeighborsBatch), and the fits are run in parallel (OpenMP).
+    /// \param points The input points.
+    /// \param results The outputs will be returned here, one for each input point.
+    /// \param method The interpolation method to be used.
+    /// \param distances The distances to the nearest neighbors of each point (see approximate) will be returned here. This can be set to NULL if not needed (by default).
+    /// \param nearestNeighbors The nearest neighbors of each point RELATIVE to the point (see approximate) will be returned here. This can be set to NULL if not needed (by default).
+    void approximateBatch(const std::vector<std::vector<double> >& points, std::vector<std::vector<double> >* results, InterpolationMethod method = QUADRATIC_INTERPOLATION, std::vector<std::vector<double> >* distances = NULL, std::vector<std::vector<std::vector<double> > >* nearestNeighbors = NULL) const;
+
+    /// Set the tolerance for updating the linear transformation. When reset is called with updateCovariance set to true, the linear transformation is only recalculated if the covariance matrix of the new training set differs from the one it was calculated for by more than the tolerance (see covarianceDrift).
+    /// Otherwise the old transformation is kept, so the distances to the existing points don't change.
+    /// \param tolerance The tolerance. 0 (default) means that the linear transformation is always recalculated.
+    void setCovarianceTolerance(double tolerance) { check(tolerance >= 0, "invalid tolerance " << tolerance); covarianceTolerance_ = tolerance; }
+
+    /// Find out how much the covariance matrix of the training set has changed since the linear transformation was calculated. The covariance matrix is kept up to date as the points are added, without going through the training set.
+    /// This is not available after constructing from a snapshot until the next reset.
+    /// \return The largest absolute difference between an element of the linearly transformed covariance matrix and the unit matrix.
+    double covarianceDrift() const;
+
+    /// Use approximate nearest neighbors. Since the interpolation is weighted by the inverse distances anyway, roughly nearest neighbors are often good enough and can be found much faster in high dimensions.
+    /// \param epsilon The neighbors found will be at most (1 + epsilon) times farther than the exact ones. Set to 0 (default) for exact neighbors.
+    /// \param maxVisits The maximum number of training points to check for each search. Set to 0 (default) for no limit. See KDTree::setApproximation for details. The points added since the kd tree was last merged (see ConcurrentKDTree) are always searched exactly.
+    void setApproximateNeighbors(double epsilon = 0, unsigned long maxVisits = 0) { check(knn_, ""); knn_->setApproximation(epsilon, maxVisits); }
+
+    /// Write a snapshot of the trained state, which can be used later to construct the same approximator (see the constructor above).
+    /// The snapshot is a header (4 unsigned longs: nIn, nOut, training set size, bytes per output value), followed by the linear transformation matrix, the kernel length scale, the output values and the kd tree snapshot (see KDTree::writeSnapshot), all in the native binary format.
+    /// \param out The stream to write to. It should be opened in binary mode.
+    void writeSnapshot(std::ostream& out) const;
 
     /// Get the dimensionality of the input space.
     int nIn() const { return nPoints_; }
@@ -74,7 +219,58 @@ public:
     /// Get the dimensionality of the output space.
     int nOut() const { return nData_; }
 
+    /// Get the table of the output values. After constructing from a snapshot this is a view of the snapshot, which can be shared (see setValues). The values of the points added by addPoint are only included if the table is shared with the caller.
+    const RowTable& values() const { return *data_; }
+
 private:
+    // sizes the matrices and buffers, nPoints_, nData_ and k_ need to be set
+    void allocate();
+    // recalculates the linear transformation (if updateCovariance) and rebuilds the kd tree
+    void resetPoints(unsigned long dataSize, const std::vector<std::vector<double> >& points, bool updateCovariance, unsigned long previousSize);
+    // adds a point to the running mean and covariance
+    void addToStatistics(const std::vector<double>& point);
+    // removes a point that was added before from the running mean and covariance
+    void removeFromStatistics(const std::vector<double>& point);
+    // copies choleskyMat_ into transformation_, needs to be called after choleskyMat_ is changed
+    void updateTransformation();
+    // fits the kernel length scale for the Gaussian process interpolation using the points in kernelSamples_, the kd tree needs to be built
+    void fitKernel() const;
+    // calls fitKernel if the kernel has not been fitted since the last reset, can be called from any thread
+    void ensureKernel() const;
+    // calculates the kernel matrix for the given points and factorizes it, adding a small noise term to the diagonal (larger if needed to make the matrix positive definite)
+    int factorizeKernel(const std::vector<std::vector<double> >& points, int n, Math::SymmetricMatrix<double>* kernel) const;
+    // the Gaussian process interpolation
+    void getGPApproximation(std::vector<double>& val, Workspace* workspace) const;
+    // applies the linear transformation to an input point
+    void transform(const std::vector<double>& point, std::vector<double>* transformed) const;
+    // finds the nearest neighbors of the transformed point in the workspace
+    void searchNeighbors(Workspace* workspace, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices) const;
+    // copies the nearest neighbors found in the workspace to the outputs of the search functions
+    void copyNeighbors(const Workspace& workspace, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices) const;
+
+    // the output values of training point i, from data_ or from the added values
+    inline double value(unsigned long i, int j) const
+    {
+        if(data_ != &ownData_ || i < ownData_.size())
+            return (*data_)(i, j);
+
+        const double* row = addedRow(i - ownData_.size());
+        return row[j];
+    }
+    void getValues(unsigned long i, std::vector<double>* row) const;
+
+    // the location of an added row, the block b has addedBlockRows_ * 2^b rows
+    inline const double* addedRow(unsigned long i) const
+    {
+        const unsigned long q = i / addedBlockRows_ + 1;
+        int b = 0;
+        while((2ul << b) <= q)
+            ++b;
+        return &(addedBlocks_[b][(i - addedBlockRows_ * ((1ul << b) - 1)) * nData_]);
+    }
+    void addRow(const std::vector<double>& val);
+    void clearAdded();
+
     inline double cov(double d) const { return sigma_ * std::exp(-d / (2 * l_)); }
     inline double cov(const std::vector<double>& x, const std::vector<double>& y) const
     {
@@ -93,31 +289,53 @@ private:
 
 private:
     const int k_;
-    KDTree* knn_;
+    ConcurrentKDTree* knn_;
 
-    std::vector<std::vector<double > > data_;
+    // the output values, data_ points either to ownData_ or to a table shared with the caller
+    RowTable ownData_;
+    const RowTable* data_;
 
-    std::vector<std::vector<double> > pointsTransformed_;
+    // the output values of the points added by addPoint if the table is not shared, row by row in blocks of increasing sizes
+    // the blocks are allocated when needed and never moved, so that the rows can be read by other threads while new ones are added
+    static const unsigned long addedBlockRows_ = 256;
+    static const int maxAddedBlocks_ = 48;
+    std::vector<double> addedBlocks_[maxAddedBlocks_];
+    unsigned long nAdded_;
 
-    std::vector<double> pointTransformed_;
+    bool singlePrecision_;
 
     unsigned long dataSize_;
     int nPoints_;
     int nData_;
 
-    std::vector<unsigned long> indices_;
-    std::vector<double> dists_;
+    // the amplitude and the length scale (squared) of the kernel, the length scale is fitted lazily by ensureKernel
+    double sigma_;
+    mutable double l_;
+
+    // the transformed training points around which the kernel length scale is fitted
+    std::vector<std::vector<double> > kernelSamples_;
+    mutable std::atomic<bool> kernelFitted_;
+    mutable std::mutex kernelMutex_;
 
-    double sigma_, l_;
+    // changes every time the kernel or the training points are changed, used to check if the Gaussian process cache of a workspace is still valid
+    mutable unsigned long version_;
+    static std::atomic<unsigned long> versionCounter_;
 
     Math::SymmetricMatrix<double> covariance_;
     Math::Matrix<double> choleskyMat_;
-    Math::Matrix<double> v_, w_;
 
-    Math::Matrix<double> x_, xLin_;
-    Math::Matrix<double> xT_, xTLin_;
-    Math::Matrix<double> inv_, invLin_;
-    Math::Matrix<double> prod_, prodLin_;
+    // a copy of choleskyMat_, row by row, for fast access
+    std::vector<double> transformation_;
+
+    double covarianceTolerance_;
+
+    // the running mean and the sum of the products of deviations from the mean (the lower triangle, row by row) of the training set
+    unsigned long statsCount_;
+    std::vector<double> statsMean_;
+    std::vector<double> statsComoment_;
+
+    // used by the non-const query functions
+    Workspace workspace_;
 };
 
 #endif
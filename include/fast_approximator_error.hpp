@@ -30,6 +30,18 @@ public:
     /// \param dm The decision method, i.e. what property of the error probability distribution to use to compare to precision.
     FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testValues, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method = AVG_DISTANCE, double precision = 1.0, DecisionMethod dm = TWO_SIGMA);
 
+    /// Constructor with the outputs of the test set in a table (see RowTable). The parameters are the same as above.
+    FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const RowTable& testValues, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method = AVG_DISTANCE, double precision = 1.0, DecisionMethod dm = TWO_SIGMA);
+
+    /// Constructor from a previously evaluated error model (see writeModel). The test set is not needed in this case.
+    /// \param fa A reference to the fast approximator being used.
+    /// \param model The stream to read the error model from.
+    /// \param f A function used to evaluate the error for (see above).
+    /// \param method The method to be used to evaluate the error. Should be the same as the one the model was evaluated with.
+    /// \param precision This is the error threshold. The error value will be acceptable if it's smaller than precision.
+    /// \param dm The decision method, i.e. what property of the error probability distribution to use to compare to precision.
+    FastApproximatorError(FastApproximator& fa, std::istream& model, const Math::RealFunctionMultiDim& f, ErrorMethod method = AVG_DISTANCE, double precision = 1.0, DecisionMethod dm = TWO_SIGMA);
+
     /// Destructor.
     ~FastApproximatorError();
 
@@ -40,6 +52,9 @@ public:
     /// \param end The index after the last point to be used. To use all of the points set end to the size of testPoints.
     void reset(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testValues, unsigned long begin, unsigned long end);
 
+    /// Reset the test set, with the outputs in a table (see RowTable). The parameters are the same as above.
+    void reset(const std::vector<std::vector<double> >& testPoints, const RowTable& testValues, unsigned long begin, unsigned long end);
+
     /// Approximate function.
     /// \param point The input point at which the approximation needs to be done.
     /// \param val The approximated result is returned here.
@@ -47,6 +62,7 @@ public:
     /// \param error2Sigma If specified (i.e. not NULL), the two sigma upper bound of the absolute error probability distribution will be returned here.
     /// \param errorMean If specified (i.e. not NULL), the mean of the error probability distribution will be returned here.
     /// \param errorVar If specified (i.e. not NULL), the variance of the error probability distribution will be returned here.
+    /// \return true if the approximation is good enough, false if the estimated error is too large or the fit failed, in which case the exact function should be called.
     bool approximate(const std::vector<double>& point, std::vector<double>& val, double *error1Sigma = NULL, double *error2Sigma = NULL, double *errorMean = NULL, double *errorVar = NULL);
 
     /// Set the precision.
@@ -54,10 +70,45 @@ public:
     /// \param dm The decision method, i.e. what property of the error probability distribution to use to compare to precision.
     void setPrecision(double p, DecisionMethod dm = TWO_SIGMA) { check(p > 0, "invalid precision " << p); check(dm >= 0 && dm < DECISION_METHOD_MAX, ""); precision_ = p; }
 
+    /// The durations of the steps of the last call of approximate, in seconds.
+    struct StepTimes
+    {
+        /// The nearest neighbor search.
+        double neighbors;
+        /// The evaluation of the error model. This is 0 if the error model was not evaluated (see errorEvaluated).
+        double error;
+        /// The fit of the approximation. This is 0 if no fit was done (see fitted).
+        double fit;
+        /// Whether the error model was evaluated. It is not if the fit needed by the error method failed.
+        bool errorEvaluated;
+        /// Whether a fit was done. The fit is only done if the estimated error is small enough, unless the error method needs the fit itself.
+        bool fitted;
+    };
+
+    /// Set whether the durations of the steps of approximate are measured (see getStepTimes). This is off by default.
+    /// \param timing true to measure the durations.
+    void setStepTiming(bool timing) { stepTiming_ = timing; }
+
+    /// Get the durations of the steps of the last call of approximate. Only valid if the timing is on (see setStepTiming).
+    /// \return The durations.
+    const StepTimes& getStepTimes() const { return stepTimes_; }
+
     /// Get the error probability distribution.
+    /// \return The distribution, or NULL if it has not been evaluated (e.g. the error model has been read with readModel).
     Posterior1D* getDistrib() { return posterior_; }
 
+    /// Write the error model, i.e. the summary of the error probability distribution that is used by approximate, in the native binary format. The distribution itself is not written.
+    /// \param out The stream to write to.
+    void writeModel(std::ostream& out) const;
+
+    /// Read the error model written by writeModel.
+    /// \param in The stream to read from.
+    void readModel(std::istream& in);
+
 private:
+    void initMethod();
+    // exactly one of testData and testTable should be non-NULL
+    void reset(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >* testData, const RowTable* testTable, unsigned long begin, unsigned long end);
     double evaluateError();
 
 private:
@@ -68,9 +119,11 @@ private:
     Posterior1D* posterior_;
     bool posteriorGood_;
     double mean_, var_;
+    double sigma1_, sigma2_;
 
     std::vector<double> val_;
     std::vector<double> linVal_;
+    std::vector<double> testRow_;
 
     std::vector<double>* distances_;
     std::vector<std::vector<double> >* nearestNeighbors_;
@@ -81,6 +134,9 @@ private:
 
     double precision_;
     DecisionMethod decMethod_;
+
+    bool stepTiming_;
+    StepTimes stepTimes_;
 };
 
 class BasicFAErrorFunctionAvg : public Math::RealFunctionMultiDim
@@ -2,17 +2,34 @@
 #define COSMO_PP_KD_TREE_HPP
 
 #include <vector>
-#include <queue>
 #include <utility>
+#include <iostream>
 
 /// A k-d tree class.
+/// The tree is stored without pointers. All of the nodes are kept in one contiguous buffer in depth-first traversal order (the left child of a node always immediately follows it), and the coordinates of the points are kept in a flat row-major array in the same order as the nodes.
+/// This makes the nearest neighbor search cache friendly, since the nodes visited during a search and their coordinates are close together in memory.
+/// New points are added with the logarithmic method (Bentley-Saxe). The tree is a collection of a few balanced components of decreasing size, each occupying a contiguous range of the buffers. An inserted point becomes a component of its own and the trailing components are merged (rebuilt) whenever the last one becomes at least as large as the one before it.
+/// This keeps all of the components balanced with an amortized insertion cost of O(log^2 N), and the searches go through all of the components.
+/// The coordinates can optionally be stored in single precision, which halves the memory they take. The distances are still calculated in double precision (from the rounded coordinates).
+/// Since the tree has no pointers, it can be written out as a snapshot (see writeSnapshot) and later used in place from memory, e.g. from a memory mapped file shared between processes, without being copied or rebuilt.
 class KDTree
 {
 public:
     /// Constructor.
     /// \param dim The dimensionality of the space.
     /// \param points The points to build the tree on.
-    KDTree(int dim, const std::vector<std::vector<double> >& points);
+    /// \param singlePrecision If true, the coordinates are stored in single precision (float). The distances returned are then the distances to the rounded points.
+    KDTree(int dim, const std::vector<std::vector<double> >& points, bool singlePrecision = false);
+
+    /// Constructor from a snapshot (see writeSnapshot). The snapshot is used in place, without copying, so it must stay in memory and unchanged for the lifetime of the tree.
+    /// The tree can still be modified (reset, reBalance, insert), in which case it will first make its own copy of the data.
+    /// An exception is thrown if the snapshot is shorter than implied by its header.
+    /// \param snapshot A pointer to the beginning of the snapshot. Must be aligned to 8 bytes.
+    /// \param size The number of bytes available at snapshot. Can be more than the size of the snapshot.
+    KDTree(const char* snapshot, unsigned long size);
+
+    /// Copy constructor. A tree constructed from a snapshot is copied without copying the snapshot, so the snapshot must outlive the copy too.
+    KDTree(const KDTree& other);
 
     /// Destructor.
     ~KDTree();
@@ -20,20 +37,51 @@ public:
     /// Reset the set of points and rebuild the tree.
     void reset(const std::vector<std::vector<double> >& points);
 
-    /// Rebalance the tree. The set of points doesn't change.
+    /// Rebalance the tree, i.e. merge all of the components into one. The set of points doesn't change.
     void reBalance();
 
-    /// Insert a new point into the tree. The tree is not re-balanced, the element is simply inserted into the appropriate location of the tree.
+    /// Insert a new point into the tree. Only the smallest components of the tree are rebuilt (see above), so the tree stays balanced without calling reBalance.
     /// \param point The point to insert.
     void insert(const std::vector<double>& point);
 
-    /// Get the depth of the tree.
+    /// Make the nearest neighbor searches approximate. A branch of the tree is skipped if it is farther than d / (1 + epsilon), where d is the distance to the farthest of the k neighbors found so far.
+    /// Each returned neighbor is then at most (1 + epsilon) times farther than the exact neighbor with the same rank. This can be much faster than the exact search in high dimensions.
+    /// \param epsilon The approximation parameter. Setting it to 0 (default) gives the exact search.
+    /// \param maxVisits The maximum number of points to check in each search. The search stops when this is reached (but not before k points have been found). Set to 0 (default) for no limit. With a limit the epsilon guarantee above no longer holds.
+    void setApproximation(double epsilon = 0, unsigned long maxVisits = 0);
+
+    /// Get the approximation parameter epsilon (see setApproximation).
+    double epsilon() const { return epsilon_; }
+
+    /// Get the maximum number of points to check in each search (see setApproximation).
+    unsigned long maxVisits() const { return maxVisits_; }
+
+    /// Get the dimensionality of the space.
+    int dim() const { return dim_; }
+
+    /// Check if the coordinates are stored in single precision.
+    bool singlePrecision() const { return single_; }
+
+    /// Get the depth of the tree, i.e. the largest depth of its components.
     /// \return The depth.
     int depth() const { return depth_; }
 
+    /// Get the number of balanced components the tree currently consists of.
+    /// \return The number of components.
+    int nComponents() const { return roots_.size(); }
+
     /// Get the number of elements in the tree.
     /// \return The number of elements.
-    unsigned long nElements() const { return elements_.size(); }
+    unsigned long nElements() const { return nNodes_; }
+
+    /// Write a snapshot of the tree, which can be used later to construct the same tree (see the constructor above). The approximation settings are not included.
+    /// The snapshot is a header (5 unsigned longs: dimension, number of nodes, number of components, depth, size of one coordinate in bytes), followed by the component roots, the raw node array and the coordinates (padded to a multiple of 8 bytes), all in the native binary format.
+    /// \param out The stream to write to. It should be opened in binary mode.
+    void writeSnapshot(std::ostream& out) const;
+
+    /// Get the size of the snapshot written by writeSnapshot. It is always a multiple of 8.
+    /// \return The size in bytes.
+    unsigned long snapshotSize() const;
 
     /// Find k nearest neighbors of a given point in the tree.
     /// \param point The point to search around.
@@ -49,37 +97,121 @@ public:
     /// \param distanceSquares A pointer to a vector where the squared distances to the nearest neighbors will be returned. Can be set to NULL (default option) in which case this will be ignored.
     void findNearestNeighbors(const std::vector<double> &point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL) const;
 
+    /// Find k nearest neighbors of a given point in the tree, returning both their indices and their coordinates.
+    /// \param point The point to search around.
+    /// \param k The number of nearest neighbors to return.
+    /// \param indices A pointer to a vector where the INDICES of the nearest neighbors will be returned (see above).
+    /// \param distanceSquares A pointer to a vector where the squared distances to the nearest neighbors will be returned. Can be NULL.
+    /// \param neighbors A pointer to a vector where the nearest neighbors will be returned.
+    void findNearestNeighbors(const std::vector<double> &point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares, std::vector<std::vector<double> > *neighbors) const;
+
+    /// Find k nearest neighbors for many points at once. The queries are run in parallel if OpenMP is enabled, each thread reusing its own search buffers.
+    /// \param points The points to search around.
+    /// \param k The number of nearest neighbors to return for each point.
+    /// \param indices A pointer to a vector where the INDICES of the nearest neighbors will be returned (see above). The vector is resized to points.size() * k, the neighbors of point i are at positions i * k, ..., i * k + k - 1.
+    /// \param distanceSquares A pointer to a vector where the squared distances to the nearest neighbors will be returned, in the same layout as indices. Can be set to NULL (default option) in which case this will be ignored.
+    /// \param neighbors A pointer to a vector where the coordinates of the nearest neighbors will be returned. The vector is resized to points.size() * k * dim, the coordinates of neighbor j of point i start at position (i * k + j) * dim. Can be set to NULL (default option) in which case this will be ignored.
+    void findNearestNeighborsBatch(const std::vector<std::vector<double> > &points, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL, std::vector<double> *neighbors = NULL) const;
+
+    /// Find all of the points within a given distance from a point.
+    /// \param point The point to search around.
+    /// \param radius The distance. Points at exactly this distance are included.
+    /// \param indices A pointer to a vector where the INDICES of the points found will be returned (see above), ordered by increasing distance.
+    /// \param distanceSquares A pointer to a vector where the squared distances to the points found will be returned. Can be set to NULL (default option) in which case this will be ignored.
+    void findWithinRadius(const std::vector<double> &point, double radius, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares = NULL) const;
+
+    /// Find all of the points inside an axis-aligned box.
+    /// \param lower The lower corner of the box.
+    /// \param upper The upper corner of the box. Points on the boundary of the box are included.
+    /// \param indices A pointer to a vector where the INDICES of the points found will be returned (see above), in no particular order.
+    void findInBox(const std::vector<double> &lower, const std::vector<double> &upper, std::vector<unsigned long> *indices) const;
+
 private:
     struct Node
     {
-        unsigned long index;
+        unsigned long index; // the index of the point as it was given in the constructor (or insert)
+        unsigned long left; // position of the left child in nodes_, nullNode if none
+        unsigned long right; // position of the right child in nodes_, nullNode if none
         int depth;
-        Node *parent;
-        Node *left;
-        Node *right;
+        int padding; // always 0, the nodes are written to the snapshots as they are so the padding needs to be initialized
     };
 
-    struct ComparePair
+    // scratch space for the search, can be reused between searches
+    struct SearchBuffer
     {
-        inline bool operator() (const std::pair<double, unsigned long>& a, const std::pair<double, unsigned long>& b) const
-        {
-            return a.first < b.first;
-        }
+        std::vector<std::pair<double, unsigned long> > best; // the nearest neighbors found so far (squared distance, position), sorted by distance
+        std::vector<std::pair<unsigned long, double> > stack; // the nodes left to visit (position, lower bound on the squared distance)
     };
 
 private:
-    Node* construct(std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, Node *parent);
-    void destruct(Node *root);
+    void build(const std::vector<double>& elements);
+    // rebuild the nodes from begin to the end as one component, elements and ids are the coordinates and the indices of the points to use
+    void rebuild(unsigned long begin, const double *elements, const unsigned long *ids);
+    // returns the height of the constructed subtree
+    int construct(const double *elements, const unsigned long *ids, std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, unsigned long pos);
+
+    // finds the nearest neighbors and returns their POSITIONS in nodes_
+    void findNearestPositions(const std::vector<double>& point, int k, std::vector<unsigned long> *positions, std::vector<double> *distanceSquares) const;
+    // same as above but with a given buffer and output arrays of size k, distanceSquares can be NULL
+    void findNearestPositions(const std::vector<double>& point, int k, SearchBuffer& buffer, unsigned long *positions, double *distanceSquares) const;
+
+    // calls search with the template parameter equal to dim_ if dim_ <= Dim, otherwise with Dim = 0
+    template<int Dim>
+    void dispatchSearch(const double *point, int k, SearchBuffer& buffer) const;
+
+    // Dim is the dimension known at compile time, or 0 for the generic version, T is the type of the stored coordinates
+    template<int Dim, typename T>
+    void search(const double *point, int k, SearchBuffer& buffer) const;
+
+    template<typename T>
+    void radiusSearch(const double *point, double radiusSq, std::vector<std::pair<double, unsigned long> >& found) const;
+
+    template<typename T>
+    void boxSearch(const double *lower, const double *upper, std::vector<unsigned long> *indices) const;
 
-    void search(const Node *current, std::priority_queue<std::pair<double, unsigned long>, std::vector<std::pair<double, unsigned long> >, ComparePair>& bpq, int k, const std::vector<double>& point) const;
+    // copies the external data (snapshot) into nodes_ and coords_, needs to be called before modifying the tree
+    void makeOwned();
+    // points nodesPtr_ and coordsPtr_ to nodes_ and coords_, needs to be called after they are resized
+    void updatePointers();
+
+    // the coordinates of all the nodes, T needs to match the storage type
+    template<typename T>
+    const T* coordinateArray() const;
+
+    // copies the coordinates of the node at position pos into res
+    void copyCoordinates(unsigned long pos, double *res) const;
+
+    // the size of the coordinates in the snapshot
+    unsigned long coordinatesSize() const;
+    // the size of the snapshot with the given number of component roots
+    unsigned long snapshotSize(unsigned long nRoots) const;
+
+    // not assignable
+    KDTree& operator=(const KDTree&);
 
 private:
     int dim_;
-    std::vector<std::vector<double> > elements_;
+    bool single_;
+
+    // only one of coords_ and coordsSingle_ is used, depending on single_
+    std::vector<Node> nodes_;
+    std::vector<double> coords_;
+    std::vector<float> coordsSingle_;
+
+    // the nodes and the coordinates used by the searches, either pointing to nodes_ and coords_ (coordsSingle_) or to an external snapshot
+    const Node* nodesPtr_;
+    const double* coordsPtr_;
+    const float* coordsSinglePtr_;
+    unsigned long nNodes_;
+    bool external_;
+
+    // the positions of the roots of the components, component i occupies the positions from roots_[i] to roots_[i + 1]
+    std::vector<unsigned long> roots_;
 
     int depth_;
 
-    Node *root_;
+    double epsilon_;
+    unsigned long maxVisits_;
 };
 
 #endif
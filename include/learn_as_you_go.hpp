@@ -4,13 +4,16 @@
 #include <fstream>
 #include <vector>
 #include <string>
-#include <map>
 
 #include <macros.hpp>
 #include <function.hpp>
 #include <random.hpp>
 #include <fast_approximator.hpp>
 #include <fast_approximator_error.hpp>
+#include <mapped_file.hpp>
+#include <pca_compressor.hpp>
+#include <point_index.hpp>
+#include <learn_as_you_go_telemetry.hpp>
 
 /// Learn as you go approximation class.
 /// This class evaluates a given function f, and as it goes it builds a training set. For every new call, it checks whether a quick approximation from the already existing set is acceptable and if so, calculates the approximation. Otherwise the exact value of f is calculated and added to the training set.
@@ -18,6 +21,16 @@
 class LearnAsYouGo
 {
 public:
+    /// The ways of sharing the new training points between the MPI processes.
+    enum CommunicationMode
+    {
+        /// Every batch of new points is sent to each of the other processes separately.
+        POINT_TO_POINT = 0,
+        /// All of the processes periodically exchange their new points in a non-blocking collective operation.
+        COLLECTIVE,
+        COMMUNICATION_MODE_MAX
+    };
+
     /// Constructor.
     /// \param nIn The dimensionality of the input space.
     /// \param nOut The dimensionality of the output space.
@@ -25,8 +38,10 @@ public:
     /// \param errorFunc The function that is used to model the error. errorFunc should take as an input the output of f and return a single real number.
     /// \minCount The minimum size of the training set before approximation can be performed.
     /// \precision The error threshold. This is used to decide whether or not the approximation is acceptable.
-    /// \fileName If specified, the training set is continuously saved into this file. Also, if the file exists, the training set will be read in the constructor. So if a file is specified, it will always be read and updated.
-    LearnAsYouGo(int nIn, int nData, const Math::RealFunctionMultiToMulti& f, const Math::RealFunctionMultiDim& errorFunc, unsigned long minCount = 10000, double precision = 0.1, const char* fileName = "");
+    /// \fileName If specified, the training set is continuously saved into this file. The new training points are appended to the file as they come in (see writeIntoFile for the format), so the cost of the updates does not grow with the size of the training set. Also, if the file exists, the training set will be read in the constructor. So if a file is specified, it will always be read and updated. In the destructor a snapshot of the training set and the fast approximator is also written into fileName followed by ".snapshot" (see writeSnapshot), which is used by readFromFile.
+    /// \singlePrecision If true, the output values of the training set and the linearly transformed input points in the fast approximator are stored in single precision, which halves the memory needed. The approximation itself is still calculated in double precision.
+    /// \nComponents If positive, the fast approximator interpolates the output values compressed to this many principal components (see PCACompressor) instead of the nOut values themselves, and the approximations are decompressed on output. This makes every approximation faster when nOut is large (e.g. a vector of Cl values). It is only a speed option, it does not reduce the memory used per training point: the exact output values stay in memory for the file, for repeated points, for evaluateExact and for recalculating the coefficients, and the nComponents coefficients per point are stored next to them (use singlePrecision to reduce the memory). The basis is recalculated every time the error model is updated, and the coefficients are then recalculated from the exact values. The compression loss is not included in the error model, so nComponents should be large enough to make it negligible. The file with the training set always contains the exact output values. Must be less than nOut.
+    LearnAsYouGo(int nIn, int nData, const Math::RealFunctionMultiToMulti& f, const Math::RealFunctionMultiDim& errorFunc, unsigned long minCount = 10000, double precision = 0.1, const char* fileName = "", bool singlePrecision = false, int nComponents = 0);
 
     /// Destructor.
     ~LearnAsYouGo();
@@ -49,19 +64,68 @@ public:
     /// \p The error threshold. This is used to decide whether or not the approximation is acceptable.
     void setPrecision(double p);
 
-    /// Save into a file.
+    /// Set the distance below which new points are considered duplicates of existing training points. Such points are not added to the training set.
+    /// The distance is measured in the linearly transformed space of the FastApproximator where the input training parameters are decorrelated, so it is in units of the spread of the training set.
+    /// This check is only done once the fast approximator has been constructed (i.e. the training set has reached minCount).
+    /// \param r The distance. 0 (default) means that only exactly equal points are considered duplicates.
+    void setDuplicateRadius(double r);
+
+    /// Set the tolerance for updating the linear transformation of the fast approximator when the error model is updated (see FastApproximator::setCovarianceTolerance).
+    /// While the covariance matrix of the training set stays within the tolerance, the training set is not transformed again, which makes the updates much faster.
+    /// \param tolerance The tolerance. 0 means that the linear transformation is recalculated on every update. The default is 0.05.
+    void setCovarianceTolerance(double tolerance);
+
+    /// Set whether the fast approximator and the error model are updated in the background.
+    /// Every time the training set grows past the update threshold, the fast approximator and the error model are rebuilt, which normally stalls the calling thread for the whole duration.
+    /// In the asynchronous mode they are rebuilt by a worker thread on a copy of the training set, while evaluate keeps using the previous ones. The new ones are swapped in by the first call of evaluate after the worker is done, and the training points added in the meantime are carried over.
+    /// The copy of the training set temporarily doubles the memory used. errorFunc is called from the worker thread at the same time as from the calling thread, so it needs to be thread safe.
+    /// If the update fails in the worker thread, the exception (of any type) is rethrown by the call of evaluate that would swap in the results.
+    /// \param async true for the asynchronous mode. The default is false.
+    void setAsyncUpdate(bool async);
+
+    /// Set the way of sharing the new training points between the MPI processes. This needs to be called by all of the processes, with the same mode, right after construction.
+    /// In the POINT_TO_POINT mode (default) each process sends every batch of new points to each of the other processes separately, and polls all of them for incoming batches, which makes a number of small messages quadratic in the number of processes.
+    /// In the COLLECTIVE mode the processes exchange their new points in rounds, each round being a non-blocking MPI_Iallgather of the numbers of new points followed by a non-blocking MPI_Iallgatherv of the points themselves, on a separate communicator. A new round starts as soon as the previous one is done, the buffers are reused from round to round. Since every process needs to take part in every round, in the destructor each process keeps exchanging until all of the processes are done. The points received then are added to the training set and the file, but the fast approximator and the error model are not retrained.
+    /// \param mode The mode.
+    void setCommunicationMode(CommunicationMode mode);
+
+    /// Save the whole training set into a file, replacing it atomically.
+    /// The file consists of a header followed by fixed size records, one per training point, each ending with a checksum. New records are later appended to the file used by the constructor, so it can be read even if a crash happens in the middle of an update.
+    /// The file used by the constructor is only written completely (compacted) when needed, i.e. when it is new, has an old format, or has a damaged end.
     /// \param fileName The name of the file.
     void writeIntoFile(const char* fileName) const;
     
     /// Read from a file.
+    /// The records are read up to the end of the file, or up to the first incomplete or corrupted record. Files in the format before the record checksums are also read.
+    /// If a snapshot with the name fileName followed by ".snapshot" exists and was written when the file had exactly its current contents (the same size and the same last record), the training set and the fast approximator are taken from it without reading the records (see writeSnapshot). Otherwise the records are read and the fast approximator is constructed from them.
     /// \param fileName The name of the file.
     /// \return If the operation was successful.
     bool readFromFile(const char* fileName);
 
+    /// Save a snapshot of the training set and the fast approximator (the input points, the output values, the kd tree, the error model, and the compression basis and sample) into a file. Only the process with ID 0 writes.
+    /// The snapshot is memory mapped when read, and the output values and the kd tree are used in place, so all of the processes on the same machine share one copy of them, and nothing needs to be recalculated. Each process keeps its own copy of the input points (which are small) and of the index for finding repeated points. A process makes its own copy of the output values once it adds new training points.
+    /// The snapshot records the size and the last record of the training set file (if the file is up to date), readFromFile only uses it with the same file. The file is replaced atomically, so it is safe to write it while other processes are using the old one.
+    /// \param fileName The name of the file.
+    void writeSnapshot(const char* fileName) const;
+
     /// Set a file to log the progress. Upon every call of evaluate a new row will be added to this log file with the following values: the total number of calls, the number of calls with for which the same input point has been used previously, the number of calls for which the approximation was successful (not counting the cases where the input point was the same as a point in the training set), and the number of calls for which the approximation failed and the exact value of the function was calculated.
     /// \param fileNameBase The file name base. If only one process is run then the log file name is simply the base followed by ".txt". If multiple MPI processes are run, each will create a log file with the name "fileNameBase_id.txt", where id is the MPI process ID, i.e. a number between 0 and number of processes - 1.
     void logIntoFile(const char* fileNameBase);
 
+    /// Set whether the performance of the approximation is measured (see LearnAsYouGoTelemetry). This is off by default.
+    /// The measurements include the durations of the calls of evaluate for each outcome (exact, repeated point, approximation accepted or rejected), the durations of the nearest neighbor search, the fit and the error model evaluation, the size of the training set over time, and the durations of the updates of the fast approximator and the error model.
+    /// Turning it on starts the measurements from scratch, turning it off discards them.
+    /// \param on true to turn the measurements on.
+    void setTelemetry(bool on);
+
+    /// Get the measurements of the performance. The telemetry needs to be on (see setTelemetry).
+    /// \return The measurements.
+    const LearnAsYouGoTelemetry& getTelemetry() const { check(telemetry_, "the telemetry is not on"); return *telemetry_; }
+
+    /// Write the measurements of the performance into files, both in the CSV and the JSON formats (see LearnAsYouGoTelemetry). The telemetry needs to be on (see setTelemetry).
+    /// \param fileNameBase The file name base. The files are named as in logIntoFile, with the extensions ".csv" and ".json", so each MPI process writes its own files.
+    void writeTelemetry(const char* fileNameBase) const;
+
     /// Get the total number of calls.
     /// \return The total number of calls.
     unsigned long getTotalCount() const { return totalCount_; }
@@ -71,10 +135,28 @@ public:
     unsigned long getSuccessfulCount() const { return successfulCount_; }
 
 private:
+    // the state of an asynchronous update, defined in the source file
+    struct UpdateJob;
+
     void construct();
     void randomizeErrorSet();
+    // moves a random subset of size testSize of the training set to the end
+    // compressedData is reordered the same way as data unless it is empty
+    static void randomizeErrorSet(unsigned long testSize, Math::UniformRealGenerator& gen, std::vector<std::vector<double> >* points, RowTable* data, RowTable* compressedData);
+
+    // starts an asynchronous update on a copy of the training set
+    void startUpdate();
+    // runs in the worker thread
+    void runUpdate(UpdateJob* job) const;
+    // waits for the asynchronous update to finish and swaps in its results
+    void finishUpdate();
 
     void constructFast();
+    // reads the training set and the fast approximator from the snapshot if it was written when the training set file had the given size and last record checksum
+    bool readSnapshot(const char* fileName, unsigned long fileSize, unsigned long lastChecksum);
+    int neighborCount() const;
+    // adds the points starting from begin to the fast approximator, which has been trained on the points before begin
+    void addToFast(unsigned long begin);
 
     void log();
 
@@ -82,29 +164,50 @@ private:
 
     void communicate();
     void receive();
-
-    void addDataPoint(const std::vector<double>& p, const std::vector<double>& d);
-
-    void resetPointMap();
+    // advances the collective exchange (see setCommunicationMode) without blocking, done means that this process will not have any new points anymore
+    // returns true if all of the processes have been done in the round that has just finished
+    bool exchange(bool done);
+
+    // if update is false the point is only added to the training set (and to the fast approximator if it exists), nothing is retrained
+    void addDataPoint(const std::vector<double>& p, const std::vector<double>& d, bool update = true);
+
+    void resetPointIndex();
+
+    // appends the new records to the file, or rewrites the whole file if compactFile_ is set
+    void appendToFile();
+    // a record of the file: the point, the output values, and the checksum
+    void makeRecord(const std::vector<double>& p, const std::vector<double>& d, std::vector<char>* record) const;
+
+    // (re)calculates the compression basis and compresses the training set in it
+    void updateCompression();
+    // compresses all of the exact output values in data, always from the exact values so that the compression loss does not accumulate over the basis updates
+    static void compressData(const PCACompressor& compressor, const RowTable& data, RowTable* compressedData);
+    bool compressed() const { return compressor_ && compressor_->ready(); }
+    // the table interpolated by the fast approximator
+    const RowTable& trainingData() const { return compressed() ? compressedData_ : data_; }
+    // the number of columns of trainingData()
+    int dataWidth() const { return compressed() ? nComponents_ : nData_; }
+    // gets the exact output values of a training point
+    void getData(unsigned long i, std::vector<double>* d) const;
+    const Math::RealFunctionMultiDim& errorFunction() const;
 
 private:
-    struct PointComp
+    // the error function evaluated on the decompressed output values, used by the error model when the training set is compressed
+    class DecompressedErrorFunc : public Math::RealFunctionMultiDim
     {
-        bool operator()(const std::vector<double>& a, const std::vector<double>& b) const
+    public:
+        DecompressedErrorFunc(const PCACompressor& compressor, const Math::RealFunctionMultiDim& errorFunc) : compressor_(compressor), errorFunc_(errorFunc) {}
+
+        virtual double evaluate(const std::vector<double>& x) const
         {
-            check(a.size() == b.size(), "");
-            check(!a.empty(), "");
-
-            for(int i = 0; i < a.size(); ++i)
-            {
-                if(a[i] < b[i])
-                    return true;
-                if(a[i] > b[i])
-                    return false;
-            }
-
-            return false;
+            std::vector<double> v;
+            compressor_.decompress(x, &v);
+            return errorFunc_.evaluate(v);
         }
+
+    private:
+        const PCACompressor& compressor_;
+        const Math::RealFunctionMultiDim& errorFunc_;
     };
 
 private:
@@ -113,8 +216,15 @@ private:
     const Math::RealFunctionMultiDim& errorFunc_;
 
     double precision_;
+    double duplicateRadius_;
+    double covarianceTolerance_;
+    bool singlePrecision_;
+    int nComponents_;
+    bool asyncUpdate_;
 
     bool updateFile_;
+    // the file needs to be rewritten completely at the next update
+    bool compactFile_;
     std::string fileName_;
 
     int nProcesses_;
@@ -135,19 +245,54 @@ private:
     std::vector<void*> updateReceiveReq_;
     bool firstUpdateRequested_;
 
+    CommunicationMode communicationMode_;
+
+    // the collective exchange
+    void* exchangeComm_;
+    void* exchangeReq_;
+    // 0 - no round in progress, 1 - exchanging the numbers of points, 2 - exchanging the points
+    int exchangeState_;
+    int exchangeHeader_[2];
+    std::vector<int> exchangeHeaders_;
+    std::vector<int> exchangeCounts_;
+    std::vector<int> exchangeDispls_;
+    // the new points not sent yet, the points being sent, and the points received, each point followed by its output values
+    std::vector<double> exchangePending_;
+    std::vector<double> exchangeSend_;
+    std::vector<double> exchangeReceive_;
+
     std::ofstream* logFile_;
 
+    LearnAsYouGoTelemetry* telemetry_;
+
     Math::UniformRealGenerator gen_;
 
     FastApproximator* fa_;
     FastApproximatorError* fast_;
+    MappedFile* snapshot_;
+
+    PCACompressor* compressor_;
+    DecompressedErrorFunc* compressedErrorFunc_;
+
+    UpdateJob* job_;
 
     unsigned long totalCount_, successfulCount_, sameCount_;
 
-    std::vector<std::vector<double> > points_, data_;
+    std::vector<std::vector<double> > points_;
+
+    // the exact output values, shared with the fast approximator unless the training set is compressed
+    RowTable data_;
+    // the compression coefficients of the output values in the same order, shared with the fast approximator, empty unless the training set is compressed
+    // these are kept next to data_ since only the interpolation uses them
+    RowTable compressedData_;
 
     std::vector<double> tempParams_;
     std::vector<double> tempData_;
+    std::vector<double> tempCompressed_;
+
+    // the records of the training points not written into the file yet
+    std::vector<char> newRecords_;
+    std::vector<char> record_;
 
     std::vector<double> currentParams_;
     std::vector<double> currentData_;
@@ -156,7 +301,10 @@ private:
     std::vector<std::vector<double> > communicateData_;
     std::vector<std::vector<double> > receiveBuff_;
 
-    std::map<std::vector<double>, unsigned long, PointComp> pointMap_;
+    // finds the exact matches in points_
+    PointIndex pointIndex_;
+
+    std::vector<unsigned long> duplicates_;
 };
 
 #endif
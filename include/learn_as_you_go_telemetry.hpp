@@ -0,0 +1,121 @@
+#ifndef COSMO_PP_LEARN_AS_YOU_GO_TELEMETRY_HPP
+#define COSMO_PP_LEARN_AS_YOU_GO_TELEMETRY_HPP
+
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+#include <macros.hpp>
+#include <duration_histogram.hpp>
+
+/// Measurements of the performance of a LearnAsYouGo object (see LearnAsYouGo::setTelemetry).
+/// It contains the histograms of the durations of the calls of evaluate, separately for the different outcomes, and of the steps of the approximation, the size of the training set over time, and the durations of the updates of the fast approximator and the error model.
+/// The times are measured in seconds since the construction (or the last clear).
+class LearnAsYouGoTelemetry
+{
+public:
+    /// The measured durations.
+    enum Timing
+    {
+        /// The calls where the exact function was calculated because the fast approximator has not been constructed yet.
+        EXACT = 0,
+        /// The calls where the input point was already in the training set.
+        REPEATED,
+        /// The calls where the approximation was accepted.
+        APPROXIMATE_ACCEPTED,
+        /// The calls where the approximation was rejected, including the calculation of the exact function.
+        APPROXIMATE_REJECTED,
+        /// The nearest neighbor searches of the approximations.
+        NEAREST_NEIGHBORS,
+        /// The fits of the approximations, including the decompression. The fit is done if the estimated error is small enough (or always if the error method needs it), even if the fit itself then fails.
+        FIT,
+        /// The evaluations of the error model for the approximations.
+        ERROR_MODEL,
+        /// The updates of the fast approximator and the error model.
+        RETRAIN,
+        TIMING_MAX
+    };
+
+    /// The size of the training set at some time.
+    struct SizeSample
+    {
+        /// The time in seconds.
+        double time;
+        /// The total number of calls of evaluate so far.
+        unsigned long calls;
+        /// The size of the training set.
+        unsigned long size;
+    };
+
+    /// An update of the fast approximator and the error model.
+    struct Retrain
+    {
+        /// The time in seconds when the update was finished.
+        double time;
+        /// The size of the training set the update was made with.
+        unsigned long size;
+        /// The duration in seconds.
+        double duration;
+        /// Whether the update was made in the background (see LearnAsYouGo::setAsyncUpdate).
+        bool background;
+    };
+
+public:
+    /// Constructor. Starts the clock.
+    LearnAsYouGoTelemetry();
+
+    /// Remove all of the measurements and restart the clock.
+    void clear();
+
+    /// Get the name of a timing, as used in the output.
+    /// \param t The timing.
+    /// \return The name.
+    static const char* timingName(Timing t);
+
+    /// Get the histogram of a timing.
+    /// \param t The timing.
+    /// \return The histogram.
+    const DurationHistogram& timing(Timing t) const { check(t >= 0 && t < TIMING_MAX, "invalid timing " << t); return timings_[t]; }
+
+    /// Get the size of the training set over time. A sample is added every time the size grows by at least 1%.
+    const std::vector<SizeSample>& sizes() const { return sizes_; }
+
+    /// Get the updates of the fast approximator and the error model.
+    const std::vector<Retrain>& retrains() const { return retrains_; }
+
+    /// Get the time since the construction (or the last clear).
+    /// \return The time in seconds.
+    double elapsed() const;
+
+    /// Add a duration.
+    /// \param t The timing.
+    /// \param seconds The duration in seconds.
+    void addTiming(Timing t, double seconds) { check(t >= 0 && t < TIMING_MAX, "invalid timing " << t); timings_[t].add(seconds); }
+
+    /// Report the size of the training set. A sample is only kept if the size has grown by at least 1% since the last one.
+    /// \param calls The total number of calls of evaluate so far.
+    /// \param size The size of the training set.
+    void addSize(unsigned long calls, unsigned long size);
+
+    /// Add an update of the fast approximator and the error model. Its duration is also added to the RETRAIN histogram.
+    /// \param size The size of the training set the update was made with.
+    /// \param duration The duration in seconds.
+    /// \param background Whether the update was made in the background.
+    void addRetrain(unsigned long size, double duration, bool background);
+
+    /// Write the measurements in the CSV format. There are three tables separated by empty lines: the summary of each timing (count, total, mean, min, 50%, 90% and 99% quantiles, max), the sizes of the training set, and the updates.
+    /// \param out The stream to write to.
+    void writeCSV(std::ostream& out) const;
+
+    /// Write the measurements in the JSON format. In addition to the summaries, the non-empty histogram bins of the timings are written (as pairs of the lower edge and the count).
+    /// \param out The stream to write to.
+    void writeJSON(std::ostream& out) const;
+
+private:
+    std::chrono::steady_clock::time_point start_;
+    std::vector<DurationHistogram> timings_;
+    std::vector<SizeSample> sizes_;
+    std::vector<Retrain> retrains_;
+};
+
+#endif
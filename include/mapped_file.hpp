@@ -0,0 +1,37 @@
+#ifndef COSMO_PP_MAPPED_FILE_HPP
+#define COSMO_PP_MAPPED_FILE_HPP
+
+/// A read-only memory mapped file.
+/// The contents of the file are not copied into the memory of the process, the pages are loaded by the operating system when needed.
+/// All of the processes on the same machine mapping the same file share one copy of it in memory.
+/// The file should not be modified while it is mapped. To update it, write a new file and rename it over the old one.
+class MappedFile
+{
+public:
+    /// Constructor. Maps the whole file. An exception is thrown if the file cannot be opened or mapped.
+    /// \param fileName The name of the file.
+    MappedFile(const char* fileName);
+
+    /// Destructor. Unmaps the file.
+    ~MappedFile();
+
+    /// Get the contents of the file. The returned pointer is aligned to a page boundary.
+    /// \return A pointer to the beginning of the file in memory.
+    const char* data() const { return data_; }
+
+    /// Get the size of the file.
+    /// \return The size in bytes.
+    unsigned long size() const { return size_; }
+
+private:
+    // not copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    const char* data_;
+    unsigned long size_;
+};
+
+#endif
+
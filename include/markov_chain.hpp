@@ -186,14 +186,14 @@ public:
 
 public:
     /// Constructor for the case of a single chain.
-    /// \param fileName The name of the file containing the chain.
+    /// \param fileName The name of the file containing the chain. The file can be in the text format or in the binary format (see BinaryChainWriter), which is recognized automatically.
     /// \param burnin The number of elements to ignore from the beginning of the chain.
     /// \param thin The thinning factor. Must be positive.
     MarkovChain(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1, const char *errorLogFileNameBase = NULL, int nError = 1);
 
     /// Constructor for the case of multiple chains.
     /// \param nChains The number of chains.
-    /// \param fileNameRoot The root of the names of the files containing the chains. The actual file names should be this root followed by _ then the index of the chain (from 0 to nChains - 1) and then .txt
+    /// \param fileNameRoot The root of the names of the files containing the chains. The actual file names should be this root followed by _ then the index of the chain (from 0 to nChains - 1) and then .txt, or .bin for the binary format (see BinaryChainWriter). If both exist, the newer one is used.
     /// \param burnin The number of elements to ignore from the beginning of the chain.
     /// \param thin The thinning factor. Must be positive.
     MarkovChain(int nChains, const char* fileNameRoot, unsigned long burnin = 0, unsigned int thin = 1, const char *errorLogFileNameBase = NULL);
@@ -202,7 +202,7 @@ public:
     ~MarkovChain();
 
     /// Allows to add another chain file.
-    /// \param fileName The name of the file containing the chain.
+    /// \param fileName The name of the file containing the chain, in the text or the binary format.
     /// \param burnin The number of elements to ignore from the beginning of the chain.
     /// \param thin The thinning factor. Must be positive.
     void addFile(const char* fileName, unsigned long burnin = 0, unsigned int thin = 1);
@@ -371,6 +371,11 @@ public:
     /// \return 0 if successful, otherwise an error code (see Lapack documentation).
     int invertFromCholeskyFactorization();
 
+    /// Solve the linear system A x = b, where A is this matrix. This function should be called after choleskyFactorize. It is much faster than inverting the matrix if only a few solutions are needed.
+    /// \param b The right hand side. The solution will be written here.
+    /// \return 0 if successful, otherwise an error code (see Lapack documentation).
+    int solveFromCholeskyFactorization(std::vector<DataType>* b) const;
+
     /// Invert the matrix (in place).
     /// \return 0 if successful, otherwise an error code (see Lapack documentation).
     virtual int invert();
@@ -741,6 +741,14 @@ SymmetricMatrix<T>::invertFromCholeskyFactorization()
     return -1;
 }
 
+template<typename T>
+int
+SymmetricMatrix<T>::solveFromCholeskyFactorization(std::vector<DataType>* b) const
+{
+    check(false, "");
+    return -1;
+}
+
 template<typename T>
 int
 SymmetricMatrix<T>::invert()
@@ -797,6 +805,10 @@ template<>
 int
 SymmetricMatrix<double>::invertFromCholeskyFactorization();
 
+template<>
+int
+SymmetricMatrix<double>::solveFromCholeskyFactorization(std::vector<double>* b) const;
+
 template<>
 int
 SymmetricMatrix<double>::invert();
@@ -9,6 +9,10 @@
 #include <cmath>
 #include <limits>
 #include <ctime>
+#include <cstdio>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -16,6 +20,8 @@
 #include <likelihood_function.hpp>
 #include <random.hpp>
 #include <matrix_impl.hpp>
+#include <binary_chain.hpp>
+#include <spsc_queue.hpp>
 
 namespace Math
 {
@@ -65,6 +71,9 @@ private:
 public:
     enum CONVERGENCE_DIAGNOSTIC { GELMAN_RUBIN = 0, ACCURACY, CONVERGENCE_DIAGNOSTIC_MAX };
 
+    /// The format of the chain files. TEXT_CHAIN is the text format described in run, BINARY_CHAIN is the binary format described in BinaryChainWriter.
+    enum CHAIN_FORMAT { TEXT_CHAIN = 0, BINARY_CHAIN, CHAIN_FORMAT_MAX };
+
     /// Constructor.
     /// \param nPar The number of parameters.
     /// \param like The likelihood function.
@@ -106,6 +115,13 @@ public:
     /// \param blocks A vector defining the indices of the parameters in each block. Each element of the vector is the index following the end of the corresponding block. There are as many elements as there are blocks. For example, if all of the parameters are to belong to one block, the vector should contain one element with value equal to the number of the parameters.
     void specifyParameterBlocks(const std::vector<int>& blocks);
 
+    /// Set the speeds of the parameter blocks for fast/slow sampling. Should be called after specifyParameterBlocks, if that is called.
+    /// The speed of a block is the number of times it is updated in each iteration. The blocks with the lowest speed are the slow ones, the rest are fast. The slow blocks need to come first, i.e. the speeds need to be non-decreasing. The speeds are typically chosen so that the time spent on updating the fast blocks is comparable to the time of updating the slow ones. For this to be useful the likelihood function needs to be fast when only the fast parameters change (e.g. PlanckLikelihood skips CLASS when the cosmological parameters are unchanged).
+    /// With dragSteps > 0 the slow blocks are updated by dragging (R. Neal, arXiv:math/0502099). Each slow proposal is followed by dragSteps updates of all of the fast blocks, sampling from an interpolation between the posteriors at the old and the new slow parameters, and the final point is accepted or rejected as a whole. This allows large moves of the slow parameters in directions degenerate with the fast ones. Each drag step calculates the likelihood alternately at the old and the new slow parameters, so dragging only pays off if the likelihood function keeps the expensive results for both of them. PlanckLikelihood only keeps the last cosmology, so with it every drag step runs CLASS twice and dragging is much slower than oversampling the fast blocks (dragSteps = 0). The proposals need to be symmetric, and dragging cannot be combined with delayed acceptance (see setDelayedAcceptance).
+    /// \param speeds The speeds of the blocks, as many as the blocks. By default all of the speeds are 1.
+    /// \param dragSteps The number of drag steps for each slow update. 0 (default) means no dragging, i.e. the fast blocks are only oversampled.
+    void setBlockSpeeds(const std::vector<int>& speeds, int dragSteps = 0);
+
     /// Set an external prior function for all of the parameters. The values set by setParam or setParamGauss will then be ignored. 
     /// One of these functions still needs to be called for each parameter to set their names, starting values, sampling widths, and accuracies.
     /// \param prior A pointer to the external prior function.
@@ -116,7 +132,26 @@ public:
     /// \param proposal A pointer to the external proposal distribution.
     void useExternalProposal(ProposalFunctionBase* proposal) { externalProposal_ = proposal; }
 
-    /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings. The resulting chain is written in the file (fileRoot).txt. The first column is the number of repetitions of the element, the second column is -2ln(likelihood), the following columns are the values of all of the parameters.
+    /// Set the format of the chain files, and how often they are written to the disk.
+    /// For cheap likelihoods formatting the text and writing to the disk can take most of the time of the run, in which case the binary format with a large flushEvery should be used. The binary chain is written in the file (fileRoot).bin (with the chain index before the extension if there are multiple chains). It can be read directly by MarkovChain, or converted to the text format with BinaryChainWriter::convertToText.
+    /// The chain is always written to the disk before the resume information (see run), so that the two are consistent.
+    /// When a run starts from scratch, the chain file in the other format with the same name (left from an earlier run) is removed, since MarkovChain reads the newer one of the two.
+    /// \param format The format. The default is TEXT_CHAIN.
+    /// \param flushEvery The chain elements are written to the disk every this many iterations (100 by default).
+    void setChainFormat(CHAIN_FORMAT format, unsigned long flushEvery = 100);
+
+    /// Set whether the chain and the resume information are written by a separate thread.
+    /// In the asynchronous mode the sampler only copies the chain elements and the resume information into a lock-free queue, and an output thread formats and writes them, so the latency of the file system (e.g. on a network file system) is taken out of the sampling steps. If the output thread falls behind on the resume information, only the latest one is written. The order is the same as in the synchronous mode, i.e. the resume information is only written after the chain elements before it.
+    /// If writing fails in the output thread, the exception (of any type) is rethrown by run.
+    /// \param async true for the asynchronous mode. The default is false.
+    void setAsyncOutput(bool async) { asyncOutput_ = async; }
+
+    /// Set whether the proposals are screened with the approximate likelihood (delayed acceptance).
+    /// In this mode the likelihood function is expected to have a cheap approximate calculate and an expensive calculateExact (e.g. PlanckLikeFast). Each proposal is first accepted or rejected with the approximate likelihood, and calculateExact is only called for the proposals that pass the first stage. These are then accepted with the probability min(1, L(y) L_approx(x) / (L(x) L_approx(y))), where x is the current point and y is the proposal. The resulting chain samples the exact posterior, and the likelihoods written in the chain are the exact ones. The number of calls of calculateExact is reduced by the first stage rejection rate.
+    /// \param delayed true for delayed acceptance. The default is false, in which case only calculate is used.
+    void setDelayedAcceptance(bool delayed) { delayedAcceptance_ = delayed; }
+
+    /// Run the scan. Should be called after all of the other necessary functions have been called to set all of the necessary settings. The resulting chain is written in the file (fileRoot).txt (with the chain index before the extension if there are multiple chains), unless the binary format is set (see setChainFormat). The first column is the number of repetitions of the element, the second column is -2ln(likelihood), the following columns are the values of all of the parameters.
     /// \param maxChainLength The maximum length of the chain (1000000 by default). The scan will stop when the chain reaches that length, even if the required accuracy for the parameters has not been achieved. If the accuracies are achieved earlier the scan will stop earlier.
     /// \param writeResumeInformationEvery Defines if resume information should be written in a file and how often. This will allow an interrupted run to resume. 0 will mean no resume information will be written. The default setting of 1 is recommended in most cases. However, if the likelihood calculation is very fast, so that the likelihood computing time is faster or comparable to writing out a small binary file, this parameter should be set to higher value. The reason is that it will slow down the scan significantly, and the chance of the resume file being corrupt and useless will be high (this will happen if the code is stopped during writing out the resume file).
     /// \param burnin The burnin length. These elements will still be written out into the chain but will be ignored for determining convergence.
@@ -135,15 +170,36 @@ private:
     inline void calculateStoppingData();
     inline bool stop();
     inline bool checkStoppingCrit();
-    inline double generateNewPoint(int i) const { return current_[i] + generator_->generate() * samplingWidth_[i]; }
+    inline double generateNewPoint(const std::vector<double>& point, int i) const { return point[i] + generator_->generate() * samplingWidth_[i]; }
+
+    // generates a proposal for the given block from point, in place. block will contain the new values of the block parameters
+    void proposeBlock(int i, std::vector<double>& point, std::vector<double>* block);
+    // one Metropolis-Hastings update of block i, returns true if accepted
+    bool updateBlock(int i, int* notAcceptedCount, unsigned long* passedFirstStage);
+    // one update of the slow block i by dragging the fast blocks, returns true if accepted
+    bool dragBlock(int i);
+    // the likelihood is only calculated if the prior is nonzero
+    void evaluatePoint(std::vector<double>& point, double* prior, double* like);
     inline void openOut(bool append);
-    inline void closeOut() { out_.close(); }
-    inline void writeChainElement();
+    inline void closeOut();
+    inline void flushOut();
+    inline void writeChainElement(double like, const double* params);
     inline void update();
-    inline void writeResumeInfo() const;
+    inline void writeResumeInfo(std::ostream& out) const;
+    // writes the resume file atomically, through a temporary file
+    void saveResumeInfo(const std::string& info) const;
     inline bool readResumeInfo();
 
-    inline void writeCommInfo(std::ofstream& out) const;
+    // the asynchronous output (see setAsyncOutput)
+    void startOutputThread();
+    // waits for the output thread to write everything and stop
+    void stopOutputThread();
+    void outputLoop();
+    // waits for a free slot in the output queue
+    void waitForOutputSlot();
+    void checkOutputError();
+
+    inline void writeCommInfo(std::ostream& out) const;
     inline void readCommInfo(std::ifstream& in);
     bool synchronizeCommInfo();
 
@@ -173,6 +229,9 @@ private:
     PriorFunctionBase* externalPrior_;
     ProposalFunctionBase* externalProposal_;
     std::vector<int> blocks_;
+    std::vector<int> blockSpeeds_;
+    int nSlowBlocks_;
+    int dragSteps_;
 
     unsigned long covarianceElementsNum_;
     Math::SymmetricMatrix<double> covariance_;
@@ -209,7 +268,7 @@ private:
         std::vector<double> sums, sqSums, stdMean;
         double iter;
 
-        inline void writeIntoFile(std::ofstream& out) const
+        inline void writeIntoFile(std::ostream& out) const
         {
             const int n = sums.size();
             check(sqSums.size() == n, "");
@@ -247,6 +306,31 @@ private:
     const int resumeCode_;
 
     std::ofstream out_;
+    CHAIN_FORMAT chainFormat_;
+    unsigned long flushEvery_;
+    BinaryChainWriter* binaryOut_;
+
+    enum OUTPUT_JOB_TYPE { CHAIN_ELEMENT_JOB = 0, RESUME_INFO_JOB, STOP_JOB, OUTPUT_JOB_TYPE_MAX };
+
+    struct OutputJob
+    {
+        OUTPUT_JOB_TYPE type;
+        // -2ln(likelihood) followed by the parameters
+        std::vector<double> element;
+        std::string resumeInfo;
+    };
+
+    bool asyncOutput_;
+    SPSCQueue<OutputJob> outputQueue_;
+    std::thread outputThread_;
+    std::atomic<bool> outputFailed_;
+    // the exception thrown in the output thread, of any type, set before outputFailed_
+    std::exception_ptr outputError_;
+
+    bool delayedAcceptance_;
+    // the approximate likelihood of the current point, only used with delayed acceptance
+    double currentApproxLike_;
+
     int nChains_, currentChainI_;
     double burnin_;
 
@@ -297,7 +381,7 @@ private:
         std::vector<double> paramSum;
         std::vector<std::vector<double> > matrixSum;
 
-        inline void writeIntoFile(std::ofstream& out) const
+        inline void writeIntoFile(std::ostream& out) const
         {
             const int dim = paramSum.size();
             check(matrixSum.size() == dim, "");
@@ -599,6 +683,21 @@ MetropolisHastings::openOut(bool append)
     fileName << fileRoot_;
     if(nChains_ > 1)
         fileName << '_' << currentChainI_;
+
+    // MarkovChain reads the newer one of the two formats, so a file in the other format left from an earlier run is removed when starting from scratch
+    if(!append)
+        std::remove((fileName.str() + (chainFormat_ == BINARY_CHAIN ? ".txt" : ".bin")).c_str());
+
+    if(chainFormat_ == BINARY_CHAIN)
+    {
+        fileName << ".bin";
+
+        // when resuming, the elements written after the resume information are dropped
+        check(!binaryOut_, "");
+        binaryOut_ = new BinaryChainWriter(fileName.str().c_str(), paramNames_, flushEvery_, append, iteration_);
+        return;
+    }
+
     fileName << ".txt";
 
     if(append)
@@ -617,13 +716,41 @@ MetropolisHastings::openOut(bool append)
 }
 
 void
-MetropolisHastings::writeChainElement()
+MetropolisHastings::closeOut()
 {
+    if(binaryOut_)
+    {
+        delete binaryOut_;
+        binaryOut_ = NULL;
+        return;
+    }
+
+    out_.close();
+}
+
+void
+MetropolisHastings::flushOut()
+{
+    if(binaryOut_)
+        binaryOut_->flush();
+    else
+        out_.flush();
+}
+
+void
+MetropolisHastings::writeChainElement(double like, const double* params)
+{
+    if(binaryOut_)
+    {
+        binaryOut_->write(1, like, params);
+        return;
+    }
+
     check(out_, "");
-    out_ << 1 << "   " << currentLike_;
+    out_ << 1 << "   " << like;
     for(int i = 0; i < n_; ++i)
-        out_ << "   " << current_[i];
-    out_ << std::endl;
+        out_ << "   " << params[i];
+    out_ << '\n';
 }
 
 void
@@ -699,7 +826,7 @@ MetropolisHastings::updateCovarianceMatrix(const CovarianceMatrixUpdateInfo& inf
 }
 
 void
-MetropolisHastings::writeCommInfo(std::ofstream& out) const
+MetropolisHastings::writeCommInfo(std::ostream& out) const
 {
     const int n = commInfo_.size();
     check(n == nChains_, "");
@@ -754,12 +881,8 @@ MetropolisHastings::readCommInfo(std::ifstream& in)
 }
 
 void
-MetropolisHastings::writeResumeInfo() const
+MetropolisHastings::writeResumeInfo(std::ostream& out) const
 {
-    std::ofstream out(resumeFileName_.c_str(), std::ios::binary | std::ios::out);
-    if(!out)
-        return;
-
     out.write((char*)(&maxChainLength_), sizeof(unsigned long));
     out.write((char*)(&iteration_), sizeof(unsigned long));
     out.write((char*)(&currentLike_), sizeof(double));
@@ -799,8 +922,6 @@ MetropolisHastings::writeResumeInfo() const
         writeCommInfo(out);
 
     out.write((char*)(&resumeCode_), sizeof(int));
-
-    out.close();
 }
 
 bool
@@ -2,6 +2,8 @@
 #define COSMO_PP_NUMERICS_HPP
 
 #include <cmath>
+#include <cstring>
+#include <stdint.h>
 
 namespace Math
 {
@@ -24,6 +26,21 @@ bool areEqual(T a, T b, T precision = 1E-7)
 	return std::abs(a - b) / std::abs(a) < precision;
 }
 	
+/// Checks if a number is finite, i.e. neither infinite nor NaN.
+
+/// Unlike std::isfinite this checks the bits of the number, so it works even if the code is compiled with -ffast-math (the release build), which lets the compiler assume that there are no infinities or NaNs.
+/// \param x The number.
+/// \return true if x is finite.
+inline bool isFinite(double x)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+
+    // the exponent bits are all set for infinities and NaNs
+    const uint64_t exponentMask = 0x7FF0000000000000ULL;
+    return (bits & exponentMask) != exponentMask;
+}
+
 /// This class is used to check if a real number is less than the other one with a given precision. 
 /// It can be used to construct sets and maps of real numbers. If the numbers are equal within a given precision then they're not considered to be less than one another.
 template<typename T>
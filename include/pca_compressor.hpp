@@ -0,0 +1,102 @@
+#ifndef COSMO_PP_PCA_COMPRESSOR_HPP
+#define COSMO_PP_PCA_COMPRESSOR_HPP
+
+#include <vector>
+#include <iostream>
+
+#include <random.hpp>
+
+/// Lossy compression of vectors by principal component analysis.
+/// A vector v of dimension n is represented by its coefficients c = B (v - m) on the first few principal components B (an orthonormal set of nComponents vectors) around the mean m, and is approximately recovered as m + B^T c.
+/// The basis is calculated from a sample of the vectors added with addSample. The sample is a uniformly random subset of bounded size of all of the vectors added so far (reservoir sampling), so the basis can be periodically recalculated as more vectors come in, at a fixed cost.
+class PCACompressor
+{
+public:
+    /// Constructor.
+    /// \param n The dimension of the vectors.
+    /// \param nComponents The number of principal components to keep, i.e. the dimension of the compressed vectors. Must be less than n.
+    /// \param sampleSize The maximum number of sample vectors kept for calculating the basis. 0 (default) means 10 * nComponents.
+    PCACompressor(int n, int nComponents, unsigned long sampleSize = 0);
+
+    /// Get the dimension of the vectors.
+    int n() const { return n_; }
+
+    /// Get the number of principal components, i.e. the dimension of the compressed vectors.
+    int nComponents() const { return nComponents_; }
+
+    /// Check if the basis has been calculated.
+    bool ready() const { return ready_; }
+
+    /// Add a new vector to the sample. It replaces a random one of the existing sample vectors (or none) if the sample is full.
+    /// \param v The vector.
+    void addSample(const std::vector<double>& v);
+
+    /// Get the number of vectors in the sample.
+    unsigned long nSamples() const { return samples_.size(); }
+
+    /// Replace the sample by the sample of another compressor with the same dimensions. The basis is not changed.
+    /// \param other The other compressor.
+    void copySample(const PCACompressor& other);
+
+    /// (Re)calculate the basis from the current sample. There need to be at least 2 sample vectors.
+    void updateBasis();
+
+    /// Get the fraction of the variance of the sample explained by the basis when it was last calculated.
+    double explainedVariance() const { return explained_; }
+
+    /// Compress a vector.
+    /// \param v The vector, of dimension n.
+    /// \param c The coefficients (of dimension nComponents) will be returned here.
+    void compress(const std::vector<double>& v, std::vector<double>* c) const;
+
+    /// Decompress a vector.
+    /// \param c The coefficients, of dimension nComponents.
+    /// \param v The approximate vector (of dimension n) will be returned here.
+    void decompress(const std::vector<double>& c, std::vector<double>* v) const;
+
+    /// Get the size of the output of writeBasis.
+    /// \return The size in bytes.
+    unsigned long basisSize() const;
+
+    /// Write the basis (the mean followed by the components) in the native binary format.
+    /// \param out The stream to write to.
+    void writeBasis(std::ostream& out) const;
+
+    /// Set the basis from the format written by writeBasis. The sample is not changed.
+    /// An exception is thrown if fewer than basisSize() bytes are available or if the basis contains values that are not finite. The current basis is not changed in that case.
+    /// \param data A pointer to the basis. The data is copied.
+    /// \param size The number of bytes available at data.
+    void readBasis(const char* data, unsigned long size);
+
+    /// Get the size of the output of writeSample.
+    /// \return The size in bytes.
+    unsigned long sampleBytes() const;
+
+    /// Write the sample (the number of vectors seen so far and the sample vectors) in the native binary format.
+    /// \param out The stream to write to.
+    void writeSample(std::ostream& out) const;
+
+    /// Replace the sample by the one in the format written by writeSample. An exception is thrown if the data is truncated or invalid, the current sample is not changed in that case.
+    /// \param data A pointer to the sample. Must be aligned to 8 bytes. The data is copied.
+    /// \param size The number of bytes available at data.
+    /// \return The number of bytes read.
+    unsigned long readSample(const char* data, unsigned long size);
+
+private:
+    int n_;
+    int nComponents_;
+    unsigned long sampleSize_;
+    unsigned long seen_;
+    bool ready_;
+    double explained_;
+
+    std::vector<std::vector<double> > samples_;
+
+    std::vector<double> mean_;
+    // the components, row by row
+    std::vector<double> basis_;
+
+    Math::UniformRealGenerator gen_;
+};
+
+#endif
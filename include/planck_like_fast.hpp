@@ -27,7 +27,8 @@ public:
     /// \param kPerDecade The number of points per decade in the k space for the primordial power spectrum calculation.
     /// \param precision The precision of the likelihood. If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
     /// \param minCount The minimum number of points in the training set for the approximation to be acceptable.
-    PlanckLikeFast(CosmologicalParams* params, bool lowT = true, bool lowP = true, bool highT = true, bool highP = true, bool highLikeLite = true, bool lensingT = true, bool lensingP = true, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000);
+    /// \param nComponents If positive, the emulated Cl values are interpolated as this many principal components, which speeds up the approximations (see LearnAsYouGo).
+    PlanckLikeFast(CosmologicalParams* params, bool lowT = true, bool lowP = true, bool highT = true, bool highP = true, bool highLikeLite = true, bool lensingT = true, bool lensingP = true, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000, int nComponents = 0);
 #else
     /// Constructor.
     /// \param params A pointer to CosmologicalParameters. This is used to simply set the parameter model and the number of cosmological parameters. The values of the parameters do not matter.
@@ -40,7 +41,8 @@ public:
     /// \param kPerDecade The number of points per decade in the k space for the primordial power spectrum calculation.
     /// \param precision The precision of the likelihood. If the estimated error of the approximation is less than this precision then the approximation is used (fast), otherwise the full likelihood will be calculated (slow).
     /// \param minCount The minimum number of points in the training set for the approximation to be acceptable.
-    PlanckLikeFast(CosmologicalParams* params, bool useCommander = true, bool useCamspec = true, bool useLensing = true, bool usePolarization = false, bool useActSpt = false, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000);
+    /// \param nComponents If positive, the emulated Cl values are interpolated as this many principal components, which speeds up the approximations (see LearnAsYouGo).
+    PlanckLikeFast(CosmologicalParams* params, bool useCommander = true, bool useCamspec = true, bool useLensing = true, bool usePolarization = false, bool useActSpt = false, bool includeTensors = false, double kPerDecade = 100, double precision = 0.2, unsigned long minCount = 10000, int nComponents = 0);
 #endif
 
     /// Destructor.
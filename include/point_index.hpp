@@ -0,0 +1,59 @@
+#ifndef COSMO_PP_POINT_INDEX_HPP
+#define COSMO_PP_POINT_INDEX_HPP
+
+#include <vector>
+
+/// A hash index for finding exact matches of points in a vector of points.
+/// The index only stores the positions of the points in the vector (an open addressing hash table with linear probing), the points themselves are not copied. The hash is calculated from the bit patterns of the coordinates.
+/// The points are compared by the bit patterns of the coordinates, except that 0 and -0 are considered equal. Unlike ==, this does not depend on the floating point options of the compiler (e.g. -ffast-math).
+class PointIndex
+{
+public:
+    /// Constructor.
+    /// \param points The vector of points to index. It is not copied, so it needs to stay alive for the lifetime of the index. Initially none of the points are indexed.
+    explicit PointIndex(const std::vector<std::vector<double> >& points);
+
+    /// Get the number of indexed points.
+    unsigned long size() const { return size_; }
+
+    /// Remove all of the points from the index.
+    void clear();
+
+    /// Index all of the points in the vector, from scratch.
+    void reset();
+
+    /// Add a point to the index.
+    /// \param i The position of the point in the vector. A point equal to it should not already be indexed.
+    void insert(unsigned long i);
+
+    /// Find a point.
+    /// \param point The point to find.
+    /// \param i If the point is found, its position in the vector will be returned here.
+    /// \return true if the point is found.
+    bool find(const std::vector<double>& point, unsigned long* i) const;
+
+    /// The hash function used for the points.
+    /// \param point The point.
+    /// \return The hash.
+    static unsigned long hash(const std::vector<double>& point);
+
+private:
+    static bool equal(const std::vector<double>& a, const std::vector<double>& b);
+
+    // grows the table to have at least the given number of slots (rounded up to a power of 2) and reinserts the points
+    void rehash(unsigned long nSlots);
+
+    // not copyable
+    PointIndex(const PointIndex&);
+    PointIndex& operator=(const PointIndex&);
+
+private:
+    const std::vector<std::vector<double> >& points_;
+    unsigned long size_;
+
+    // the positions of the points, or empty_, the size is a power of 2
+    std::vector<unsigned long> slots_;
+    static const unsigned long empty_;
+};
+
+#endif
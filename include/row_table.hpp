@@ -0,0 +1,107 @@
+#ifndef COSMO_PP_ROW_TABLE_HPP
+#define COSMO_PP_ROW_TABLE_HPP
+
+#include <vector>
+#include <iostream>
+
+#include <macros.hpp>
+
+/// A table of real numbers with a fixed number of columns, stored contiguously row by row.
+/// The values can be stored either in double or in single (float) precision. In single precision the table takes half the memory, the values are rounded when stored and returned as double.
+/// The table can also be a read-only view of external memory (e.g. a memory mapped file), in which case it makes its own copy of the data before the first modification.
+class RowTable
+{
+public:
+    /// Constructor.
+    /// \param width The number of columns.
+    /// \param singlePrecision If true, the values are stored in single precision.
+    explicit RowTable(int width = 0, bool singlePrecision = false);
+
+    /// Copy constructor. The copy of a view is a view of the same memory.
+    RowTable(const RowTable& other);
+
+    /// Remove all of the rows and change the format.
+    /// \param width The number of columns.
+    /// \param singlePrecision If true, the values are stored in single precision.
+    void reset(int width, bool singlePrecision = false);
+
+    /// Make the table a view of external memory, in the format written by writeRaw. The memory is used in place, without copying, so it must stay unchanged for the lifetime of the table (or until it is modified).
+    /// \param width The number of columns.
+    /// \param size The number of rows.
+    /// \param singlePrecision If the values are in single precision.
+    /// \param external A pointer to the values. Must be aligned to 8 bytes.
+    void reset(int width, unsigned long size, bool singlePrecision, const char* external);
+
+    /// Get the number of columns.
+    int width() const { return width_; }
+
+    /// Get the number of rows.
+    unsigned long size() const { return size_; }
+
+    /// Check if the values are stored in single precision.
+    bool singlePrecision() const { return single_; }
+
+    /// Get one value.
+    /// \param i The row.
+    /// \param j The column.
+    /// \return The value.
+    double operator()(unsigned long i, int j) const
+    {
+        check(i < size_, "");
+        check(j >= 0 && j < width_, "");
+        return (single_ ? double(singlePtr_[i * width_ + j]) : doublePtr_[i * width_ + j]);
+    }
+
+    /// Get a row.
+    /// \param i The row.
+    /// \param row The values will be returned here.
+    void getRow(unsigned long i, std::vector<double>* row) const;
+
+    /// Add a row at the end.
+    /// \param row The values, the size must be equal to the width.
+    void push_back(const std::vector<double>& row);
+
+    /// Replace the contents by the first n rows of a vector.
+    /// \param n The number of rows to use.
+    /// \param rows The rows. Must have at least n elements, each with the size equal to the width.
+    void assign(unsigned long n, const std::vector<std::vector<double> >& rows);
+
+    /// Swap two rows.
+    void swapRows(unsigned long i, unsigned long j);
+
+    /// Swap the contents with another table, without copying the values.
+    /// \param other The other table.
+    void swap(RowTable& other);
+
+    /// Write the values in the native binary format, padded with zeros to a multiple of 8 bytes. This can be used later to construct a view (see the constructor above).
+    /// \param out The stream to write to.
+    void writeRaw(std::ostream& out) const;
+
+    /// Get the size of the output of writeRaw.
+    /// \return The size in bytes.
+    unsigned long rawSize() const;
+
+private:
+    // copies the external data, needs to be called before modifying the table
+    void makeOwned();
+    // points doublePtr_ and singlePtr_ to doubles_ and singles_
+    void updatePointers();
+
+    // not assignable
+    RowTable& operator=(const RowTable&);
+
+private:
+    int width_;
+    unsigned long size_;
+    bool single_;
+    bool external_;
+
+    // only one of these is used, depending on single_
+    std::vector<double> doubles_;
+    std::vector<float> singles_;
+
+    const double* doublePtr_;
+    const float* singlePtr_;
+};
+
+#endif
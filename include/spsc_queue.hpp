@@ -0,0 +1,61 @@
+#ifndef COSMO_PP_SPSC_QUEUE_HPP
+#define COSMO_PP_SPSC_QUEUE_HPP
+
+#include <vector>
+#include <atomic>
+
+#include <macros.hpp>
+
+/// A bounded lock-free queue for exactly one producer thread and one consumer thread.
+/// The slots are allocated once and reused: the producer fills the slot returned by back() and publishes it with push(), and the consumer reads front() and releases it with pop(). So the elements that hold memory (e.g. vectors or strings) keep it from round to round, and nothing is allocated in the steady state.
+template<typename T>
+class SPSCQueue
+{
+public:
+    /// Constructor.
+    /// \param capacity The maximum number of elements in the queue.
+    explicit SPSCQueue(unsigned long capacity) : slots_(capacity), head_(0), tail_(0) { check(capacity > 0, ""); }
+
+    /// Get the maximum number of elements in the queue.
+    unsigned long capacity() const { return slots_.size(); }
+
+    /// Get the number of elements in the queue. Exact when called from the consumer thread, a lower bound of the number of free slots when called from the producer thread.
+    unsigned long size() const { return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire); }
+
+    /// Check if the queue is full. To be called from the producer thread.
+    bool full() const { return head_.load(std::memory_order_relaxed) - tail_.load(std::memory_order_acquire) == slots_.size(); }
+
+    /// Check if the queue is empty. To be called from the consumer thread.
+    bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_relaxed); }
+
+    /// Get the next free slot. To be called from the producer thread when the queue is not full.
+    T& back() { check(!full(), "the queue is full"); return slots_[head_.load(std::memory_order_relaxed) % slots_.size()]; }
+
+    /// Publish the slot returned by back() to the consumer. To be called from the producer thread.
+    void push() { check(!full(), "the queue is full"); head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /// Get an element. To be called from the consumer thread.
+    /// \param i The position of the element from the front, must be less than size().
+    /// \return The element.
+    const T& at(unsigned long i) const { check(i < size(), ""); return slots_[(tail_.load(std::memory_order_relaxed) + i) % slots_.size()]; }
+
+    /// Get the first element. To be called from the consumer thread when the queue is not empty.
+    T& front() { check(!empty(), "the queue is empty"); return slots_[tail_.load(std::memory_order_relaxed) % slots_.size()]; }
+
+    /// Release the first element to the producer. To be called from the consumer thread.
+    void pop() { check(!empty(), "the queue is empty"); tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+private:
+    // not copyable
+    SPSCQueue(const SPSCQueue&);
+    SPSCQueue& operator=(const SPSCQueue&);
+
+private:
+    std::vector<T> slots_;
+
+    // the numbers of elements pushed and popped so far, written only by the producer and the consumer respectively
+    std::atomic<unsigned long> head_;
+    std::atomic<unsigned long> tail_;
+};
+
+#endif
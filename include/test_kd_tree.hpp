@@ -17,6 +17,12 @@ protected:
     void runSubTest2(double& res, double& expected, std::string& subTestName);
     void runSubTest3(double& res, double& expected, std::string& subTestName);
     void runSubTest4(double& res, double& expected, std::string& subTestName);
+    void runSubTest5(double& res, double& expected, std::string& subTestName);
+    void runSubTest6(double& res, double& expected, std::string& subTestName);
+    void runSubTest7(double& res, double& expected, std::string& subTestName);
+    void runSubTest8(double& res, double& expected, std::string& subTestName);
+    void runSubTest9(double& res, double& expected, std::string& subTestName);
+    void runSubTest10(double& res, double& expected, std::string& subTestName);
 
     bool test(int dim, unsigned long nPoints, int k, int seed = 0);
 };
@@ -0,0 +1,27 @@
+#ifndef COSMO_PP_TEST_LEARN_AS_YOU_GO_HPP
+#define COSMO_PP_TEST_LEARN_AS_YOU_GO_HPP
+
+#include <test_framework.hpp>
+
+class TestLearnAsYouGo : public TestFramework
+{
+public:
+    TestLearnAsYouGo(double precision = 1e-3) : TestFramework(precision) {}
+    ~TestLearnAsYouGo() {}
+
+protected:
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runSubTest0(double& res, double& expected, std::string& subTestName);
+    void runSubTest1(double& res, double& expected, std::string& subTestName);
+    void runSubTest2(double& res, double& expected, std::string& subTestName);
+    void runSubTest3(double& res, double& expected, std::string& subTestName);
+    void runSubTest4(double& res, double& expected, std::string& subTestName);
+    void runSubTest5(double& res, double& expected, std::string& subTestName);
+    void runSubTest6(double& res, double& expected, std::string& subTestName);
+};
+
+#endif
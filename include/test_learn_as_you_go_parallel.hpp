@@ -0,0 +1,23 @@
+#ifndef COSMO_PP_TEST_LEARN_AS_YOU_GO_PARALLEL_HPP
+#define COSMO_PP_TEST_LEARN_AS_YOU_GO_PARALLEL_HPP
+
+#include <test_framework.hpp>
+
+// the subtests are run by all of the MPI processes, since the LearnAsYouGo constructor is collective
+class TestLearnAsYouGoParallel : public TestFramework
+{
+public:
+    TestLearnAsYouGoParallel(double precision = 1e-3) : TestFramework(precision) {}
+    ~TestLearnAsYouGoParallel() {}
+
+protected:
+    bool isParallel(unsigned int i) const { return true; }
+    std::string name() const;
+    unsigned int numberOfSubtests() const;
+    void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runSubTest0(double& res, double& expected, std::string& subTestName);
+};
+
+#endif
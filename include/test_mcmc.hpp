@@ -13,6 +13,12 @@ protected:
     std::string name() const;
     unsigned int numberOfSubtests() const;
     void runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+
+private:
+    void runGaussSubTest(unsigned int i, double& res, double& expected, std::string& subTestName);
+    void runBinaryConvertSubTest(double& res, double& expected, std::string& subTestName);
+    void runResumeSubTest(double& res, double& expected, std::string& subTestName);
+    void runDraggingSubTest(double& res, double& expected, std::string& subTestName);
 };
 
 #endif
@@ -0,0 +1,240 @@
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <binary_chain.hpp>
+
+namespace
+{
+
+const char chainMagic[8] = {'C', 'P', 'P', 'C', 'H', 'A', 'I', 'N'};
+
+} // namespace
+
+BinaryChainWriter::BinaryChainWriter(const char* fileName, const std::vector<std::string>& paramNames, unsigned long bufferSize, bool append, unsigned long keep) : fileName_(fileName), nParams_(paramNames.size()), bufferSize_(bufferSize)
+{
+    check(nParams_ > 0, "");
+    check(bufferSize_ > 0, "");
+
+    StandardException exc;
+
+    bool appending = false;
+    if(append && isBinary(fileName))
+    {
+        unsigned long headerSize;
+        int nParams;
+        {
+            BinaryChainReader reader(fileName);
+            headerSize = reader.headerSize();
+            nParams = reader.nParams();
+        }
+
+        struct stat st;
+        if(nParams == nParams_ && stat(fileName, &st) == 0)
+        {
+            const unsigned long recordSize = (2 + nParams_) * sizeof(double);
+            const unsigned long nRecords = std::min((unsigned long)(st.st_size - headerSize) / recordSize, keep);
+            if(truncate(fileName, headerSize + nRecords * recordSize) != 0)
+            {
+                std::stringstream exceptionStr;
+                exceptionStr << "Cannot truncate the file " << fileName << ".";
+                exc.set(exceptionStr.str());
+                throw exc;
+            }
+            appending = true;
+        }
+    }
+
+    if(appending)
+        out_.open(fileName, std::ios::binary | std::ios::out | std::ios::app);
+    else
+        out_.open(fileName, std::ios::binary | std::ios::out | std::ios::trunc);
+
+    if(!out_)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    if(!appending)
+    {
+        std::vector<char> names;
+        for(int i = 0; i < nParams_; ++i)
+        {
+            names.insert(names.end(), paramNames[i].begin(), paramNames[i].end());
+            names.push_back('\0');
+        }
+
+        // the records start at a multiple of 8 bytes
+        const int headerSize = (sizeof(chainMagic) + 2 * sizeof(int) + names.size() + 7) / 8 * 8;
+        names.resize(headerSize - sizeof(chainMagic) - 2 * sizeof(int), '\0');
+
+        out_.write(chainMagic, sizeof(chainMagic));
+        out_.write((const char*)(&nParams_), sizeof(int));
+        out_.write((const char*)(&headerSize), sizeof(int));
+        out_.write(&(names[0]), names.size());
+        out_.flush();
+    }
+
+    buffer_.reserve(bufferSize_ * (2 + nParams_));
+}
+
+BinaryChainWriter::~BinaryChainWriter()
+{
+    // the destructor must not throw, a failed write is only reported
+    try
+    {
+        flush();
+    }
+    catch(StandardException& e)
+    {
+        output_screen(e.what() << std::endl);
+    }
+    out_.close();
+}
+
+void
+BinaryChainWriter::write(double prob, double like, const double* params)
+{
+    buffer_.push_back(prob);
+    buffer_.push_back(like);
+    buffer_.insert(buffer_.end(), params, params + nParams_);
+
+    if(buffer_.size() >= bufferSize_ * (2 + nParams_))
+        flush();
+}
+
+void
+BinaryChainWriter::flush()
+{
+    if(buffer_.empty())
+        return;
+
+    out_.write((const char*)(&(buffer_[0])), buffer_.size() * sizeof(double));
+    out_.flush();
+    buffer_.clear();
+
+    if(!out_)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << fileName_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+bool
+BinaryChainWriter::isBinary(const char* fileName)
+{
+    std::ifstream in(fileName, std::ios::binary | std::ios::in);
+    if(!in)
+        return false;
+
+    char magic[sizeof(chainMagic)];
+    in.read(magic, sizeof(magic));
+    return in && std::memcmp(magic, chainMagic, sizeof(chainMagic)) == 0;
+}
+
+void
+BinaryChainWriter::convertToText(const char* binaryFileName, const char* textFileName)
+{
+    BinaryChainReader reader(binaryFileName);
+
+    std::ofstream out(textFileName);
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << textFileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    double prob, like;
+    std::vector<double> params;
+    while(reader.read(&prob, &like, &params))
+    {
+        out << prob << "   " << like;
+        for(int i = 0; i < params.size(); ++i)
+            out << "   " << params[i];
+        out << '\n';
+    }
+    out.close();
+}
+
+BinaryChainReader::BinaryChainReader(const char* fileName) : fileName_(fileName), in_(fileName, std::ios::binary | std::ios::in)
+{
+    StandardException exc;
+    if(!in_)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open input file " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    char magic[sizeof(chainMagic)];
+    int nParams = 0, headerSize = 0;
+    in_.read(magic, sizeof(magic));
+    in_.read((char*)(&nParams), sizeof(int));
+    in_.read((char*)(&headerSize), sizeof(int));
+
+    const int namesSize = headerSize - sizeof(chainMagic) - 2 * sizeof(int);
+    if(!in_ || std::memcmp(magic, chainMagic, sizeof(chainMagic)) != 0 || nParams <= 0 || namesSize < nParams)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " is not a valid binary chain file.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    std::vector<char> names(namesSize);
+    in_.read(&(names[0]), namesSize);
+    if(!in_)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " is not a valid binary chain file.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    std::vector<char>::iterator it = names.begin();
+    for(int i = 0; i < nParams; ++i)
+    {
+        std::vector<char>::iterator end = std::find(it, names.end(), '\0');
+        if(end == names.end())
+        {
+            std::stringstream exceptionStr;
+            exceptionStr << "The file " << fileName << " is not a valid binary chain file.";
+            exc.set(exceptionStr.str());
+            throw exc;
+        }
+
+        paramNames_.push_back(std::string(it, end));
+        it = end + 1;
+    }
+
+    headerSize_ = headerSize;
+    record_.resize(2 + nParams);
+}
+
+bool
+BinaryChainReader::read(double* prob, double* like, std::vector<double>* params)
+{
+    in_.read((char*)(&(record_[0])), record_.size() * sizeof(double));
+    if(!in_)
+        return false;
+
+    *prob = record_[0];
+    *like = record_[1];
+    params->assign(record_.begin() + 2, record_.end());
+    return true;
+}
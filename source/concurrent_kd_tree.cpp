@@ -0,0 +1,373 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <thread>
+
+#include <macros.hpp>
+#include <concurrent_kd_tree.hpp>
+
+ConcurrentKDTree::ConcurrentKDTree(int dim, const std::vector<std::vector<double> >& points, bool singlePrecision, unsigned long mergeCount) : dim_(dim), single_(singlePrecision), mergeCount_(mergeCount), epsilon_(0), maxVisits_(0), state_(NULL), epoch_(0)
+{
+    check(dim_ > 0, "invalid dimension " << dim_);
+
+    readers_[0] = 0;
+    readers_[1] = 0;
+
+    publish(new KDTree(dim_, points, single_));
+}
+
+ConcurrentKDTree::ConcurrentKDTree(const char* snapshot, unsigned long size, unsigned long mergeCount) : mergeCount_(mergeCount), epsilon_(0), maxVisits_(0), state_(NULL), epoch_(0)
+{
+    readers_[0] = 0;
+    readers_[1] = 0;
+
+    KDTree* base = new KDTree(snapshot, size);
+    dim_ = base->dim();
+    single_ = base->singlePrecision();
+
+    publish(base);
+}
+
+ConcurrentKDTree::~ConcurrentKDTree()
+{
+    // there should be no readers left at this point, nothing is checked since the destructor cannot throw
+    State* state = state_.load();
+    delete state->base;
+    delete state;
+}
+
+ConcurrentKDTree::ReadGuard::ReadGuard(const ConcurrentKDTree& tree) : counter_(tree.readers_[tree.epoch_.load() & 1])
+{
+    // the counter is incremented BEFORE loading the pointer, so the writer will wait for this reader if it replaces the state after this point
+    ++counter_;
+    state_ = tree.state_.load();
+}
+
+ConcurrentKDTree::ReadGuard::~ReadGuard()
+{
+    --counter_;
+}
+
+void
+ConcurrentKDTree::synchronize()
+{
+    // Flip the epoch twice, each time waiting for the readers on the old parity to finish.
+    // A reader may have read the epoch before the first flip but incremented the counter after it, the second flip takes care of those.
+    for(int i = 0; i < 2; ++i)
+    {
+        const unsigned long old = epoch_++;
+        while(readers_[old & 1].load() != 0)
+            std::this_thread::yield();
+    }
+}
+
+void
+ConcurrentKDTree::publish(KDTree* base)
+{
+    check(base, "");
+    check(base->dim() == dim_, "");
+
+    base->setApproximation(epsilon_, maxVisits_);
+
+    unsigned long capacity = mergeCount_;
+    if(!capacity)
+        capacity = std::max((unsigned long) 64, (unsigned long) std::sqrt(double(base->nElements())));
+
+    State* old = state_.exchange(new State(base, capacity, dim_));
+    if(!old)
+        return;
+
+    synchronize();
+    delete old->base;
+    delete old;
+}
+
+KDTree*
+ConcurrentKDTree::mergedTree() const
+{
+    const State* state = state_.load();
+    const unsigned long count = state->deltaCount.load(std::memory_order_relaxed);
+
+    KDTree* tree = new KDTree(*(state->base));
+    std::vector<double> point(dim_);
+    for(unsigned long i = 0; i < count; ++i)
+    {
+        std::copy(state->delta.begin() + i * dim_, state->delta.begin() + (i + 1) * dim_, point.begin());
+        tree->insert(point);
+    }
+
+    return tree;
+}
+
+void
+ConcurrentKDTree::reset(const std::vector<std::vector<double> >& points)
+{
+    publish(new KDTree(dim_, points, single_));
+}
+
+void
+ConcurrentKDTree::insert(const std::vector<double>& point)
+{
+    check(point.size() == dim_, "");
+
+    State* state = state_.load();
+    const unsigned long count = state->deltaCount.load(std::memory_order_relaxed);
+    check((count + 1) * dim_ <= state->delta.size(), "");
+
+    // the delta points are rounded the same way as the points in the tree, so that the distances do not change when they are merged
+    double* x = &(state->delta[count * dim_]);
+    for(int j = 0; j < dim_; ++j)
+        x[j] = (single_ ? double(float(point[j])) : point[j]);
+
+    // the readers only look at the first deltaCount points, the coordinates above are visible to them before the new count
+    state->deltaCount.store(count + 1, std::memory_order_release);
+
+    // the buffer is merged as soon as it is full, so it never holds more than mergeCount points between the insertions
+    if((count + 2) * dim_ > state->delta.size())
+        merge();
+}
+
+void
+ConcurrentKDTree::merge()
+{
+    if(state_.load()->deltaCount.load(std::memory_order_relaxed) == 0)
+        return;
+
+    publish(mergedTree());
+}
+
+void
+ConcurrentKDTree::reBalance()
+{
+    KDTree* tree = mergedTree();
+    tree->reBalance();
+    publish(tree);
+}
+
+void
+ConcurrentKDTree::setApproximation(double epsilon, unsigned long maxVisits)
+{
+    epsilon_ = epsilon;
+    maxVisits_ = maxVisits;
+
+    // the base tree is immutable, so the new settings need a new copy of it
+    publish(mergedTree());
+}
+
+unsigned long
+ConcurrentKDTree::nElements() const
+{
+    ReadGuard guard(*this);
+    return guard.state().base->nElements() + guard.state().deltaCount.load(std::memory_order_acquire);
+}
+
+unsigned long
+ConcurrentKDTree::nDelta() const
+{
+    ReadGuard guard(*this);
+    return guard.state().deltaCount.load(std::memory_order_acquire);
+}
+
+void
+ConcurrentKDTree::writeSnapshot(std::ostream& out) const
+{
+    const State* state = state_.load();
+    if(state->deltaCount.load(std::memory_order_relaxed) == 0)
+    {
+        state->base->writeSnapshot(out);
+        return;
+    }
+
+    KDTree* tree = mergedTree();
+    tree->writeSnapshot(out);
+    delete tree;
+}
+
+void
+ConcurrentKDTree::findNearestNeighbors(const std::vector<double>& point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares, std::vector<std::vector<double> > *neighbors) const
+{
+    check(point.size() == dim_, "");
+    check(indices, "");
+
+    ReadGuard guard(*this);
+    const State& state = guard.state();
+    const unsigned long baseSize = state.base->nElements();
+    const unsigned long deltaCount = state.deltaCount.load(std::memory_order_acquire);
+    check(k > 0 && k <= baseSize + deltaCount, "invalid k = " << k << ", the tree has " << baseSize + deltaCount << " elements");
+
+    std::vector<double> dists;
+    std::vector<double>* d = (distanceSquares ? distanceSquares : &dists);
+
+    const int kBase = (int) std::min((unsigned long) k, baseSize);
+    if(kBase > 0)
+    {
+        if(neighbors)
+            state.base->findNearestNeighbors(point, kBase, indices, d, neighbors);
+        else
+            state.base->findNearestNeighbors(point, kBase, indices, d);
+    }
+    else
+    {
+        indices->clear();
+        d->clear();
+        if(neighbors)
+            neighbors->clear();
+    }
+
+    // the delta points replace the farthest ones found if they are closer
+    for(unsigned long i = 0; i < deltaCount; ++i)
+    {
+        const double* x = &(state.delta[i * dim_]);
+        const double bound = (d->size() == k ? d->back() : std::numeric_limits<double>::max());
+
+        double dist = 0;
+        for(int j = 0; j < dim_ && dist < bound; ++j)
+            dist += (x[j] - point[j]) * (x[j] - point[j]);
+
+        if(!(dist < bound))
+            continue;
+
+        const unsigned long pos = std::upper_bound(d->begin(), d->end(), dist) - d->begin();
+        d->insert(d->begin() + pos, dist);
+        indices->insert(indices->begin() + pos, baseSize + i);
+        if(neighbors)
+            neighbors->insert(neighbors->begin() + pos, std::vector<double>(x, x + dim_));
+
+        if(d->size() > k)
+        {
+            d->pop_back();
+            indices->pop_back();
+            if(neighbors)
+                neighbors->pop_back();
+        }
+    }
+}
+
+void
+ConcurrentKDTree::findNearestNeighborsBatch(const std::vector<std::vector<double> >& points, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares, std::vector<double> *neighbors) const
+{
+    check(indices, "");
+
+    const long n = points.size();
+    for(long q = 0; q < n; ++q)
+    {
+        check(points[q].size() == dim_, "");
+    }
+
+    ReadGuard guard(*this);
+    const State& state = guard.state();
+    const unsigned long baseSize = state.base->nElements();
+    const unsigned long deltaCount = state.deltaCount.load(std::memory_order_acquire);
+    check(k > 0 && k <= baseSize + deltaCount, "invalid k = " << k << ", the tree has " << baseSize + deltaCount << " elements");
+
+    std::vector<double> dists;
+    std::vector<double>* d = (distanceSquares ? distanceSquares : &dists);
+
+    if(deltaCount == 0)
+    {
+        state.base->findNearestNeighborsBatch(points, k, indices, d, neighbors);
+        return;
+    }
+
+    const int kBase = (int) std::min((unsigned long) k, baseSize);
+    std::vector<unsigned long> baseIndices;
+    std::vector<double> baseDists, baseNeighbors;
+    if(kBase > 0)
+        state.base->findNearestNeighborsBatch(points, kBase, &baseIndices, &baseDists, (neighbors ? &baseNeighbors : NULL));
+
+    indices->resize(n * k);
+    d->resize(n * k);
+    if(neighbors)
+        neighbors->resize(n * k * dim_);
+
+    // the delta points replace the farthest ones found if they are closer, the results of each point are kept sorted in place
+#pragma omp parallel for default(shared) schedule(dynamic, 64)
+    for(long q = 0; q < n; ++q)
+    {
+        unsigned long* ind = &((*indices)[q * k]);
+        double* dist = &((*d)[q * k]);
+        double* nb = (neighbors ? &((*neighbors)[q * k * dim_]) : NULL);
+
+        int found = kBase;
+        if(kBase > 0)
+        {
+            std::copy(baseIndices.begin() + q * kBase, baseIndices.begin() + (q + 1) * kBase, ind);
+            std::copy(baseDists.begin() + q * kBase, baseDists.begin() + (q + 1) * kBase, dist);
+            if(nb)
+                std::copy(baseNeighbors.begin() + q * kBase * dim_, baseNeighbors.begin() + (q + 1) * kBase * dim_, nb);
+        }
+
+        const std::vector<double>& point = points[q];
+        for(unsigned long i = 0; i < deltaCount; ++i)
+        {
+            const double* x = &(state.delta[i * dim_]);
+            const double bound = (found == k ? dist[k - 1] : std::numeric_limits<double>::max());
+
+            double dd = 0;
+            for(int j = 0; j < dim_ && dd < bound; ++j)
+                dd += (x[j] - point[j]) * (x[j] - point[j]);
+
+            if(!(dd < bound))
+                continue;
+
+            const int pos = std::upper_bound(dist, dist + found, dd) - dist;
+
+            // the farthest one drops out if all k are found
+            for(int m = (found < k ? found : k - 1); m > pos; --m)
+            {
+                dist[m] = dist[m - 1];
+                ind[m] = ind[m - 1];
+                if(nb)
+                    std::copy(nb + (m - 1) * dim_, nb + m * dim_, nb + m * dim_);
+            }
+
+            dist[pos] = dd;
+            ind[pos] = baseSize + i;
+            if(nb)
+                std::copy(x, x + dim_, nb + pos * dim_);
+
+            if(found < k)
+                ++found;
+        }
+    }
+}
+
+void
+ConcurrentKDTree::findWithinRadius(const std::vector<double>& point, double radius, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares) const
+{
+    check(point.size() == dim_, "");
+    check(indices, "");
+
+    ReadGuard guard(*this);
+    const State& state = guard.state();
+    const unsigned long baseSize = state.base->nElements();
+    const unsigned long deltaCount = state.deltaCount.load(std::memory_order_acquire);
+
+    std::vector<double> dists;
+    std::vector<double>* d = (distanceSquares ? distanceSquares : &dists);
+
+    if(baseSize)
+        state.base->findWithinRadius(point, radius, indices, d);
+    else
+    {
+        indices->clear();
+        d->clear();
+    }
+
+    const double r2 = radius * radius;
+    for(unsigned long i = 0; i < deltaCount; ++i)
+    {
+        const double* x = &(state.delta[i * dim_]);
+
+        double dist = 0;
+        for(int j = 0; j < dim_ && dist <= r2; ++j)
+            dist += (x[j] - point[j]) * (x[j] - point[j]);
+
+        if(dist > r2)
+            continue;
+
+        const unsigned long pos = std::upper_bound(d->begin(), d->end(), dist) - d->begin();
+        d->insert(d->begin() + pos, dist);
+        indices->insert(indices->begin() + pos, baseSize + i);
+    }
+}
@@ -0,0 +1,104 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include <macros.hpp>
+#include <duration_histogram.hpp>
+
+namespace
+{
+
+const double lowest = 1e-7;
+const int binsPerOctave = 4;
+const int nOctaves = 34;
+
+} // namespace
+
+DurationHistogram::DurationHistogram() : bins_(binsPerOctave * nOctaves, 0)
+{
+    clear();
+}
+
+void
+DurationHistogram::clear()
+{
+    bins_.assign(bins_.size(), 0);
+    count_ = 0;
+    total_ = 0;
+    min_ = std::numeric_limits<double>::max();
+    max_ = 0;
+}
+
+void
+DurationHistogram::add(double seconds)
+{
+    if(seconds < 0)
+        seconds = 0;
+
+    int i = 0;
+    if(seconds > lowest)
+        i = std::min(int(binsPerOctave * std::log2(seconds / lowest)), nBins() - 1);
+
+    ++bins_[i];
+    ++count_;
+    total_ += seconds;
+    min_ = std::min(min_, seconds);
+    max_ = std::max(max_, seconds);
+}
+
+void
+DurationHistogram::merge(const DurationHistogram& other)
+{
+    check(other.bins_.size() == bins_.size(), "");
+
+    for(int i = 0; i < nBins(); ++i)
+        bins_[i] += other.bins_[i];
+
+    count_ += other.count_;
+    total_ += other.total_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+}
+
+double
+DurationHistogram::binLower(int i) const
+{
+    check(i >= 0 && i < nBins(), "invalid bin " << i);
+
+    if(i == 0)
+        return 0;
+
+    return lowest * std::exp2(double(i) / binsPerOctave);
+}
+
+double
+DurationHistogram::quantile(double q) const
+{
+    check(q >= 0 && q <= 1, "invalid quantile " << q);
+
+    if(!count_)
+        return 0;
+
+    // the rank of the duration, counting from 1
+    const double rank = std::max(1.0, std::ceil(q * count_));
+    unsigned long cumulative = 0;
+    for(int i = 0; i < nBins(); ++i)
+    {
+        if(cumulative + bins_[i] < rank)
+        {
+            cumulative += bins_[i];
+            continue;
+        }
+
+        // interpolate within the bin on the logarithmic scale
+        const double lower = std::max(binLower(i), min_);
+        const double upper = std::min(i == nBins() - 1 ? max_ : binLower(i + 1), max_);
+        if(lower <= 0 || upper <= lower)
+            return std::max(lower, std::min(upper, max_));
+
+        const double f = (rank - cumulative) / bins_[i];
+        return lower * std::pow(upper / lower, f);
+    }
+
+    return max_;
+}
@@ -3,41 +3,220 @@
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <exception>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <matrix_impl.hpp>
 #include <fast_approximator.hpp>
 
-FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, int k) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), x_(k, nPoints + nPoints * (nPoints + 1) / 2 + 1), xLin_(k, nPoints + 1), xT_(nPoints + nPoints * (nPoints + 1) / 2 + 1, k), xTLin_(nPoints_ + 1, k), inv_(nPoints + nPoints * (nPoints + 1) / 2 + 1, nPoints + nPoints * (nPoints + 1) / 2 + 1), invLin_(nPoints_ + 1, nPoints_ + 1), prod_(nPoints + nPoints * (nPoints + 1) / 2 + 1, k), prodLin_(nPoints_ + 1, k), pointTransformed_(nPoints), sigma_(1), l_(1e-6)
+std::atomic<unsigned long> FastApproximator::versionCounter_(0);
+
+FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, int k, bool singlePrecision) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), ownData_(nData, singlePrecision), data_(&ownData_), singlePrecision_(singlePrecision), sigma_(1), l_(1), kernelFitted_(false), version_(0), covarianceTolerance_(0), statsCount_(0), nAdded_(0)
+{
+    allocate();
+
+    reset(dataSize, points, data, true);
+}
+
+FastApproximator::FastApproximator(int nPoints, int nData, unsigned long dataSize, const std::vector<std::vector<double> >& points, const RowTable& data, int k, bool singlePrecision) : knn_(NULL), k_(k), nPoints_(nPoints), nData_(nData), ownData_(nData, singlePrecision), data_(&ownData_), singlePrecision_(singlePrecision), sigma_(1), l_(1), kernelFitted_(false), version_(0), covarianceTolerance_(0), statsCount_(0), nAdded_(0)
+{
+    allocate();
+
+    reset(dataSize, points, data, true);
+}
+
+FastApproximator::FastApproximator(const char* snapshot, unsigned long size, int k) : knn_(NULL), k_(k), data_(&ownData_), sigma_(1), l_(1), kernelFitted_(false), version_(0), covarianceTolerance_(0), statsCount_(0), nAdded_(0)
+{
+    check(snapshot, "");
+    check(reinterpret_cast<unsigned long>(snapshot) % sizeof(unsigned long) == 0, "the snapshot must be aligned to " << sizeof(unsigned long) << " bytes");
+
+    const unsigned long *header = (size < 4 * sizeof(unsigned long) ? NULL : reinterpret_cast<const unsigned long*>(snapshot));
+    if(header && ((header[3] != sizeof(double) && header[3] != sizeof(float)) || header[0] > (unsigned long) std::numeric_limits<int>::max() || header[1] == 0 || header[1] > (unsigned long) std::numeric_limits<int>::max()))
+    {
+        StandardException exc;
+        exc.set("Invalid fast approximator snapshot header.");
+        throw exc;
+    }
+
+    // the sizes of the header, the transformation matrix and the length scale, and the output values (padded to 8 bytes), the counts are checked first so that the calculation cannot overflow for a damaged header
+    bool truncated = (!header || header[0] == 0 || header[0] > size / sizeof(double) / header[0] || (header[1] && header[2] > size / header[1] / header[3]));
+    unsigned long used = 0;
+    if(!truncated)
+    {
+        used = 4 * sizeof(unsigned long) + (header[0] * header[0] + 1) * sizeof(double) + (header[1] * header[2] * header[3] + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+        truncated = (size < used);
+    }
+
+    if(truncated)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "The fast approximator snapshot is truncated, only " << size << " bytes available.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    nPoints_ = header[0];
+    nData_ = header[1];
+    dataSize_ = header[2];
+
+    allocate();
+
+    const double *p = reinterpret_cast<const double*>(snapshot + 4 * sizeof(unsigned long));
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            choleskyMat_(i, j) = *(p++);
+    }
+
+    updateTransformation();
+
+    l_ = *(p++);
+    kernelFitted_ = true;
+    version_ = ++versionCounter_;
+
+    // the data and the kd tree are used in place
+    ownData_.reset(nData_, dataSize_, header[3] == sizeof(float), reinterpret_cast<const char*>(p));
+
+    check(4 * sizeof(unsigned long) + (nPoints_ * nPoints_ + 1) * sizeof(double) + ownData_.rawSize() == used, "");
+    knn_ = new ConcurrentKDTree(reinterpret_cast<const char*>(p) + ownData_.rawSize(), size - used);
+    if(knn_->nElements() != dataSize_ || knn_->dim() != nPoints_)
+    {
+        delete knn_;
+        knn_ = NULL;
+        StandardException exc;
+        exc.set("Invalid fast approximator snapshot, the kd tree does not match the output values.");
+        throw exc;
+    }
+
+    singlePrecision_ = knn_->singlePrecision();
+}
+
+FastApproximator::~FastApproximator()
+{
+    check(knn_, "");
+    delete knn_;
+}
+
+void
+FastApproximator::allocate()
 {
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
+    check(k_ > 0, "");
+
+    covariance_.resize(nPoints_, nPoints_);
+    choleskyMat_.resize(nPoints_, nPoints_);
+
+    statsMean_.resize(nPoints_);
+    statsComoment_.resize(nPoints_ * (nPoints_ + 1) / 2);
+
+    workspace_.resize(nPoints_, k_);
+}
+
+FastApproximator::Workspace::Workspace() : nIn_(0), k_(0), gpVersion_(0)
+{
+}
+
+FastApproximator::Workspace::~Workspace()
+{
+}
+
+void
+FastApproximator::Workspace::resize(int nIn, int k)
+{
+    check(nIn > 0, "");
+    check(k > 0, "");
+
+    if(nIn == nIn_ && k == k_)
+        return;
+
+    nIn_ = nIn;
+    k_ = k;
+
+    const int nQuad = nIn + nIn * (nIn + 1) / 2 + 1;
+
+    x_.resize(k, nQuad);
+    xT_.resize(nQuad, k);
+    prod_.resize(nQuad, nQuad);
+
+    xLin_.resize(k, nIn + 1);
+    xTLin_.resize(nIn + 1, k);
+    prodLin_.resize(nIn + 1, nIn + 1);
 
     for(int i = 0; i < k; ++i)
     {
-        x_(i, 0) = 1;
         xT_(0, i) = 1;
-
-        xLin_(i, 0) = 1;
         xTLin_(0, i) = 1;
     }
 
-    covariance_.resize(nPoints_, nPoints_);
-    choleskyMat_.resize(nPoints_, nPoints_);
-    v_.resize(nPoints_, 1);
-    w_.resize(nPoints_, 1);
+    normal_.resize(nQuad, nQuad);
+    normalLin_.resize(nIn + 1, nIn + 1);
+    solution_.resize(nQuad);
+    weights_.resize(k);
+    coefficients_.resize(k);
 
-    indices_.resize(k_);
-    dists_.resize(k_);
+    pointTransformed_.resize(nIn);
+    indices_.resize(k);
+    dists_.resize(k);
 
-    reset(dataSize, points, data, true);
+    kernel_.resize(k, k);
+    gpRhs_.resize(k);
+    gpVersion_ = 0;
 }
 
-FastApproximator::~FastApproximator()
+void
+FastApproximator::writeSnapshot(std::ostream& out) const
 {
     check(knn_, "");
-    delete knn_;
+
+    unsigned long header[4];
+    header[0] = nPoints_;
+    header[1] = nData_;
+    header[2] = dataSize_;
+    header[3] = (data_->singlePrecision() ? sizeof(float) : sizeof(double));
+    out.write(reinterpret_cast<const char*>(header), 4 * sizeof(unsigned long));
+
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+        {
+            const double c = choleskyMat_(i, j);
+            out.write(reinterpret_cast<const char*>(&c), sizeof(double));
+        }
+    }
+
+    ensureKernel();
+    out.write(reinterpret_cast<const char*>(&l_), sizeof(double));
+
+    // only the rows used by the approximator, a shared table can have more, and the added rows are kept separately
+    if(data_->size() == dataSize_)
+        data_->writeRaw(out);
+    else
+    {
+        RowTable rows(nData_, data_->singlePrecision());
+        std::vector<double> row;
+        for(unsigned long i = 0; i < dataSize_; ++i)
+        {
+            getValues(i, &row);
+            rows.push_back(row);
+        }
+        rows.writeRaw(out);
+    }
+
+    knn_->writeSnapshot(out);
+
+    StandardException exc;
+    if(!out)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Failed to write the fast approximator snapshot.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
 }
 
 void
@@ -46,135 +225,545 @@ FastApproximator::addPoint(const std::vector<double>& p, const std::vector<doubl
     check(p.size() == nPoints_, "");
     check(val.size() == nData_, "");
 
-    for(int i = 0; i < nPoints_; ++i)
-        v_(i, 0) = p[i];
+    std::vector<double> pointTransformed;
+    transform(p, &pointTransformed);
 
-    Math::Matrix<double>::multiplyMatrices(choleskyMat_, v_, &w_);
-    pointsTransformed_.resize(pointsTransformed_.size() + 1);
-    pointsTransformed_.back().resize(nPoints_);
-    for(int i = 0; i < nPoints_; ++i)
-        pointsTransformed_.back()[i] = w_(i, 0);
+    // the statistics are only kept up to date if they describe the whole training set (not after constructing from a snapshot)
+    if(statsCount_ == dataSize_)
+        addToStatistics(p);
 
-    data_.push_back(val);
+    // a shared table should already contain the new row
+    if(data_ == &ownData_)
+        addRow(val);
+    else
+        check(data_->size() > dataSize_, "the new row needs to be added to the shared data table first");
     ++dataSize_;
 
-    knn_->insert(pointsTransformed_.back());
+    // the value is stored before the point is inserted, so that it is there when other threads find the point
+    knn_->insert(pointTransformed);
 
     check(dataSize_ == knn_->nElements(), "");
-    if(knn_->depth() > 5 * std::log(double(dataSize_)) / std::log(2.0))
+}
+
+void
+FastApproximator::setValues(const RowTable& values)
+{
+    check(values.width() == nData_, "");
+    check(values.size() >= dataSize_, "");
+
+    ownData_.reset(nData_, singlePrecision_);
+    clearAdded();
+    data_ = &values;
+}
+
+void
+FastApproximator::addRow(const std::vector<double>& val)
+{
+    check(val.size() == nData_, "");
+
+    const unsigned long q = nAdded_ / addedBlockRows_ + 1;
+    int b = 0;
+    while((2ul << b) <= q)
+        ++b;
+    check(b < maxAddedBlocks_, "too many points added");
+
+    if(addedBlocks_[b].empty())
+        addedBlocks_[b].resize(addedBlockRows_ * (1ul << b) * nData_);
+
+    double* row = const_cast<double*>(addedRow(nAdded_));
+    for(int j = 0; j < nData_; ++j)
+        row[j] = (data_->singlePrecision() ? double(float(val[j])) : val[j]);
+
+    ++nAdded_;
+}
+
+void
+FastApproximator::clearAdded()
+{
+    for(int b = 0; b < maxAddedBlocks_; ++b)
+        std::vector<double>().swap(addedBlocks_[b]);
+    nAdded_ = 0;
+}
+
+void
+FastApproximator::getValues(unsigned long i, std::vector<double>* row) const
+{
+    if(data_ != &ownData_ || i < ownData_.size())
     {
-        output_screen("The KD Tree has become unbalanced. Rebalancing..." << std::endl);
-        knn_->reBalance();
-        output_screen("OK" << std::endl);
+        data_->getRow(i, row);
+        return;
     }
+
+    const double* r = addedRow(i - ownData_.size());
+    row->assign(r, r + nData_);
 }
 
 void
-FastApproximator::reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, bool updateCovariance)
+FastApproximator::reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const std::vector<std::vector<double> >& data, bool updateCovariance, unsigned long previousSize)
 {
     output_screen("Fast Approximator learn with " << dataSize << " points." << std::endl);
     Timer timer("FAST APPROXIMATOR LEARN");
     timer.start();
 
-    dataSize_ = dataSize;
-    check(dataSize_ > 0, "");
-    check(points.size() >= dataSize_, "");
-    check(data.size() >= dataSize_, "");
+    check(data.size() >= dataSize, "");
 
-    data_ = data;
+    ownData_.reset(nData_, singlePrecision_);
+    ownData_.assign(dataSize, data);
+    clearAdded();
+    data_ = &ownData_;
 
-    if(updateCovariance)
+    resetPoints(dataSize, points, updateCovariance, previousSize);
+
+    timer.end();
+}
+
+void
+FastApproximator::reset(unsigned long dataSize, const std::vector<std::vector<double> >& points, const RowTable& data, bool updateCovariance, unsigned long previousSize)
+{
+    output_screen("Fast Approximator learn with " << dataSize << " points." << std::endl);
+    Timer timer("FAST APPROXIMATOR LEARN");
+    timer.start();
+
+    check(data.width() == nData_, "");
+    check(data.size() >= dataSize, "");
+
+    ownData_.reset(nData_, singlePrecision_);
+    clearAdded();
+    data_ = &data;
+
+    resetPoints(dataSize, points, updateCovariance, previousSize);
+
+    timer.end();
+}
+
+void
+FastApproximator::resetPoints(unsigned long dataSize, const std::vector<std::vector<double> >& points, bool updateCovariance, unsigned long previousSize)
+{
+    check(dataSize > 0, "");
+    check(points.size() >= dataSize, "");
+    check(previousSize == 0 || (previousSize >= dataSize && points.size() >= previousSize), "invalid previous size " << previousSize);
+
+    if(previousSize && statsCount_ == dataSize_ && statsCount_ == previousSize)
+    {
+        // the new training set is part of the current one, only the points left out are removed from the statistics
+        for(unsigned long i = dataSize; i < previousSize; ++i)
+        {
+            check(points[i].size() >= nPoints_, "");
+            removeFromStatistics(points[i]);
+        }
+    }
+    else
     {
-        std::vector<double> mean(nPoints_, 0);
+        // the statistics are calculated in one pass over the points, then kept up to date by addPoint
+        statsCount_ = 0;
+        std::fill(statsMean_.begin(), statsMean_.end(), 0.0);
+        std::fill(statsComoment_.begin(), statsComoment_.end(), 0.0);
 
-        for(unsigned long i = 0; i < dataSize_; ++i)
+        for(unsigned long i = 0; i < dataSize; ++i)
         {
             check(points[i].size() >= nPoints_, "");
+            addToStatistics(points[i]);
+        }
+    }
 
-            for(int j = 0; j < nPoints_; ++j)
-                mean[j] += points[i][j];
+    dataSize_ = dataSize;
+    check(statsCount_ == dataSize_, "");
+
+    if(updateCovariance)
+    {
+        // the linear transformation is kept if it still decorrelates the training set well enough, then the distances to the existing points don't change
+        double drift = 0;
+        if(knn_ && covarianceTolerance_ > 0 && (drift = covarianceDrift()) <= covarianceTolerance_)
+        {
+            output_screen1("The covariance matrix has changed by " << drift << ", which is within the tolerance " << covarianceTolerance_ << ". Keeping the linear transformation." << std::endl);
         }
+        else
+        {
+            check(dataSize_ > 1, "");
 
-        for(int i = 0; i < nPoints_; ++i)
-            mean[i] /= double(dataSize_);
+            for(int i = 0; i < nPoints_; ++i)
+            {
+                for(int j = 0; j <= i; ++j)
+                    covariance_(i, j) = statsComoment_[i * (i + 1) / 2 + j] / double(dataSize_ - 1);
+            }
+
+            covariance_.choleskyFactorize();
+
+            for(int i = 0; i < nPoints_; ++i)
+            {
+                for(int j = 0; j < nPoints_; ++j)
+                    choleskyMat_(i, j) = (j <= i ? covariance_(i, j) : 0.0);
+            }
+
+            choleskyMat_.invert();
+            updateTransformation();
+        }
+    }
+
+    // the transformed points are only needed to build the kd tree, which keeps its own copy
+    std::vector<std::vector<double> > pointsTransformed(dataSize_);
+
+    for(unsigned long i = 0; i < dataSize_; ++i)
+        transform(points[i], &(pointsTransformed[i]));
+
+    if(!knn_)
+        knn_ = new ConcurrentKDTree(nPoints_, pointsTransformed, singlePrecision_);
+    else
+        knn_->reset(pointsTransformed);
+
+    // the kernel is only fitted when the Gaussian process interpolation is used, the neighborhoods are spread over the training set
+    const unsigned long nSamples = std::min(dataSize_, (unsigned long) 8);
+    kernelSamples_.resize(nSamples);
+    for(unsigned long s = 0; s < nSamples; ++s)
+        kernelSamples_[s] = pointsTransformed[s * dataSize_ / nSamples];
+
+    version_ = ++versionCounter_;
+    kernelFitted_ = false;
+}
 
-        for(int i = 0; i < nPoints_; ++i)
+void
+FastApproximator::ensureKernel() const
+{
+    if(kernelFitted_.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard<std::mutex> lock(kernelMutex_);
+    if(kernelFitted_.load(std::memory_order_relaxed))
+        return;
+
+    fitKernel();
+    kernelFitted_.store(true, std::memory_order_release);
+}
+
+void
+FastApproximator::fitKernel() const
+{
+    check(knn_, "");
+
+    version_ = ++versionCounter_;
+
+    // The length scale is chosen by leave-one-out cross validation on a few neighborhoods spread over the training set.
+    // The neighborhoods are smaller than k to keep this cheap, the best length scale depends mostly on the density of the points.
+    const unsigned long nSamples = kernelSamples_.size();
+    const int m = (int) std::min((unsigned long) std::min(k_, 50), knn_->nElements());
+    if(m < 3 || nSamples == 0)
+    {
+        l_ = 1;
+        return;
+    }
+
+    std::vector<std::vector<std::vector<double> > > neighborhoods(nSamples);
+    std::vector<std::vector<unsigned long> > indices(nSamples);
+    std::vector<double> dists;
+
+    // the starting point is the mean distance squared within a neighborhood
+    double base = 0;
+    for(unsigned long s = 0; s < nSamples; ++s)
+    {
+        knn_->findNearestNeighbors(kernelSamples_[s], m, &(indices[s]), &dists, &(neighborhoods[s]));
+        for(int i = 0; i < m; ++i)
+            base += dists[i];
+    }
+    base /= double(nSamples * m);
+
+    if(base <= 0)
+    {
+        l_ = 1;
+        return;
+    }
+
+    const int nFactors = 5;
+    const double factors[nFactors] = {1.0 / 16, 1.0 / 4, 1, 4, 16};
+
+    Math::SymmetricMatrix<double> kernel;
+    std::vector<double> rhs(m), residuals(nData_ * m), vars(nData_);
+
+    double bestScore = 0, bestL = base;
+    bool found = false;
+
+    for(int f = 0; f < nFactors; ++f)
+    {
+        l_ = base * factors[f];
+
+        double score = 0;
+        bool good = true;
+        for(unsigned long s = 0; good && s < nSamples; ++s)
         {
-            for(int j = i; j < nPoints_; ++j)
+            if(factorizeKernel(neighborhoods[s], m, &kernel))
             {
-                double t1 = 0;
-                for(unsigned long k = 0; k < dataSize_; ++k)
-                    t1 += points[k][i] * points[k][j];
+                good = false;
+                break;
+            }
+
+            for(int j = 0; j < nData_; ++j)
+            {
+                double mean = 0, mean2 = 0;
+                for(int i = 0; i < m; ++i)
+                {
+                    const double y = value(indices[s][i], j);
+                    mean += y;
+                    mean2 += y * y;
+                }
+                mean /= m;
+                vars[j] = mean2 / m - mean * mean;
+
+                for(int i = 0; i < m; ++i)
+                    rhs[i] = value(indices[s][i], j) - mean;
 
-                covariance_(i, j) = (t1 - double(dataSize_) * mean[i] * mean[j]) / double(dataSize_ - 1);
+                kernel.solveFromCholeskyFactorization(&rhs);
+                std::copy(rhs.begin(), rhs.end(), residuals.begin() + j * m);
             }
+
+            // the leave-one-out residual of point i is [K^-1 (y - mean)]_i / [K^-1]_ii
+            if(kernel.invertFromCholeskyFactorization())
+            {
+                good = false;
+                break;
+            }
+
+            for(int j = 0; j < nData_; ++j)
+            {
+                if(vars[j] <= 0)
+                    continue;
+
+                for(int i = 0; i < m; ++i)
+                {
+                    const double r = residuals[j * m + i] / kernel(i, i);
+                    score += r * r / vars[j];
+                }
+            }
+        }
+
+        if(good && (!found || score < bestScore))
+        {
+            bestScore = score;
+            bestL = l_;
+            found = true;
         }
+    }
 
-        covariance_.choleskyFactorize();
+    l_ = bestL;
+    output_screen1("The Gaussian process kernel length scale is " << std::sqrt(l_) << "." << std::endl);
+}
 
-        for(int i = 0; i < nPoints_; ++i)
+int
+FastApproximator::factorizeKernel(const std::vector<std::vector<double> >& points, int n, Math::SymmetricMatrix<double>* kernel) const
+{
+    check(points.size() >= n, "");
+    check(kernel, "");
+
+    if(kernel->rows() != n)
+        kernel->resize(n, n);
+
+    int info = 0;
+    for(double noise = 1e-8; noise < 1e-3; noise *= 100)
+    {
+        for(int i = 0; i < n; ++i)
         {
-            for(int j = 0; j < nPoints_; ++j)
-                choleskyMat_(i, j) = (j <= i ? covariance_(i, j) : 0.0);
+            for(int j = 0; j < i; ++j)
+                (*kernel)(i, j) = cov(points[i], points[j]);
+
+            (*kernel)(i, i) = sigma_ * (1 + noise);
         }
 
-        choleskyMat_.invert();
+        info = kernel->choleskyFactorize();
+        if(info == 0)
+            return 0;
     }
 
-    pointsTransformed_.resize(dataSize_);
+    return info;
+}
 
-    for(unsigned long i = 0; i < dataSize_; ++i)
+void
+FastApproximator::getGPApproximation(std::vector<double>& val, Workspace* workspace) const
+{
+    // the neighborhood is identified by the set of the indices, the order of the neighbors can be different from one query to the next
+    workspace->sortedIndices_ = workspace->indices_;
+    std::sort(workspace->sortedIndices_.begin(), workspace->sortedIndices_.end());
+
+    if(workspace->gpVersion_ != version_ || workspace->sortedIndices_ != workspace->gpIndices_)
     {
-        pointsTransformed_[i].resize(nPoints_);
+        // the weights are K^-1 (y - mean) for each output, with the kernel matrix K of the neighbors
+        workspace->gpNeighbors_ = workspace->neighbors_;
 
-        for(int j = 0; j < nPoints_; ++j)
+        const int info = factorizeKernel(workspace->gpNeighbors_, k_, &(workspace->kernel_));
+        if(info)
         {
-            v_(j, 0) = points[i][j];
+            // the approximation is unusable, as for the failed least squares fits the caller should fall back to the exact calculation
+            workspace->gpVersion_ = 0;
+            val.resize(nData_);
+            for(int j = 0; j < nData_; ++j)
+                val[j] = std::numeric_limits<double>::quiet_NaN();
+            return;
         }
 
-        Math::Matrix<double>::multiplyMatrices(choleskyMat_, v_, &w_);
-        for(int j = 0; j < nPoints_; ++j)
-            pointsTransformed_[i][j] = w_(j, 0);
+        std::vector<double>& rhs = workspace->gpRhs_;
+        workspace->gpMean_.resize(nData_);
+        workspace->gpWeights_.resize(k_ * nData_);
+
+        for(int j = 0; j < nData_; ++j)
+        {
+            double mean = 0;
+            for(int i = 0; i < k_; ++i)
+                mean += value(workspace->indices_[i], j);
+            mean /= k_;
+
+            for(int i = 0; i < k_; ++i)
+                rhs[i] = value(workspace->indices_[i], j) - mean;
+
+            workspace->kernel_.solveFromCholeskyFactorization(&rhs);
+
+            workspace->gpMean_[j] = mean;
+            for(int i = 0; i < k_; ++i)
+                workspace->gpWeights_[i * nData_ + j] = rhs[i];
+        }
+
+        workspace->gpIndices_.swap(workspace->sortedIndices_);
+        workspace->gpVersion_ = version_;
     }
 
-    if(!knn_)
-        knn_ = new KDTree(nPoints_, pointsTransformed_);
-    else
-        knn_->reset(pointsTransformed_);
+    val = workspace->gpMean_;
+    for(int i = 0; i < k_; ++i)
+    {
+        const double c = cov(workspace->pointTransformed_, workspace->gpNeighbors_[i]);
+        const double *w = &(workspace->gpWeights_[i * nData_]);
+        for(int j = 0; j < nData_; ++j)
+            val[j] += c * w[j];
+    }
+}
 
-    timer.end();
+void
+FastApproximator::addToStatistics(const std::vector<double>& point)
+{
+    // Welford's algorithm, numerically stable
+    ++statsCount_;
+
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        const double delta = point[i] - statsMean_[i];
+        statsMean_[i] += delta / double(statsCount_);
+
+        // only the lower triangle is stored, row by row
+        double *comoment = &(statsComoment_[i * (i + 1) / 2]);
+        for(int j = 0; j <= i; ++j)
+            comoment[j] += delta * (point[j] - statsMean_[j]);
+    }
 }
 
 void
-FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices)
+FastApproximator::removeFromStatistics(const std::vector<double>& point)
 {
-    check(point.size() == nPoints_, "");
+    // the inverse of the update in addToStatistics, the comoment update uses the mean with the point included, so the means are changed last
+    check(statsCount_ > 1, "");
+    --statsCount_;
 
     for(int i = 0; i < nPoints_; ++i)
     {
-        v_(i, 0) = point[i];
+        const double delta = point[i] - (statsMean_[i] - (point[i] - statsMean_[i]) / double(statsCount_));
+
+        double *comoment = &(statsComoment_[i * (i + 1) / 2]);
+        for(int j = 0; j <= i; ++j)
+            comoment[j] -= delta * (point[j] - statsMean_[j]);
     }
-    Math::Matrix<double>::multiplyMatrices(choleskyMat_, v_, &w_);
+
     for(int i = 0; i < nPoints_; ++i)
-        pointTransformed_[i] = w_(i, 0);
+        statsMean_[i] -= (point[i] - statsMean_[i]) / double(statsCount_);
+}
 
-    check(knn_, "");
-    knn_->findNearestNeighbors(pointTransformed_, k_, &indices_, &dists_);
+double
+FastApproximator::covarianceDrift() const
+{
+    check(statsCount_ == dataSize_, "the statistics of the training set are not available, the approximator needs to be reset first");
+    check(statsCount_ > 1, "");
 
-    if(dists_[0] == 0)
+    // calculate T C T^T, where T is the linear transformation and C is the current covariance matrix, which should be the unit matrix if nothing has changed
+    std::vector<double> tc(nPoints_ * nPoints_, 0);
+    for(int i = 0; i < nPoints_; ++i)
     {
-        output_screen("FOUND DISTANCE = 0" << std::endl);
-        for(int i = 0; i < nPoints_; ++i)
+        for(int l = 0; l < nPoints_; ++l)
         {
-            //output_screen("\t" << pointTransformed_[i] << "\t" << pointsTransformed_[indices_[0]][i] << std::endl);
+            const double t = choleskyMat_(i, l);
+            for(int j = 0; j < nPoints_; ++j)
+            {
+                const double c = (j <= l ? statsComoment_[l * (l + 1) / 2 + j] : statsComoment_[j * (j + 1) / 2 + l]);
+                tc[i * nPoints_ + j] += t * c;
+            }
         }
     }
 
+    double drift = 0;
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+        {
+            double d = 0;
+            for(int l = 0; l < nPoints_; ++l)
+                d += tc[i * nPoints_ + l] * choleskyMat_(j, l);
+            d /= double(statsCount_ - 1);
+
+            drift = std::max(drift, std::abs(d - (i == j ? 1.0 : 0.0)));
+        }
+    }
+
+    return drift;
+}
+
+void
+FastApproximator::updateTransformation()
+{
+    transformation_.resize(nPoints_ * nPoints_);
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            transformation_[i * nPoints_ + j] = choleskyMat_(i, j);
+    }
+}
+
+void
+FastApproximator::transform(const std::vector<double>& point, std::vector<double>* transformed) const
+{
+    check(point.size() == nPoints_, "");
+    check(transformed, "");
+
+    transformed->resize(nPoints_);
+    const double *t = &(transformation_[0]);
+    for(int i = 0; i < nPoints_; ++i)
+    {
+        double x = 0;
+        for(int j = 0; j < nPoints_; ++j)
+            x += t[j] * point[j];
+        (*transformed)[i] = x;
+        t += nPoints_;
+    }
+}
+
+void
+FastApproximator::findNearestNeighbors(const std::vector<double>& point, Workspace* workspace, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices) const
+{
+    check(workspace, "");
+    workspace->resize(nPoints_, k_);
+
+    transform(point, &(workspace->pointTransformed_));
+    searchNeighbors(workspace, distances, nearestNeighbors, indices);
+}
+
+void
+FastApproximator::searchNeighbors(Workspace* workspace, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices) const
+{
+    check(knn_, "");
+    knn_->findNearestNeighbors(workspace->pointTransformed_, k_, &(workspace->indices_), &(workspace->dists_), &(workspace->neighbors_));
+
+    copyNeighbors(*workspace, distances, nearestNeighbors, indices);
+}
+
+void
+FastApproximator::copyNeighbors(const Workspace& workspace, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices) const
+{
     if(distances)
     {
         distances->resize(k_);
         for(int i = 0; i < k_; ++i)
-            (*distances)[i] = std::sqrt(dists_[i]);
+            (*distances)[i] = std::sqrt(workspace.dists_[i]);
     }
 
     if(nearestNeighbors)
@@ -182,150 +771,262 @@ FastApproximator::findNearestNeighbors(const std::vector<double>& point, std::ve
         nearestNeighbors->resize(k_);
         for(int i = 0; i < k_; ++i)
         {
-            const unsigned long index = indices_[i];
-            (*nearestNeighbors)[i] = pointsTransformed_[index];
+            (*nearestNeighbors)[i] = workspace.neighbors_[i];
             for(int j = 0; j < nPoints_; ++j)
-                (*nearestNeighbors)[i][j] -= pointTransformed_[j];
+                (*nearestNeighbors)[i][j] -= workspace.pointTransformed_[j];
         }
     }
 
     if(indices)
     {
-        *indices = indices_;
+        *indices = workspace.indices_;
     }
 }
 
 void
-FastApproximator::getApproximation(std::vector<double>& val, InterpolationMethod method)
+FastApproximator::findWithinRadius(const std::vector<double>& point, double radius, std::vector<unsigned long>* indices, std::vector<double>* distances) const
+{
+    check(indices, "");
+
+    std::vector<double> pointTransformed;
+    transform(point, &pointTransformed);
+
+    check(knn_, "");
+    knn_->findWithinRadius(pointTransformed, radius, indices, distances);
+
+    if(distances)
+    {
+        for(unsigned long i = 0; i < distances->size(); ++i)
+            (*distances)[i] = std::sqrt((*distances)[i]);
+    }
+}
+
+void
+FastApproximator::getApproximation(std::vector<double>& val, Workspace* workspace, InterpolationMethod method) const
 {
     check(method >= 0 && method < INTERPOLATION_METHOD_MAX, "");
+    check(workspace, "");
+    check(workspace->nIn_ == nPoints_ && workspace->k_ == k_, "findNearestNeighbors needs to be called first");
+
+    const std::vector<double>& pointTransformed = workspace->pointTransformed_;
+    const std::vector<std::vector<double> >& neighbors = workspace->neighbors_;
+    const std::vector<unsigned long>& indices = workspace->indices_;
+    const std::vector<double>& dists = workspace->dists_;
+    std::vector<double>& weights = workspace->weights_;
+    std::vector<double>& coefficients = workspace->coefficients_;
+    std::vector<double>& solution = workspace->solution_;
 
     val.resize(nData_);
 
-    if(std::sqrt(dists_[0]) < 1e-7)
+    if(std::sqrt(dists[0]) < 1e-7)
     {
-        //output_screen("FOUND distance = " << dists_[0] << std::endl);
-        const unsigned long index = indices_[0];
-        for(int i = 0; i < nData_; ++i)
-            val[i] = data_[index][i];
+        //output_screen("FOUND distance = " << dists[0] << std::endl);
+        getValues(indices[0], &val);
+
+        return;
+    }
 
+    if(method == GP_INTERPOLATION)
+    {
+        ensureKernel();
+        getGPApproximation(val, workspace);
         return;
     }
 
-    //Timer t1("MATRIX OPERATIONS");
-    //t1.start();
+    // The fit is weighted least squares with the design matrix X (one row per neighbor, the columns are 1, the linear terms and the quadratic terms) and the weights W.
+    // Only the intercept of the fit is needed, which is e0^T (X^T W X)^{-1} X^T W y. So instead of inverting X^T W X we solve (X^T W X) z = e0 once using the Cholesky decomposition, then the intercept is sum_j c_j y_j with c = W X z.
+    const bool linear = (method == LINEAR_INTERPOLATION);
+    Math::Matrix<double>& x = (linear ? workspace->xLin_ : workspace->x_);
+    Math::Matrix<double>& xT = (linear ? workspace->xTLin_ : workspace->xT_);
+    Math::Matrix<double>& prod = (linear ? workspace->prodLin_ : workspace->prod_);
+    Math::SymmetricMatrix<double>& normal = (linear ? workspace->normalLin_ : workspace->normal_);
+    const int nTerms = xT.rows();
 
-    std::vector<double> weights(k_);
-    for(int i = 0; i < k_; ++i)
-        weights[i] = 1.0 / std::sqrt(dists_[i]);
-    
     for(int i = 0; i < k_; ++i)
     {
-        const unsigned long index = indices_[i];
+        weights[i] = 1.0 / std::sqrt(dists[i]);
+
+        const std::vector<double>& neighbor = neighbors[i];
         for(int j = 0; j < nPoints_; ++j)
         {
-            const double x = pointsTransformed_[index][j] - pointTransformed_[j];
-            switch(method)
+            const double d = neighbor[j] - pointTransformed[j];
+            x(i, j + 1) = d * weights[i];
+            xT(j + 1, i) = d;
+
+            if(!linear)
             {
-            case LINEAR_INTERPOLATION:
-                xLin_(i, j + 1) = x * weights[i];
-                xTLin_(j + 1, i) = x;
-                break;
-            case QUADRATIC_INTERPOLATION:
-                x_(i, j + 1) = x * weights[i];
-                xT_(j + 1, i) = x;
                 for(int l = 0; l <= j; ++l)
                 {
-                    const double y = pointsTransformed_[index][l] - pointTransformed_[l];
-                    x_(i, nPoints_ + 1 + j * (j + 1) / 2 + l) = x * y * weights[i];
-                    xT_(nPoints_ + 1 + j * (j + 1) / 2 + l, i) = x * y;
+                    const double e = neighbor[l] - pointTransformed[l];
+                    x(i, nPoints_ + 1 + j * (j + 1) / 2 + l) = d * e * weights[i];
+                    xT(nPoints_ + 1 + j * (j + 1) / 2 + l, i) = d * e;
                 }
-                break;
-            default:
-                check(false, "");
-                break;
             }
+        }
 
+        x(i, 0) = weights[i];
+    }
+
+    Math::Matrix<double>::multiplyMatrices(xT, x, &prod);
+
+    // the ridge keeps the normal matrix positive definite when the neighbors are (nearly) degenerate, if the factorization still fails it is retried with a larger ridge relative to the largest diagonal element
+    double maxDiagonal = 0;
+    for(int a = 0; a < nTerms; ++a)
+        maxDiagonal = std::max(maxDiagonal, prod(a, a));
+
+    const int maxAttempts = 4;
+    double ridge = 1e-5;
+    int info = 1;
+    for(int attempt = 0; attempt < maxAttempts && info; ++attempt)
+    {
+        for(int a = 0; a < nTerms; ++a)
+        {
+            for(int b = 0; b <= a; ++b)
+                normal(a, b) = prod(a, b);
+            normal(a, a) += ridge;
         }
 
-        switch(method)
+        info = normal.choleskyFactorize();
+        if(info == 0)
         {
-        case LINEAR_INTERPOLATION:
-            xLin_(i, 0) = weights[i];
-            break;
-        case QUADRATIC_INTERPOLATION:
-            x_(i, 0) = weights[i];
-            break;
-        default:
-            check(false, "");
-            break;
+            solution.assign(nTerms, 0);
+            solution[0] = 1;
+            info = normal.solveFromCholeskyFactorization(&solution);
         }
+
+        ridge = std::max(100 * ridge, 1e-6 * maxDiagonal * std::pow(100.0, attempt));
+    }
+
+    if(info)
+    {
+        // the fit is unusable, the caller should fall back to the exact calculation
+        for(int i = 0; i < nData_; ++i)
+            val[i] = std::numeric_limits<double>::quiet_NaN();
+        return;
     }
 
-    switch(method)
+    for(int i = 0; i < k_; ++i)
+        coefficients[i] = 0;
+
+    for(int a = 0; a < nTerms; ++a)
     {
-    case LINEAR_INTERPOLATION:
-        Math::Matrix<double>::multiplyMatrices(xTLin_, xLin_, &invLin_);
+        const double z = solution[a];
+        for(int i = 0; i < k_; ++i)
+            coefficients[i] += xT(a, i) * z;
+    }
 
-        for(int i = 0; i < invLin_.rows(); ++i)
-            invLin_(i, i) += 1e-5;
+    for(int i = 0; i < nData_; ++i)
+        val[i] = 0;
 
-        invLin_.invert();
-        Math::Matrix<double>::multiplyMatrices(invLin_, xTLin_, &prodLin_);
-        break;
+    for(int j = 0; j < k_; ++j)
+    {
+        const double c = coefficients[j] * weights[j];
+        for(int i = 0; i < nData_; ++i)
+            val[i] += c * value(indices[j], i);
+    }
+}
 
-    case QUADRATIC_INTERPOLATION:
-        Math::Matrix<double>::multiplyMatrices(xT_, x_, &inv_);
-        for(int i = 0; i < inv_.rows(); ++i)
-            inv_(i, i) += 1e-5;
+void
+FastApproximator::approximate(const std::vector<double>& point, std::vector<double>& val, Workspace* workspace, InterpolationMethod method, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices) const
+{
+    findNearestNeighbors(point, workspace, distances, nearestNeighbors, indices);
+    getApproximation(val, workspace, method);
+}
 
-        inv_.invert();
-        Math::Matrix<double>::multiplyMatrices(inv_, xT_, &prod_);
-        break;
+void
+FastApproximator::approximateBatch(const std::vector<std::vector<double> >& points, std::vector<std::vector<double> >* results, InterpolationMethod method, std::vector<std::vector<double> >* distances, std::vector<std::vector<std::vector<double> > >* nearestNeighbors) const
+{
+    check(results, "");
+
+    const long n = points.size();
+
+    results->resize(n);
+    if(distances)
+        distances->resize(n);
+    if(nearestNeighbors)
+        nearestNeighbors->resize(n);
+
+    if(!n)
+        return;
 
-    default:
-        check(false, "");
-        break;
+    // transform all of the points with one matrix product, each column is a point
+    Math::Matrix<double> p(nPoints_, n), transformed;
+    for(long i = 0; i < n; ++i)
+    {
+        check(points[i].size() == nPoints_, "");
+        for(int j = 0; j < nPoints_; ++j)
+            p(j, i) = points[i][j];
     }
+    Math::Matrix<double>::multiplyMatrices(choleskyMat_, p, &transformed);
 
+    std::vector<std::vector<double> > pointsTransformed(n, std::vector<double>(nPoints_));
+    for(long i = 0; i < n; ++i)
+    {
+        for(int j = 0; j < nPoints_; ++j)
+            pointsTransformed[i][j] = transformed(j, i);
+    }
 
-    //t1.end();
+    // one batch search for all of the points, the neighbors of point i start at i * k_
+    check(knn_, "");
+    std::vector<unsigned long> batchIndices;
+    std::vector<double> batchDists, batchNeighbors;
+    knn_->findNearestNeighborsBatch(pointsTransformed, k_, &batchIndices, &batchDists, &batchNeighbors);
 
-    //Timer t2("PARAMETER ESTIMATION");
-    //t2.start();
+    // exceptions of any type cannot leave the parallel region, the first one is rethrown after it
+    std::exception_ptr exc;
 
-    for(int i = 0; i < nData_; ++i)
+#pragma omp parallel default(shared)
     {
-        double res = 0;
-        for(int j = 0; j < k_; ++j)
+        // each thread reuses the same workspace for all of its points
+        Workspace workspace;
+        bool ready = false;
+        try
         {
-            const unsigned long index = indices_[j];
-            const double y = data_[index][i] * weights[j];
-
-            switch(method)
+            workspace.resize(nPoints_, k_);
+            ready = true;
+        }
+        catch (...)
+        {
+#pragma omp critical (fast_approximator_batch)
             {
-            case LINEAR_INTERPOLATION:
-                res += prodLin_(0, j) * y;
-                break;
-            case QUADRATIC_INTERPOLATION:
-                res += prod_(0, j) * y;
-                break;
-            default:
-                check(false, "");
-                break;
+                if(!exc)
+                    exc = std::current_exception();
             }
         }
 
-        val[i] = res;
-    }
+#pragma omp for schedule(dynamic, 16)
+        for(long i = 0; i < n; ++i)
+        {
+            if(!ready)
+                continue;
 
-    //t2.end();
-}
+            try
+            {
+                workspace.pointTransformed_ = pointsTransformed[i];
+                workspace.indices_.assign(batchIndices.begin() + i * k_, batchIndices.begin() + (i + 1) * k_);
+                workspace.dists_.assign(batchDists.begin() + i * k_, batchDists.begin() + (i + 1) * k_);
+                workspace.neighbors_.resize(k_);
+                for(int j = 0; j < k_; ++j)
+                {
+                    const double* x = &(batchNeighbors[(i * k_ + j) * nPoints_]);
+                    workspace.neighbors_[j].assign(x, x + nPoints_);
+                }
 
-void
-FastApproximator::approximate(const std::vector<double>& point, std::vector<double>& val, InterpolationMethod method, std::vector<double>* distances, std::vector<std::vector<double> >* nearestNeighbors, std::vector<unsigned long>* indices)
-{
-    findNearestNeighbors(point, distances, nearestNeighbors, indices);
-    getApproximation(val, method);
+                copyNeighbors(workspace, (distances ? &((*distances)[i]) : NULL), (nearestNeighbors ? &((*nearestNeighbors)[i]) : NULL), NULL);
+                getApproximation((*results)[i], &workspace, method);
+            }
+            catch (...)
+            {
+#pragma omp critical (fast_approximator_batch)
+                {
+                    if(!exc)
+                        exc = std::current_exception();
+                }
+            }
+        }
+    }
+
+    if(exc)
+        std::rethrow_exception(exc);
 }
 
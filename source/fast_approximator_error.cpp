@@ -1,11 +1,53 @@
 #include <sstream>
 #include <string>
 #include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 
 #include <exception_handler.hpp>
+#include <numerics.hpp>
 #include <fast_approximator_error.hpp>
 
-FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0)
+namespace
+{
+
+// the fast approximator returns NaN when the fit fails
+bool isUsable(const std::vector<double>& val)
+{
+    for(unsigned long i = 0; i < val.size(); ++i)
+    {
+        if(!Math::isFinite(val[i]))
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0), sigma1_(0), sigma2_(0), stepTiming_(false), stepTimes_()
+{
+    initMethod();
+
+    reset(testPoints, testData, begin, end);
+}
+
+FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::vector<std::vector<double> >& testPoints, const RowTable& testData, unsigned long begin, unsigned long end, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0), sigma1_(0), sigma2_(0), stepTiming_(false), stepTimes_()
+{
+    initMethod();
+
+    reset(testPoints, testData, begin, end);
+}
+
+FastApproximatorError::FastApproximatorError(FastApproximator& fa, std::istream& model, const Math::RealFunctionMultiDim& f, ErrorMethod method, double precision, DecisionMethod dm) : fa_(fa), method_(method), posterior_(NULL), distances_(NULL), nearestNeighbors_(NULL), val_(fa.nOut()), linVal_(fa.nOut()), f_(f), precision_(precision), decMethod_(dm), posteriorGood_(false), mean_(0), var_(0), sigma1_(0), sigma2_(0), stepTiming_(false), stepTimes_()
+{
+    initMethod();
+
+    readModel(model);
+}
+
+void
+FastApproximatorError::initMethod()
 {
     check(precision_ > 0, "invalid precision " << precision_);
     check(decMethod_ >= 0 && decMethod_ < DECISION_METHOD_MAX, "");
@@ -28,14 +70,12 @@ FastApproximatorError::FastApproximatorError(FastApproximator& fa, const std::ve
         check(false, "");
         break;
     }
-
-    reset(testPoints, testData, begin, end);
 }
 
 FastApproximatorError::~FastApproximatorError()
 {
-    check(posterior_, "");
-    delete posterior_;
+    if(posterior_)
+        delete posterior_;
 
     if(distances_)
         delete distances_;
@@ -47,9 +87,25 @@ FastApproximatorError::~FastApproximatorError()
 void
 FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >& testData, unsigned long begin, unsigned long end)
 {
-    check(testPoints.size() >= end, "");
     check(testData.size() >= end, "");
 
+    reset(testPoints, &testData, NULL, begin, end);
+}
+
+void
+FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints, const RowTable& testData, unsigned long begin, unsigned long end)
+{
+    check(testData.size() >= end, "");
+
+    reset(testPoints, NULL, &testData, begin, end);
+}
+
+void
+FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints, const std::vector<std::vector<double> >* testData, const RowTable* testTable, unsigned long begin, unsigned long end)
+{
+    check(testPoints.size() >= end, "");
+    check(testData || testTable, "");
+
     if(end == begin)
     {
         posteriorGood_ = false;
@@ -70,37 +126,67 @@ FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints
     double mean2 = 0;
     unsigned long goodCount = 0;
 
+    // the test points are approximated in blocks, the neighbors found are kept in memory for one block at a time
+    const unsigned long blockSize = 256;
+    std::vector<std::vector<double> > blockPoints, blockVals, blockLinVals, blockDistances;
+    std::vector<std::vector<std::vector<double> > > blockNeighbors;
+
     ProgressMeter meter(end - begin);
-    for(unsigned long i = begin; i < end; ++i)
+    for(unsigned long blockBegin = begin; blockBegin < end; blockBegin += blockSize)
     {
-        fa_.findNearestNeighbors(testPoints[i], distances_, nearestNeighbors_);
-        fa_.getApproximation(val_, FastApproximator::QUADRATIC_INTERPOLATION);
+        const unsigned long blockEnd = std::min(blockBegin + blockSize, end);
+        blockPoints.assign(testPoints.begin() + blockBegin, testPoints.begin() + blockEnd);
 
-        if(method_ == LIN_QUAD_DIFF)
-            fa_.getApproximation(linVal_, FastApproximator::LINEAR_INTERPOLATION);
+        fa_.approximateBatch(blockPoints, &blockVals, FastApproximator::QUADRATIC_INTERPOLATION, (distances_ ? &blockDistances : NULL), (nearestNeighbors_ ? &blockNeighbors : NULL));
 
-        const double estimatedError = evaluateError();
-        const double correctError = f_.evaluate(testData[i]) - f_.evaluate(val_);
+        if(method_ == LIN_QUAD_DIFF)
+            fa_.approximateBatch(blockPoints, &blockLinVals, FastApproximator::LINEAR_INTERPOLATION);
 
-        if(estimatedError == 0)
+        for(unsigned long i = blockBegin; i < blockEnd; ++i)
         {
-            check(correctError == 0, "");
+            const unsigned long j = i - blockBegin;
+            val_.swap(blockVals[j]);
+            if(method_ == LIN_QUAD_DIFF)
+                linVal_.swap(blockLinVals[j]);
+            if(distances_)
+                distances_->swap(blockDistances[j]);
+            if(nearestNeighbors_)
+                nearestNeighbors_->swap(blockNeighbors[j]);
+
+            if(!isUsable(val_) || (method_ == LIN_QUAD_DIFF && !isUsable(linVal_)))
+            {
+                meter.advance();
+                continue;
+            }
+
+            const double estimatedError = evaluateError();
+            if(testTable)
+                testTable->getRow(i, &testRow_);
+
+            const double correctError = f_.evaluate(testTable ? testRow_ : (*testData)[i]) - f_.evaluate(val_);
+
+            if(estimatedError == 0)
+            {
+                check(correctError == 0, "");
+            }
+            else
+            {
+                const double ratio = correctError / estimatedError;
+                posterior_->addPoint(std::abs(ratio), 1, 1);
+                mean_ += ratio;
+                mean2 += ratio * ratio;
+                ++goodCount;
+            }
+            meter.advance();
         }
-        else
-        {
-            const double ratio = correctError / estimatedError;
-            posterior_->addPoint(std::abs(ratio), 1, 1);
-            mean_ += ratio;
-            mean2 += ratio * ratio;
-            ++goodCount;
-        }
-        meter.advance();
     }
 
     if(goodCount >= 100)
     {
         posterior_->generate();
         posteriorGood_ = true;
+        sigma1_ = posterior_->get1SigmaUpper();
+        sigma2_ = posterior_->get2SigmaUpper();
         output_screen1("Posterior 1 sigma is: " << posterior_->get1SigmaUpper() << std::endl);
         output_screen1("Posterior 2 sigma is: " << posterior_->get2SigmaUpper() << std::endl);
         posterior_->writeIntoFile("fast_approximator_error_ratio.txt");
@@ -123,6 +209,40 @@ FastApproximatorError::reset(const std::vector<std::vector<double> >& testPoints
     t.end();
 }
 
+void
+FastApproximatorError::writeModel(std::ostream& out) const
+{
+    const double model[5] = {double(posteriorGood_), sigma1_, sigma2_, mean_, var_};
+    out.write((const char*)(model), sizeof(model));
+}
+
+void
+FastApproximatorError::readModel(std::istream& in)
+{
+    double model[5];
+    in.read((char*)(model), sizeof(model));
+
+    StandardException exc;
+    if(!in)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Failed to read the error model.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    posteriorGood_ = (model[0] != 0);
+    sigma1_ = model[1];
+    sigma2_ = model[2];
+    mean_ = model[3];
+    var_ = model[4];
+
+    // the distribution itself is not stored
+    if(posterior_)
+        delete posterior_;
+    posterior_ = NULL;
+}
+
 double
 FastApproximatorError::evaluateError()
 {
@@ -205,19 +325,49 @@ FastApproximatorError::evaluateError()
 bool
 FastApproximatorError::approximate(const std::vector<double>& point, std::vector<double>& val, double *error1Sigma, double *error2Sigma, double *errorMean, double *errorVar)
 {
+    // the steps that are not reached because of an early return stay 0
+    stepTimes_ = StepTimes();
+
+    std::chrono::steady_clock::time_point t0, t1, t2, t3;
+    if(stepTiming_)
+        t0 = std::chrono::steady_clock::now();
+
     fa_.findNearestNeighbors(point, distances_, nearestNeighbors_);
+
+    if(stepTiming_)
+    {
+        t1 = std::chrono::steady_clock::now();
+        stepTimes_.neighbors = std::chrono::duration<double>(t1 - t0).count();
+    }
+
     if(method_ == LIN_QUAD_DIFF)
     {
         fa_.getApproximation(val_);
         fa_.getApproximation(linVal_, FastApproximator::LINEAR_INTERPOLATION);
+        stepTimes_.fitted = true;
+        if(stepTiming_)
+            stepTimes_.fit = std::chrono::duration<double>(std::chrono::steady_clock::now() - t1).count();
+        if(!isUsable(val_) || !isUsable(linVal_))
+            return false;
     }
+
+    if(stepTiming_)
+        t2 = std::chrono::steady_clock::now();
+
     const double e = evaluateError();
 
+    stepTimes_.errorEvaluated = true;
+    if(stepTiming_)
+    {
+        t3 = std::chrono::steady_clock::now();
+        stepTimes_.error = std::chrono::duration<double>(t3 - t2).count();
+    }
+
     double estimatedError1 = 1e10, estimatedError2 = 1e10, estMean = 0, estVar = 1e20;
     if(posteriorGood_)
     {
-        estimatedError1 = e * posterior_->get1SigmaUpper();
-        estimatedError2 = e * posterior_->get2SigmaUpper();
+        estimatedError1 = e * sigma1_;
+        estimatedError2 = e * sigma2_;
         estMean = e * mean_;
         estVar = e * e * var_;
     }
@@ -250,6 +400,13 @@ FastApproximatorError::approximate(const std::vector<double>& point, std::vector
     if(method_ == LIN_QUAD_DIFF)
         val = val_;
     else
+    {
         fa_.getApproximation(val);
+        stepTimes_.fitted = true;
+        if(stepTiming_)
+            stepTimes_.fit = std::chrono::duration<double>(std::chrono::steady_clock::now() - t3).count();
+        if(!isUsable(val))
+            return false;
+    }
     return true;
 }
@@ -1,43 +1,336 @@
 #include <algorithm>
+#include <exception>
+#include <limits>
+#include <ostream>
+#include <sstream>
+#include <string>
 
 #include <macros.hpp>
+#include <exception_handler.hpp>
 #include <kd_tree.hpp>
 
-KDTree::KDTree(int dim, const std::vector<std::vector<double> >& elements) : dim_(dim), elements_(elements)
+namespace
+{
+
+const unsigned long nullNode = std::numeric_limits<unsigned long>::max();
+
+// subtrees with more points than this are constructed in parallel
+const unsigned long parallelConstructCutoff = 10000;
+
+// the largest dimension for which a specialized search is compiled
+const int maxStaticDim = 32;
+
+// Squared distance between a and b. Dim is the dimension if known at compile time, otherwise 0 and dim is used. T is the type of the stored coordinates b, the sum is always calculated in double.
+// The sum is accumulated in blocks of 4 so that it vectorizes well. The calculation stops early, returning a partial sum, as soon as the partial sum exceeds bound.
+template<int Dim, typename T>
+inline double distanceSquared(const double *a, const T *b, int dim, double bound)
+{
+    const int d = (Dim ? Dim : dim);
+
+    double res = 0;
+    int i = 0;
+    for(; i + 4 <= d; i += 4)
+    {
+        const double d0 = a[i] - double(b[i]);
+        const double d1 = a[i + 1] - double(b[i + 1]);
+        const double d2 = a[i + 2] - double(b[i + 2]);
+        const double d3 = a[i + 3] - double(b[i + 3]);
+        res += (d0 * d0 + d1 * d1) + (d2 * d2 + d3 * d3);
+        if(res > bound)
+            return res;
+    }
+
+    for(; i < d; ++i)
+    {
+        const double delta = a[i] - double(b[i]);
+        res += delta * delta;
+    }
+
+    return res;
+}
+
+void flatten(int dim, const std::vector<std::vector<double> >& points, std::vector<double> *res)
+{
+    res->resize(points.size() * dim);
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        check(points[i].size() == dim, "");
+        std::copy(points[i].begin(), points[i].end(), res->begin() + i * dim);
+    }
+}
+
+}
+
+KDTree::KDTree(int dim, const std::vector<std::vector<double> >& elements, bool singlePrecision) : dim_(dim), single_(singlePrecision), external_(false), epsilon_(0), maxVisits_(0)
 {
     check(dim_ > 0, "invalid dimension " << dim_ << ", must be positive");
 
-    std::vector<unsigned long> elemsIndices(elements_.size());
-    for(unsigned long i = 0; i < elemsIndices.size(); ++i)
-        elemsIndices[i] = i;
+    std::vector<double> flat;
+    flatten(dim_, elements, &flat);
+    build(flat);
+}
 
-    depth_ = 0;
-    root_ = construct(elemsIndices, 0, elemsIndices.size(), 0, NULL);
+KDTree::KDTree(const char* snapshot, unsigned long size) : external_(true), epsilon_(0), maxVisits_(0)
+{
+    check(snapshot, "");
+    check(reinterpret_cast<unsigned long>(snapshot) % sizeof(unsigned long) == 0, "the snapshot must be aligned to " << sizeof(unsigned long) << " bytes");
+
+    StandardException exc;
+    if(size < 5 * sizeof(unsigned long))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The kd tree snapshot is truncated, only " << size << " bytes available.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    const unsigned long *header = reinterpret_cast<const unsigned long*>(snapshot);
+    if(header[0] == 0 || header[0] > (unsigned long) std::numeric_limits<int>::max() || (header[4] != sizeof(double) && header[4] != sizeof(float)) || header[3] > header[1] || header[3] > (unsigned long) std::numeric_limits<int>::max())
+    {
+        exc.set("Invalid kd tree snapshot header.");
+        throw exc;
+    }
+
+    dim_ = header[0];
+    nNodes_ = header[1];
+    const unsigned long nRoots = header[2];
+    depth_ = header[3];
+    single_ = (header[4] == sizeof(float));
+
+    // the counts are checked separately first so that the size calculation cannot overflow for a damaged header
+    if(nRoots > size / sizeof(unsigned long) || nNodes_ > size / sizeof(Node) || (nNodes_ && dim_ > size / nNodes_ / sizeof(float)) || size < snapshotSize(nRoots))
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The kd tree snapshot is truncated, only " << size << " bytes available.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    roots_.assign(header + 5, header + 5 + nRoots);
+
+    // the nodes and the coordinates are used in place
+    const char *p = snapshot + (5 + nRoots) * sizeof(unsigned long);
+    nodesPtr_ = reinterpret_cast<const Node*>(p);
+    p += nNodes_ * sizeof(Node);
+    coordsPtr_ = (single_ ? NULL : reinterpret_cast<const double*>(p));
+    coordsSinglePtr_ = (single_ ? reinterpret_cast<const float*>(p) : NULL);
+
+    // the structure is checked here, so that a damaged snapshot is rejected instead of being searched out of bounds
+    bool valid = (roots_.empty() ? nNodes_ == 0 : roots_[0] == 0);
+    for(unsigned long i = 1; valid && i < roots_.size(); ++i)
+        valid = (roots_[i] > roots_[i - 1] && roots_[i] < nNodes_);
+
+    // within each component the left child directly follows its parent and the right child comes later, so the searches always move forward
+    for(unsigned long c = 0; valid && c < roots_.size(); ++c)
+    {
+        const unsigned long end = (c + 1 < roots_.size() ? roots_[c + 1] : nNodes_);
+        for(unsigned long pos = roots_[c]; valid && pos < end; ++pos)
+        {
+            const Node& node = nodesPtr_[pos];
+            valid = (node.index < nNodes_ && node.depth >= 0 && node.depth <= depth_);
+            valid = valid && (node.left == nullNode || node.left == pos + 1) && (node.left == nullNode || node.left < end);
+            valid = valid && (node.right == nullNode || (node.right > pos && node.right < end));
+        }
+    }
+
+    if(!valid)
+    {
+        exc.set("Invalid kd tree snapshot, the nodes are damaged.");
+        throw exc;
+    }
+}
+
+KDTree::KDTree(const KDTree& other) : dim_(other.dim_), single_(other.single_), nodes_(other.nodes_), coords_(other.coords_), coordsSingle_(other.coordsSingle_), nodesPtr_(other.nodesPtr_), coordsPtr_(other.coordsPtr_), coordsSinglePtr_(other.coordsSinglePtr_), nNodes_(other.nNodes_), external_(other.external_), roots_(other.roots_), depth_(other.depth_), epsilon_(other.epsilon_), maxVisits_(other.maxVisits_)
+{
+    if(!external_)
+        updatePointers();
 }
 
 KDTree::~KDTree()
 {
-    destruct(root_);
+}
+
+unsigned long
+KDTree::snapshotSize() const
+{
+    return snapshotSize(roots_.size());
+}
+
+unsigned long
+KDTree::snapshotSize(unsigned long nRoots) const
+{
+    return (5 + nRoots) * sizeof(unsigned long) + nNodes_ * sizeof(Node) + coordinatesSize();
+}
+
+unsigned long
+KDTree::coordinatesSize() const
+{
+    // padded to a multiple of 8 bytes
+    const unsigned long size = nNodes_ * dim_ * (single_ ? sizeof(float) : sizeof(double));
+    return (size + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+}
+
+void
+KDTree::writeSnapshot(std::ostream& out) const
+{
+    unsigned long header[5];
+    header[0] = dim_;
+    header[1] = nNodes_;
+    header[2] = roots_.size();
+    header[3] = depth_;
+    header[4] = (single_ ? sizeof(float) : sizeof(double));
+
+    out.write(reinterpret_cast<const char*>(header), 5 * sizeof(unsigned long));
+    if(!roots_.empty())
+        out.write(reinterpret_cast<const char*>(&(roots_[0])), roots_.size() * sizeof(unsigned long));
+    if(nNodes_)
+    {
+        out.write(reinterpret_cast<const char*>(nodesPtr_), nNodes_ * sizeof(Node));
+
+        const unsigned long size = nNodes_ * dim_ * (single_ ? sizeof(float) : sizeof(double));
+        out.write(single_ ? reinterpret_cast<const char*>(coordsSinglePtr_) : reinterpret_cast<const char*>(coordsPtr_), size);
+
+        const char padding[sizeof(double)] = {0};
+        out.write(padding, coordinatesSize() - size);
+    }
+
+    check(out, "failed to write the kd tree snapshot");
+}
+
+void
+KDTree::makeOwned()
+{
+    if(!external_)
+        return;
+
+    nodes_.assign(nodesPtr_, nodesPtr_ + nNodes_);
+    if(single_)
+        coordsSingle_.assign(coordsSinglePtr_, coordsSinglePtr_ + nNodes_ * dim_);
+    else
+        coords_.assign(coordsPtr_, coordsPtr_ + nNodes_ * dim_);
+    external_ = false;
+    updatePointers();
+}
+
+void
+KDTree::updatePointers()
+{
+    check(!external_, "");
+
+    nNodes_ = nodes_.size();
+    nodesPtr_ = (nodes_.empty() ? NULL : &(nodes_[0]));
+    coordsPtr_ = (coords_.empty() ? NULL : &(coords_[0]));
+    coordsSinglePtr_ = (coordsSingle_.empty() ? NULL : &(coordsSingle_[0]));
+}
+
+void
+KDTree::copyCoordinates(unsigned long pos, double *res) const
+{
+    check(pos < nNodes_, "");
+
+    if(single_)
+        std::copy(coordsSinglePtr_ + pos * dim_, coordsSinglePtr_ + (pos + 1) * dim_, res);
+    else
+        std::copy(coordsPtr_ + pos * dim_, coordsPtr_ + (pos + 1) * dim_, res);
+}
+
+template<>
+const double*
+KDTree::coordinateArray<double>() const
+{
+    check(!single_, "");
+    return coordsPtr_;
+}
+
+template<>
+const float*
+KDTree::coordinateArray<float>() const
+{
+    check(single_, "");
+    return coordsSinglePtr_;
 }
 
 void
 KDTree::reset(const std::vector<std::vector<double> >& elements)
 {
-    elements_ = elements;
-    reBalance(); // assumes that rebalance destroys and reconstructs the tree
+    std::vector<double> flat;
+    flatten(dim_, elements, &flat);
+    build(flat);
 }
 
 void
 KDTree::reBalance()
 {
-    destruct(root_);
+    makeOwned();
 
-    std::vector<unsigned long> elemsIndices(elements_.size());
-    for(unsigned long i = 0; i < elemsIndices.size(); ++i)
-        elemsIndices[i] = i;
+    // put the coordinates back in the original index order and rebuild
+    std::vector<double> flat(nodes_.size() * dim_);
+    for(unsigned long i = 0; i < nodes_.size(); ++i)
+    {
+        check(nodes_[i].index < nodes_.size(), "");
+        copyCoordinates(i, &(flat[nodes_[i].index * dim_]));
+    }
+
+    build(flat);
+}
+
+void
+KDTree::setApproximation(double epsilon, unsigned long maxVisits)
+{
+    check(epsilon >= 0, "invalid epsilon " << epsilon << ", must be non-negative");
+
+    epsilon_ = epsilon;
+    maxVisits_ = maxVisits;
+}
+
+void
+KDTree::build(const std::vector<double>& elements)
+{
+    check(elements.size() % dim_ == 0, "");
+
+    const unsigned long n = elements.size() / dim_;
+
+    nodes_.resize(n);
+    coords_.resize(single_ ? 0 : n * dim_);
+    coordsSingle_.resize(single_ ? n * dim_ : 0);
+    external_ = false;
+    updatePointers();
 
     depth_ = 0;
-    root_ = construct(elemsIndices, 0, elemsIndices.size(), 0, NULL);
+    roots_.clear();
+
+    if(!n)
+        return;
+
+    std::vector<unsigned long> ids(n);
+    for(unsigned long i = 0; i < n; ++i)
+        ids[i] = i;
+
+    roots_.push_back(0);
+    rebuild(0, &(elements[0]), &(ids[0]));
+}
+
+void
+KDTree::rebuild(unsigned long begin, const double *elements, const unsigned long *ids)
+{
+    check(begin < nodes_.size(), "");
+
+    const unsigned long n = nodes_.size() - begin;
+
+    std::vector<unsigned long> elemsIndices(n);
+    for(unsigned long i = 0; i < n; ++i)
+        elemsIndices[i] = i;
+
+    int height = 0;
+
+    // the subtrees are built as OpenMP tasks, see construct
+#pragma omp parallel default(shared) if(n > parallelConstructCutoff)
+    {
+#pragma omp single
+        height = construct(elements, ids, elemsIndices, 0, n, 0, begin);
+    }
+
+    depth_ = std::max(depth_, height);
 }
 
 void
@@ -45,176 +338,437 @@ KDTree::insert(const std::vector<double>& elem)
 {
     check(elem.size() == dim_, "");
 
-    elements_.push_back(elem);
+    makeOwned();
 
-    Node *node = new Node;
-    node->index = elements_.size() - 1;
-    node->left = NULL;
-    node->right = NULL;
+    const unsigned long pos = nodes_.size();
 
-    if(!root_)
-    {
-        check(elements_.size() == 1, "");
-        node->depth = 0;
-        node->parent = NULL;
-        root_ = node;
+    Node node;
+    node.index = pos;
+    node.left = nullNode;
+    node.right = nullNode;
+    node.depth = 0;
+    node.padding = 0;
 
-        check(depth_ == 0, "");
-        depth_ = 1;
-        return;
-    }
+    nodes_.push_back(node);
+    if(single_)
+        coordsSingle_.insert(coordsSingle_.end(), elem.begin(), elem.end());
+    else
+        coords_.insert(coords_.end(), elem.begin(), elem.end());
+    updatePointers();
 
-    Node *current = root_;
+    // the new point starts as a component of its own
+    roots_.push_back(pos);
+    depth_ = std::max(depth_, 1);
 
-    while(true)
+    // merge the trailing components while the last one is at least as large as the one before it
+    while(roots_.size() >= 2)
     {
-        const int compareIndex = current->depth % dim_;
-        const bool goLeft = elem[compareIndex] < elements_[current->index][compareIndex];
+        const unsigned long lastSize = nodes_.size() - roots_.back();
+        const unsigned long prevSize = roots_.back() - roots_[roots_.size() - 2];
+        if(lastSize < prevSize)
+            break;
 
-        if(goLeft)
-        {
-            if(current->left)
-            {
-                current = current->left;
-                continue;
-            }
-            else
-            {
-                current->left = node;
-                break;
-            }
-        }
-        
-        check(!goLeft, "");
-        if(current->right)
-        {
-            current = current->right;
-            continue;
-        }
+        roots_.pop_back();
+    }
+
+    const unsigned long begin = roots_.back();
+    if(begin == pos)
+        return;
 
-        check(!current->right, "");
-        current->right = node;
-        break;
+    // the merged components form a suffix of the arrays which is rebuilt in place
+    std::vector<double> elements((nodes_.size() - begin) * dim_);
+    std::vector<unsigned long> ids(nodes_.size() - begin);
+    for(unsigned long i = 0; i < ids.size(); ++i)
+    {
+        ids[i] = nodes_[begin + i].index;
+        copyCoordinates(begin + i, &(elements[i * dim_]));
     }
 
-    node->parent = current;
-    node->depth = current->depth + 1;
+    rebuild(begin, &(elements[0]), &(ids[0]));
 }
 
 void
 KDTree::findNearestNeighbors(const std::vector<double> &point, int k, std::vector<std::vector<double> > *neighbors, std::vector<double> *distanceSquares) const
 {
-    std::vector<unsigned long> indices;
-    findNearestNeighbors(point, k, &indices, distanceSquares);
+    check(neighbors, "");
+
+    std::vector<unsigned long> positions;
+    findNearestPositions(point, k, &positions, distanceSquares);
 
-    check(indices.size() == k, "");
+    check(positions.size() == k, "");
 
     neighbors->resize(k);
     for(int i = 0; i < k; ++i)
     {
-        check(indices[i] < elements_.size(), "");
-        neighbors->at(i) = elements_[indices[i]];
+        neighbors->at(i).resize(dim_);
+        copyCoordinates(positions[i], &(neighbors->at(i)[0]));
+    }
+}
+
+void
+KDTree::findNearestNeighbors(const std::vector<double>& point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares, std::vector<std::vector<double> > *neighbors) const
+{
+    check(indices, "");
+    check(neighbors, "");
+
+    findNearestPositions(point, k, indices, distanceSquares);
+
+    neighbors->resize(k);
+    for(int i = 0; i < k; ++i)
+    {
+        const unsigned long pos = (*indices)[i];
+        neighbors->at(i).resize(dim_);
+        copyCoordinates(pos, &(neighbors->at(i)[0]));
+        (*indices)[i] = nodesPtr_[pos].index;
     }
 }
 
 void
 KDTree::findNearestNeighbors(const std::vector<double>& point, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares) const
 {
-    check(point.size() == dim_, "");
+    check(indices, "");
+
+    findNearestPositions(point, k, indices, distanceSquares);
+
+    for(int i = 0; i < k; ++i)
+    {
+        check((*indices)[i] < nNodes_, "");
+        (*indices)[i] = nodesPtr_[(*indices)[i]].index;
+    }
+}
 
+void
+KDTree::findNearestNeighborsBatch(const std::vector<std::vector<double> >& points, int k, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares, std::vector<double> *neighbors) const
+{
     check(k >= 0, "invalid k");
     check(indices, "");
 
-    indices->resize(k);
+    const long n = points.size();
+
+    indices->resize(n * k);
 
     if(distanceSquares)
-        distanceSquares->resize(k);
+        distanceSquares->resize(n * k);
 
-    if(!k)
+    if(neighbors)
+        neighbors->resize(n * k * dim_);
+
+    if(!k || !n)
         return;
 
     check(nElements() >= k, k << " nearest neighbors requested but there are only " << nElements() << " elements in the kd tree");
 
-    ComparePair cp;
-    std::vector<std::pair<double, unsigned long> > container;
-    container.reserve(k + 1);
-    std::priority_queue<std::pair<double, unsigned long>, std::vector<std::pair<double, unsigned long> >, ComparePair> bpq(cp, container);
-    search(root_, bpq, k, point);
-
-    check(bpq.size() == k, "");
+    // exceptions cannot leave the parallel region, the first one is rethrown after it
+    std::exception_ptr exc;
 
-    for(int i = k - 1; i >= 0; --i)
+#pragma omp parallel default(shared)
     {
-        check(!bpq.empty(), "");
-        indices->at(i) = bpq.top().second;
-        if(distanceSquares)
-            distanceSquares->at(i) = bpq.top().first;
-        bpq.pop();
+        // each thread reuses the same buffer for all of its queries
+        SearchBuffer buffer;
+
+#pragma omp for schedule(dynamic, 64)
+        for(long i = 0; i < n; ++i)
+        {
+            try
+            {
+                unsigned long *ind = &((*indices)[i * k]);
+                findNearestPositions(points[i], k, buffer, ind, (distanceSquares ? &((*distanceSquares)[i * k]) : NULL));
+
+                for(int j = 0; j < k; ++j)
+                {
+                    if(neighbors)
+                        copyCoordinates(ind[j], &((*neighbors)[(i * k + j) * dim_]));
+                    ind[j] = nodesPtr_[ind[j]].index;
+                }
+            }
+            catch (...)
+            {
+#pragma omp critical (kd_tree_batch)
+                {
+                    if(!exc)
+                        exc = std::current_exception();
+                }
+            }
+        }
     }
 
-    check(bpq.empty(), "");
+    if(exc)
+        std::rethrow_exception(exc);
 }
 
 void
-KDTree::search(const Node *current, std::priority_queue<std::pair<double, unsigned long>, std::vector<std::pair<double, unsigned long> >, ComparePair>& bpq, int k, const std::vector<double>& point) const
+KDTree::findWithinRadius(const std::vector<double>& point, double radius, std::vector<unsigned long> *indices, std::vector<double> *distanceSquares) const
 {
-    check(k > 0, "");
     check(point.size() == dim_, "");
+    check(radius >= 0, "invalid radius " << radius);
+    check(indices, "");
 
-    if(!current)
-        return;
+    std::vector<std::pair<double, unsigned long> > found;
 
-    check(current->index < elements_.size(), "");
-    const std::vector<double>& v = elements_[current->index];
-    check(v.size() == dim_, "");
+    if(single_)
+        radiusSearch<float>(&(point[0]), radius * radius, found);
+    else
+        radiusSearch<double>(&(point[0]), radius * radius, found);
 
-    // calculate distance
-    double distance = 0;
-    for(int i = 0; i < dim_; ++i)
+    std::sort(found.begin(), found.end());
+
+    indices->resize(found.size());
+    if(distanceSquares)
+        distanceSquares->resize(found.size());
+
+    for(unsigned long i = 0; i < found.size(); ++i)
     {
-        const double delta = point[i] - v[i];
-        distance += delta * delta; // euclidean distance squared
+        (*indices)[i] = found[i].second;
+        if(distanceSquares)
+            (*distanceSquares)[i] = found[i].first;
     }
+}
+
+template<typename T>
+void
+KDTree::radiusSearch(const double *point, double radiusSq, std::vector<std::pair<double, unsigned long> >& found) const
+{
+    const T *coords = coordinateArray<T>();
+
+    // same traversal as for the nearest neighbors, with a fixed bound
+    std::vector<std::pair<unsigned long, double> > stack;
+    for(std::vector<unsigned long>::const_reverse_iterator it = roots_.rbegin(); it != roots_.rend(); ++it)
+        stack.push_back(std::make_pair(*it, 0.0));
 
-    check(bpq.size() <= k, "");
+    while(!stack.empty())
+    {
+        unsigned long pos = stack.back().first;
+        const double bound = stack.back().second;
+        stack.pop_back();
 
-    bpq.emplace(distance, current->index);
-    if(bpq.size() > k)
-        bpq.pop();
+        if(bound > radiusSq)
+            continue;
 
-    check(bpq.size() <= k, "");
+        while(pos != nullNode)
+        {
+            check(pos < nNodes_, "");
+            const Node& current = nodesPtr_[pos];
+            const T *v = coords + pos * dim_;
 
-    const int index = current->depth % dim_;
-    const bool goLeft = point[index] < v[index];
+            const double distance = distanceSquared<0>(point, v, dim_, radiusSq);
+            if(distance <= radiusSq)
+                found.push_back(std::make_pair(distance, current.index));
 
-    if(goLeft)
-        search(current->left, bpq, k, point);
-    else
-        search(current->right, bpq, k, point);
+            const int index = current.depth % dim_;
+            const double delta = point[index] - v[index];
+            const bool goLeft = (delta < 0);
+
+            const unsigned long otherSide = (goLeft ? current.right : current.left);
+            if(otherSide != nullNode && delta * delta <= radiusSq)
+                stack.push_back(std::make_pair(otherSide, delta * delta));
 
-    bool goOtherSide = false;
-    if(bpq.size() < k)
-        goOtherSide = true;
+            pos = (goLeft ? current.left : current.right);
+        }
+    }
+}
+
+void
+KDTree::findInBox(const std::vector<double>& lower, const std::vector<double>& upper, std::vector<unsigned long> *indices) const
+{
+    check(lower.size() == dim_, "");
+    check(upper.size() == dim_, "");
+    check(indices, "");
+
+    indices->clear();
+
+    if(single_)
+        boxSearch<float>(&(lower[0]), &(upper[0]), indices);
     else
+        boxSearch<double>(&(lower[0]), &(upper[0]), indices);
+}
+
+template<typename T>
+void
+KDTree::boxSearch(const double *lower, const double *upper, std::vector<unsigned long> *indices) const
+{
+    const T *coords = coordinateArray<T>();
+
+    std::vector<unsigned long> stack(roots_.rbegin(), roots_.rend());
+
+    while(!stack.empty())
     {
-        const double delta = point[index] - v[index];
-        const double deltaSq = delta * delta;
+        const unsigned long pos = stack.back();
+        stack.pop_back();
+
+        check(pos < nNodes_, "");
+        const Node& current = nodesPtr_[pos];
+        const T *v = coords + pos * dim_;
+
+        bool inside = true;
+        for(int i = 0; i < dim_; ++i)
+        {
+            if(v[i] < lower[i] || v[i] > upper[i])
+            {
+                inside = false;
+                break;
+            }
+        }
 
-        check(!bpq.empty(), "");
-        const double maxDist = bpq.top().first;
+        if(inside)
+            indices->push_back(current.index);
 
-        if(deltaSq <= maxDist)
-            goOtherSide = true;
+        // the left subtree has the coordinates not larger than the split value, the right one not smaller
+        const int index = current.depth % dim_;
+        if(current.right != nullNode && upper[index] >= v[index])
+            stack.push_back(current.right);
+        if(current.left != nullNode && lower[index] <= v[index])
+            stack.push_back(current.left);
     }
+}
+
+template<int Dim, typename T>
+void
+KDTree::search(const double *point, int k, SearchBuffer& buffer) const
+{
+    const int dim = (Dim ? Dim : dim_);
+    check(dim == dim_, "");
+    check(k > 0, "");
+    check(buffer.best.size() == k, "");
+    check(nNodes_, "");
+
+    const T *coords = coordinateArray<T>();
+
+    std::pair<double, unsigned long> *best = &(buffer.best[0]);
+    int nFound = 0;
+    double maxDist = std::numeric_limits<double>::max();
+
+    // for the approximate search the branches are pruned more aggressively, by the factor 1 / (1 + epsilon)^2
+    const double pruneFactor = 1.0 / ((1.0 + epsilon_) * (1.0 + epsilon_));
+    unsigned long visits = 0;
+
+    // start from the roots of all the components, largest one first
+    std::vector<std::pair<unsigned long, double> >& stack = buffer.stack;
+    stack.clear();
+    for(std::vector<unsigned long>::const_reverse_iterator it = roots_.rbegin(); it != roots_.rend(); ++it)
+        stack.push_back(std::make_pair(*it, 0.0));
+
+    while(!stack.empty())
+    {
+        unsigned long pos = stack.back().first;
+        const double bound = stack.back().second;
+        stack.pop_back();
 
-    if(!goOtherSide)
+        // the whole subtree is farther than the farthest neighbor found so far
+        if(nFound == k && bound > maxDist * pruneFactor)
+            continue;
+
+        // go down to a leaf, remembering the other sides for later
+        while(pos != nullNode)
+        {
+            check(pos < nNodes_, "");
+            const Node& current = nodesPtr_[pos];
+            const T *v = coords + pos * dim;
+
+            const double distance = distanceSquared<Dim>(point, v, dim, maxDist);
+
+            if(nFound < k || distance < maxDist)
+            {
+                // insert keeping the buffer sorted, the farthest one drops out if the buffer is full
+                int i = (nFound < k ? nFound++ : k - 1);
+                while(i > 0 && best[i - 1].first > distance)
+                {
+                    best[i] = best[i - 1];
+                    --i;
+                }
+                best[i].first = distance;
+                best[i].second = pos;
+
+                if(nFound == k)
+                    maxDist = best[k - 1].first;
+            }
+
+            const int index = current.depth % dim;
+            const double delta = point[index] - v[index];
+            const bool goLeft = (delta < 0);
+
+            const unsigned long otherSide = (goLeft ? current.right : current.left);
+            if(otherSide != nullNode)
+                stack.push_back(std::make_pair(otherSide, delta * delta));
+
+            pos = (goLeft ? current.left : current.right);
+
+            // the budget of visits is exhausted, stop the search
+            if(maxVisits_ && ++visits >= maxVisits_ && nFound == k)
+            {
+                stack.clear();
+                break;
+            }
+        }
+    }
+
+    check(nFound == k, "");
+}
+
+template<int Dim>
+void
+KDTree::dispatchSearch(const double *point, int k, SearchBuffer& buffer) const
+{
+    if(dim_ == Dim)
+    {
+        if(single_)
+            search<Dim, float>(point, k, buffer);
+        else
+            search<Dim, double>(point, k, buffer);
+    }
+    else
+        dispatchSearch<Dim - 1>(point, k, buffer);
+}
+
+template<>
+void
+KDTree::dispatchSearch<0>(const double *point, int k, SearchBuffer& buffer) const
+{
+    if(single_)
+        search<0, float>(point, k, buffer);
+    else
+        search<0, double>(point, k, buffer);
+}
+
+void
+KDTree::findNearestPositions(const std::vector<double>& point, int k, std::vector<unsigned long> *positions, std::vector<double> *distanceSquares) const
+{
+    check(k >= 0, "invalid k");
+    check(positions, "");
+
+    positions->resize(k);
+
+    if(distanceSquares)
+        distanceSquares->resize(k);
+
+    if(!k)
         return;
 
-    // search the other branch
-    if(goLeft)
-        search(current->right, bpq, k, point);
+    check(nElements() >= k, k << " nearest neighbors requested but there are only " << nElements() << " elements in the kd tree");
+
+    SearchBuffer buffer;
+    findNearestPositions(point, k, buffer, &((*positions)[0]), (distanceSquares ? &((*distanceSquares)[0]) : NULL));
+}
+
+void
+KDTree::findNearestPositions(const std::vector<double>& point, int k, SearchBuffer& buffer, unsigned long *positions, double *distanceSquares) const
+{
+    check(point.size() == dim_, "");
+    check(k > 0, "");
+
+    buffer.best.resize(k);
+    buffer.stack.reserve(depth_ + roots_.size());
+
+    if(dim_ <= maxStaticDim)
+        dispatchSearch<maxStaticDim>(&(point[0]), k, buffer);
     else
-        search(current->left, bpq, k, point);
+        dispatchSearch<0>(&(point[0]), k, buffer);
+
+    for(int i = 0; i < k; ++i)
+    {
+        positions[i] = buffer.best[i].second;
+        if(distanceSquares)
+            distanceSquares[i] = buffer.best[i].first;
+    }
 }
 
 namespace
@@ -224,68 +778,77 @@ struct CompareKDTreeNode
 {
     int dim;
     int compareIndex;
-    const std::vector<std::vector<double> > *elements;
+    const double *elements;
 
     bool operator() (unsigned long a, unsigned long b) const
     {
         check(dim > 0, "");
         check(compareIndex < dim, "");
 
-        check(a < elements->size(), "");
-        check(b < elements->size(), "");
-
-        const std::vector<double> &aVec = elements->at(a);
-        const std::vector<double> &bVec = elements->at(b);
-
-        check(aVec.size() == dim, "");
-        check(bVec.size() == dim, "");
-
-        return aVec[compareIndex] < bVec[compareIndex];
+        return elements[a * dim + compareIndex] < elements[b * dim + compareIndex];
     }
 };
 
 }
 
-KDTree::Node*
-KDTree::construct(std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, Node *parent)
+int
+KDTree::construct(const double *elements, const unsigned long *ids, std::vector<unsigned long> &elementsIndices, unsigned long begin, unsigned long end, int depth, unsigned long pos)
 {
-    check(end >= begin, "");
+    check(end > begin, "");
     check(end <= elementsIndices.size(), "");
-
-    if(end == begin)
-        return NULL;
+    check(pos < nodes_.size(), "");
 
     CompareKDTreeNode comp;
     comp.dim = dim_;
     comp.compareIndex = depth % dim_;
-    comp.elements = &elements_;
-
-    std::vector<unsigned long>::iterator beginIt = elementsIndices.begin() + begin, endIt = elementsIndices.begin() + end;
-    std::sort(beginIt, endIt, comp);
+    comp.elements = elements;
 
-    unsigned long median = (begin + end) / 2;
+    const unsigned long median = (begin + end) / 2;
     check(median >= begin && median < end, "");
 
-    Node* node = new Node;
-    node->index = elementsIndices[median];
-    node->depth = depth;
-    node->parent = parent;
-    node->left = construct(elementsIndices, begin, median, depth + 1, node);
-    node->right = construct(elementsIndices, median + 1, end, depth + 1, node);
+    // only the median needs to be in place, with smaller elements before and larger ones after it
+    std::vector<unsigned long>::iterator beginIt = elementsIndices.begin() + begin, medianIt = elementsIndices.begin() + median, endIt = elementsIndices.begin() + end;
+    std::nth_element(beginIt, medianIt, endIt, comp);
 
-    depth_ = std::max(depth + 1, depth_);
+    // depth-first layout: the left subtree directly follows the node, the right subtree follows the left subtree
+    const unsigned long leftSize = median - begin;
+    const unsigned long rightSize = end - median - 1;
 
-    return node;
-}
+    const unsigned long local = elementsIndices[median];
 
-void
-KDTree::destruct(Node* root)
-{
-    if(!root)
-        return;
+    Node& node = nodes_[pos];
+    node.index = ids[local];
+    node.depth = depth;
+    node.left = (leftSize ? pos + 1 : nullNode);
+    node.right = (rightSize ? pos + 1 + leftSize : nullNode);
+    node.padding = 0;
+
+    if(single_)
+        std::copy(elements + local * dim_, elements + (local + 1) * dim_, coordsSingle_.begin() + pos * dim_);
+    else
+        std::copy(elements + local * dim_, elements + (local + 1) * dim_, coords_.begin() + pos * dim_);
+
+    // the two subtrees occupy separate ranges of all the arrays so they can be built independently
+    int leftHeight = 0, rightHeight = 0;
+
+    if(end - begin > parallelConstructCutoff)
+    {
+#pragma omp task default(shared)
+        leftHeight = construct(elements, ids, elementsIndices, begin, median, depth + 1, pos + 1);
+
+        if(rightSize)
+            rightHeight = construct(elements, ids, elementsIndices, median + 1, end, depth + 1, pos + 1 + leftSize);
+
+#pragma omp taskwait
+    }
+    else
+    {
+        if(leftSize)
+            leftHeight = construct(elements, ids, elementsIndices, begin, median, depth + 1, pos + 1);
+        if(rightSize)
+            rightHeight = construct(elements, ids, elementsIndices, median + 1, end, depth + 1, pos + 1 + leftSize);
+    }
 
-    destruct(root->left);
-    destruct(root->right);
-    delete root;
+    return std::max(leftHeight, rightHeight) + 1;
 }
 
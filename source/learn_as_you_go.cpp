@@ -8,17 +8,90 @@
 #include <vector>
 #include <sstream>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <exception>
 
 #include <learn_as_you_go.hpp>
 #include <exception_handler.hpp>
 
-LearnAsYouGo::LearnAsYouGo(int nPoints, int nData, const Math::RealFunctionMultiToMulti& f, const Math::RealFunctionMultiDim& errorFunc, unsigned long minCount, double precision, const char* fileName) : nPoints_(nPoints), nData_(nData), f_(f), errorFunc_(errorFunc), minCount_(minCount), precision_(precision), fileName_(fileName), gen_(std::time(0), 0, 1), fa_(NULL), fast_(NULL)
+namespace
+{
+
+// the first 8 bytes of the training set file, "LAYGLOG1"
+const unsigned long fileMagic = 0x31474f4c4759414cUL;
+
+// the number of unsigned longs in the header of the snapshot
+const unsigned long snapshotHeaderSize = 9;
+
+// FNV-1a checksum of the bytes of a record
+unsigned long recordChecksum(const char* data, unsigned long size)
+{
+    unsigned long h = 14695981039346656037UL;
+    for(unsigned long i = 0; i < size; ++i)
+    {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+double secondsSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+struct LearnAsYouGo::UpdateJob
+{
+    UpdateJob(const std::vector<std::vector<double> >& p, const RowTable& d, int seed) : points(p), data(d), gen(seed, 0, 1), compressor(NULL), errorFunc(NULL), fa(NULL), fast(NULL), duration(0), done(false) {}
+
+    ~UpdateJob()
+    {
+        if(fast) delete fast;
+        if(fa) delete fa;
+        if(errorFunc) delete errorFunc;
+        if(compressor) delete compressor;
+    }
+
+    // the copy of the training set
+    std::vector<std::vector<double> > points;
+    RowTable data;
+
+    unsigned long testSize;
+    double precision;
+    double covarianceTolerance;
+    Math::UniformRealGenerator gen;
+
+    // a copy of the compressor, with the updated basis, and the training set compressed in it
+    PCACompressor* compressor;
+    DecompressedErrorFunc* errorFunc;
+    RowTable compressedData;
+
+    // the results
+    FastApproximator* fa;
+    FastApproximatorError* fast;
+    // the exception thrown by the worker, of any type, rethrown by finishUpdate
+    std::exception_ptr error;
+    // in seconds
+    double duration;
+
+    std::atomic<bool> done;
+    std::thread thread;
+};
+
+LearnAsYouGo::LearnAsYouGo(int nPoints, int nData, const Math::RealFunctionMultiToMulti& f, const Math::RealFunctionMultiDim& errorFunc, unsigned long minCount, double precision, const char* fileName, bool singlePrecision, int nComponents) : nPoints_(nPoints), nData_(nData), f_(f), errorFunc_(errorFunc), minCount_(minCount), precision_(precision), duplicateRadius_(0), covarianceTolerance_(0.05), singlePrecision_(singlePrecision), nComponents_(nComponents), asyncUpdate_(false), updateFile_(false), compactFile_(true), fileName_(fileName), gen_(std::time(0), 0, 1), fa_(NULL), fast_(NULL), snapshot_(NULL), compressor_(NULL), compressedErrorFunc_(NULL), job_(NULL), pointIndex_(points_)
 {
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
     check(minCount_ >= 10, "");
     check(precision_ > 0, "");
+    check(nComponents_ >= 0, "invalid number of components " << nComponents_);
 
     if(fileName_ != "")
     {
@@ -32,8 +105,53 @@ LearnAsYouGo::LearnAsYouGo(int nPoints, int nData, const Math::RealFunctionMulti
 
 LearnAsYouGo::~LearnAsYouGo()
 {
+#ifdef COSMO_MPI
+    if(communicationMode_ == COLLECTIVE)
+    {
+        // the other processes may be waiting for this one to take part in the exchange
+        while(!exchange(true))
+            std::this_thread::yield();
+
+        MPI_Comm_free((MPI_Comm*) exchangeComm_);
+        delete (MPI_Comm*) exchangeComm_;
+        delete (MPI_Request*) exchangeReq_;
+    }
+#endif
+
+    if(job_)
+    {
+        try
+        {
+            finishUpdate();
+        }
+        catch(std::exception& e)
+        {
+            output_screen(e.what() << std::endl);
+        }
+        catch(...)
+        {
+            output_screen("The background update of the fast approximator failed with an unknown exception." << std::endl);
+        }
+    }
+
+    // a write error (e.g. a full disk) is reported, the destructor must not throw
     if(updateFile_)
-        writeIntoFile(fileName_.c_str());
+    {
+        try
+        {
+            appendToFile();
+            if(fa_)
+                writeSnapshot((fileName_ + ".snapshot").c_str());
+        }
+        catch(std::exception& e)
+        {
+            output_screen(e.what() << std::endl);
+        }
+        catch(...)
+        {
+            output_screen("Writing the training set to the file " << fileName_ << " failed with an unknown exception." << std::endl);
+        }
+    }
 
     if(logFile_)
     {
@@ -41,8 +159,16 @@ LearnAsYouGo::~LearnAsYouGo()
         delete logFile_;
     }
 
-    if(fa_) delete fa_;
+    if(telemetry_) delete telemetry_;
+
     if(fast_) delete fast_;
+    if(fa_) delete fa_;
+
+    if(compressedErrorFunc_) delete compressedErrorFunc_;
+    if(compressor_) delete compressor_;
+
+    // the fast approximator may be using the mapped snapshot, so this goes last
+    if(snapshot_) delete snapshot_;
 
 #ifdef COSMO_MPI
     for(int i = 0; i < updateRequests_.size(); ++i)
@@ -81,6 +207,11 @@ LearnAsYouGo::construct()
 
     firstUpdateRequested_ = false;
 
+    communicationMode_ = POINT_TO_POINT;
+    exchangeComm_ = NULL;
+    exchangeReq_ = NULL;
+    exchangeState_ = 0;
+
 #ifdef COSMO_MPI
     updateReceiveReq_.resize(nProcesses_);
     for(int i = 0; i < nProcesses_; ++i)
@@ -92,12 +223,15 @@ LearnAsYouGo::construct()
     successfulCount_ = 0;
 
     logFile_ = NULL;
+    telemetry_ = NULL;
 
     // memory allocation
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
 
     currentData_.resize(nData_);
+    data_.reset(nData_, singlePrecision_);
+    compressedData_.reset(nComponents_ > 0 ? nComponents_ : nData_, singlePrecision_);
 
     communicateBuff_.resize(communicateCount_ * (nPoints_ + nData_));
     receiveBuff_.resize(nProcesses_);
@@ -107,6 +241,13 @@ LearnAsYouGo::construct()
     tempParams_.resize(nPoints_);
     tempData_.resize(nData_);
 
+    if(nComponents_ > 0)
+    {
+        check(nComponents_ < nData_, "the number of components " << nComponents_ << " must be less than the output dimension " << nData_);
+        compressor_ = new PCACompressor(nData_, nComponents_);
+        compressedErrorFunc_ = new DecompressedErrorFunc(*compressor_, errorFunc_);
+    }
+
     CosmoMPI::create().barrier();
 
     communicateTag_ = CosmoMPI::create().getCommTag();
@@ -120,6 +261,16 @@ LearnAsYouGo::readFromFile(const char* fileName)
     if(!in)
         return false;
 
+    // files written before the log format have no magic number, and start with the number of points and the size of the training set
+    unsigned long magic = 0;
+    in.read((char*)(&magic), sizeof(magic));
+    const bool legacy = (magic != fileMagic);
+    if(legacy)
+    {
+        in.clear();
+        in.seekg(0);
+    }
+
     in.read((char*)(&nPoints_), sizeof(nPoints_));
     in.read((char*)(&nData_), sizeof(nData_));
     in.read((char*)(&precision_), sizeof(precision_));
@@ -132,45 +283,314 @@ LearnAsYouGo::readFromFile(const char* fileName)
 
     construct();
 
-    unsigned long dataSize;
+    const std::string snapshotName = std::string(fileName) + ".snapshot";
 
-    in.read((char*)(&dataSize), sizeof(dataSize));
-    points_.resize(dataSize);
-    data_.resize(dataSize);
+    // if the snapshot was written when the file had exactly its current contents, the whole training set is taken from the snapshot and the file is not parsed
+    if(!legacy)
+    {
+        const std::streampos recordsBegin = in.tellg();
+        in.seekg(0, std::ios::end);
+        const unsigned long fileSize = (unsigned long) in.tellg();
 
-    for(unsigned long i = 0; i < dataSize; ++i)
+        unsigned long lastChecksum = 0;
+        if(fileSize >= (unsigned long) recordsBegin + sizeof(lastChecksum))
+        {
+            in.seekg(fileSize - sizeof(lastChecksum));
+            in.read((char*)(&lastChecksum), sizeof(lastChecksum));
+        }
+
+        if(in && readSnapshot(snapshotName.c_str(), fileSize, lastChecksum))
+        {
+            compactFile_ = false;
+            return true;
+        }
+
+        in.clear();
+        in.seekg(recordsBegin);
+    }
+
+    unsigned long dataSize = 0;
+    if(legacy)
+        in.read((char*)(&dataSize), sizeof(dataSize));
+
+    // the records are read until the end of the file, a partially written or corrupted record ends the training set
+    const unsigned long valuesSize = (nPoints_ + nData_) * sizeof(double);
+    const unsigned long recordSize = valuesSize + (legacy ? 0 : sizeof(unsigned long));
+    std::vector<char> record(recordSize);
+    bool complete = true;
+
+    for(unsigned long i = 0; !legacy || i < dataSize; ++i)
     {
-        points_[i].resize(nPoints_);
-        data_[i].resize(nData_);
+        in.read(&(record[0]), recordSize);
+        if(!legacy && in.gcount() == 0)
+            break;
+
+        if(in.gcount() != recordSize)
+        {
+            complete = false;
+            break;
+        }
+
+        if(!legacy)
+        {
+            unsigned long checksum;
+            std::memcpy(&checksum, &(record[valuesSize]), sizeof(checksum));
+            if(checksum != recordChecksum(&(record[0]), valuesSize))
+            {
+                complete = false;
+                break;
+            }
+        }
 
-        in.read((char*)(&(points_[i][0])), nPoints_ * sizeof(double));
-        in.read((char*)(&(data_[i][0])), nData_ * sizeof(double));
+        std::memcpy(&(tempParams_[0]), &(record[0]), nPoints_ * sizeof(double));
+        std::memcpy(&(tempData_[0]), &(record[nPoints_ * sizeof(double)]), nData_ * sizeof(double));
+
+        unsigned long index;
+        if(pointIndex_.find(tempParams_, &index))
+            continue;
+
+        points_.push_back(tempParams_);
+        pointIndex_.insert(points_.size() - 1);
+        data_.push_back(tempData_);
+
+        if(compressor_)
+            compressor_->addSample(tempData_);
     }
 
     in.close();
 
-    resetPointMap();
+    if(!complete)
+        output_screen1("The file " << fileName << " is truncated or corrupted after " << points_.size() << " training points, the rest of it is ignored." << std::endl);
+
+    // the file is rewritten in the current format, without the damaged part, at the next update
+    compactFile_ = (legacy || !complete);
 
     if(points_.size() >= minCount_)
-    {
         constructFast();
+
+    return true;
+}
+
+bool
+LearnAsYouGo::readSnapshot(const char* fileName, unsigned long fileSize, unsigned long lastChecksum)
+{
+    check(!fa_, "");
+    check(!fast_, "");
+    check(!snapshot_, "");
+    check(points_.empty(), "");
+
+    {
+        std::ifstream in(fileName, std::ios::binary | std::ios::in);
+        if(!in)
+            return false;
+
+        in.seekg(0, std::ios::end);
+        if((unsigned long) in.tellg() < snapshotHeaderSize * sizeof(unsigned long) + 5 * sizeof(double))
+            return false;
+    }
+
+    MappedFile* mapped = new MappedFile(fileName);
+
+    const unsigned long *header = reinterpret_cast<const unsigned long*>(mapped->data());
+    const unsigned long n = header[2];
+
+    // the snapshot is only used if it was written when the training set file had its current contents, with the same settings
+    const bool good = (header[0] == nPoints_ && header[1] == nData_ && n > 0 && header[5] == nComponents_ && header[6] == (singlePrecision_ ? sizeof(float) : sizeof(double)) && header[7] == fileSize && header[8] == lastChecksum);
+
+    if(!good)
+    {
+        output_screen1("The snapshot " << fileName << " does not match the training set file, not using it." << std::endl);
+        delete mapped;
+        return false;
+    }
+
+    // everything is checked against the size of the snapshot before anything is changed, a damaged snapshot is not used
+    PCACompressor* compressor = NULL;
+    const char* exact = NULL;
+    const double* points = NULL;
+    unsigned long offset = snapshotHeaderSize * sizeof(unsigned long) + 5 * sizeof(double);
+    StandardException exc;
+    try
+    {
+        if(compressor_)
+        {
+            compressor = new PCACompressor(*compressor_);
+            compressor->readBasis(mapped->data() + offset, mapped->size() - offset);
+            offset += compressor->basisSize();
+            offset += compressor->readSample(mapped->data() + offset, mapped->size() - offset);
+        }
+
+        if(n > (mapped->size() - offset) / sizeof(double) / nPoints_)
+        {
+            exc.set("The training points are truncated.");
+            throw exc;
+        }
+        points = reinterpret_cast<const double*>(mapped->data() + offset);
+        offset += n * nPoints_ * sizeof(double);
+
+        if(compressor_)
+        {
+            // the exact output values, padded to 8 bytes (see RowTable::writeRaw)
+            const unsigned long rowBytes = nData_ * (singlePrecision_ ? sizeof(float) : sizeof(double));
+            if(n > (mapped->size() - offset) / rowBytes)
+            {
+                exc.set("The output values are truncated.");
+                throw exc;
+            }
+            exact = mapped->data() + offset;
+            offset += (n * rowBytes + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+        }
+
+        fa_ = new FastApproximator(mapped->data() + offset, mapped->size() - offset, neighborCount());
+        if(fa_->nIn() != nPoints_ || fa_->nOut() != (compressor_ ? nComponents_ : nData_) || fa_->values().size() != n || fa_->values().singlePrecision() != singlePrecision_)
+        {
+            exc.set("The fast approximator does not match the training set.");
+            throw exc;
+        }
+    }
+    catch(StandardException& e)
+    {
+        output_screen1("The snapshot " << fileName << " is damaged, not using it. " << e.what() << std::endl);
+        if(fa_)
+        {
+            delete fa_;
+            fa_ = NULL;
+        }
+        if(compressor)
+            delete compressor;
+        delete mapped;
+        return false;
     }
 
+    output_screen1("Reading the training set and the fast approximator from the snapshot " << fileName << "." << std::endl);
+
+    updateErrorThreshold_ = header[3];
+    testSize_ = header[4];
+
+    // the input points are small, each process keeps its own copy of them and the index
+    points_.resize(n);
+    for(unsigned long i = 0; i < n; ++i)
+        points_[i].assign(points + i * nPoints_, points + (i + 1) * nPoints_);
+    resetPointIndex();
+
+    // the output values are used in place, so they are shared by all of the processes mapping the snapshot (until a process adds new points, see RowTable)
+    RowTable training(fa_->values());
+    if(compressor_)
+    {
+        data_.reset(nData_, n, singlePrecision_, exact);
+        compressedData_.swap(training);
+
+        delete compressedErrorFunc_;
+        delete compressor_;
+        compressor_ = compressor;
+        compressedErrorFunc_ = new DecompressedErrorFunc(*compressor_, errorFunc_);
+    }
+    else
+        data_.swap(training);
+
+    fa_->setValues(trainingData());
+
+    snapshot_ = mapped;
+    fa_->setCovarianceTolerance(covarianceTolerance_);
+
+    std::stringstream model(std::string(mapped->data() + snapshotHeaderSize * sizeof(unsigned long), 5 * sizeof(double)));
+    fast_ = new FastApproximatorError(*fa_, model, errorFunction(), FastApproximatorError::AVG_INV_DISTANCE, precision_);
+
     return true;
 }
 
+void
+LearnAsYouGo::writeSnapshot(const char* fileName) const
+{
+    if(processId_ != 0)
+        return;
+
+    check(fa_, "the fast approximator has not been constructed yet");
+    check(fast_, "");
+    check(!points_.empty(), "");
+
+    // write into a temporary file first and then rename it, so that other processes mapping the old snapshot are not affected
+    const std::string tempName = std::string(fileName) + ".tmp";
+
+    std::ofstream out(tempName.c_str(), std::ios::binary | std::ios::out);
+    StandardException exc;
+    if(!out)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << tempName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    // the state of the training set file, which identifies the training set of the snapshot in readFromFile
+    // it is only recorded if the file is up to date, otherwise the snapshot will not be used
+    unsigned long fileSize = 0, lastChecksum = 0;
+    if(updateFile_ && !compactFile_ && newRecords_.empty())
+    {
+        std::ifstream in(fileName_.c_str(), std::ios::binary | std::ios::in);
+        in.seekg(0, std::ios::end);
+        fileSize = (unsigned long) in.tellg();
+        in.seekg(fileSize - sizeof(lastChecksum));
+        in.read((char*)(&lastChecksum), sizeof(lastChecksum));
+        if(!in)
+            fileSize = 0;
+    }
+
+    unsigned long header[snapshotHeaderSize];
+    header[0] = nPoints_;
+    header[1] = nData_;
+    header[2] = points_.size();
+    header[3] = updateErrorThreshold_;
+    header[4] = testSize_;
+    header[5] = nComponents_;
+    header[6] = (singlePrecision_ ? sizeof(float) : sizeof(double));
+    header[7] = fileSize;
+    header[8] = lastChecksum;
+
+    out.write((char*)(header), snapshotHeaderSize * sizeof(unsigned long));
+    fast_->writeModel(out);
+    if(compressor_)
+    {
+        compressor_->writeBasis(out);
+        compressor_->writeSample(out);
+    }
+
+    // the points in the same order as in the fast approximator
+    for(unsigned long i = 0; i < points_.size(); ++i)
+        out.write((char*)(&(points_[i][0])), nPoints_ * sizeof(double));
+
+    // the fast approximator contains the values it interpolates, the exact values are only written separately if they are different
+    check(data_.size() == points_.size(), "");
+    if(compressor_)
+        data_.writeRaw(out);
+
+    fa_->writeSnapshot(out);
+    out.close();
+
+    if(!out || std::rename(tempName.c_str(), fileName) != 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write the snapshot into " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
 void
 LearnAsYouGo::writeIntoFile(const char* fileName) const
 {
     if(processId_ != 0)
         return;
 
-    std::ofstream out(fileName, std::ios::binary | std::ios::out);
+    // write into a temporary file first and then rename it, so that the old file stays intact if the writing is interrupted
+    const std::string tempName = std::string(fileName) + ".tmp";
+
+    std::ofstream out(tempName.c_str(), std::ios::binary | std::ios::out);
     StandardException exc;
     if(!out)
     {
         std::stringstream exceptionStr;
-        exceptionStr << "Cannot writo into output file " << fileName << ".";
+        exceptionStr << "Cannot write into output file " << tempName << ".";
         exc.set(exceptionStr.str());
         throw exc;
     }
@@ -180,31 +600,96 @@ LearnAsYouGo::writeIntoFile(const char* fileName) const
     check(precision_ > 0, "");
     check(minCount_ > 10, "");
 
+    out.write((char*)(&fileMagic), sizeof(fileMagic));
     out.write((char*)(&nPoints_), sizeof(nPoints_));
     out.write((char*)(&nData_), sizeof(nData_));
     out.write((char*)(&precision_), sizeof(precision_));
     out.write((char*)(&minCount_), sizeof(minCount_));
 
-    unsigned long dataSize = points_.size();
+    const unsigned long dataSize = points_.size();
     check(data_.size() == dataSize, "");
-    check(pointMap_.size() == dataSize, "");
+    check(pointIndex_.size() == dataSize, "");
+
+    std::vector<char> record;
+    std::vector<double> d;
 
-    out.write((char*)(&dataSize), sizeof(dataSize));
     for(unsigned long i = 0; i < dataSize; ++i)
     {
-        out.write((char*)(&(points_[i][0])), nPoints_ * sizeof(double));
-        out.write((char*)(&(data_[i][0])), nData_ * sizeof(double));
+        getData(i, &d);
+        makeRecord(points_[i], d, &record);
+        out.write(&(record[0]), record.size());
+    }
+
+    out.close();
+
+    if(!out || std::rename(tempName.c_str(), fileName) != 0)
+    {
+        std::remove(tempName.c_str());
+
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write the training set into " << fileName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+}
+
+void
+LearnAsYouGo::makeRecord(const std::vector<double>& p, const std::vector<double>& d, std::vector<char>* record) const
+{
+    check(p.size() == nPoints_, "");
+    check(d.size() == nData_, "");
+
+    const unsigned long valuesSize = (nPoints_ + nData_) * sizeof(double);
+    record->resize(valuesSize + sizeof(unsigned long));
+
+    std::memcpy(&((*record)[0]), &(p[0]), nPoints_ * sizeof(double));
+    std::memcpy(&((*record)[nPoints_ * sizeof(double)]), &(d[0]), nData_ * sizeof(double));
+
+    const unsigned long checksum = recordChecksum(&((*record)[0]), valuesSize);
+    std::memcpy(&((*record)[valuesSize]), &checksum, sizeof(checksum));
+}
+
+void
+LearnAsYouGo::appendToFile()
+{
+    check(updateFile_, "");
+
+    if(processId_ != 0)
+        return;
+
+    if(compactFile_)
+    {
+        writeIntoFile(fileName_.c_str());
+        compactFile_ = false;
+        newRecords_.clear();
+        return;
     }
 
+    if(newRecords_.empty())
+        return;
+
+    // all of the new records in one write, a crash in the middle of it only damages the new records
+    std::ofstream out(fileName_.c_str(), std::ios::binary | std::ios::out | std::ios::app);
+    if(out)
+        out.write(&(newRecords_[0]), newRecords_.size());
     out.close();
+
+    if(!out)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot append to the file " << fileName_ << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    newRecords_.clear();
 }
 
 void
-LearnAsYouGo::resetPointMap()
+LearnAsYouGo::resetPointIndex()
 {
-    pointMap_.clear();
-    for(unsigned long i = 0; i < points_.size(); ++i)
-        pointMap_[points_[i]] = i;
+    pointIndex_.reset();
 }
 
 void
@@ -223,29 +708,95 @@ LearnAsYouGo::logIntoFile(const char* fileNameBase)
     logFile_ = new std::ofstream(fileName.str().c_str());
 }
 
+void
+LearnAsYouGo::setTelemetry(bool on)
+{
+    if(telemetry_)
+    {
+        delete telemetry_;
+        telemetry_ = NULL;
+    }
+
+    if(on)
+    {
+        telemetry_ = new LearnAsYouGoTelemetry;
+        telemetry_->addSize(totalCount_, points_.size());
+    }
+}
+
+void
+LearnAsYouGo::writeTelemetry(const char* fileNameBase) const
+{
+    check(telemetry_, "the telemetry is not on");
+
+    std::stringstream fileName;
+    fileName << fileNameBase;
+
+    if(nProcesses_ > 1)
+        fileName << '_' << processId_;
+
+    const std::string csvName = fileName.str() + ".csv";
+    std::ofstream csv(csvName.c_str());
+    if(!csv)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << csvName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    telemetry_->writeCSV(csv);
+    csv.close();
+
+    const std::string jsonName = fileName.str() + ".json";
+    std::ofstream json(jsonName.c_str());
+    if(!json)
+    {
+        StandardException exc;
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot write into output file " << jsonName << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+    telemetry_->writeJSON(json);
+    json.close();
+}
+
 void
 LearnAsYouGo::randomizeErrorSet()
 {
-    check(testSize_ > 0, "");
-    check(points_.size() > testSize_, "");
+    randomizeErrorSet(testSize_, gen_, &points_, &data_, &compressedData_);
+    resetPointIndex();
+}
+
+void
+LearnAsYouGo::randomizeErrorSet(unsigned long testSize, Math::UniformRealGenerator& gen, std::vector<std::vector<double> >* points, RowTable* data, RowTable* compressedData)
+{
+    check(testSize > 0, "");
+    check(points->size() > testSize, "");
+    check(data->size() == points->size(), "");
+    check(compressedData, "");
 
-    for(unsigned long i = points_.size() - testSize_; i < points_.size(); ++i)
+    const bool compressed = (compressedData->size() != 0);
+    check(!compressed || compressedData->size() == points->size(), "");
+
+    for(unsigned long i = points->size() - testSize; i < points->size(); ++i)
     {
-        const double r = gen_.generate() * points_.size();
+        const double r = gen.generate() * points->size();
         unsigned long index = (unsigned long) std::floor(r);
 
-        check(index >= 0 && index <= points_.size(), "");
-        if(index == points_.size())
-            index = points_.size() - 1;
+        check(index >= 0 && index <= points->size(), "");
+        if(index == points->size())
+            index = points->size() - 1;
 
         if(index != i)
         {
-            points_[i].swap(points_[index]);
-            data_[i].swap(data_[index]);
+            (*points)[i].swap((*points)[index]);
+            data->swapRows(i, index);
+            if(compressed)
+                compressedData->swapRows(i, index);
         }
     }
-
-    resetPointMap();
 }
 
 void
@@ -258,20 +809,82 @@ LearnAsYouGo::setPrecision(double p)
         fast_->setPrecision(precision_);
 }
 
+void
+LearnAsYouGo::setDuplicateRadius(double r)
+{
+    check(r >= 0, "invalid duplicate radius " << r << ", must be non-negative");
+    duplicateRadius_ = r;
+}
+
+void
+LearnAsYouGo::setCovarianceTolerance(double tolerance)
+{
+    check(tolerance >= 0, "invalid tolerance " << tolerance << ", must be non-negative");
+    covarianceTolerance_ = tolerance;
+
+    if(fa_)
+        fa_->setCovarianceTolerance(covarianceTolerance_);
+}
+
+void
+LearnAsYouGo::setAsyncUpdate(bool async)
+{
+    asyncUpdate_ = async;
+}
+
+void
+LearnAsYouGo::setCommunicationMode(CommunicationMode mode)
+{
+    check(mode >= 0 && mode < COMMUNICATION_MODE_MAX, "invalid communication mode " << mode);
+    check(!firstUpdateRequested_ && newCommunicateCount_ == 0 && exchangeState_ == 0, "the communication mode needs to be set before any communication");
+
+    if(mode == communicationMode_)
+        return;
+
+#ifdef COSMO_MPI
+    if(mode == COLLECTIVE)
+    {
+        // a separate communicator so that the exchange does not interfere with the other collective operations of the program
+        exchangeComm_ = new MPI_Comm;
+        MPI_Comm_dup(MPI_COMM_WORLD, (MPI_Comm*) exchangeComm_);
+        exchangeReq_ = new MPI_Request;
+        exchangeHeaders_.resize(2 * nProcesses_);
+        exchangeCounts_.resize(nProcesses_);
+        exchangeDispls_.resize(nProcesses_);
+    }
+    else
+    {
+        MPI_Comm_free((MPI_Comm*) exchangeComm_);
+        delete (MPI_Comm*) exchangeComm_;
+        delete (MPI_Request*) exchangeReq_;
+        exchangeComm_ = NULL;
+        exchangeReq_ = NULL;
+    }
+#endif
+
+    communicationMode_ = mode;
+}
+
 void
 LearnAsYouGo::evaluate(const std::vector<double>& x, std::vector<double>* res, double *error1Sigma, double *error2Sigma, double *errorMean, double *errorVar)
 {
     receive();
 
+    if(job_ && job_->done)
+        finishUpdate();
+
     check(x.size() == nPoints_, "");
 
-    ++totalCount_;
+    std::chrono::steady_clock::time_point start;
+    if(telemetry_)
+        start = std::chrono::steady_clock::now();
 
-    const std::map<std::vector<double>, unsigned long, PointComp>::const_iterator it = pointMap_.find(x);
+    ++totalCount_;
 
-    if(it != pointMap_.end())
+    unsigned long index;
+    if(pointIndex_.find(x, &index))
     {
-        *res = data_[it->second];
+        getData(index, res);
         ++sameCount_;
 
         if(error1Sigma) *error1Sigma = 0;
@@ -279,14 +892,47 @@ LearnAsYouGo::evaluate(const std::vector<double>& x, std::vector<double>* res, d
         if(errorMean) *errorMean = 0;
         if(errorVar) *errorVar = 0;
 
+        if(telemetry_)
+            telemetry_->addTiming(LearnAsYouGoTelemetry::REPEATED, secondsSince(start));
+
         log();
         return;
     }
 
+    const bool tried = (fast_ != NULL);
+    if(tried)
+        fast_->setStepTiming(telemetry_ != NULL);
+
     bool good = false;
-    if(fast_)
+    double decompressTime = 0;
+    if(fast_ && compressed())
+    {
+        good = fast_->approximate(x, tempCompressed_, error1Sigma, error2Sigma, errorMean, errorVar);
+        if(good)
+        {
+            std::chrono::steady_clock::time_point decompressStart;
+            if(telemetry_)
+                decompressStart = std::chrono::steady_clock::now();
+
+            compressor_->decompress(tempCompressed_, res);
+
+            if(telemetry_)
+                decompressTime = secondsSince(decompressStart);
+        }
+    }
+    else if(fast_)
         good = fast_->approximate(x, *res, error1Sigma, error2Sigma, errorMean, errorVar);
 
+    if(telemetry_ && tried)
+    {
+        const FastApproximatorError::StepTimes& steps = fast_->getStepTimes();
+        telemetry_->addTiming(LearnAsYouGoTelemetry::NEAREST_NEIGHBORS, steps.neighbors);
+        if(steps.errorEvaluated)
+            telemetry_->addTiming(LearnAsYouGoTelemetry::ERROR_MODEL, steps.error);
+        if(steps.fitted)
+            telemetry_->addTiming(LearnAsYouGoTelemetry::FIT, steps.fit + decompressTime);
+    }
+
     if(!good)
     {
         actual(x, res);
@@ -296,12 +942,19 @@ LearnAsYouGo::evaluate(const std::vector<double>& x, std::vector<double>* res, d
         if(errorMean) *errorMean = 0;
         if(errorVar) *errorVar = 0;
 
+        // the time of the exact calculation includes the update of the fast approximator if one was triggered by the new point
+        if(telemetry_)
+            telemetry_->addTiming(tried ? LearnAsYouGoTelemetry::APPROXIMATE_REJECTED : LearnAsYouGoTelemetry::EXACT, secondsSince(start));
+
         log();
         return;
     }
 
     ++successfulCount_;
 
+    if(telemetry_)
+        telemetry_->addTiming(LearnAsYouGoTelemetry::APPROXIMATE_ACCEPTED, secondsSince(start));
+
     log();
 }
 
@@ -310,11 +963,10 @@ LearnAsYouGo::evaluateExact(const std::vector<double>& x, std::vector<double>* r
 {
     check(x.size() == nPoints_, "");
 
-    const std::map<std::vector<double>, unsigned long, PointComp>::const_iterator it = pointMap_.find(x);
-
-    if(it != pointMap_.end())
+    unsigned long index;
+    if(pointIndex_.find(x, &index))
     {
-        *res = data_[it->second];
+        getData(index, res);
         return;
     }
 
@@ -343,58 +995,111 @@ LearnAsYouGo::log()
 }
 
 void
-LearnAsYouGo::addDataPoint(const std::vector<double>& p, const std::vector<double>& d)
+LearnAsYouGo::addDataPoint(const std::vector<double>& p, const std::vector<double>& d, bool update)
 {
     check(p.size() == nPoints_, "");
     check(d.size() == nData_, "");
-    check(pointMap_.size() == points_.size(), "");
-
-    const std::map<std::vector<double>, unsigned long, PointComp>::const_iterator it = pointMap_.find(p);
+    check(pointIndex_.size() == points_.size(), "");
 
-    if(it != pointMap_.end())
+    unsigned long index;
+    if(pointIndex_.find(p, &index))
     {
 #ifdef CHECKS_ON
         for(int i = 0; i < nData_; ++i)
         {
-            check(d[i] == data_[it->second][i], "");
+            check(float(d[i]) == float(data_(index, i)), "");
         }
 #endif
         return;
     }
 
+    if(fa_ && duplicateRadius_ > 0)
+    {
+        fa_->findWithinRadius(p, duplicateRadius_, &duplicates_);
+        if(!duplicates_.empty())
+        {
+            output_screen2("The new point is within " << duplicateRadius_ << " of an existing training point, not adding it." << std::endl);
+            return;
+        }
+    }
+
     ++pointsCount_;
     ++newPointsCount_;
 
+    if(compressor_)
+        compressor_->addSample(d);
+
+    // the exact values are kept, the fast approximator gets the compressed ones
+    const std::vector<double>* row = &d;
+    if(compressed())
+    {
+        compressor_->compress(d, &tempCompressed_);
+        compressedData_.push_back(tempCompressed_);
+        row = &tempCompressed_;
+    }
+
     points_.push_back(p);
     data_.push_back(d);
-    pointMap_[p] = points_.size() - 1;
+    pointIndex_.insert(points_.size() - 1);
+
+    if(telemetry_)
+        telemetry_->addSize(totalCount_, points_.size());
+
+    if(updateFile_ && processId_ == 0)
+    {
+        makeRecord(p, d, &record_);
+        newRecords_.insert(newRecords_.end(), record_.begin(), record_.end());
+    }
 
     if(fast_)
     {
         check(fa_, "");
-        fa_->addPoint(p, d);
+        fa_->addPoint(p, *row);
     }
-    else if(points_.size() >= minCount_)
+
+    // at shutdown the point is only recorded, the fast approximator and the error model are not (re)built, the file is written by the destructor
+    if(!update)
+        return;
+
+    if(!fast_ && points_.size() >= minCount_)
     {
         constructFast();
         return;
     }
 
-    if(points_.size() >= updateErrorThreshold_)
+    if(points_.size() >= updateErrorThreshold_ && asyncUpdate_)
     {
+        if(!job_)
+            startUpdate();
+    }
+    else if(points_.size() >= updateErrorThreshold_)
+    {
+        std::chrono::steady_clock::time_point start;
+        if(telemetry_)
+            start = std::chrono::steady_clock::now();
+
+        if(compressor_)
+            updateCompression();
+
+        // the fast approximator contains all of the points, only the new test set is left out of its statistics
         randomizeErrorSet();
-        fa_->reset(points_.size() - testSize_, points_, data_, true);
-        fast_->reset(points_, data_, points_.size() - testSize_, points_.size());
+        fa_->reset(points_.size() - testSize_, points_, trainingData(), true, points_.size());
+        fast_->reset(points_, trainingData(), points_.size() - testSize_, points_.size());
         if(processId_ == 0)
         {
             std::stringstream fileName;
             fileName << "fast_approximator_error_ratio_" << points_.size() << ".txt";
             fast_->getDistrib()->writeIntoFile(fileName.str().c_str());
         }
+
+        // the test points are added back, the rest of the training set is unchanged so the kd tree doesn't need to be rebuilt
+        addToFast(points_.size() - testSize_);
+
+        if(telemetry_)
+            telemetry_->addRetrain(points_.size(), secondsSince(start), false);
+
         updateErrorThreshold_ = points_.size() + points_.size() / 4;
         testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
-
-        fa_->reset(points_.size(), points_, data_, false);
     }
 
     if(fast_ && newPointsCount_ >= updateCount_)
@@ -407,11 +1112,10 @@ LearnAsYouGo::addDataPoint(const std::vector<double>& p, const std::vector<doubl
         updateCount_ = (points_.size() > 10000 ? points_.size() / 1000 : 10);
         check(updateCount_ >= 10, "");
 
-        output_screen1("Updating the file " << fileName_ << "." << std::endl);
         if(updateFile_)
         {
             output_screen1("Updating the file " << fileName_ << "." << std::endl);
-            writeIntoFile(fileName_.c_str());
+            appendToFile();
         }
     }
 }
@@ -424,21 +1128,28 @@ LearnAsYouGo::constructFast()
 
     output_screen1("Constructing the fast approximator." << std::endl);
 
+    std::chrono::steady_clock::time_point start;
+    if(telemetry_)
+        start = std::chrono::steady_clock::now();
+
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
     check(!points_.empty(), "");
     check(data_.size() == points_.size(), "");
-    check(pointMap_.size() == points_.size(), "");
+    check(pointIndex_.size() == points_.size(), "");
+
+    if(compressor_)
+        updateCompression();
 
-    const int k = (nPoints_ + nPoints_ * (nPoints_ + 1) / 2 + 1) * 2;
-    //const int k = nPoints_ + nPoints_ * nPoints_ + 1;
+    const int k = neighborCount();
 
     check(testSize_ > 0, "");
     if(points_.size() > 2 * testSize_)
     {
         randomizeErrorSet();
-        fa_ = new FastApproximator(nPoints_, nData_, points_.size() - testSize_, points_, data_, k);
-        fast_ = new FastApproximatorError(*fa_, points_, data_, points_.size() - testSize_, points_.size(), errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
+        fa_ = new FastApproximator(nPoints_, dataWidth(), points_.size() - testSize_, points_, trainingData(), k, singlePrecision_);
+        fa_->setCovarianceTolerance(covarianceTolerance_);
+        fast_ = new FastApproximatorError(*fa_, points_, trainingData(), points_.size() - testSize_, points_.size(), errorFunction(), FastApproximatorError::AVG_INV_DISTANCE, precision_);
 
         if(processId_ == 0)
         {
@@ -447,15 +1158,241 @@ LearnAsYouGo::constructFast()
             fast_->getDistrib()->writeIntoFile(fileName.str().c_str());
         }
 
-        fa_->reset(points_.size(), points_, data_, false);
+        addToFast(points_.size() - testSize_);
         updateErrorThreshold_ = points_.size() + points_.size() / 4;
         testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
     }
     else
     {
-        fa_ = new FastApproximator(nPoints_, nData_, points_.size(), points_, data_, k);
-        fast_ = new FastApproximatorError(*fa_, points_, data_, points_.size(), points_.size(), errorFunc_, FastApproximatorError::AVG_INV_DISTANCE, precision_);
+        fa_ = new FastApproximator(nPoints_, dataWidth(), points_.size(), points_, trainingData(), k, singlePrecision_);
+        fa_->setCovarianceTolerance(covarianceTolerance_);
+        fast_ = new FastApproximatorError(*fa_, points_, trainingData(), points_.size(), points_.size(), errorFunction(), FastApproximatorError::AVG_INV_DISTANCE, precision_);
+    }
+
+    if(telemetry_)
+        telemetry_->addRetrain(points_.size(), secondsSince(start), false);
+}
+
+void
+LearnAsYouGo::startUpdate()
+{
+    check(!job_, "");
+    check(fa_, "");
+    check(fast_, "");
+
+    output_screen1("Starting to update the fast approximator in the background with " << points_.size() << " points." << std::endl);
+
+    job_ = new UpdateJob(points_, data_, int(gen_.generate() * 1000000000));
+    job_->testSize = testSize_;
+    job_->precision = precision_;
+    job_->covarianceTolerance = covarianceTolerance_;
+
+    if(compressor_)
+    {
+        job_->compressor = new PCACompressor(*compressor_);
+        job_->errorFunc = new DecompressedErrorFunc(*(job_->compressor), errorFunc_);
+    }
+
+    job_->thread = std::thread(&LearnAsYouGo::runUpdate, this, job_);
+}
+
+void
+LearnAsYouGo::runUpdate(UpdateJob* job) const
+{
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // the same steps as the synchronous update, on the copy of the training set
+    try
+    {
+        if(job->compressor)
+        {
+            job->compressor->updateBasis();
+            compressData(*(job->compressor), job->data, &(job->compressedData));
+        }
+
+        const unsigned long n = job->points.size();
+        randomizeErrorSet(job->testSize, job->gen, &(job->points), &(job->data), &(job->compressedData));
+
+        const RowTable& training = (job->compressor ? job->compressedData : job->data);
+        job->fa = new FastApproximator(nPoints_, training.width(), n - job->testSize, job->points, training, neighborCount(), singlePrecision_);
+        job->fa->setCovarianceTolerance(job->covarianceTolerance);
+        job->fast = new FastApproximatorError(*(job->fa), job->points, training, n - job->testSize, n, (job->errorFunc ? *(job->errorFunc) : errorFunc_), FastApproximatorError::AVG_INV_DISTANCE, job->precision);
+
+        std::vector<double> row;
+        for(unsigned long i = n - job->testSize; i < n; ++i)
+        {
+            training.getRow(i, &row);
+            job->fa->addPoint(job->points[i], row);
+        }
+    }
+    catch(...)
+    {
+        job->error = std::current_exception();
+    }
+
+    job->duration = secondsSince(start);
+    job->done = true;
+}
+
+void
+LearnAsYouGo::finishUpdate()
+{
+    check(job_, "");
+    job_->thread.join();
+
+    UpdateJob* job = job_;
+    job_ = NULL;
+
+    if(job->error)
+    {
+        const std::exception_ptr error = job->error;
+        delete job;
+        output_screen("The background update of the fast approximator failed." << std::endl);
+        std::rethrow_exception(error);
+    }
+
+    const unsigned long n = job->points.size();
+    check(points_.size() >= n, "");
+
+    output_screen1("Switching to the fast approximator updated in the background with " << n << " points." << std::endl);
+
+    // the new training set is the one of the job (in a different order) followed by the points added since the job started, compressed in the new basis
+    std::vector<double> row, compressedRow;
+    for(unsigned long i = n; i < points_.size(); ++i)
+    {
+        data_.getRow(i, &row);
+        if(job->compressor)
+        {
+            job->compressor->compress(row, &compressedRow);
+            job->compressedData.push_back(compressedRow);
+        }
+
+        job->points.push_back(std::vector<double>());
+        job->points.back().swap(points_[i]);
+        job->data.push_back(row);
+    }
+
+    points_.swap(job->points);
+    data_.swap(job->data);
+    compressedData_.swap(job->compressedData);
+    resetPointIndex();
+
+    // the old fast approximator refers to the old table, which is now in the job, and the old error model may refer to the old compressor
+    delete fast_;
+    delete fa_;
+
+    fa_ = job->fa;
+    fast_ = job->fast;
+    job->fa = NULL;
+    job->fast = NULL;
+
+    if(job->compressor)
+    {
+        // the samples added since the job started are kept
+        job->compressor->copySample(*compressor_);
+
+        delete compressedErrorFunc_;
+        delete compressor_;
+
+        compressor_ = job->compressor;
+        compressedErrorFunc_ = job->errorFunc;
+        job->compressor = NULL;
+        job->errorFunc = NULL;
+    }
+
+    fa_->setValues(trainingData());
+    fa_->setCovarianceTolerance(covarianceTolerance_);
+    fast_->setPrecision(precision_);
+
+    if(telemetry_)
+        telemetry_->addRetrain(n, job->duration, true);
+
+    delete job;
+
+    addToFast(n);
+
+    if(processId_ == 0)
+    {
+        std::stringstream fileName;
+        fileName << "fast_approximator_error_ratio_" << n << ".txt";
+        fast_->getDistrib()->writeIntoFile(fileName.str().c_str());
+    }
+
+    updateErrorThreshold_ = n + n / 4;
+    testSize_ = std::min(updateErrorThreshold_ / 20, (unsigned long) 1000);
+}
+
+void
+LearnAsYouGo::addToFast(unsigned long begin)
+{
+    check(fa_, "");
+    check(begin <= points_.size(), "");
+
+    const RowTable& training = trainingData();
+    std::vector<double> row;
+    for(unsigned long i = begin; i < points_.size(); ++i)
+    {
+        training.getRow(i, &row);
+        fa_->addPoint(points_[i], row);
+    }
+}
+
+void
+LearnAsYouGo::updateCompression()
+{
+    check(compressor_, "");
+
+    compressor_->updateBasis();
+    output_screen1("Updated the output compression basis, " << nComponents_ << " components explain a fraction " << compressor_->explainedVariance() << " of the variance of the sample." << std::endl);
+
+    compressData(*compressor_, data_, &compressedData_);
+}
+
+void
+LearnAsYouGo::compressData(const PCACompressor& compressor, const RowTable& data, RowTable* compressedData)
+{
+    check(compressor.ready(), "");
+    check(data.width() == compressor.n(), "");
+    check(compressedData, "");
+
+    const unsigned long n = data.size();
+    std::vector<std::vector<double> > rows(n);
+
+#pragma omp parallel for
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        std::vector<double> row;
+        data.getRow(i, &row);
+        compressor.compress(row, &(rows[i]));
+    }
+
+    compressedData->reset(compressor.nComponents(), data.singlePrecision());
+    compressedData->assign(n, rows);
+}
+
+void
+LearnAsYouGo::getData(unsigned long i, std::vector<double>* d) const
+{
+    data_.getRow(i, d);
+}
+
+const Math::RealFunctionMultiDim&
+LearnAsYouGo::errorFunction() const
+{
+    if(compressor_)
+    {
+        check(compressedErrorFunc_, "");
+        return *compressedErrorFunc_;
     }
+
+    return errorFunc_;
+}
+
+int
+LearnAsYouGo::neighborCount() const
+{
+    return (nPoints_ + nPoints_ * (nPoints_ + 1) / 2 + 1) * 2;
+    //return nPoints_ + nPoints_ * nPoints_ + 1;
 }
 
 void
@@ -465,6 +1402,12 @@ LearnAsYouGo::receive()
     check(nPoints_ > 0, "");
     check(nData_ > 0, "");
 
+    if(communicationMode_ == COLLECTIVE)
+    {
+        exchange(false);
+        return;
+    }
+
     if(!firstUpdateRequested_)
     {
         for(int i = 0; i < nProcesses_; ++i)
@@ -519,6 +1462,13 @@ LearnAsYouGo::communicate()
     if(nProcesses_ == 1)
         return;
 
+    if(communicationMode_ == COLLECTIVE)
+    {
+        exchangePending_.insert(exchangePending_.end(), currentParams_.begin(), currentParams_.end());
+        exchangePending_.insert(exchangePending_.end(), currentData_.begin(), currentData_.end());
+        return;
+    }
+
     check(communicateBuff_.size() == communicateCount_ * (nPoints_ + nData_), "");
 
     check(newCommunicateCount_ < communicateCount_, "");
@@ -533,6 +1483,20 @@ LearnAsYouGo::communicate()
 
     if(newCommunicateCount_ == communicateCount_)
     {
+        // free the sends that have completed
+        for(int i = updateRequests_.size() - 1; i >= 0; --i)
+        {
+            int sendFlag = 0;
+            MPI_Status sendSt;
+            MPI_Test((MPI_Request*) updateRequests_[i], &sendFlag, &sendSt);
+            if(sendFlag)
+            {
+                delete (MPI_Request*) updateRequests_[i];
+                updateRequests_.erase(updateRequests_.begin() + i);
+                communicateData_.erase(communicateData_.begin() + i);
+            }
+        }
+
         for(int i = 0; i < nProcesses_; ++i)
         {
             if(i == processId_)
@@ -551,3 +1515,87 @@ LearnAsYouGo::communicate()
 #endif
 }
 
+bool
+LearnAsYouGo::exchange(bool done)
+{
+#ifdef COSMO_MPI
+    check(communicationMode_ == COLLECTIVE, "");
+
+    if(nProcesses_ == 1)
+        return true;
+
+    const int recordSize = nPoints_ + nData_;
+    MPI_Comm comm = *((MPI_Comm*) exchangeComm_);
+    MPI_Request* req = (MPI_Request*) exchangeReq_;
+    int flag = 0;
+    MPI_Status st;
+
+    if(exchangeState_ == 0)
+    {
+        // the points evaluated from now on go into the next round
+        exchangeSend_.swap(exchangePending_);
+        exchangePending_.clear();
+
+        check(exchangeSend_.size() % recordSize == 0, "");
+        exchangeHeader_[0] = exchangeSend_.size() / recordSize;
+        exchangeHeader_[1] = (done ? 1 : 0);
+
+        MPI_Iallgather(exchangeHeader_, 2, MPI_INT, &(exchangeHeaders_[0]), 2, MPI_INT, comm, req);
+        exchangeState_ = 1;
+        return false;
+    }
+
+    if(exchangeState_ == 1)
+    {
+        MPI_Test(req, &flag, &st);
+        if(!flag)
+            return false;
+
+        int total = 0;
+        for(int i = 0; i < nProcesses_; ++i)
+        {
+            exchangeCounts_[i] = exchangeHeaders_[2 * i] * recordSize;
+            exchangeDispls_[i] = total;
+            total += exchangeCounts_[i];
+        }
+
+        // the buffer keeps its capacity from round to round
+        exchangeReceive_.resize(total);
+        MPI_Iallgatherv((exchangeSend_.empty() ? NULL : &(exchangeSend_[0])), exchangeSend_.size(), MPI_DOUBLE, (exchangeReceive_.empty() ? NULL : &(exchangeReceive_[0])), &(exchangeCounts_[0]), &(exchangeDispls_[0]), MPI_DOUBLE, comm, req);
+        exchangeState_ = 2;
+    }
+
+    check(exchangeState_ == 2, "");
+
+    MPI_Test(req, &flag, &st);
+    if(!flag)
+        return false;
+
+    exchangeState_ = 0;
+
+    bool allDone = true;
+    for(int i = 0; i < nProcesses_; ++i)
+    {
+        allDone = allDone && (exchangeHeaders_[2 * i + 1] != 0);
+
+        if(i == processId_ || exchangeHeaders_[2 * i] == 0)
+            continue;
+
+        output_screen1("Received " << exchangeHeaders_[2 * i] << " new points from process " << i << "." << std::endl);
+
+        for(int l = 0; l < exchangeHeaders_[2 * i]; ++l)
+        {
+            const double* record = &(exchangeReceive_[exchangeDispls_[i] + l * recordSize]);
+            tempParams_.assign(record, record + nPoints_);
+            tempData_.assign(record + nPoints_, record + recordSize);
+
+            // at shutdown the points of the other processes are still recorded, but without retraining
+            addDataPoint(tempParams_, tempData_, !done);
+        }
+    }
+
+    return allDone;
+#else
+    return true;
+#endif
+}
@@ -0,0 +1,137 @@
+#include <iomanip>
+
+#include <macros.hpp>
+#include <learn_as_you_go_telemetry.hpp>
+
+namespace
+{
+
+const char* const timingNames[LearnAsYouGoTelemetry::TIMING_MAX] = {"exact", "repeated", "approximate_accepted", "approximate_rejected", "nearest_neighbors", "fit", "error_model", "retrain"};
+
+const double quantiles[] = {0.5, 0.9, 0.99};
+const char* const quantileNames[] = {"p50", "p90", "p99"};
+const int nQuantiles = 3;
+
+} // namespace
+
+LearnAsYouGoTelemetry::LearnAsYouGoTelemetry() : timings_(TIMING_MAX)
+{
+    clear();
+}
+
+void
+LearnAsYouGoTelemetry::clear()
+{
+    start_ = std::chrono::steady_clock::now();
+    for(int i = 0; i < TIMING_MAX; ++i)
+        timings_[i].clear();
+    sizes_.clear();
+    retrains_.clear();
+}
+
+const char*
+LearnAsYouGoTelemetry::timingName(Timing t)
+{
+    check(t >= 0 && t < TIMING_MAX, "invalid timing " << t);
+    return timingNames[t];
+}
+
+double
+LearnAsYouGoTelemetry::elapsed() const
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+}
+
+void
+LearnAsYouGoTelemetry::addSize(unsigned long calls, unsigned long size)
+{
+    if(!sizes_.empty() && size * 100 < sizes_.back().size * 101)
+        return;
+
+    SizeSample s;
+    s.time = elapsed();
+    s.calls = calls;
+    s.size = size;
+    sizes_.push_back(s);
+}
+
+void
+LearnAsYouGoTelemetry::addRetrain(unsigned long size, double duration, bool background)
+{
+    Retrain r;
+    r.time = elapsed();
+    r.size = size;
+    r.duration = duration;
+    r.background = background;
+    retrains_.push_back(r);
+
+    addTiming(RETRAIN, duration);
+}
+
+void
+LearnAsYouGoTelemetry::writeCSV(std::ostream& out) const
+{
+    out << std::setprecision(6);
+
+    out << "timing,count,total,mean,min";
+    for(int q = 0; q < nQuantiles; ++q)
+        out << ',' << quantileNames[q];
+    out << ",max" << std::endl;
+
+    for(int i = 0; i < TIMING_MAX; ++i)
+    {
+        const DurationHistogram& h = timings_[i];
+        out << timingNames[i] << ',' << h.count() << ',' << h.total() << ',' << h.mean() << ',' << h.min();
+        for(int q = 0; q < nQuantiles; ++q)
+            out << ',' << h.quantile(quantiles[q]);
+        out << ',' << h.max() << std::endl;
+    }
+
+    out << std::endl << "time,calls,training_size" << std::endl;
+    for(unsigned long i = 0; i < sizes_.size(); ++i)
+        out << sizes_[i].time << ',' << sizes_[i].calls << ',' << sizes_[i].size << std::endl;
+
+    out << std::endl << "retrain_time,training_size,duration,background" << std::endl;
+    for(unsigned long i = 0; i < retrains_.size(); ++i)
+        out << retrains_[i].time << ',' << retrains_[i].size << ',' << retrains_[i].duration << ',' << (retrains_[i].background ? 1 : 0) << std::endl;
+}
+
+void
+LearnAsYouGoTelemetry::writeJSON(std::ostream& out) const
+{
+    out << std::setprecision(6);
+
+    out << "{" << std::endl;
+    out << "  \"elapsed\": " << elapsed() << ',' << std::endl;
+    out << "  \"timings\": {" << std::endl;
+    for(int i = 0; i < TIMING_MAX; ++i)
+    {
+        const DurationHistogram& h = timings_[i];
+        out << "    \"" << timingNames[i] << "\": {\"count\": " << h.count() << ", \"total\": " << h.total() << ", \"mean\": " << h.mean() << ", \"min\": " << h.min();
+        for(int q = 0; q < nQuantiles; ++q)
+            out << ", \"" << quantileNames[q] << "\": " << h.quantile(quantiles[q]);
+        out << ", \"max\": " << h.max() << ", \"bins\": [";
+
+        bool first = true;
+        for(int j = 0; j < h.nBins(); ++j)
+        {
+            if(!h.binCount(j))
+                continue;
+            out << (first ? "" : ", ") << '[' << h.binLower(j) << ", " << h.binCount(j) << ']';
+            first = false;
+        }
+        out << "]}" << (i == TIMING_MAX - 1 ? "" : ",") << std::endl;
+    }
+    out << "  }," << std::endl;
+
+    out << "  \"training_size\": [";
+    for(unsigned long i = 0; i < sizes_.size(); ++i)
+        out << (i ? ", " : "") << "{\"time\": " << sizes_[i].time << ", \"calls\": " << sizes_[i].calls << ", \"size\": " << sizes_[i].size << '}';
+    out << "]," << std::endl;
+
+    out << "  \"retrains\": [";
+    for(unsigned long i = 0; i < retrains_.size(); ++i)
+        out << (i ? ", " : "") << "{\"time\": " << retrains_[i].time << ", \"size\": " << retrains_[i].size << ", \"duration\": " << retrains_[i].duration << ", \"background\": " << (retrains_[i].background ? "true" : "false") << '}';
+    out << "]" << std::endl;
+    out << "}" << std::endl;
+}
@@ -0,0 +1,61 @@
+#include <string>
+#include <sstream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <mapped_file.hpp>
+
+MappedFile::MappedFile(const char* fileName) : data_(NULL), size_(0)
+{
+    StandardException exc;
+
+    const int fd = open(fileName, O_RDONLY);
+    if(fd < 0)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot open the file " << fileName << " for mapping.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        std::stringstream exceptionStr;
+        exceptionStr << "The file " << fileName << " is empty or cannot be accessed.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    size_ = st.st_size;
+
+    void *p = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+
+    // the mapping stays valid after the file is closed
+    close(fd);
+
+    if(p == MAP_FAILED)
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "Cannot map the file " << fileName << " into memory.";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    data_ = static_cast<const char*>(p);
+    output_screen1("Mapped the file " << fileName << " of size " << size_ << " bytes." << std::endl);
+}
+
+MappedFile::~MappedFile()
+{
+    // the constructor throws if the mapping fails, so data_ is always set here
+    if(data_)
+        munmap(const_cast<char*>(data_), size_);
+}
+
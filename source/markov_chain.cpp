@@ -5,6 +5,9 @@
 #include <algorithm>
 #include <utility>
 #include <cmath>
+#include <memory>
+
+#include <sys/stat.h>
 
 #include <macros.hpp>
 #include <exception_handler.hpp>
@@ -12,6 +15,7 @@
 #include <gauss_smooth.hpp>
 #include <progress_meter.hpp>
 #include <markov_chain.hpp>
+#include <binary_chain.hpp>
 #include <numerics.hpp>
 
 void
@@ -526,9 +530,15 @@ MarkovChain::MarkovChain(int nChains, const char* fileNameRoot, unsigned long bu
         fileName << fileNameRoot;
         if(nChains > 1)
             fileName << '_' << i;
-        fileName << ".txt";
+
+        // the chain written in the binary format has the extension .bin, the newer file is used if both exist
+        const std::string textName = fileName.str() + ".txt", binaryName = fileName.str() + ".bin";
+        struct stat textSt, binarySt;
+        const bool textExists = (stat(textName.c_str(), &textSt) == 0), binaryExists = (stat(binaryName.c_str(), &binarySt) == 0);
+        const bool useBinary = binaryExists && (!textExists || binarySt.st_mtime > textSt.st_mtime);
+
         double thisMaxP;
-        readFile(fileName.str().c_str(), burnin, thin, bigChain, thisMaxP);
+        readFile((useBinary ? binaryName : textName).c_str(), burnin, thin, bigChain, thisMaxP);
         if(thisMaxP > maxP)
             maxP = thisMaxP;
     }
@@ -567,9 +577,16 @@ MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int t
     check(thin > 0, "thin factor cannot be 0");
 
     StandardException exc;
-    std::ifstream in(fileName);
 
-    if(!in)
+    // the binary format (see BinaryChainWriter) is recognized by its header
+    std::unique_ptr<BinaryChainReader> binary;
+    std::ifstream in;
+    if(BinaryChainWriter::isBinary(fileName))
+        binary.reset(new BinaryChainReader(fileName));
+    else
+        in.open(fileName);
+
+    if(!binary && !in)
     {
         std::stringstream exceptionStr;
         exceptionStr << "Cannot open input file " << fileName << ".";
@@ -584,16 +601,40 @@ MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int t
 
     int notFound = 0, found = 0;
 
-    while(!in.eof())
+    while(binary || !in.eof())
     {
-        std::string s;
-        std::getline(in, s);
-        if(s == "")
-            break;
-
-        std::stringstream str(s);
         Element* elem = new Element;
-        str >> elem->prob >> elem->like;
+        if(binary)
+        {
+            if(!binary->read(&(elem->prob), &(elem->like), &(elem->params)))
+            {
+                delete elem;
+                break;
+            }
+        }
+        else
+        {
+            std::string s;
+            std::getline(in, s);
+            if(s == "")
+            {
+                delete elem;
+                break;
+            }
+
+            std::stringstream str(s);
+            str >> elem->prob >> elem->like;
+
+            while(!str.eof())
+            {
+                double val = std::numeric_limits<double>::min();
+                str >> val;
+                if(val == std::numeric_limits<double>::min())
+                    break;
+
+                elem->params.push_back(val);
+            }
+        }
 
         elem->errMean = 0;
         elem->errVar = 0;
@@ -604,16 +645,6 @@ MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int t
         if(elem->like < minLike_)
             minLike_ = elem->like;
 
-        while(!str.eof())
-        {
-            double val = std::numeric_limits<double>::min();
-            str >> val;
-            if(val == std::numeric_limits<double>::min())
-                break;
-
-            elem->params.push_back(val);
-        }
-
         if(nParams_ == -1)
             nParams_ = elem->params.size();
 
@@ -621,6 +652,7 @@ MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int t
         {
             std::stringstream exceptionStr;
             exceptionStr << "Invalid chain file " << fileName << ". There are " << elem->params.size() << " parameters on line " << line << " while the previous lines had " << nParams_ << " parameters.";
+            delete elem;
             exc.set(exceptionStr.str());
             throw exc;
         }
@@ -664,6 +696,7 @@ MarkovChain::readFile(const char* fileName, unsigned long burnin, unsigned int t
 
         ++line;
     }
+
     output_screen("OK" << std::endl);
     output_screen("Successfully read the chain. It has " << bigChain.size() << " elements, " << nParams_ << " parameters." << std::endl);
 
@@ -221,6 +221,9 @@ extern "C"
     // invert from Cholesky factorization
     void dpptri_(char *uplo, int *n, double *a, int *info);
 
+    // solve from Cholesky factorization
+    void dpptrs_(char *uplo, int *n, int *nrhs, double *a, double *b, int *ldb, int *info);
+
     // tridiagonal reduction
     void dsptrd_(char *uplo, int *n, double *a, double *d, double *e, double *tau, int *info);
 
@@ -264,6 +267,25 @@ SymmetricMatrix<double>::invertFromCholeskyFactorization()
     return info;
 }
 
+template<>
+int
+SymmetricMatrix<double>::solveFromCholeskyFactorization(std::vector<double>* b) const
+{
+    check(rows_ == cols_, "");
+    check(rows_ > 0, "matrix is empty");
+    check(b, "");
+    check(b->size() == rows_, "");
+
+    char c = 'U';
+    int n = rows_;
+    int nrhs = 1;
+    int ldb = rows_;
+    int info;
+
+    dpptrs_(&c, &n, &nrhs, const_cast<double*>(&(v_[0])), &(b->at(0)), &ldb, &info);
+    return info;
+}
+
 template<>
 int
 SymmetricMatrix<double>::invert()
@@ -4,6 +4,9 @@
 
 #include <cosmo_mpi.hpp>
 
+#include <chrono>
+#include <algorithm>
+
 #include <macros.hpp>
 #include <exception_handler.hpp>
 #include <mcmc.hpp>
@@ -11,7 +14,7 @@
 namespace Math
 {
 
-MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed, bool isLikelihoodApproximate) : n_(nPar), like_(&like), likelihoodApproximate_(isLikelihoodApproximate), spareLike_(NULL), fileRoot_(fileRoot), paramNames_(nPar), param1_(nPar, 0), param2_(nPar, 0), starting_(nPar, std::numeric_limits<double>::max()), current_(nPar), prev_(nPar), samplingWidth_(nPar, 0), accuracy_(nPar, 0), paramSum_(nPar, 0), paramSquaredSum_(nPar, 0), corSum_(nPar, 0), priorMods_(nPar, PRIOR_MODE_MAX), externalPrior_(NULL), externalProposal_(NULL), resumeCode_(123456), nChains_(1), currentChainI_(0), stop_(false), stopRequestMessage_(111222), stopRequestSent_(false), stopMessageRequested_(false), haveStoppedMessage_(476901), firstUpdateRequested_(false), reachedSigma_(nPar, -1), rGelmanRubin_(nPar, -1), adapt_(false), covEpsilon_(1e-7), covFactor_(2.4 * 2.4 / nPar), myCovUpdateInfo_(nPar), tempCovUpdateInfo_(nPar), covarianceReady_(false), firstCovUpdateRequested_(false)
+MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::string fileRoot, time_t seed, bool isLikelihoodApproximate) : n_(nPar), like_(&like), likelihoodApproximate_(isLikelihoodApproximate), spareLike_(NULL), fileRoot_(fileRoot), paramNames_(nPar), param1_(nPar, 0), param2_(nPar, 0), starting_(nPar, std::numeric_limits<double>::max()), current_(nPar), prev_(nPar), samplingWidth_(nPar, 0), accuracy_(nPar, 0), paramSum_(nPar, 0), paramSquaredSum_(nPar, 0), corSum_(nPar, 0), priorMods_(nPar, PRIOR_MODE_MAX), externalPrior_(NULL), externalProposal_(NULL), nSlowBlocks_(nPar), dragSteps_(0), resumeCode_(123456), nChains_(1), currentChainI_(0), stop_(false), stopRequestMessage_(111222), stopRequestSent_(false), stopMessageRequested_(false), haveStoppedMessage_(476901), firstUpdateRequested_(false), reachedSigma_(nPar, -1), rGelmanRubin_(nPar, -1), adapt_(false), covEpsilon_(1e-7), covFactor_(2.4 * 2.4 / nPar), myCovUpdateInfo_(nPar), tempCovUpdateInfo_(nPar), covarianceReady_(false), firstCovUpdateRequested_(false), chainFormat_(TEXT_CHAIN), flushEvery_(100), binaryOut_(NULL), asyncOutput_(false), outputQueue_(1024), outputFailed_(false), delayedAcceptance_(false), currentApproxLike_(0)
 {
 
     nChains_ = CosmoMPI::create().numProcesses();
@@ -56,6 +59,7 @@ MetropolisHastings::MetropolisHastings(int nPar, LikelihoodFunction& like, std::
     check(nPar > 0, "");
     for(int i = 1; i <= nPar; ++i)
         blocks_.push_back(i);
+    blockSpeeds_.resize(nPar, 1);
 
     if(seed == 0)
         seed_ = std::time(0);
@@ -83,6 +87,26 @@ MetropolisHastings::~MetropolisHastings()
     delete uniformGen_;
     delete generator_;
 
+    // in case run was interrupted by an exception
+    if(outputThread_.joinable())
+    {
+        try
+        {
+            stopOutputThread();
+        }
+        catch(std::exception& e)
+        {
+            output_screen(e.what() << std::endl);
+        }
+        catch(...)
+        {
+            output_screen("Writing the chain failed with an unknown exception." << std::endl);
+        }
+    }
+
+    if(binaryOut_)
+        delete binaryOut_;
+
 #ifdef COSMO_MPI
     delete (MPI_Request*) sendStopRequest_;
     delete (MPI_Request*) receiveStopRequest_;
@@ -221,6 +245,16 @@ MetropolisHastings::setParamGauss(int i, const std::string& name, double mean, d
         accuracy_[i] = accuracy;
 }
 
+void
+MetropolisHastings::setChainFormat(CHAIN_FORMAT format, unsigned long flushEvery)
+{
+    check(format >= 0 && format < CHAIN_FORMAT_MAX, "invalid chain format " << format);
+    check(flushEvery > 0, "invalid flushEvery " << flushEvery);
+
+    chainFormat_ = format;
+    flushEvery_ = flushEvery;
+}
+
 void
 MetropolisHastings::communicate()
 {
@@ -451,6 +485,213 @@ MetropolisHastings::sendHaveStopped()
 #endif
 }
 
+void
+MetropolisHastings::proposeBlock(int i, std::vector<double>& point, std::vector<double>* block)
+{
+    check(i >= 0 && i < blocks_.size(), "invalid block index " << i);
+
+    const int blockBegin = (i == 0 ? 0 : blocks_[i - 1]), blockEnd = blocks_[i];
+    block->resize(blockEnd - blockBegin);
+
+    if(adapt_ && covarianceReady_)
+    {
+        for(int j = 0; j < n_; ++j)
+            generatedVec_[j] = 0;
+
+        for(int j = blockBegin; j < blockEnd; ++j)
+            generatedVec_[j] = generator_->generate();
+
+        for(int k = 0; k < rotatedVec_.size(); ++k)
+        {
+            rotatedVec_[k] = 0;
+            // note the upper bound! cholesky_ is used here as lower diagonal
+            for(int j = 0; j <= k; ++j)
+                rotatedVec_[k] += cholesky_(k, j) * generatedVec_[j];
+        }
+
+        for(int j = 0; j < n_; ++j)
+            point[j] += rotatedVec_[j];
+    }
+    else
+    {
+        if(externalProposal_)
+            externalProposal_->generate(&(point[0]), n_, &((*block)[0]), i);
+        else
+        {
+            for(int j = blockBegin; j < blockEnd; ++j)
+                (*block)[j - blockBegin] = generateNewPoint(point, j);
+        }
+
+        for(int j = blockBegin; j < blockEnd; ++j)
+            point[j] = (*block)[j - blockBegin];
+    }
+
+}
+
+bool
+MetropolisHastings::updateBlock(int i, int* notAcceptedCount, unsigned long* passedFirstStage)
+{
+    const int blockBegin = (i == 0 ? 0 : blocks_[i - 1]), blockEnd = blocks_[i];
+
+    std::vector<double> currentOld = current_;
+    std::vector<double> block;
+    proposeBlock(i, current_, &block);
+
+    const double newPrior = calculatePrior();
+    const double oldLike = currentLike_, oldApproxLike = currentApproxLike_;
+    double newLike = oldLike, newApproxLike = oldApproxLike;
+    if(newPrior != 0)
+    {
+        if(delayedAcceptance_)
+            newApproxLike = like_->calculate(&(current_[0]), n_);
+        else
+            newLike = like_->calculate(&(current_[0]), n_);
+    }
+
+    // with delayed acceptance this is the first stage, using the approximate likelihood
+    double p = newPrior / currentPrior_;
+    const double deltaLike = (delayedAcceptance_ ? newApproxLike - oldApproxLike : newLike - oldLike);
+    p *= std::exp(-deltaLike / 2.0);
+
+    if(!(adapt_ && covarianceReady_) && externalProposal_ && !externalProposal_->isSymmetric(i))
+    {
+        std::vector<double> oldBlock(blockEnd - blockBegin);
+        for(int j = blockBegin; j < blockEnd; ++j)
+            oldBlock[j - blockBegin] = currentOld[j];
+
+        p *= externalProposal_->calculate(&(current_[0]), n_, &(oldBlock[0]), i);
+        p /= externalProposal_->calculate(&(currentOld[0]), n_, &(block[0]), i);
+    }
+
+    if(*notAcceptedCount > 4 * n_)
+    {
+        output_screen("WARNING! Haven't moved for " << *notAcceptedCount << " iterations because the likelihood difference is too large!" << std::endl);
+        output_screen("\tcurrent like = " << (delayedAcceptance_ ? newApproxLike : newLike) << std::endl);
+        output_screen("\told like = " << (delayedAcceptance_ ? oldApproxLike : oldLike) << std::endl);
+        output_screen("\tcurrent prior = " << currentPrior_ << std::endl);
+        output_screen("\tnew prior = " << newPrior << std::endl);
+        output_screen("\tp = " << p << std::endl);
+        if(likelihoodApproximate_ && !delayedAcceptance_)
+        {
+            output_screen("Forcing to move since the likelihood is approximate!" << std::endl);
+            p = 1;
+        }
+    }
+
+    if(p > 1)
+        p = 1;
+    
+    const double q = uniformGen_->generate(); 
+    bool accept = (q <= p);
+
+    if(accept && delayedAcceptance_)
+    {
+        ++(*passedFirstStage);
+
+        // the prior and the proposal ratios cancel in the second stage, only the ratio of the exact to the approximate likelihoods is left
+        newLike = like_->calculateExact(&(current_[0]), n_);
+        const double p2 = std::exp(-((newLike - oldLike) - (newApproxLike - oldApproxLike)) / 2.0);
+        accept = (uniformGen_->generate() <= p2);
+    }
+
+    if(accept)
+    {
+        currentLike_ = newLike;
+        currentApproxLike_ = newApproxLike;
+        currentPrior_ = newPrior;
+        *notAcceptedCount = 0;
+    }
+    else
+    {
+        current_ = currentOld;
+        if(deltaLike > 10)
+            ++(*notAcceptedCount);
+    }
+
+    return accept;
+}
+
+void
+MetropolisHastings::evaluatePoint(std::vector<double>& point, double* prior, double* like)
+{
+    // calculatePrior works on current_
+    current_.swap(point);
+    *prior = calculatePrior();
+    *like = (*prior != 0 ? like_->calculate(&(current_[0]), n_) : 0);
+    current_.swap(point);
+}
+
+bool
+MetropolisHastings::dragBlock(int i)
+{
+    check(i < nSlowBlocks_, "");
+
+    // -2ln of the posterior, up to a constant
+    struct Point
+    {
+        std::vector<double> x;
+        double prior, like;
+
+        double chi2() const { return (prior > 0 ? like - 2 * std::log(prior) : std::numeric_limits<double>::infinity()); }
+    };
+
+    // the slow proposal, the fast parameters are then dragged along for both of the points by the same shifts
+    Point from, to;
+    from.x = current_;
+    from.prior = currentPrior_;
+    from.like = currentLike_;
+
+    to.x = current_;
+    std::vector<double> block;
+    proposeBlock(i, to.x, &block);
+    evaluatePoint(to.x, &to.prior, &to.like);
+    if(to.prior == 0)
+        return false;
+
+    // the log of the acceptance probability is the average of ln(posterior(to) / posterior(from)) over the drag steps, including the starting point
+    double logP = (from.chi2() - to.chi2()) / 2;
+
+    Point newFrom, newTo;
+    for(int k = 1; k <= dragSteps_; ++k)
+    {
+        // the fast parameters are sampled from posterior(from)^(1 - beta) * posterior(to)^beta
+        const double beta = double(k) / double(dragSteps_ + 1);
+        for(int j = nSlowBlocks_; j < blocks_.size(); ++j)
+        {
+            newFrom.x = from.x;
+            proposeBlock(j, newFrom.x, &block);
+
+            newTo.x = to.x;
+            for(int l = 0; l < n_; ++l)
+                newTo.x[l] += newFrom.x[l] - from.x[l];
+
+            evaluatePoint(newFrom.x, &newFrom.prior, &newFrom.like);
+            if(newFrom.prior == 0)
+                continue;
+            evaluatePoint(newTo.x, &newTo.prior, &newTo.like);
+            if(newTo.prior == 0)
+                continue;
+
+            const double delta = (1 - beta) * (newFrom.chi2() - from.chi2()) + beta * (newTo.chi2() - to.chi2());
+            if(uniformGen_->generate() <= std::exp(-delta / 2))
+            {
+                std::swap(from, newFrom);
+                std::swap(to, newTo);
+            }
+        }
+        logP += (from.chi2() - to.chi2()) / 2;
+    }
+    logP /= (dragSteps_ + 1);
+
+    if(!(std::log(uniformGen_->generate()) < logP))
+        return false;
+
+    current_.swap(to.x);
+    currentPrior_ = to.prior;
+    currentLike_ = to.like;
+    return true;
+}
+
 int
 MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformationEvery, unsigned long burnin, CONVERGENCE_DIAGNOSTIC cd, double convergenceCriterion, bool adaptiveProposal)
 {
@@ -465,6 +706,15 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 
     check(convergenceCriterion > 0, "invalid convergence criterion " << convergenceCriterion << ", needs to be positive");
 
+    if(dragSteps_)
+    {
+        check(!delayedAcceptance_, "dragging cannot be combined with delayed acceptance");
+        for(int i = 0; i < blocks_.size(); ++i)
+        {
+            check(!externalProposal_ || externalProposal_->isSymmetric(i), "dragging needs symmetric proposals, the proposal for block " << i << " is not symmetric");
+        }
+    }
+
     if(adaptiveProposal)
         useAdaptiveProposal();
     
@@ -512,6 +762,10 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
     {
         output_screen("Resuming from previous run, already have " << iteration_ << " iterations." << std::endl);
         openOut(true);
+
+        // the resume information only has the exact likelihood
+        if(delayedAcceptance_)
+            currentApproxLike_ = like_->calculate(&(current_[0]), n_);
     }
     else
     {
@@ -520,7 +774,13 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         maxChainLength_ = maxChainLength;
 
         current_ = starting_;
-        currentLike_ = like_->calculate(&(current_[0]), n_);
+        if(delayedAcceptance_)
+        {
+            currentApproxLike_ = like_->calculate(&(current_[0]), n_);
+            currentLike_ = like_->calculateExact(&(current_[0]), n_);
+        }
+        else
+            currentLike_ = like_->calculate(&(current_[0]), n_);
         currentPrior_ = calculatePrior();
         prev_ = current_;
         iteration_ = 0;
@@ -538,123 +798,39 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         openOut(false);
     }
 
+    if(asyncOutput_)
+        startOutputThread();
+
     std::vector<unsigned long> accepted(blocks_.size(), 0);
+    std::vector<unsigned long> passedFirstStage(blocks_.size(), 0);
     unsigned long currentIter = 0;
 
     int notAcceptedCount = 0;
     while(!stop())
     {
-        int blockBegin = 0;
         for(int i = 0; i < blocks_.size(); ++i)
         {
-            int blockEnd = blocks_[i];
-
-            std::vector<double> currentOld = current_;
-
-            std::vector<double> block(blockEnd - blockBegin);
-
-            if(adapt_ && covarianceReady_)
-            {
-                for(int j = 0; j < n_; ++j)
-                    generatedVec_[j] = 0;
-
-                for(int j = blockBegin; j < blockEnd; ++j)
-                    generatedVec_[j] = generator_->generate();
-
-                for(int i = 0; i < rotatedVec_.size(); ++i)
-                {
-                    rotatedVec_[i] = 0;
-                    // note the upper bound! cholesky_ is used here as lower diagonal
-                    for(int j = 0; j <= i; ++j)
-                        rotatedVec_[i] += cholesky_(i, j) * generatedVec_[j];
-                }
-
-                for(int j = 0; j < n_; ++j)
-                    current_[j] += rotatedVec_[j];
-            }
-            else
-            {
-                if(externalProposal_)
-                    externalProposal_->generate(&(current_[0]), n_, &(block[0]), i);
-                else
-                {
-                    for(int j = blockBegin; j < blockEnd; ++j)
-                        block[j - blockBegin] = generateNewPoint(j);
-                }
-
-                for(int j = blockBegin; j < blockEnd; ++j)
-                    current_[j] = block[j - blockBegin];
-            }
-
-
-            const double newPrior = calculatePrior();
-            const double oldLike = currentLike_;
-            if(newPrior != 0)
-            {
-                currentLike_ = like_->calculate(&(current_[0]), n_);
-                /*
-                if(iteration_ > burnin_ / 3 && likelihoodApproximate_ && std::abs(currentLike_ - oldLike) > 10)
-                {
-                    const double approxLike = currentLike_;
-                    currentLike_ = like_->calculateExact(&(current_[0]), n_);
-                    output_screen1("The approximate likelihood is too far from the previous point, calculating it exactly." << std::endl);
-                    output_screen1("Approx like = " << approxLike << std::endl << "Exact like = " << currentLike_ << std::endl);
-                }
-                */
-            }
-
-            double p = newPrior / currentPrior_;
-            const double deltaLike = currentLike_ - oldLike;
-            p *= std::exp(-deltaLike / 2.0);
-
-            if(!(adapt_ && covarianceReady_) && externalProposal_ && !externalProposal_->isSymmetric(i))
-            {
-                std::vector<double> oldBlock(blockEnd - blockBegin);
-                for(int j = blockBegin; j < blockEnd; ++j)
-                    oldBlock[j - blockBegin] = currentOld[j];
-
-                p *= externalProposal_->calculate(&(current_[0]), n_, &(oldBlock[0]), i);
-                p /= externalProposal_->calculate(&(currentOld[0]), n_, &(block[0]), i);
-            }
-
-            if(notAcceptedCount > 4 * n_)
-            {
-                output_screen("WARNING! Haven't moved for " << notAcceptedCount << " iterations because the likelihood difference is too large!" << std::endl);
-                output_screen("\tcurrent like = " << currentLike_ << std::endl);
-                output_screen("\told like = " << oldLike << std::endl);
-                output_screen("\tcurrent prior = " << currentPrior_ << std::endl);
-                output_screen("\tnew prior = " << newPrior << std::endl);
-                output_screen("\tp = " << p << std::endl);
-                if(likelihoodApproximate_)
-                {
-                    output_screen("Forcing to move since the likelihood is approximate!" << std::endl);
-                    p = 1;
-                }
-            }
-
-            if(p > 1)
-                p = 1;
-            
-            const double q = uniformGen_->generate(); 
-
-            if(q <= p)
+            for(int k = 0; k < blockSpeeds_[i]; ++k)
             {
-                currentPrior_ = newPrior;
-                ++accepted[i];
-                notAcceptedCount = 0;
-            }
-            else
-            {
-                current_ = currentOld;
-                currentLike_ = oldLike;
-                if(deltaLike > 10)
-                    ++notAcceptedCount;
+                const bool acc = (dragSteps_ && i < nSlowBlocks_ ? dragBlock(i) : updateBlock(i, &notAcceptedCount, &(passedFirstStage[i])));
+                if(acc)
+                    ++accepted[i];
             }
+        }
 
-            blockBegin = blockEnd;
+        if(asyncOutput_)
+        {
+            waitForOutputSlot();
+            OutputJob& job = outputQueue_.back();
+            job.type = CHAIN_ELEMENT_JOB;
+            job.element.resize(n_ + 1);
+            job.element[0] = currentLike_;
+            std::copy(current_.begin(), current_.end(), job.element.begin() + 1);
+            outputQueue_.push();
         }
+        else
+            writeChainElement(currentLike_, &(current_[0]));
 
-        writeChainElement();
         ++iteration_;
         ++currentIter;
         update();
@@ -669,19 +845,40 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
         }
 
         if(writeResumeInformationEvery && iteration_ % writeResumeInformationEvery == 0)
-            writeResumeInfo();
+        {
+            std::ostringstream info;
+            writeResumeInfo(info);
+
+            if(asyncOutput_)
+            {
+                waitForOutputSlot();
+                OutputJob& job = outputQueue_.back();
+                job.type = RESUME_INFO_JOB;
+                job.resumeInfo = info.str();
+                outputQueue_.push();
+            }
+            else
+            {
+                // the resume information should never be ahead of the chain file
+                flushOut();
+                saveResumeInfo(info.str());
+            }
+        }
+        else if(!asyncOutput_ && iteration_ % flushEvery_ == 0)
+            flushOut();
 
         if(iteration_ % 100 == 0)
         {
-            closeOut();
-            openOut(true);
-
             output_screen(std::endl);
             output_screen(std::endl);
             output_screen("Total iterations: " << iteration_ << std::endl);
             for(int i = 0; i < accepted.size(); ++i)
             {
-                output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(currentIter) << std::endl);
+                output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(currentIter * blockSpeeds_[i]) << std::endl);
+                if(delayedAcceptance_)
+                {
+                    output_screen("First stage acceptance rate for parameter block " << i << " = " << double(passedFirstStage[i]) / double(currentIter * blockSpeeds_[i]) << std::endl);
+                }
             }
         }
     }
@@ -691,6 +888,9 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 
     communicate();
 
+    if(asyncOutput_)
+        stopOutputThread();
+
     closeOut();
 
     if(isMaster())
@@ -712,7 +912,7 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
 
     for(int i = 0; i < blocks_.size(); ++i)
     {
-        output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(iteration_) << std::endl);
+        output_screen("Acceptance rate for parameter block " << i << " = " << double(accepted[i]) / double(iteration_ * blockSpeeds_[i]) << std::endl);
     }
 
     if(!isMaster())
@@ -742,6 +942,147 @@ MetropolisHastings::run(unsigned long maxChainLength, int writeResumeInformation
     return nChains_;
 }
 
+void
+MetropolisHastings::saveResumeInfo(const std::string& info) const
+{
+    const std::string tempName = resumeFileName_ + ".tmp";
+    std::ofstream out(tempName.c_str(), std::ios::binary | std::ios::out);
+    if(!out)
+        return;
+
+    out.write(info.data(), info.size());
+    out.close();
+
+    // the old resume file stays complete until it is replaced
+    if(!out || std::rename(tempName.c_str(), resumeFileName_.c_str()) != 0)
+    {
+        output_screen("Cannot write the resume file " << resumeFileName_ << "." << std::endl);
+    }
+}
+
+void
+MetropolisHastings::startOutputThread()
+{
+    check(!outputThread_.joinable(), "");
+    check(outputQueue_.empty(), "");
+
+    outputFailed_ = false;
+    outputError_ = std::exception_ptr();
+    outputThread_ = std::thread(&MetropolisHastings::outputLoop, this);
+}
+
+void
+MetropolisHastings::waitForOutputSlot()
+{
+    checkOutputError();
+
+    while(outputQueue_.full())
+        std::this_thread::yield();
+}
+
+void
+MetropolisHastings::checkOutputError()
+{
+    if(!outputFailed_)
+        return;
+
+    output_screen("Writing the chain failed." << std::endl);
+    std::rethrow_exception(outputError_);
+}
+
+void
+MetropolisHastings::stopOutputThread()
+{
+    check(outputThread_.joinable(), "");
+
+    while(outputQueue_.full())
+        std::this_thread::yield();
+
+    outputQueue_.back().type = STOP_JOB;
+    outputQueue_.push();
+    outputThread_.join();
+
+    checkOutputError();
+}
+
+void
+MetropolisHastings::outputLoop()
+{
+    unsigned long written = 0;
+    int idle = 0;
+
+    while(true)
+    {
+        if(outputQueue_.empty())
+        {
+            // spin for a little while before backing off, so that a busy sampler is served quickly
+            if(++idle < 100)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+
+        idle = 0;
+        OutputJob& job = outputQueue_.front();
+        if(job.type == STOP_JOB)
+        {
+            outputQueue_.pop();
+            break;
+        }
+
+        // after a failure the jobs are only drained, so that the sampler doesn't wait forever
+        if(!outputFailed_)
+        {
+            try
+            {
+                if(job.type == CHAIN_ELEMENT_JOB)
+                {
+                    check(job.element.size() == n_ + 1, "");
+                    writeChainElement(job.element[0], &(job.element[1]));
+                    if(++written % flushEvery_ == 0)
+                        flushOut();
+                }
+                else
+                {
+                    check(job.type == RESUME_INFO_JOB, "");
+
+                    // only the latest resume information matters, so it is skipped if there is a newer one already in the queue
+                    bool newer = false;
+                    for(unsigned long i = 1; i < outputQueue_.size() && !newer; ++i)
+                        newer = (outputQueue_.at(i).type == RESUME_INFO_JOB);
+
+                    if(!newer)
+                    {
+                        flushOut();
+                        saveResumeInfo(job.resumeInfo);
+                    }
+                }
+            }
+            catch(...)
+            {
+                outputError_ = std::current_exception();
+                outputFailed_ = true;
+            }
+        }
+
+        outputQueue_.pop();
+    }
+
+    if(!outputFailed_)
+    {
+        try
+        {
+            flushOut();
+        }
+        catch(...)
+        {
+            outputError_ = std::current_exception();
+            outputFailed_ = true;
+        }
+    }
+}
+
 void
 MetropolisHastings::specifyParameterBlocks(const std::vector<int>& blocks)
 {
@@ -755,6 +1096,31 @@ MetropolisHastings::specifyParameterBlocks(const std::vector<int>& blocks)
 #endif
 
     blocks_ = blocks;
+    blockSpeeds_.clear();
+    blockSpeeds_.resize(blocks_.size(), 1);
+    nSlowBlocks_ = blocks_.size();
+    dragSteps_ = 0;
+}
+
+void
+MetropolisHastings::setBlockSpeeds(const std::vector<int>& speeds, int dragSteps)
+{
+    check(speeds.size() == blocks_.size(), "need " << blocks_.size() << " speeds, one for each block, " << speeds.size() << " given");
+    check(dragSteps >= 0, "invalid number of drag steps " << dragSteps);
+
+    int nSlow = 0;
+    for(int i = 0; i < speeds.size(); ++i)
+    {
+        check(speeds[i] > 0, "invalid speed " << speeds[i] << " for block " << i);
+        check(i == 0 || speeds[i] >= speeds[i - 1], "the speeds need to be non-decreasing, i.e. the slow blocks need to come first");
+        if(speeds[i] == speeds[0])
+            ++nSlow;
+    }
+    check(dragSteps == 0 || nSlow < speeds.size(), "dragging needs at least one fast block");
+
+    blockSpeeds_ = speeds;
+    nSlowBlocks_ = nSlow;
+    dragSteps_ = dragSteps;
 }
 
 bool
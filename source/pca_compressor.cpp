@@ -0,0 +1,230 @@
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <sstream>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <numerics.hpp>
+#include <matrix_impl.hpp>
+#include <pca_compressor.hpp>
+
+PCACompressor::PCACompressor(int n, int nComponents, unsigned long sampleSize) : n_(n), nComponents_(nComponents), sampleSize_(sampleSize ? sampleSize : 10 * nComponents), seen_(0), ready_(false), explained_(0), gen_(std::time(0), 0, 1)
+{
+    check(n_ > 0, "invalid dimension " << n_);
+    check(nComponents_ > 0 && nComponents_ < n_, "invalid number of components " << nComponents_ << ", must be positive and less than " << n_);
+    check(sampleSize_ >= 2, "");
+}
+
+void
+PCACompressor::addSample(const std::vector<double>& v)
+{
+    check(v.size() == n_, "");
+
+    ++seen_;
+    if(samples_.size() < sampleSize_)
+    {
+        samples_.push_back(v);
+        return;
+    }
+
+    const unsigned long j = (unsigned long) std::floor(gen_.generate() * seen_);
+    if(j < sampleSize_)
+        samples_[j] = v;
+}
+
+void
+PCACompressor::copySample(const PCACompressor& other)
+{
+    check(other.n_ == n_, "");
+    check(other.nComponents_ == nComponents_, "");
+
+    samples_ = other.samples_;
+    sampleSize_ = other.sampleSize_;
+    seen_ = other.seen_;
+}
+
+void
+PCACompressor::updateBasis()
+{
+    const int m = samples_.size();
+    check(m >= 2, "need at least 2 samples to calculate the basis, have " << m);
+
+    std::vector<double> mean(n_, 0);
+    for(int i = 0; i < m; ++i)
+    {
+        for(int j = 0; j < n_; ++j)
+            mean[j] += samples_[i][j];
+    }
+    for(int j = 0; j < n_; ++j)
+        mean[j] /= m;
+
+    // the components are found from the eigenvectors of the m x m Gram matrix of the samples rather than the n x n covariance matrix, the sample is much smaller than n
+    Math::Matrix<double> x(m, n_), xT, gram;
+    for(int i = 0; i < m; ++i)
+    {
+        for(int j = 0; j < n_; ++j)
+            x(i, j) = samples_[i][j] - mean[j];
+    }
+    x.getTranspose(&xT);
+    Math::Matrix<double>::multiplyMatrices(x, xT, &gram);
+
+    Math::SymmetricMatrix<double> g(m, m);
+    for(int i = 0; i < m; ++i)
+    {
+        for(int j = 0; j <= i; ++j)
+            g(i, j) = gram(i, j);
+    }
+
+    std::vector<double> eigenvals;
+    Math::Matrix<double> eigenvecs;
+    g.getEigen(&eigenvals, &eigenvecs);
+
+    // the eigenvalues are in ascending order
+    double total = 0, kept = 0;
+    for(int i = 0; i < m; ++i)
+        total += std::max(eigenvals[i], 0.0);
+
+    // each component is a combination of the samples with the coefficients given by an eigenvector, normalized by the square root of the eigenvalue
+    Math::Matrix<double> u(nComponents_, m, 0.0), b;
+    for(int k = 0; k < nComponents_ && k < m; ++k)
+    {
+        const double lambda = eigenvals[m - 1 - k];
+        if(lambda <= 1e-12 * eigenvals[m - 1])
+            break;
+
+        kept += lambda;
+        const double norm = 1.0 / std::sqrt(lambda);
+        for(int i = 0; i < m; ++i)
+            u(k, i) = eigenvecs(i, m - 1 - k) * norm;
+    }
+    Math::Matrix<double>::multiplyMatrices(u, x, &b);
+
+    std::vector<double> basis(nComponents_ * n_);
+    for(int k = 0; k < nComponents_; ++k)
+    {
+        for(int j = 0; j < n_; ++j)
+            basis[k * n_ + j] = b(k, j);
+    }
+
+    mean_.swap(mean);
+    basis_.swap(basis);
+    explained_ = (total > 0 ? kept / total : 1);
+    ready_ = true;
+}
+
+void
+PCACompressor::compress(const std::vector<double>& v, std::vector<double>* c) const
+{
+    check(ready_, "the basis has not been calculated");
+    check(v.size() == n_, "");
+
+    c->resize(nComponents_);
+    for(int k = 0; k < nComponents_; ++k)
+    {
+        const double* b = &(basis_[k * n_]);
+        double s = 0;
+        for(int j = 0; j < n_; ++j)
+            s += b[j] * (v[j] - mean_[j]);
+        (*c)[k] = s;
+    }
+}
+
+void
+PCACompressor::decompress(const std::vector<double>& c, std::vector<double>* v) const
+{
+    check(ready_, "the basis has not been calculated");
+    check(c.size() == nComponents_, "");
+
+    v->assign(mean_.begin(), mean_.end());
+    for(int k = 0; k < nComponents_; ++k)
+    {
+        const double* b = &(basis_[k * n_]);
+        const double ck = c[k];
+        for(int j = 0; j < n_; ++j)
+            (*v)[j] += ck * b[j];
+    }
+}
+
+unsigned long
+PCACompressor::basisSize() const
+{
+    return (n_ + nComponents_ * n_) * sizeof(double);
+}
+
+void
+PCACompressor::writeBasis(std::ostream& out) const
+{
+    check(ready_, "the basis has not been calculated");
+
+    out.write((const char*)(&(mean_[0])), n_ * sizeof(double));
+    out.write((const char*)(&(basis_[0])), nComponents_ * n_ * sizeof(double));
+}
+
+void
+PCACompressor::readBasis(const char* data, unsigned long size)
+{
+    check(data, "");
+
+    StandardException exc;
+    if(size < basisSize())
+    {
+        std::stringstream exceptionStr;
+        exceptionStr << "The compression basis is truncated, " << size << " bytes available, need " << basisSize() << ".";
+        exc.set(exceptionStr.str());
+        throw exc;
+    }
+
+    const double* p = reinterpret_cast<const double*>(data);
+    for(int i = 0; i < n_ + nComponents_ * n_; ++i)
+    {
+        if(!Math::isFinite(p[i]))
+        {
+            exc.set("The compression basis is invalid, it contains values that are not finite.");
+            throw exc;
+        }
+    }
+
+    mean_.assign(p, p + n_);
+    basis_.assign(p + n_, p + n_ + nComponents_ * n_);
+    ready_ = true;
+}
+
+unsigned long
+PCACompressor::sampleBytes() const
+{
+    return 2 * sizeof(unsigned long) + samples_.size() * n_ * sizeof(double);
+}
+
+void
+PCACompressor::writeSample(std::ostream& out) const
+{
+    const unsigned long header[2] = {seen_, samples_.size()};
+    out.write((const char*)(header), 2 * sizeof(unsigned long));
+    for(unsigned long i = 0; i < samples_.size(); ++i)
+        out.write((const char*)(&(samples_[i][0])), n_ * sizeof(double));
+}
+
+unsigned long
+PCACompressor::readSample(const char* data, unsigned long size)
+{
+    check(data, "");
+
+    StandardException exc;
+    const unsigned long* header = reinterpret_cast<const unsigned long*>(data);
+    if(size < 2 * sizeof(unsigned long) || header[1] > sampleSize_ || header[1] > header[0] || header[1] > (size - 2 * sizeof(unsigned long)) / sizeof(double) / n_)
+    {
+        exc.set("The compression sample is truncated or invalid.");
+        throw exc;
+    }
+
+    const double* p = reinterpret_cast<const double*>(data + 2 * sizeof(unsigned long));
+    std::vector<std::vector<double> > samples(header[1]);
+    for(unsigned long i = 0; i < samples.size(); ++i)
+        samples[i].assign(p + i * n_, p + (i + 1) * n_);
+
+    seen_ = header[0];
+    samples_.swap(samples);
+
+    return 2 * sizeof(unsigned long) + samples_.size() * n_ * sizeof(double);
+}
@@ -480,7 +480,7 @@ private:
 
 #ifdef COSMO_PLANCK_15
 
-PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP, bool highT, bool highP, bool highLikeLite, bool lensingT, bool lensingP, bool includeTensors, double kPerDecade, double precision, unsigned long minCount) : cosmoParams_(params), lowT_(lowT), lowP_(lowP), highT_(highT), highP_(highP), highLikeLite_(highLikeLite), lensingT_(lensingT), lensingP_(lensingP), like_(lowT, lowP, highT, highP, highLikeLite, lensingT, lensingP, includeTensors, kPerDecade, !highT || highLikeLite), logError_(false), rand_(std::time(0), 0, 1)
+PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP, bool highT, bool highP, bool highLikeLite, bool lensingT, bool lensingP, bool includeTensors, double kPerDecade, double precision, unsigned long minCount, int nComponents) : cosmoParams_(params), lowT_(lowT), lowP_(lowP), highT_(highT), highP_(highP), highLikeLite_(highLikeLite), lensingT_(lensingT), lensingP_(lensingP), like_(lowT, lowP, highT, highP, highLikeLite, lensingT, lensingP, includeTensors, kPerDecade, !highT || highLikeLite), logError_(false), rand_(std::time(0), 0, 1)
 {
     check(!lowP || lowT, "cannot include lowP without lowT");
     check(!highP || highT, "cannot include highP without highT");
@@ -527,7 +527,7 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool lowT, bool lowP,
         if(useBB) ++nCl;
         if(useLensing) ++nCl;
 
-        layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), nCl * lList_.size(), *f, *errorFunc, minCount, precision, fileName.str().c_str());
+        layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), nCl * lList_.size(), *f, *errorFunc, minCount, precision, fileName.str().c_str(), false, nComponents);
 
         layg_->logIntoFile("planck_like_fast_log");
 
@@ -785,7 +785,7 @@ PlanckLikeFast::doCalculation(double* params, int nPar, bool exact)
 
 #else
 
-PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bool useCamspec, bool useLensing, bool usePolarization, bool useActSpt, bool includeTensors, double kPerDecade, double precision, unsigned long minCount) : cosmoParams_(params), useCommander_(useCommander), useCamspec_(useCamspec), useLensing_(useLensing), usePol_(usePolarization), useActSpt_(useActSpt), like_(useCommander, useCamspec, useLensing, usePolarization, useActSpt, includeTensors, kPerDecade, false), logError_(false), rand_(std::time(0), 0, 1)
+PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bool useCamspec, bool useLensing, bool usePolarization, bool useActSpt, bool includeTensors, double kPerDecade, double precision, unsigned long minCount, int nComponents) : cosmoParams_(params), useCommander_(useCommander), useCamspec_(useCamspec), useLensing_(useLensing), usePol_(usePolarization), useActSpt_(useActSpt), like_(useCommander, useCamspec, useLensing, usePolarization, useActSpt, includeTensors, kPerDecade, false), logError_(false), rand_(std::time(0), 0, 1)
 {
     check(useCommander_ || useCamspec_ || useLensing_ || usePol_ || useActSpt_, "at least one likelihood must be used");
 
@@ -818,7 +818,7 @@ PlanckLikeFast::PlanckLikeFast(CosmologicalParams* params, bool useCommander, bo
     std::stringstream fileName;
     fileName << "planck_fast_" << cosmoParams_->name() << ".dat";
 
-    layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), lList_.size() + 3, *f, *errorFunc, minCount, precision, fileName.str().c_str());
+    layg_ = new LearnAsYouGo(cosmoParamsVec_.size(), lList_.size() + 3, *f, *errorFunc, minCount, precision, fileName.str().c_str(), false, nComponents);
 
     layg_->logIntoFile("planck_like_fast_log");
 
@@ -0,0 +1,143 @@
+#include <cstring>
+#include <stdint.h>
+
+#include <macros.hpp>
+#include <point_index.hpp>
+
+namespace
+{
+
+// the bit pattern of a coordinate, with -0 replaced by 0
+// this is done on the integer bits since the floating point comparison with 0 can be optimized away with -ffast-math, which ignores the sign of zero
+inline uint64_t coordinateBits(double x)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    if((bits << 1) == 0)
+        bits = 0;
+    return bits;
+}
+
+} // namespace
+
+const unsigned long PointIndex::empty_ = (unsigned long)(-1);
+
+PointIndex::PointIndex(const std::vector<std::vector<double> >& points) : points_(points), size_(0)
+{
+}
+
+void
+PointIndex::clear()
+{
+    slots_.clear();
+    size_ = 0;
+}
+
+void
+PointIndex::reset()
+{
+    clear();
+    rehash(2 * points_.size());
+    for(unsigned long i = 0; i < points_.size(); ++i)
+        insert(i);
+}
+
+unsigned long
+PointIndex::hash(const std::vector<double>& point)
+{
+    // FNV-1a over the 64 bit patterns, followed by a final mix so that the low bits depend on all of the coordinates
+    uint64_t h = 14695981039346656037ULL;
+    for(unsigned long i = 0; i < point.size(); ++i)
+    {
+        h ^= coordinateBits(point[i]);
+        h *= 1099511628211ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned long) h;
+}
+
+bool
+PointIndex::equal(const std::vector<double>& a, const std::vector<double>& b)
+{
+    if(a.size() != b.size())
+        return false;
+
+    for(unsigned long i = 0; i < a.size(); ++i)
+    {
+        if(coordinateBits(a[i]) != coordinateBits(b[i]))
+            return false;
+    }
+
+    return true;
+}
+
+void
+PointIndex::rehash(unsigned long nSlots)
+{
+    unsigned long n = 16;
+    while(n < nSlots)
+        n *= 2;
+
+    if(n <= slots_.size())
+        return;
+
+    std::vector<unsigned long> old(n, empty_);
+    old.swap(slots_);
+
+    const unsigned long mask = slots_.size() - 1;
+    for(unsigned long j = 0; j < old.size(); ++j)
+    {
+        if(old[j] == empty_)
+            continue;
+
+        unsigned long s = hash(points_[old[j]]) & mask;
+        while(slots_[s] != empty_)
+            s = (s + 1) & mask;
+        slots_[s] = old[j];
+    }
+}
+
+void
+PointIndex::insert(unsigned long i)
+{
+    check(i < points_.size(), "");
+
+    // the load factor is kept at most 1/2
+    if(2 * (size_ + 1) > slots_.size())
+        rehash(2 * (size_ + 1));
+
+    const unsigned long mask = slots_.size() - 1;
+    unsigned long s = hash(points_[i]) & mask;
+    while(slots_[s] != empty_)
+    {
+        check(!equal(points_[slots_[s]], points_[i]), "the point is already indexed");
+        s = (s + 1) & mask;
+    }
+
+    slots_[s] = i;
+    ++size_;
+}
+
+bool
+PointIndex::find(const std::vector<double>& point, unsigned long* i) const
+{
+    if(slots_.empty())
+        return false;
+
+    const unsigned long mask = slots_.size() - 1;
+    unsigned long s = hash(point) & mask;
+    while(slots_[s] != empty_)
+    {
+        if(equal(points_[slots_[s]], point))
+        {
+            *i = slots_[s];
+            return true;
+        }
+        s = (s + 1) & mask;
+    }
+
+    return false;
+}
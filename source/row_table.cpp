@@ -0,0 +1,174 @@
+#include <algorithm>
+
+#include <row_table.hpp>
+
+RowTable::RowTable(int width, bool singlePrecision) : width_(width), size_(0), single_(singlePrecision), external_(false), doublePtr_(NULL), singlePtr_(NULL)
+{
+    check(width_ >= 0, "invalid width " << width_);
+}
+
+RowTable::RowTable(const RowTable& other) : width_(other.width_), size_(other.size_), single_(other.single_), external_(other.external_), doubles_(other.doubles_), singles_(other.singles_), doublePtr_(other.doublePtr_), singlePtr_(other.singlePtr_)
+{
+    if(!external_)
+        updatePointers();
+}
+
+void
+RowTable::reset(int width, bool singlePrecision)
+{
+    check(width >= 0, "invalid width " << width);
+
+    width_ = width;
+    single_ = singlePrecision;
+    size_ = 0;
+    external_ = false;
+    doubles_.clear();
+    singles_.clear();
+    updatePointers();
+}
+
+void
+RowTable::reset(int width, unsigned long size, bool singlePrecision, const char* external)
+{
+    check(width >= 0, "invalid width " << width);
+    check(external, "");
+    check(reinterpret_cast<unsigned long>(external) % sizeof(double) == 0, "the data must be aligned to " << sizeof(double) << " bytes");
+
+    width_ = width;
+    size_ = size;
+    single_ = singlePrecision;
+    external_ = true;
+    doubles_.clear();
+    singles_.clear();
+
+    doublePtr_ = (single_ ? NULL : reinterpret_cast<const double*>(external));
+    singlePtr_ = (single_ ? reinterpret_cast<const float*>(external) : NULL);
+}
+
+void
+RowTable::getRow(unsigned long i, std::vector<double>* row) const
+{
+    check(i < size_, "");
+    check(row, "");
+
+    row->resize(width_);
+    if(width_ == 0)
+        return;
+
+    if(single_)
+        std::copy(singlePtr_ + i * width_, singlePtr_ + (i + 1) * width_, row->begin());
+    else
+        std::copy(doublePtr_ + i * width_, doublePtr_ + (i + 1) * width_, row->begin());
+}
+
+void
+RowTable::push_back(const std::vector<double>& row)
+{
+    check(row.size() == width_, "");
+
+    makeOwned();
+
+    if(single_)
+        singles_.insert(singles_.end(), row.begin(), row.end());
+    else
+        doubles_.insert(doubles_.end(), row.begin(), row.end());
+
+    ++size_;
+    updatePointers();
+}
+
+void
+RowTable::assign(unsigned long n, const std::vector<std::vector<double> >& rows)
+{
+    check(rows.size() >= n, "");
+
+    external_ = false;
+    size_ = n;
+    doubles_.resize(single_ ? 0 : n * width_);
+    singles_.resize(single_ ? n * width_ : 0);
+
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        check(rows[i].size() == width_, "");
+        if(single_)
+            std::copy(rows[i].begin(), rows[i].end(), singles_.begin() + i * width_);
+        else
+            std::copy(rows[i].begin(), rows[i].end(), doubles_.begin() + i * width_);
+    }
+
+    updatePointers();
+}
+
+void
+RowTable::swapRows(unsigned long i, unsigned long j)
+{
+    check(i < size_, "");
+    check(j < size_, "");
+
+    if(i == j)
+        return;
+
+    makeOwned();
+
+    if(single_)
+        std::swap_ranges(singles_.begin() + i * width_, singles_.begin() + (i + 1) * width_, singles_.begin() + j * width_);
+    else
+        std::swap_ranges(doubles_.begin() + i * width_, doubles_.begin() + (i + 1) * width_, doubles_.begin() + j * width_);
+}
+
+void
+RowTable::swap(RowTable& other)
+{
+    std::swap(width_, other.width_);
+    std::swap(size_, other.size_);
+    std::swap(single_, other.single_);
+    std::swap(external_, other.external_);
+
+    // the vectors keep their memory when swapped, so the pointers stay valid
+    doubles_.swap(other.doubles_);
+    singles_.swap(other.singles_);
+    std::swap(doublePtr_, other.doublePtr_);
+    std::swap(singlePtr_, other.singlePtr_);
+}
+
+unsigned long
+RowTable::rawSize() const
+{
+    const unsigned long size = size_ * width_ * (single_ ? sizeof(float) : sizeof(double));
+    return (size + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+}
+
+void
+RowTable::writeRaw(std::ostream& out) const
+{
+    const unsigned long size = size_ * width_ * (single_ ? sizeof(float) : sizeof(double));
+    if(size)
+        out.write(single_ ? reinterpret_cast<const char*>(singlePtr_) : reinterpret_cast<const char*>(doublePtr_), size);
+
+    const char padding[sizeof(double)] = {0};
+    out.write(padding, rawSize() - size);
+}
+
+void
+RowTable::makeOwned()
+{
+    if(!external_)
+        return;
+
+    if(single_)
+        singles_.assign(singlePtr_, singlePtr_ + size_ * width_);
+    else
+        doubles_.assign(doublePtr_, doublePtr_ + size_ * width_);
+
+    external_ = false;
+    updatePointers();
+}
+
+void
+RowTable::updatePointers()
+{
+    check(!external_, "");
+
+    doublePtr_ = (doubles_.empty() ? NULL : &(doubles_[0]));
+    singlePtr_ = (singles_.empty() ? NULL : &(singles_[0]));
+}
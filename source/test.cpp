@@ -38,6 +38,8 @@
 #include <test_kd_tree.hpp>
 #include <test_fast_approximator.hpp>
 #include <test_fast_approximator_error.hpp>
+#include <test_learn_as_you_go.hpp>
+#include <test_learn_as_you_go_parallel.hpp>
 #include <test_mcmc_planck_fast.hpp>
 #include <test_multinest_planck_fast.hpp>
 
@@ -140,6 +142,10 @@ TestFramework* createTest(const std::string& name)
         test = new TestFastApproximator(1e-3);
     else if(name == "fast_approximator_error")
         test = new TestFastApproximatorError(1e-3);
+    else if(name == "learn_as_you_go")
+        test = new TestLearnAsYouGo(1e-3);
+    else if(name == "learn_as_you_go_parallel")
+        test = new TestLearnAsYouGoParallel(1e-3);
 #endif
 #ifdef COSMO_LAPACK
 #ifdef COSMO_CLASS
@@ -227,6 +233,8 @@ int main(int argc, char *argv[])
 #ifdef COSMO_LAPACK
         fastTests.insert("fast_approximator");
         fastTests.insert("fast_approximator_error");
+        fastTests.insert("learn_as_you_go");
+        fastTests.insert("learn_as_you_go_parallel");
 #endif
 
 #ifdef COSMO_PLANCK
@@ -1,6 +1,15 @@
 #include <ctime>
+#include <cstdio>
+#include <cmath>
+#include <fstream>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
 
 #include <random.hpp>
+#include <numerics.hpp>
+#include <mapped_file.hpp>
+#include <row_table.hpp>
 #include <fast_approximator.hpp>
 #include <test_fast_approximator.hpp>
 
@@ -13,7 +22,7 @@ TestFastApproximator::name() const
 unsigned int
 TestFastApproximator::numberOfSubtests() const
 {
-    return 1;
+    return 9;
 }
 
 double fastApproxTestFunc(double x)
@@ -24,8 +33,46 @@ double fastApproxTestFunc(double x)
 void
 TestFastApproximator::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i == 0, "invalid index " << i);
+    check(i >= 0 && i < 9, "invalid index " << i);
 
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        break;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        break;
+    case 2:
+        runSubTest2(res, expected, subTestName);
+        break;
+    case 3:
+        runSubTest3(res, expected, subTestName);
+        break;
+    case 4:
+        runSubTest4(res, expected, subTestName);
+        break;
+    case 5:
+        runSubTest5(res, expected, subTestName);
+        break;
+    case 6:
+        runSubTest6(res, expected, subTestName);
+        break;
+    case 7:
+        runSubTest7(res, expected, subTestName);
+        break;
+    case 8:
+        runSubTest8(res, expected, subTestName);
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
+
+void
+TestFastApproximator::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
     std::vector<std::vector<double> > points, data;
 
     Math::UniformRealGenerator gen(std::time(0), -10, 10);
@@ -46,7 +93,7 @@ TestFastApproximator::runSubTest(unsigned int i, double& res, double& expected,
         data.push_back(d);
     }
 
-    FastApproximator fa(1, 1, points.size(), points, data, (i == 0 ? 10 : 10));
+    FastApproximator fa(1, 1, points.size(), points, data, 10);
 
     p[0] = 0;
 
@@ -56,3 +103,560 @@ TestFastApproximator::runSubTest(unsigned int i, double& res, double& expected,
     res = d[0];
     expected = fastApproxTestFunc(p[0]);
 }
+
+void
+TestFastApproximator::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    const int nPoints = 5000;
+
+    std::vector<double> p(2), d(2);
+
+    for(int i = 0; i < nPoints; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = 3 * p[0] + gen.generate();
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]) + p[1];
+        d[1] = fastApproxTestFunc(p[1]);
+        data.push_back(d);
+    }
+
+    FastApproximator fa(2, 2, points.size(), points, data, 20);
+
+    const char* fileName = "test_fast_approximator_snapshot.dat";
+    std::ofstream out(fileName, std::ios::binary | std::ios::out);
+    fa.writeSnapshot(out);
+    out.close();
+
+    res = 0;
+    expected = 0;
+    subTestName = "snapshot";
+
+    {
+        MappedFile mapped(fileName);
+        FastApproximator faMapped(mapped.data(), mapped.size(), 20);
+
+        // the approximator from the snapshot should give exactly the same results
+        std::vector<double> d1, d2;
+        std::vector<unsigned long> indices1, indices2;
+        for(int i = 0; i < 100; ++i)
+        {
+            p[0] = gen.generate();
+            p[1] = 3 * p[0] + gen.generate();
+
+            fa.approximate(p, d1, FastApproximator::QUADRATIC_INTERPOLATION, NULL, NULL, &indices1);
+            faMapped.approximate(p, d2, FastApproximator::QUADRATIC_INTERPOLATION, NULL, NULL, &indices2);
+
+            if(indices1 != indices2 || d1 != d2)
+            {
+                output_screen("FAILED: the approximations with and without the snapshot differ for the point (" << p[0] << ", " << p[1] << ")." << std::endl);
+                res = 1;
+            }
+        }
+
+        // adding a point makes a copy of the snapshot, the new point must be found
+        p[0] = 0.5;
+        p[1] = 1.5;
+        d[0] = 123;
+        d[1] = 456;
+        fa.addPoint(p, d);
+        faMapped.addPoint(p, d);
+
+        fa.approximate(p, d1);
+        faMapped.approximate(p, d2);
+
+        if(d1 != d2 || d2 != d)
+        {
+            output_screen("FAILED: the added point was not found after the snapshot was copied." << std::endl);
+            res = 1;
+        }
+
+        // a truncated snapshot must be rejected rather than read out of bounds
+        const unsigned long truncatedSizes[] = {2 * sizeof(unsigned long), mapped.size() / 2, mapped.size() - sizeof(double)};
+        for(int i = 0; i < 3; ++i)
+        {
+            bool thrown = false;
+            try
+            {
+                FastApproximator faTruncated(mapped.data(), truncatedSizes[i], 20);
+            }
+            catch(StandardException& e)
+            {
+                thrown = true;
+            }
+
+            if(!thrown)
+            {
+                output_screen("FAILED: the snapshot truncated to " << truncatedSizes[i] << " bytes was not rejected." << std::endl);
+                res = 1;
+            }
+        }
+
+        // damaged kd tree nodes must be rejected as well, the kd tree follows the header, the transformation matrix, the length scale, and the output values
+        std::vector<unsigned long> damaged(mapped.size() / sizeof(unsigned long));
+        std::memcpy(&(damaged[0]), mapped.data(), damaged.size() * sizeof(unsigned long));
+        const unsigned long treeBegin = (4 * sizeof(unsigned long) + 5 * sizeof(double) + nPoints * 2 * sizeof(double)) / sizeof(unsigned long);
+        const unsigned long nNodes = damaged[treeBegin + 1], nRoots = damaged[treeBegin + 2];
+        const unsigned long firstNode = treeBegin + 5 + nRoots;
+
+        // the copy itself is valid
+        {
+            FastApproximator faCopy(reinterpret_cast<const char*>(&(damaged[0])), damaged.size() * sizeof(unsigned long), 20);
+            faCopy.approximate(p, d2);
+            if(nNodes != nPoints || faCopy.nIn() != 2)
+            {
+                output_screen("FAILED: the copy of the snapshot is read differently." << std::endl);
+                res = 1;
+            }
+        }
+
+        // the index of the point, the left child, and the right child of the first node
+        for(int field = 0; field < 3; ++field)
+        {
+            const unsigned long original = damaged[firstNode + field];
+            damaged[firstNode + field] = nNodes + 10;
+
+            bool thrown = false;
+            try
+            {
+                FastApproximator faDamaged(reinterpret_cast<const char*>(&(damaged[0])), damaged.size() * sizeof(unsigned long), 20);
+            }
+            catch(StandardException& e)
+            {
+                thrown = true;
+            }
+
+            if(!thrown)
+            {
+                output_screen("FAILED: the snapshot with a damaged kd tree node was not rejected." << std::endl);
+                res = 1;
+            }
+
+            damaged[firstNode + field] = original;
+        }
+    }
+
+    std::remove(fileName);
+}
+
+void
+TestFastApproximator::runSubTest2(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points;
+
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    const int nPoints = 10000;
+
+    std::vector<double> p(1), d(1);
+
+    // the output values are kept in a single precision table shared with the approximator
+    RowTable data(1, true);
+
+    for(int i = 0; i < nPoints; ++i)
+    {
+        p[0] = gen.generate();
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]);
+        data.push_back(d);
+    }
+
+    FastApproximator fa(1, 1, points.size(), points, data, 10, true);
+
+    p[0] = 0;
+    fa.approximate(p, d, FastApproximator::QUADRATIC_INTERPOLATION);
+
+    subTestName = "single_precision";
+    res = d[0];
+    expected = fastApproxTestFunc(p[0]);
+}
+
+void
+TestFastApproximator::runSubTest3(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    const int nPoints = 10000;
+
+    std::vector<double> p(1), d(1);
+
+    for(int i = 0; i < nPoints; ++i)
+    {
+        p[0] = gen.generate();
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]);
+        data.push_back(d);
+    }
+
+    const FastApproximator fa(1, 1, points.size(), points, data, 10);
+
+    const int nQueries = 1000;
+    std::vector<std::vector<double> > queries(nQueries, std::vector<double>(1)), expectedVals(nQueries), vals(nQueries);
+
+    FastApproximator::Workspace serialWorkspace;
+    for(int i = 0; i < nQueries; ++i)
+    {
+        queries[i][0] = 0.9 * gen.generate();
+        fa.approximate(queries[i], expectedVals[i], &serialWorkspace);
+    }
+
+    // the same approximator is used from all of the threads, each one with its own workspace
+#pragma omp parallel num_threads(4)
+    {
+        FastApproximator::Workspace workspace;
+
+#pragma omp for
+        for(int i = 0; i < nQueries; ++i)
+            fa.approximate(queries[i], vals[i], &workspace);
+    }
+
+    subTestName = "parallel";
+    res = 0;
+    expected = 0;
+
+    for(int i = 0; i < nQueries; ++i)
+    {
+        if(vals[i] != expectedVals[i])
+        {
+            output_screen("FAILED: the approximation at " << queries[i][0] << " is " << vals[i][0] << " in parallel and " << expectedVals[i][0] << " serially." << std::endl);
+            ++res;
+        }
+    }
+}
+
+void
+TestFastApproximator::runSubTest4(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    const int nPoints = 10000;
+
+    std::vector<double> p(2), d(1);
+
+    for(int i = 0; i < nPoints; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = gen.generate();
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+        data.push_back(d);
+    }
+
+    // the last points are added after the construction, so the batch search also goes through the points not merged into the kd tree yet
+    const int nAdded = 50;
+    FastApproximator fa(2, 1, nPoints - nAdded, points, data, 20);
+    for(int i = nPoints - nAdded; i < nPoints; ++i)
+        fa.addPoint(points[i], data[i]);
+
+    const int nQueries = 1000;
+    std::vector<std::vector<double> > queries(nQueries, std::vector<double>(2));
+    for(int i = 0; i < nQueries; ++i)
+    {
+        queries[i][0] = 0.9 * gen.generate();
+        queries[i][1] = 0.9 * gen.generate();
+    }
+
+    std::vector<std::vector<double> > vals, distances;
+    std::vector<std::vector<std::vector<double> > > neighbors;
+    fa.approximateBatch(queries, &vals, FastApproximator::QUADRATIC_INTERPOLATION, &distances, &neighbors);
+
+    subTestName = "batch";
+    res = 0;
+    expected = 0;
+
+    if(vals.size() != nQueries || distances.size() != nQueries || neighbors.size() != nQueries)
+    {
+        output_screen("FAILED: the batch returned " << vals.size() << " results, " << distances.size() << " distances and " << neighbors.size() << " neighbor sets, expected " << nQueries << "." << std::endl);
+        res = 1;
+        return;
+    }
+
+    // the points are transformed differently in the batch, so the results may differ by rounding
+    std::vector<double> dist;
+    std::vector<std::vector<double> > neighbor;
+    for(int i = 0; i < nQueries; ++i)
+    {
+        fa.approximate(queries[i], d, FastApproximator::QUADRATIC_INTERPOLATION, &dist, &neighbor);
+        const int last = dist.size() - 1;
+        if(std::abs(vals[i][0] - d[0]) > 1e-7 * (1 + std::abs(d[0])) || std::abs(distances[i][last] - dist[last]) > 1e-7 * (1 + dist[last]) || std::abs(neighbors[i][last][1] - neighbor[last][1]) > 1e-7 * (1 + dist[last]))
+        {
+            output_screen("FAILED: the batch approximation at (" << queries[i][0] << ", " << queries[i][1] << ") is " << vals[i][0] << ", expected " << d[0] << "." << std::endl);
+            ++res;
+        }
+    }
+}
+
+void
+TestFastApproximator::runSubTest5(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    const int nPoints = 5000;
+
+    std::vector<double> p(2), d(1);
+
+    for(int i = 0; i < 2 * nPoints; ++i)
+    {
+        // the second half is stretched along the first axis
+        p[0] = gen.generate() * (i < nPoints ? 1 : 2);
+        p[1] = gen.generate() + 0.5 * p[0];
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+        data.push_back(d);
+    }
+
+    FastApproximator fa(2, 1, nPoints, points, data, 10);
+
+    subTestName = "covariance_drift";
+    res = 0;
+    expected = 0;
+
+    const double initialDrift = fa.covarianceDrift();
+    if(initialDrift > 1e-10)
+    {
+        output_screen("FAILED: the covariance drift right after training is " << initialDrift << "." << std::endl);
+        ++res;
+    }
+
+    for(int i = nPoints; i < 2 * nPoints; ++i)
+        fa.addPoint(points[i], data[i]);
+
+    // the variance along the first axis has increased by a factor of 2.5
+    const double drift = fa.covarianceDrift();
+    if(drift < 0.5)
+    {
+        output_screen("FAILED: the covariance drift after adding the stretched points is only " << drift << "." << std::endl);
+        ++res;
+    }
+
+    // within the tolerance the transformation is kept, the statistics recalculated from scratch should give the same drift
+    fa.setCovarianceTolerance(10);
+    fa.reset(2 * nPoints, points, data, true);
+    if(std::abs(fa.covarianceDrift() - drift) > 1e-8 * drift)
+    {
+        output_screen("FAILED: the covariance drift calculated from scratch is " << fa.covarianceDrift() << ", while the running one is " << drift << "." << std::endl);
+        ++res;
+    }
+
+    // leaving out some of the points updates the statistics by removing them, which should agree with recalculating them
+    const int nLeftOut = 1000;
+    fa.reset(2 * nPoints - nLeftOut, points, data, true, 2 * nPoints);
+    const double removedDrift = fa.covarianceDrift();
+    fa.reset(2 * nPoints - nLeftOut, points, data, true);
+    if(std::abs(fa.covarianceDrift() - removedDrift) > 1e-8 * removedDrift)
+    {
+        output_screen("FAILED: the covariance drift after removing points is " << removedDrift << ", while calculated from scratch it is " << fa.covarianceDrift() << "." << std::endl);
+        ++res;
+    }
+
+    fa.setCovarianceTolerance(0.05);
+    fa.reset(2 * nPoints, points, data, true);
+    if(fa.covarianceDrift() > 1e-10)
+    {
+        output_screen("FAILED: the covariance drift after updating the transformation is " << fa.covarianceDrift() << "." << std::endl);
+        ++res;
+    }
+}
+
+void
+TestFastApproximator::runSubTest6(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    const int nPoints = 10000;
+
+    std::vector<double> p(2), d(1);
+
+    for(int i = 0; i < nPoints; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = gen.generate();
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+        data.push_back(d);
+    }
+
+    const FastApproximator fa(2, 1, points.size(), points, data, 20);
+
+    p[0] = 0.5;
+    p[1] = -0.3;
+
+    FastApproximator::Workspace workspace;
+    fa.approximate(p, d, &workspace, FastApproximator::GP_INTERPOLATION);
+
+    subTestName = "gaussian_process";
+    res = d[0];
+    expected = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+
+    // a nearby point with the same neighbors uses the cached kernel matrix, the result should not depend on it
+    p[0] += 1e-3;
+    std::vector<double> cached, fresh;
+    fa.approximate(p, cached, &workspace, FastApproximator::GP_INTERPOLATION);
+
+    FastApproximator::Workspace newWorkspace;
+    fa.approximate(p, fresh, &newWorkspace, FastApproximator::GP_INTERPOLATION);
+
+    if(std::abs(cached[0] - fresh[0]) > 1e-10 * std::abs(fresh[0]))
+    {
+        output_screen("FAILED: the cached Gaussian process approximation is " << cached[0] << ", while without the cache it is " << fresh[0] << "." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestFastApproximator::runSubTest7(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -10, 10);
+
+    // a linear function is interpolated exactly (up to the round off) by the linear fit, whichever neighbors are found
+    const unsigned long nInitial = 5000, nAdded = 20000;
+    std::vector<std::vector<double> > points(nInitial + nAdded, std::vector<double>(2)), data(nInitial + nAdded, std::vector<double>(2));
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        points[i][0] = gen.generate();
+        points[i][1] = gen.generate();
+        data[i][0] = 2 * points[i][0] - 3 * points[i][1] + 1;
+        data[i][1] = -data[i][0];
+    }
+
+    FastApproximator fa(2, 2, nInitial, points, data, 10);
+
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long> nAddedSoFar(0), nQueries(0), nErrors(0);
+
+    // one thread adds the points while the others query
+#pragma omp parallel default(shared) num_threads(4)
+    {
+        const int threadId = CURRENT_THREAD_NUM();
+        if(threadId == 0)
+        {
+            for(unsigned long i = nInitial; i < points.size(); ++i)
+            {
+                fa.addPoint(points[i], data[i]);
+                ++nAddedSoFar;
+            }
+            done = true;
+        }
+        else
+        {
+            FastApproximator::Workspace workspace;
+            Math::UniformRealGenerator threadGen(1000 + threadId, -9, 9);
+            std::vector<double> q(2), val;
+            std::vector<unsigned long> indices;
+            while(!done)
+            {
+                q[0] = threadGen.generate();
+                q[1] = threadGen.generate();
+                fa.approximate(q, val, &workspace, FastApproximator::LINEAR_INTERPOLATION, NULL, NULL, &indices);
+                ++nQueries;
+
+                // at most the point being added can be found before it is counted
+                const double exact = 2 * q[0] - 3 * q[1] + 1;
+                if(std::abs(val[0] - exact) > 1e-2 || std::abs(val[1] + exact) > 1e-2 || indices.size() != 10 || *std::max_element(indices.begin(), indices.end()) > nInitial + nAddedSoFar)
+                    ++nErrors;
+            }
+        }
+    }
+
+    output_screen1("Performed " << nQueries << " queries while adding the points." << std::endl);
+
+    subTestName = "concurrent_add";
+    res = 0;
+    expected = 0;
+
+    if(nErrors)
+    {
+        output_screen("FAILED: " << nErrors << " of the " << nQueries << " queries during the insertions were wrong." << std::endl);
+        ++res;
+    }
+
+    // every added point is found as its own nearest neighbor with its value
+    std::vector<double> val, distances;
+    std::vector<unsigned long> indices;
+    for(unsigned long i = nInitial; i < points.size(); i += 97)
+    {
+        fa.approximate(points[i], val, FastApproximator::LINEAR_INTERPOLATION, &distances, NULL, &indices);
+        if(indices[0] != i || distances[0] != 0 || std::abs(val[0] - data[i][0]) > 1e-6)
+        {
+            output_screen("FAILED: the added point " << i << " is not found with its value." << std::endl);
+            ++res;
+            break;
+        }
+    }
+}
+
+void
+TestFastApproximator::runSubTest8(double& res, double& expected, std::string& subTestName)
+{
+    std::vector<std::vector<double> > points, data;
+
+    Math::UniformRealGenerator gen(4567, -10, 10);
+
+    std::vector<double> p(2), d(1);
+
+    for(int i = 0; i < 2000; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = gen.generate();
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+        data.push_back(d);
+    }
+
+    // a cluster of nearly coincident points, which are all of the neighbors of the query point below, makes the kernel matrix nearly singular
+    for(int i = 0; i < 20; ++i)
+    {
+        p[0] = 0.5 + 1e-12 * i;
+        p[1] = -0.3;
+        points.push_back(p);
+
+        d[0] = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+        data.push_back(d);
+    }
+
+    const FastApproximator fa(2, 1, points.size(), points, data, 10);
+
+    p[0] = 0.5 + 1e-3;
+    p[1] = -0.3;
+    const double exact = fastApproxTestFunc(p[0]) + fastApproxTestFunc(p[1]);
+
+    subTestName = "gaussian_process_degenerate";
+    res = 0;
+    expected = 0;
+
+    // the approximation is either good or unusable (NaN), it must not abort with an exception
+    FastApproximator::Workspace workspace;
+    try
+    {
+        fa.approximate(p, d, &workspace, FastApproximator::GP_INTERPOLATION);
+        if(Math::isFinite(d[0]) && std::abs(d[0] - exact) > 1e-2 * std::abs(exact))
+        {
+            output_screen("FAILED: the Gaussian process approximation with nearly coincident neighbors is " << d[0] << ", expected " << exact << "." << std::endl);
+            ++res;
+        }
+    }
+    catch(StandardException& e)
+    {
+        output_screen("FAILED: the Gaussian process approximation with nearly coincident neighbors threw an exception: " << e.what() << std::endl);
+        ++res;
+    }
+}
@@ -1,5 +1,6 @@
 #include <cmath>
 #include <ctime>
+#include <limits>
 //#include <fstream>
 
 #include <macros.hpp>
@@ -16,7 +17,7 @@ TestFastApproximatorError::name() const
 unsigned int
 TestFastApproximatorError::numberOfSubtests() const
 {
-    return 1;
+    return 2;
 }
 
 double fastApproxErrorTestFunc(double x, double y, double z)
@@ -31,8 +32,25 @@ double fastApproxErrorTestFunc(double x, double y, double z)
 void
 TestFastApproximatorError::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 2, "invalid index " << i);
 
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        break;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
+
+void
+TestFastApproximatorError::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
     const int n = 1000;
 
     std::vector<std::vector<double> > points, data;
@@ -76,3 +94,63 @@ TestFastApproximatorError::runSubTest(unsigned int i, double& res, double& expec
     res = 0;
     expected = 0;
 }
+
+void
+TestFastApproximatorError::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    // a linear function, except in the corner x, y > 0.8 where the outputs are NaN so the fits there fail
+    std::vector<std::vector<double> > points, data;
+    std::vector<double> p(2), d(1);
+
+    Math::UniformRealGenerator gen(3456, -1, 1);
+
+    for(int i = 0; i < 2000; ++i)
+    {
+        p[0] = gen.generate();
+        p[1] = gen.generate();
+        d[0] = (p[0] > 0.8 && p[1] > 0.8 ? std::numeric_limits<double>::quiet_NaN() : 2 * p[0] - p[1]);
+        points.push_back(p);
+        data.push_back(d);
+    }
+
+    FastApproximator fa(2, 1, points.size(), points, data, 10);
+    BasicFAErrorFunctionAvg func;
+    const std::vector<std::vector<double> > noTest;
+
+    subTestName = "step_times";
+    res = 0;
+    expected = 0;
+
+    std::vector<double> good(2, 0.0), bad(2, 0.95), val;
+
+    // the error method needs the fit, which fails for the bad point before the error model is evaluated
+    FastApproximatorError linQuad(fa, noTest, noTest, 0, 0, func, FastApproximatorError::LIN_QUAD_DIFF);
+    linQuad.setStepTiming(true);
+
+    linQuad.approximate(good, val);
+    if(!linQuad.getStepTimes().fitted || !linQuad.getStepTimes().errorEvaluated)
+    {
+        output_screen("FAIL! The fit and the error model of the good point are not both recorded." << std::endl);
+        ++res;
+    }
+
+    const bool badAccepted = linQuad.approximate(bad, val);
+    const FastApproximatorError::StepTimes& badSteps = linQuad.getStepTimes();
+    if(badAccepted || !badSteps.fitted || badSteps.errorEvaluated || badSteps.error != 0)
+    {
+        output_screen("FAIL! For the failed fit the step times are those of the previous call (error model time " << badSteps.error << ")." << std::endl);
+        ++res;
+    }
+
+    // without a test set the estimated error is too large, so the fit is not done
+    FastApproximatorError avgInv(fa, noTest, noTest, 0, 0, func, FastApproximatorError::AVG_INV_DISTANCE);
+    avgInv.setStepTiming(true);
+
+    const bool goodAccepted = avgInv.approximate(good, val);
+    const FastApproximatorError::StepTimes& goodSteps = avgInv.getStepTimes();
+    if(goodAccepted || goodSteps.fitted || goodSteps.fit != 0 || !goodSteps.errorEvaluated)
+    {
+        output_screen("FAIL! For the rejected approximation a fit time of " << goodSteps.fit << " is recorded." << std::endl);
+        ++res;
+    }
+}
@@ -1,11 +1,17 @@
 #include <utility>
 #include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <cstring>
+#include <sstream>
 
 #include <macros.hpp>
+#include <exception_handler.hpp>
 #include <random.hpp>
 #include <timer.hpp>
 #include <numerics.hpp>
 #include <kd_tree.hpp>
+#include <concurrent_kd_tree.hpp>
 #include <test_kd_tree.hpp>
 
 std::string
@@ -17,7 +23,7 @@ TestKDTree::name() const
 unsigned int
 TestKDTree::numberOfSubtests() const
 {
-    return 9;
+    return 15;
 }
 
 void
@@ -75,6 +81,24 @@ TestKDTree::runSubTest(unsigned int i, double& res, double& expected, std::strin
         seed = 0;
         subTestName = "10_20_1000000";
         break;
+    case 9:
+        runSubTest5(res, expected, subTestName);
+        return;
+    case 10:
+        runSubTest6(res, expected, subTestName);
+        return;
+    case 11:
+        runSubTest7(res, expected, subTestName);
+        return;
+    case 12:
+        runSubTest8(res, expected, subTestName);
+        return;
+    case 13:
+        runSubTest9(res, expected, subTestName);
+        return;
+    case 14:
+        runSubTest10(res, expected, subTestName);
+        return;
     default:
         check(false, "");
         break;
@@ -316,6 +340,523 @@ TestKDTree::runSubTest4(double& res, double& expected, std::string& subTestName)
     }
 }
 
+void
+TestKDTree::runSubTest5(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 4;
+    const int k = 5;
+    const unsigned long size = 2000, nInsert = 1000;
+
+    std::vector<std::vector<double> > points(size + nInsert);
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    std::vector<std::vector<double> > initial(points.begin(), points.begin() + size);
+    KDTree kdTree(dim, initial);
+    for(unsigned long i = size; i < points.size(); ++i)
+        kdTree.insert(points[i]);
+
+    res = 1;
+    expected = 1;
+    subTestName = "insert_rebalance";
+
+    // the inserts should keep the components balanced
+    const int maxDepth = int(std::ceil(std::log(double(points.size() + 1)) / std::log(2.0)));
+    if(kdTree.depth() > maxDepth || kdTree.nComponents() > maxDepth)
+    {
+        output_screen("FAIL! After the inserts the tree has depth " << kdTree.depth() << " and " << kdTree.nComponents() << " components, both should be at most " << maxDepth << "." << std::endl);
+        res = 0;
+    }
+
+    std::vector<double> p(dim);
+    std::vector<unsigned long> indices;
+    for(int n = 0; n < 2; ++n)
+    {
+        for(int i = 0; i < 10; ++i)
+        {
+            for(int j = 0; j < dim; ++j)
+                p[j] = gen.generate();
+
+            kdTree.findNearestNeighbors(p, k, &indices);
+
+            std::vector<std::pair<double, unsigned long> > v(points.size());
+            for(unsigned long l = 0; l < points.size(); ++l)
+            {
+                double d = 0;
+                for(int j = 0; j < dim; ++j)
+                    d += (p[j] - points[l][j]) * (p[j] - points[l][j]);
+                v[l].first = d;
+                v[l].second = l;
+            }
+            std::sort(v.begin(), v.end());
+
+            for(int j = 0; j < k; ++j)
+            {
+                if(indices[j] != v[j].second)
+                {
+                    output_screen("FAIL! Neighbor " << j << " should have index " << v[j].second << " but it has index " << indices[j] << (n ? " after rebalancing." : ".") << std::endl);
+                    res = 0;
+                    return;
+                }
+            }
+        }
+
+        kdTree.reBalance();
+    }
+}
+
+void
+TestKDTree::runSubTest6(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 6;
+    const int k = 10;
+    const unsigned long size = 100000, nQueries = 10000;
+
+    std::vector<std::vector<double> > points(size), queries(nQueries);
+    for(unsigned long i = 0; i < size; ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        queries[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            queries[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, points);
+
+    res = 1;
+    expected = 1;
+    subTestName = "batch";
+
+    std::vector<unsigned long> batchIndices;
+    std::vector<double> batchDistances;
+
+    Timer t1("KD TREE BATCH SEARCH");
+    t1.start();
+    kdTree.findNearestNeighborsBatch(queries, k, &batchIndices, &batchDistances);
+    t1.end();
+
+    std::vector<unsigned long> indices;
+    std::vector<double> distances;
+
+    Timer t2("KD TREE ONE BY ONE SEARCH");
+    t2.start();
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        kdTree.findNearestNeighbors(queries[i], k, &indices, &distances);
+        for(int j = 0; j < k; ++j)
+        {
+            if(indices[j] != batchIndices[i * k + j] || distances[j] != batchDistances[i * k + j])
+            {
+                output_screen("FAIL! Batch search result for query " << i << ", neighbor " << j << " is (" << batchIndices[i * k + j] << ", " << batchDistances[i * k + j] << "), expected (" << indices[j] << ", " << distances[j] << ")." << std::endl);
+                res = 0;
+            }
+        }
+    }
+    t2.end();
+
+#ifdef CHECKS_ON
+    // a query of the wrong dimension must raise an exception rather than terminate inside the parallel region
+    queries[nQueries / 2].resize(dim + 1, 0);
+    bool thrown = false;
+    try
+    {
+        kdTree.findNearestNeighborsBatch(queries, k, &batchIndices, &batchDistances);
+    }
+    catch(StandardException& e)
+    {
+        thrown = true;
+    }
+
+    if(!thrown)
+    {
+        output_screen("FAIL! The batch search did not reject a query of the wrong dimension." << std::endl);
+        res = 0;
+    }
+#endif
+}
+
+void
+TestKDTree::runSubTest7(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 20;
+    const int k = 20;
+    const double epsilon = 1.0;
+    const unsigned long size = 100000, nQueries = 100;
+
+    std::vector<std::vector<double> > points(size), queries(nQueries);
+    for(unsigned long i = 0; i < size; ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        queries[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            queries[i][j] = gen.generate();
+    }
+
+    KDTree kdTree(dim, points);
+
+    res = 1;
+    expected = 1;
+    subTestName = "approximate";
+
+    std::vector<unsigned long> exactIndices, approxIndices;
+    std::vector<double> exactDistances, approxDistances;
+
+    Timer t1("KD TREE EXACT SEARCH");
+    t1.start();
+    kdTree.findNearestNeighborsBatch(queries, k, &exactIndices, &exactDistances);
+    t1.end();
+
+    kdTree.setApproximation(epsilon);
+    Timer t2("KD TREE APPROXIMATE SEARCH");
+    t2.start();
+    kdTree.findNearestNeighborsBatch(queries, k, &approxIndices, &approxDistances);
+    t2.end();
+
+    for(unsigned long i = 0; i < nQueries * k; ++i)
+    {
+        if(approxDistances[i] > (1 + epsilon) * (1 + epsilon) * exactDistances[i] * (1 + 1e-10))
+        {
+            output_screen("FAIL! Approximate neighbor " << i % k << " of query " << i / k << " has distance squared " << approxDistances[i] << " while the exact one has " << exactDistances[i] << "." << std::endl);
+            res = 0;
+        }
+    }
+
+    // with a budget of visits there is no guarantee, but k distinct sorted neighbors must still be found
+    kdTree.setApproximation(epsilon, 100);
+    kdTree.findNearestNeighborsBatch(queries, k, &approxIndices, &approxDistances);
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        std::vector<unsigned long> ind(approxIndices.begin() + i * k, approxIndices.begin() + (i + 1) * k);
+        std::sort(ind.begin(), ind.end());
+        if(std::unique(ind.begin(), ind.end()) != ind.end())
+        {
+            output_screen("FAIL! The neighbors of query " << i << " with limited visits are not distinct." << std::endl);
+            res = 0;
+        }
+        for(int j = 1; j < k; ++j)
+        {
+            if(approxDistances[i * k + j] < approxDistances[i * k + j - 1])
+            {
+                output_screen("FAIL! The neighbors of query " << i << " with limited visits are not sorted." << std::endl);
+                res = 0;
+            }
+        }
+    }
+}
+
+void
+TestKDTree::runSubTest8(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 3;
+    const double radius = 0.2;
+    const unsigned long size = 20000, nInsert = 100;
+
+    std::vector<std::vector<double> > points(size + nInsert);
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    std::vector<std::vector<double> > initial(points.begin(), points.begin() + size);
+    KDTree kdTree(dim, initial);
+    for(unsigned long i = size; i < points.size(); ++i)
+        kdTree.insert(points[i]);
+
+    res = 1;
+    expected = 1;
+    subTestName = "radius_box";
+
+    std::vector<double> p(dim), lower(dim), upper(dim);
+    for(int j = 0; j < dim; ++j)
+    {
+        p[j] = gen.generate();
+        lower[j] = gen.generate() - 0.2;
+        upper[j] = lower[j] + 0.4;
+    }
+
+    std::vector<unsigned long> radiusIndices, boxIndices;
+    std::vector<double> radiusDistances;
+    kdTree.findWithinRadius(p, radius, &radiusIndices, &radiusDistances);
+    kdTree.findInBox(lower, upper, &boxIndices);
+    std::sort(boxIndices.begin(), boxIndices.end());
+
+    std::vector<std::pair<double, unsigned long> > expectedRadius;
+    std::vector<unsigned long> expectedBox;
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        double d = 0;
+        bool inside = true;
+        for(int j = 0; j < dim; ++j)
+        {
+            d += (p[j] - points[i][j]) * (p[j] - points[i][j]);
+            if(points[i][j] < lower[j] || points[i][j] > upper[j])
+                inside = false;
+        }
+
+        if(d <= radius * radius)
+            expectedRadius.push_back(std::make_pair(d, i));
+        if(inside)
+            expectedBox.push_back(i);
+    }
+    std::sort(expectedRadius.begin(), expectedRadius.end());
+
+    if(radiusIndices.size() != expectedRadius.size())
+    {
+        output_screen("FAIL! Found " << radiusIndices.size() << " points within the radius, expected " << expectedRadius.size() << "." << std::endl);
+        res = 0;
+    }
+    else
+    {
+        for(unsigned long i = 0; i < radiusIndices.size(); ++i)
+        {
+            if(radiusIndices[i] != expectedRadius[i].second || !Math::areEqual(radiusDistances[i], expectedRadius[i].first, 1e-10))
+            {
+                output_screen("FAIL! Point " << i << " within the radius is wrong." << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    if(boxIndices != expectedBox)
+    {
+        output_screen("FAIL! Found " << boxIndices.size() << " points inside the box, expected " << expectedBox.size() << "." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestKDTree::runSubTest9(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 3, k = 5;
+    const unsigned long size = 20000, nInsert = 5030, nQueries = 1000;
+
+    std::vector<std::vector<double> > points(size + nInsert), queries(nQueries);
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        queries[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            queries[i][j] = gen.generate();
+    }
+
+    std::vector<std::vector<double> > initial(points.begin(), points.begin() + size);
+    ConcurrentKDTree kdTree(dim, initial, false, 50);
+
+    std::atomic<bool> done(false);
+    std::atomic<unsigned long> nSearches(0), nErrors(0);
+
+    // one thread inserts while the others search
+#pragma omp parallel default(shared) num_threads(4)
+    {
+        const int threadId = CURRENT_THREAD_NUM();
+        if(threadId == 0)
+        {
+            for(unsigned long i = size; i < points.size(); ++i)
+                kdTree.insert(points[i]);
+            done = true;
+        }
+        else
+        {
+            std::vector<unsigned long> indices;
+            std::vector<double> distances;
+            unsigned long q = threadId;
+            while(!done)
+            {
+                const std::vector<double>& p = queries[q++ % nQueries];
+                kdTree.findNearestNeighbors(p, k, &indices, &distances);
+                ++nSearches;
+
+                // the neighbors found must be consistent with the points, whichever tree was used
+                for(int i = 0; i < k; ++i)
+                {
+                    if(indices[i] >= points.size() || (i > 0 && distances[i] < distances[i - 1]))
+                    {
+                        ++nErrors;
+                        break;
+                    }
+
+                    double d = 0;
+                    for(int j = 0; j < dim; ++j)
+                        d += (p[j] - points[indices[i]][j]) * (p[j] - points[indices[i]][j]);
+                    if(!Math::areEqual(d, distances[i], 1e-10))
+                    {
+                        ++nErrors;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    output_screen1("Performed " << nSearches << " searches during the insertions." << std::endl);
+
+    res = 1;
+    expected = 1;
+    subTestName = "concurrent";
+
+    if(nErrors)
+    {
+        output_screen("FAIL! " << nErrors << " inconsistent searches out of " << nSearches << "." << std::endl);
+        res = 0;
+    }
+
+    // the delta buffer is merged every 50 insertions
+    if(kdTree.nElements() != points.size() || kdTree.nDelta() != nInsert % 50)
+    {
+        output_screen("FAIL! The tree has " << kdTree.nElements() << " elements (" << kdTree.nDelta() << " not merged), expected " << points.size() << "." << std::endl);
+        res = 0;
+    }
+
+    // all of the inserted points should be found, whether they are merged or not, so the results should be the same as for a regular tree
+    KDTree reference(dim, points);
+    std::vector<unsigned long> indices, expectedIndices;
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        kdTree.findNearestNeighbors(queries[i], k, &indices);
+        reference.findNearestNeighbors(queries[i], k, &expectedIndices);
+        if(indices != expectedIndices)
+        {
+            output_screen("FAIL! The neighbors of query " << i << " are wrong after the insertions." << std::endl);
+            res = 0;
+            break;
+        }
+    }
+
+    // the batch search goes through the points not merged yet as well, and returns their coordinates too
+    std::vector<unsigned long> batchIndices;
+    std::vector<double> batchDistances, batchNeighbors;
+    kdTree.findNearestNeighborsBatch(queries, k, &batchIndices, &batchDistances, &batchNeighbors);
+    for(unsigned long i = 0; i < nQueries; ++i)
+    {
+        reference.findNearestNeighbors(queries[i], k, &expectedIndices);
+        bool good = std::equal(expectedIndices.begin(), expectedIndices.end(), batchIndices.begin() + i * k);
+        for(int j = 0; good && j < k; ++j)
+            good = std::equal(points[expectedIndices[j]].begin(), points[expectedIndices[j]].end(), batchNeighbors.begin() + (i * k + j) * dim);
+
+        if(!good)
+        {
+            output_screen("FAIL! The batch search result for query " << i << " is wrong after the insertions." << std::endl);
+            res = 0;
+            break;
+        }
+    }
+
+    // the snapshot is reproducible, the padding at the end of each node (after the index, the children and the depth) is 0
+    std::ostringstream snapshot(std::ios::binary);
+    kdTree.writeSnapshot(snapshot);
+    const std::string bytes = snapshot.str();
+    unsigned long header[5];
+    std::memcpy(header, bytes.data(), sizeof(header));
+    const unsigned long nodeSize = 3 * sizeof(unsigned long) + 2 * sizeof(int);
+    const unsigned long nodesBegin = (5 + header[2]) * sizeof(unsigned long);
+    bool zeroPadding = (header[1] == points.size() && bytes.size() >= nodesBegin + header[1] * nodeSize);
+    for(unsigned long i = 0; zeroPadding && i < header[1]; ++i)
+    {
+        int padding;
+        std::memcpy(&padding, bytes.data() + nodesBegin + i * nodeSize + nodeSize - sizeof(int), sizeof(int));
+        zeroPadding = (padding == 0);
+    }
+
+    if(!zeroPadding)
+    {
+        output_screen("FAIL! The padding of the nodes in the snapshot is not 0." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestKDTree::runSubTest10(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(std::time(0), -1, 1);
+
+    const int dim = 4, k = 8;
+    const unsigned long size = 20000, nInsert = 1000, nQueries = 200;
+
+    // the points are rounded to single precision so that the brute force distances are the same as in the tree
+    std::vector<std::vector<double> > points(size + nInsert);
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        points[i].resize(dim);
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = float(gen.generate());
+    }
+
+    std::vector<std::vector<double> > initial(points.begin(), points.begin() + size);
+    KDTree kdTree(dim, initial, true);
+    for(unsigned long i = size; i < points.size(); ++i)
+        kdTree.insert(points[i]);
+
+    res = 1;
+    expected = 1;
+    subTestName = "single_precision";
+
+    if(!kdTree.singlePrecision())
+    {
+        output_screen("FAIL! The tree is not in single precision." << std::endl);
+        res = 0;
+    }
+
+    std::vector<double> p(dim), distances;
+    std::vector<unsigned long> indices;
+    std::vector<std::pair<double, unsigned long> > expectedNeighbors(points.size());
+    for(unsigned long q = 0; q < nQueries; ++q)
+    {
+        for(int j = 0; j < dim; ++j)
+            p[j] = gen.generate();
+
+        kdTree.findNearestNeighbors(p, k, &indices, &distances);
+
+        for(unsigned long i = 0; i < points.size(); ++i)
+        {
+            double d = 0;
+            for(int j = 0; j < dim; ++j)
+                d += (p[j] - points[i][j]) * (p[j] - points[i][j]);
+            expectedNeighbors[i] = std::make_pair(d, i);
+        }
+        std::partial_sort(expectedNeighbors.begin(), expectedNeighbors.begin() + k, expectedNeighbors.end());
+
+        for(int i = 0; i < k; ++i)
+        {
+            if(indices[i] != expectedNeighbors[i].second || !Math::areEqual(distances[i], expectedNeighbors[i].first, 1e-10))
+            {
+                output_screen("FAIL! Neighbor " << i << " of query " << q << " is " << indices[i] << " at " << distances[i] << ", expected " << expectedNeighbors[i].second << " at " << expectedNeighbors[i].first << "." << std::endl);
+                res = 0;
+            }
+        }
+    }
+}
+
 bool
 TestKDTree::test(int dim, unsigned long nPoints, int k, int seed)
 {
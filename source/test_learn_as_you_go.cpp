@@ -0,0 +1,991 @@
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <chrono>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <numerics.hpp>
+
+#include <random.hpp>
+#include <duration_histogram.hpp>
+#include <point_index.hpp>
+#include <pca_compressor.hpp>
+#include <learn_as_you_go.hpp>
+#include <test_learn_as_you_go.hpp>
+
+std::string
+TestLearnAsYouGo::name() const
+{
+    return std::string("LEARN AS YOU GO TESTER");
+}
+
+unsigned int
+TestLearnAsYouGo::numberOfSubtests() const
+{
+    return 7;
+}
+
+void
+TestLearnAsYouGo::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 7, "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        break;
+    case 1:
+        runSubTest1(res, expected, subTestName);
+        break;
+    case 2:
+        runSubTest2(res, expected, subTestName);
+        break;
+    case 3:
+        runSubTest3(res, expected, subTestName);
+        break;
+    case 4:
+        runSubTest4(res, expected, subTestName);
+        break;
+    case 5:
+        runSubTest5(res, expected, subTestName);
+        break;
+    case 6:
+        runSubTest6(res, expected, subTestName);
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
+
+void
+TestLearnAsYouGo::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(1234, -1, 1);
+
+    const int dim = 3;
+    const unsigned long n = 5000;
+
+    std::vector<std::vector<double> > points(n, std::vector<double>(dim));
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+            points[i][j] = gen.generate();
+    }
+
+    // the points are inserted one by one, so the table is rehashed several times
+    PointIndex index(points);
+    for(unsigned long i = 0; i < n; ++i)
+        index.insert(i);
+
+    res = 1;
+    expected = 1;
+    subTestName = "point_index";
+
+    if(index.size() != n)
+    {
+        output_screen("FAIL! The index has " << index.size() << " points, expected " << n << "." << std::endl);
+        res = 0;
+    }
+
+    // every point is found at its own position, also from a copy of it
+    unsigned long nWrong = 0;
+    for(unsigned long i = 0; i < n; ++i)
+    {
+        unsigned long pos;
+        const std::vector<double> p = points[i];
+        if(!index.find(p, &pos) || pos != i)
+            ++nWrong;
+    }
+    if(nWrong)
+    {
+        output_screen("FAIL! " << nWrong << " of the inserted points were not found at their positions." << std::endl);
+        res = 0;
+    }
+
+    // points that differ from an inserted one in the last bit of one coordinate are not found
+    unsigned long nFound = 0;
+    for(unsigned long i = 0; i < n; i += 10)
+    {
+        std::vector<double> p = points[i];
+        p[i % dim] = std::nextafter(p[i % dim], 2.0);
+        unsigned long pos;
+        if(index.find(p, &pos))
+            ++nFound;
+    }
+    if(nFound)
+    {
+        output_screen("FAIL! " << nFound << " points that were not inserted were found." << std::endl);
+        res = 0;
+    }
+
+    // 0 and -0 are the same point
+    points.push_back(std::vector<double>(dim, 0.0));
+    index.insert(n);
+    const std::vector<double> negativeZero(dim, -0.0);
+    unsigned long pos;
+    if(!index.find(negativeZero, &pos) || pos != n)
+    {
+        output_screen("FAIL! -0 should be found as 0." << std::endl);
+        res = 0;
+    }
+
+    // after clearing nothing is found, after resetting everything is found again
+    index.clear();
+    if(index.size() != 0 || index.find(points[0], &pos))
+    {
+        output_screen("FAIL! The cleared index should be empty." << std::endl);
+        res = 0;
+    }
+
+    index.reset();
+    if(index.size() != points.size() || !index.find(points[n / 2], &pos) || pos != n / 2)
+    {
+        output_screen("FAIL! The reset index should contain all of the points." << std::endl);
+        res = 0;
+    }
+}
+
+namespace
+{
+
+// a random vector of dimension n in the affine subspace spanned by the given directions around the mean
+void subspaceVector(const std::vector<double>& mean, const std::vector<std::vector<double> >& directions, Math::UniformRealGenerator& gen, std::vector<double>* v)
+{
+    *v = mean;
+    for(unsigned long k = 0; k < directions.size(); ++k)
+    {
+        const double a = gen.generate();
+        for(unsigned long j = 0; j < mean.size(); ++j)
+            (*v)[j] += a * directions[k][j];
+    }
+}
+
+// a smooth function whose output values lie in a 3 dimensional affine subspace, counting the calls
+class LearnAsYouGoTestFunc : public Math::RealFunctionMultiToMulti
+{
+public:
+    LearnAsYouGoTestFunc(int nOut) : nOut_(nOut), count_(0) {}
+
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        ++count_;
+        res->resize(nOut_);
+        for(int j = 0; j < nOut_; ++j)
+            (*res)[j] = (1 + j) * x[0] * x[0] + (j % 3) * x[1] + 0.1 * j;
+    }
+
+    unsigned long count() const { return count_; }
+
+private:
+    int nOut_;
+    mutable unsigned long count_;
+};
+
+class LearnAsYouGoTestErrorFunc : public Math::RealFunctionMultiDim
+{
+public:
+    virtual double evaluate(const std::vector<double>& v) const { return v[0]; }
+};
+
+// throws an exception of a type other than StandardException once it is armed, used to make the background update fail
+class LearnAsYouGoTestThrowingErrorFunc : public Math::RealFunctionMultiDim
+{
+public:
+    LearnAsYouGoTestThrowingErrorFunc() : armed_(false) {}
+
+    virtual double evaluate(const std::vector<double>& v) const
+    {
+        if(armed_)
+            throw std::runtime_error("error function armed");
+        return v[0];
+    }
+
+    void arm() { armed_ = true; }
+
+private:
+    bool armed_;
+};
+
+unsigned long fileSize(const char* fileName)
+{
+    std::ifstream in(fileName, std::ios::binary);
+    in.seekg(0, std::ios::end);
+    return (unsigned long) in.tellg();
+}
+
+double maxDifference(const std::vector<double>& a, const std::vector<double>& b)
+{
+    double res = 0;
+    for(unsigned long j = 0; j < a.size(); ++j)
+        res = std::max(res, std::abs(a[j] - b[j]));
+    return res;
+}
+
+} // namespace
+
+void
+TestLearnAsYouGo::runSubTest1(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(2345, -1, 1);
+
+    // vectors of 2000 values (like a Cl vector) lying exactly in a 10 dimensional affine subspace
+    const int n = 2000, nComponents = 10;
+
+    std::vector<double> mean(n);
+    std::vector<std::vector<double> > directions(nComponents, std::vector<double>(n));
+    for(int j = 0; j < n; ++j)
+    {
+        mean[j] = 100 * gen.generate();
+        for(int k = 0; k < nComponents; ++k)
+            directions[k][j] = gen.generate();
+    }
+
+    PCACompressor compressor(n, nComponents);
+    std::vector<double> v;
+    for(int i = 0; i < 200; ++i)
+    {
+        subspaceVector(mean, directions, gen, &v);
+        compressor.addSample(v);
+    }
+    compressor.updateBasis();
+
+    res = 1;
+    expected = 1;
+    subTestName = "pca_round_trip";
+
+    if(!compressor.ready() || compressor.nSamples() != 10 * nComponents)
+    {
+        output_screen("FAIL! The compressor should be ready with " << 10 * nComponents << " samples, has " << compressor.nSamples() << "." << std::endl);
+        res = 0;
+    }
+
+    if(!Math::areEqual(compressor.explainedVariance(), 1.0, 1e-8))
+    {
+        output_screen("FAIL! The explained variance is " << compressor.explainedVariance() << ", expected 1." << std::endl);
+        res = 0;
+    }
+
+    // new vectors from the same subspace survive the compression exactly
+    double maxDiff = 0;
+    std::vector<double> c, decompressed;
+    for(int i = 0; i < 100; ++i)
+    {
+        subspaceVector(mean, directions, gen, &v);
+        compressor.compress(v, &c);
+        compressor.decompress(c, &decompressed);
+        if(c.size() != nComponents || decompressed.size() != n)
+        {
+            output_screen("FAIL! The compressed vector has " << c.size() << " values and the decompressed one " << decompressed.size() << "." << std::endl);
+            res = 0;
+            return;
+        }
+        maxDiff = std::max(maxDiff, maxDifference(v, decompressed));
+    }
+
+    output_screen1("Maximum round trip difference: " << maxDiff << std::endl);
+    if(maxDiff > 1e-8)
+    {
+        output_screen("FAIL! The round trip changes the vectors by up to " << maxDiff << "." << std::endl);
+        res = 0;
+    }
+
+    // the basis written out and read back gives the same coefficients, a truncated basis is rejected
+    std::stringstream basis;
+    compressor.writeBasis(basis);
+    const std::string basisStr = basis.str();
+    if(basisStr.size() != compressor.basisSize())
+    {
+        output_screen("FAIL! The basis has " << basisStr.size() << " bytes, expected " << compressor.basisSize() << "." << std::endl);
+        res = 0;
+        return;
+    }
+
+    // the copy keeps the bytes aligned for reading the doubles
+    std::vector<double> aligned(basisStr.size() / sizeof(double));
+    std::memcpy(&(aligned[0]), basisStr.data(), basisStr.size());
+    PCACompressor other(n, nComponents);
+    other.readBasis(reinterpret_cast<const char*>(&(aligned[0])), basisStr.size());
+    std::vector<double> otherC;
+    other.compress(v, &otherC);
+    if(maxDifference(c, otherC) != 0)
+    {
+        output_screen("FAIL! The basis read back gives different coefficients." << std::endl);
+        res = 0;
+    }
+
+    bool thrown = false;
+    try
+    {
+        PCACompressor truncated(n, nComponents);
+        truncated.readBasis(reinterpret_cast<const char*>(&(aligned[0])), basisStr.size() - sizeof(double));
+    }
+    catch(StandardException& e)
+    {
+        thrown = true;
+    }
+    if(!thrown)
+    {
+        output_screen("FAIL! A truncated basis should throw an exception." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestLearnAsYouGo::runSubTest2(double& res, double& expected, std::string& subTestName)
+{
+    Math::UniformRealGenerator gen(3456, -1, 1);
+
+    const int n = 500, nComponents = 6;
+
+    std::vector<double> mean(n);
+    std::vector<std::vector<double> > directions(nComponents, std::vector<double>(n));
+    for(int j = 0; j < n; ++j)
+    {
+        mean[j] = gen.generate();
+        for(int k = 0; k < nComponents; ++k)
+            directions[k][j] = gen.generate();
+    }
+
+    // the first basis is calculated from only 3 samples, so it spans only 2 of the 6 directions
+    PCACompressor compressor(n, nComponents);
+    std::vector<double> v;
+    for(int i = 0; i < 3; ++i)
+    {
+        subspaceVector(mean, directions, gen, &v);
+        compressor.addSample(v);
+    }
+    compressor.updateBasis();
+
+    std::vector<std::vector<double> > tests(50);
+    for(unsigned long i = 0; i < tests.size(); ++i)
+        subspaceVector(mean, directions, gen, &(tests[i]));
+
+    std::vector<double> c, decompressed;
+    double before = 0;
+    for(unsigned long i = 0; i < tests.size(); ++i)
+    {
+        compressor.compress(tests[i], &c);
+        compressor.decompress(c, &decompressed);
+        before = std::max(before, maxDifference(tests[i], decompressed));
+    }
+
+    // after more samples come in, refreshing the basis makes the compression exact
+    for(int i = 0; i < 1000; ++i)
+    {
+        subspaceVector(mean, directions, gen, &v);
+        compressor.addSample(v);
+    }
+    compressor.updateBasis();
+
+    double after = 0;
+    for(unsigned long i = 0; i < tests.size(); ++i)
+    {
+        compressor.compress(tests[i], &c);
+        compressor.decompress(c, &decompressed);
+        after = std::max(after, maxDifference(tests[i], decompressed));
+    }
+
+    output_screen1("Maximum round trip difference before the refresh: " << before << ", after: " << after << std::endl);
+
+    res = 1;
+    expected = 1;
+    subTestName = "pca_basis_refresh";
+
+    if(before < 1e-3)
+    {
+        output_screen("FAIL! The basis from 3 samples should not be exact, the difference is " << before << "." << std::endl);
+        res = 0;
+    }
+
+    if(after > 1e-8)
+    {
+        output_screen("FAIL! The refreshed basis should be exact, the difference is " << after << "." << std::endl);
+        res = 0;
+    }
+
+    // a copy of the sample gives the same basis
+    PCACompressor copy(n, nComponents);
+    copy.copySample(compressor);
+    copy.updateBasis();
+    std::vector<double> copyC;
+    compressor.compress(tests[0], &c);
+    copy.compress(tests[0], &copyC);
+    if(copy.nSamples() != compressor.nSamples() || !Math::areEqual(copy.explainedVariance(), compressor.explainedVariance(), 1e-10))
+    {
+        output_screen("FAIL! The compressor with the copied sample is different." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestLearnAsYouGo::runSubTest3(double& res, double& expected, std::string& subTestName)
+{
+    res = 1;
+    expected = 1;
+    subTestName = "snapshot";
+
+    const char* fileName = "test_learn_as_you_go_snapshot.dat";
+    const std::string snapshotName = std::string(fileName) + ".snapshot";
+
+    // without and with the compression of the output values
+    const int nOuts[2] = {3, 20};
+    const int nComponents[2] = {0, 3};
+
+    for(int c = 0; c < 2; ++c)
+    {
+        std::remove(fileName);
+        std::remove(snapshotName.c_str());
+
+        Math::UniformRealGenerator gen(4567 + c, -1, 1);
+        LearnAsYouGoTestFunc f(nOuts[c]);
+        LearnAsYouGoTestErrorFunc errorFunc;
+
+        std::vector<std::vector<double> > training(4000, std::vector<double>(2)), queries(20, std::vector<double>(2));
+        for(unsigned long i = 0; i < training.size(); ++i)
+        {
+            training[i][0] = gen.generate();
+            training[i][1] = gen.generate();
+        }
+        for(unsigned long i = 0; i < queries.size(); ++i)
+        {
+            queries[i][0] = 0.9 * gen.generate();
+            queries[i][1] = 0.9 * gen.generate();
+        }
+
+        // the precision is so large that all of the approximations are accepted and the training set does not change
+        std::vector<std::vector<double> > results(queries.size());
+        std::vector<double> v;
+        {
+            LearnAsYouGo layg(2, nOuts[c], f, errorFunc, 2000, 1e10, fileName, false, nComponents[c]);
+            for(unsigned long i = 0; i < training.size(); ++i)
+                layg.evaluateExact(training[i], &v);
+            for(unsigned long i = 0; i < queries.size(); ++i)
+                layg.evaluate(queries[i], &(results[i]));
+        }
+
+        if(f.count() != training.size())
+        {
+            output_screen("FAIL! The function was called " << f.count() << " times, expected " << training.size() << "." << std::endl);
+            res = 0;
+        }
+
+        // the fast approximator read from the snapshot is the same, the one reconstructed from the file would have a different test set and linear transformation
+        {
+            LearnAsYouGo layg(2, nOuts[c], f, errorFunc, 2000, 1e10, fileName, false, nComponents[c]);
+            for(unsigned long i = 0; i < queries.size(); ++i)
+            {
+                layg.evaluate(queries[i], &v);
+                if(v != results[i])
+                {
+                    output_screen("FAIL! The approximation from the snapshot differs for query " << i << " with " << nComponents[c] << " components." << std::endl);
+                    res = 0;
+                    break;
+                }
+            }
+
+            // the training points are found with their exact values
+            std::vector<double> exact;
+            for(unsigned long i = 0; i < training.size(); i += 10)
+            {
+                layg.evaluate(training[i], &v);
+                f.evaluate(training[i], &exact);
+                if(v != exact)
+                {
+                    output_screen("FAIL! The training point " << i << " does not have its exact value after reading the snapshot." << std::endl);
+                    res = 0;
+                    break;
+                }
+            }
+        }
+
+        // a truncated snapshot is not used, the training set is read from the file instead
+        {
+            std::ifstream in(snapshotName.c_str(), std::ios::binary);
+            std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            in.close();
+
+            std::ofstream out(snapshotName.c_str(), std::ios::binary);
+            out.write(contents.data(), contents.size() / 2);
+            out.close();
+        }
+        {
+            const unsigned long count = f.count();
+            LearnAsYouGo layg(2, nOuts[c], f, errorFunc, 2000, 1e10, fileName, false, nComponents[c]);
+            layg.evaluate(training[0], &v);
+            for(unsigned long i = 0; i < queries.size(); ++i)
+                layg.evaluate(queries[i], &v);
+
+            // the training point is found and the queries are approximated, so the function is not called
+            if(f.count() != count)
+            {
+                output_screen("FAIL! The training set was not recovered from the file when the snapshot is truncated, the function was called " << f.count() - count << " times." << std::endl);
+                res = 0;
+            }
+        }
+    }
+
+    std::remove(fileName);
+    std::remove(snapshotName.c_str());
+}
+
+void
+TestLearnAsYouGo::runSubTest4(double& res, double& expected, std::string& subTestName)
+{
+    res = 1;
+    expected = 1;
+    subTestName = "crash_recovery";
+
+    const char* fileName = "test_learn_as_you_go_recovery.dat";
+    std::remove(fileName);
+
+    const int nOut = 3;
+    const unsigned long minCount = 1000;
+    const double precision = 0.1;
+    LearnAsYouGoTestFunc f(nOut);
+    LearnAsYouGoTestErrorFunc errorFunc;
+
+    // fewer points than minCount, so only the training set file is written
+    Math::UniformRealGenerator gen(5678, -1, 1);
+    std::vector<std::vector<double> > training(300, std::vector<double>(2));
+    for(unsigned long i = 0; i < training.size(); ++i)
+    {
+        training[i][0] = gen.generate();
+        training[i][1] = gen.generate();
+    }
+
+    // the header is the magic number, the numbers of inputs and outputs, the precision and minCount, each record has the values and the checksum
+    const unsigned long headerSize = sizeof(unsigned long) + 2 * sizeof(int) + sizeof(double) + sizeof(unsigned long);
+    const unsigned long recordSize = (2 + nOut) * sizeof(double) + sizeof(unsigned long);
+
+    std::vector<double> v;
+    {
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, precision, fileName);
+        for(unsigned long i = 0; i < training.size(); ++i)
+            layg.evaluate(training[i], &v);
+    }
+
+    if(fileSize(fileName) != headerSize + training.size() * recordSize)
+    {
+        output_screen("FAIL! The file has " << fileSize(fileName) << " bytes, expected " << headerSize + training.size() * recordSize << "." << std::endl);
+        res = 0;
+        std::remove(fileName);
+        return;
+    }
+
+    std::string contents;
+    {
+        std::ifstream in(fileName, std::ios::binary);
+        contents.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    // a crash in the middle of the last append leaves a partial record, the valid prefix is read and the file is compacted to it
+    {
+        std::ofstream out(fileName, std::ios::binary);
+        out.write(contents.data(), contents.size() - recordSize / 2);
+    }
+    {
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, precision, fileName);
+    }
+    if(fileSize(fileName) != headerSize + (training.size() - 1) * recordSize)
+    {
+        output_screen("FAIL! The file with a partial record was compacted to " << fileSize(fileName) << " bytes, expected " << headerSize + (training.size() - 1) * recordSize << "." << std::endl);
+        res = 0;
+    }
+
+    // a damaged last record fails the checksum and is dropped the same way
+    {
+        std::fstream io(fileName, std::ios::binary | std::ios::in | std::ios::out);
+        io.seekp(headerSize + (training.size() - 2) * recordSize + sizeof(double));
+        const char garbage[4] = {'\x13', '\x57', '\x9b', '\xdf'};
+        io.write(garbage, sizeof(garbage));
+    }
+    {
+        const unsigned long count = f.count();
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, precision, fileName);
+        for(unsigned long i = 0; i < training.size(); ++i)
+            layg.evaluate(training[i], &v);
+
+        // only the two lost points are recalculated
+        if(f.count() != count + 2)
+        {
+            output_screen("FAIL! After the recovery the function was called " << f.count() - count << " times, expected 2." << std::endl);
+            res = 0;
+        }
+    }
+    if(fileSize(fileName) != contents.size())
+    {
+        output_screen("FAIL! The recovered file has " << fileSize(fileName) << " bytes, expected " << contents.size() << "." << std::endl);
+        res = 0;
+    }
+
+    // a file in the format without the magic number and the checksums is read and converted
+    {
+        std::ofstream out(fileName, std::ios::binary);
+        const int nIn = 2;
+        const unsigned long dataSize = training.size();
+        out.write((const char*)(&nIn), sizeof(nIn));
+        out.write((const char*)(&nOut), sizeof(nOut));
+        out.write((const char*)(&precision), sizeof(precision));
+        out.write((const char*)(&minCount), sizeof(minCount));
+        out.write((const char*)(&dataSize), sizeof(dataSize));
+
+        std::vector<double> exact;
+        for(unsigned long i = 0; i < training.size(); ++i)
+        {
+            f.evaluate(training[i], &exact);
+            out.write((const char*)(&(training[i][0])), 2 * sizeof(double));
+            out.write((const char*)(&(exact[0])), nOut * sizeof(double));
+        }
+    }
+    {
+        const unsigned long count = f.count();
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, precision, fileName);
+        for(unsigned long i = 0; i < training.size(); ++i)
+            layg.evaluate(training[i], &v);
+
+        if(f.count() != count)
+        {
+            output_screen("FAIL! The function was called " << f.count() - count << " times with the training set from the old format file." << std::endl);
+            res = 0;
+        }
+    }
+    {
+        std::ifstream in(fileName, std::ios::binary);
+        const std::string converted((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if(converted != contents)
+        {
+            output_screen("FAIL! The old format file was not converted to the same contents as the one written directly." << std::endl);
+            res = 0;
+        }
+    }
+
+    // if the file cannot be written at the end (here it is replaced by a directory) the destructor reports the error instead of throwing
+    std::remove(fileName);
+    {
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, precision, fileName);
+        for(unsigned long i = 0; i < 10; ++i)
+            layg.evaluate(training[i], &v);
+
+        std::remove(fileName);
+        mkdir(fileName, S_IRWXU);
+    }
+    rmdir(fileName);
+
+    std::remove(fileName);
+}
+
+void
+TestLearnAsYouGo::runSubTest5(double& res, double& expected, std::string& subTestName)
+{
+    res = 1;
+    expected = 1;
+    subTestName = "async_update";
+
+    Math::UniformRealGenerator gen(6789, -1, 1);
+    std::vector<std::vector<double> > training(3000, std::vector<double>(2)), queries(50, std::vector<double>(2));
+    for(unsigned long i = 0; i < training.size(); ++i)
+    {
+        training[i][0] = gen.generate();
+        training[i][1] = gen.generate();
+    }
+    for(unsigned long i = 0; i < queries.size(); ++i)
+    {
+        queries[i][0] = 0.9 * gen.generate();
+        queries[i][1] = 0.9 * gen.generate();
+    }
+
+    const int nOut = 3;
+    const unsigned long minCount = 2000;
+    std::vector<double> v, exact;
+
+    // the fast approximator is constructed with 2000 points, the background update starts at 2500, and the rest of the points are added while it runs
+    {
+        LearnAsYouGoTestFunc f(nOut);
+        LearnAsYouGoTestErrorFunc errorFunc;
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, 1e10);
+        layg.setAsyncUpdate(true);
+        layg.setTelemetry(true);
+
+        for(unsigned long i = 0; i < training.size(); ++i)
+            layg.evaluateExact(training[i], &v);
+
+        // the results of the update are swapped in by evaluate once the worker is done
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while(layg.getTelemetry().retrains().size() < 2 && std::chrono::steady_clock::now() - start < std::chrono::seconds(60))
+        {
+            layg.evaluate(queries[0], &v);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        const std::vector<LearnAsYouGoTelemetry::Retrain>& retrains = layg.getTelemetry().retrains();
+        if(retrains.size() != 2 || retrains[0].background || !retrains[1].background || retrains[1].size != 2500)
+        {
+            output_screen("FAIL! Expected a synchronous update with 2000 points followed by a background one with 2500, got " << retrains.size() << " updates." << std::endl);
+            res = 0;
+        }
+
+        // the points added during the update are carried over
+        const unsigned long count = f.count();
+        for(unsigned long i = 0; i < training.size(); ++i)
+        {
+            layg.evaluate(training[i], &v);
+            f.evaluate(training[i], &exact);
+            if(v != exact)
+            {
+                output_screen("FAIL! The training point " << i << " does not have its exact value after the swap." << std::endl);
+                res = 0;
+                break;
+            }
+        }
+        if(layg.getTotalCount() - layg.getSuccessfulCount() < training.size())
+        {
+            output_screen("FAIL! Some of the training points were not found after the swap." << std::endl);
+            res = 0;
+        }
+
+        double maxDiff = 0;
+        for(unsigned long i = 0; i < queries.size(); ++i)
+        {
+            layg.evaluate(queries[i], &v);
+            f.evaluate(queries[i], &exact);
+            maxDiff = std::max(maxDiff, maxDifference(v, exact));
+        }
+        output_screen1("Maximum approximation error after the swap: " << maxDiff << std::endl);
+        if(maxDiff > 1e-2)
+        {
+            output_screen("FAIL! The approximation after the swap is off by " << maxDiff << "." << std::endl);
+            res = 0;
+        }
+
+        // the calls above were the checks themselves, the object did not call the function
+        if(f.count() != count + training.size() + queries.size())
+        {
+            output_screen("FAIL! The function was called " << f.count() - count - training.size() - queries.size() << " times after the swap." << std::endl);
+            res = 0;
+        }
+    }
+
+    // an exception of any type thrown in the background is rethrown by evaluate
+    {
+        LearnAsYouGoTestFunc f(nOut);
+        LearnAsYouGoTestThrowingErrorFunc errorFunc;
+        LearnAsYouGo layg(2, nOut, f, errorFunc, minCount, 1e10);
+        layg.setAsyncUpdate(true);
+
+        for(unsigned long i = 0; i < minCount; ++i)
+            layg.evaluateExact(training[i], &v);
+
+        errorFunc.arm();
+        for(unsigned long i = minCount; i < training.size(); ++i)
+            layg.evaluateExact(training[i], &v);
+
+        bool thrown = false;
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while(!thrown && std::chrono::steady_clock::now() - start < std::chrono::seconds(60))
+        {
+            try
+            {
+                layg.evaluate(queries[0], &v);
+            }
+            catch(std::runtime_error& e)
+            {
+                thrown = true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        if(!thrown)
+        {
+            output_screen("FAIL! The exception of the background update was not rethrown." << std::endl);
+            res = 0;
+        }
+    }
+}
+
+void
+TestLearnAsYouGo::runSubTest6(double& res, double& expected, std::string& subTestName)
+{
+    res = 1;
+    expected = 1;
+    subTestName = "telemetry";
+
+    DurationHistogram empty;
+    if(empty.count() != 0 || empty.quantile(0.5) != 0 || empty.min() != 0 || empty.max() != 0)
+    {
+        output_screen("FAIL! The empty histogram should have zero statistics." << std::endl);
+        res = 0;
+    }
+
+    // each duration lands in the bin whose edges contain it, the ones out of range land in the first and the last bins
+    const double durations[] = {2e-7, 1e-6, 3.3e-5, 1e-3, 0.27, 1, 42};
+    for(unsigned long k = 0; k < sizeof(durations) / sizeof(double); ++k)
+    {
+        DurationHistogram h;
+        h.add(durations[k]);
+
+        int bin = -1;
+        for(int i = 0; i < h.nBins(); ++i)
+        {
+            if(h.binCount(i))
+                bin = i;
+        }
+
+        if(bin < 0 || h.binLower(bin) > durations[k] || (bin < h.nBins() - 1 && h.binLower(bin + 1) <= durations[k]))
+        {
+            output_screen("FAIL! The duration " << durations[k] << " is in the bin " << bin << "." << std::endl);
+            res = 0;
+        }
+    }
+
+    DurationHistogram outOfRange;
+    outOfRange.add(-1);
+    outOfRange.add(1e-9);
+    outOfRange.add(1e6);
+    if(outOfRange.binCount(0) != 2 || outOfRange.binCount(outOfRange.nBins() - 1) != 1)
+    {
+        output_screen("FAIL! The durations out of range are not in the first and the last bins." << std::endl);
+        res = 0;
+    }
+
+    // 0.1 ms to 10 ms in steps of 0.1 ms, the quantiles are exact up to the accuracy of the bins
+    DurationHistogram h, first, second;
+    for(int i = 1; i <= 100; ++i)
+    {
+        h.add(i * 1e-4);
+        (i <= 50 ? first : second).add(i * 1e-4);
+    }
+
+    if(h.count() != 100 || !Math::areEqual(h.total(), 0.505, 1e-10) || !Math::areEqual(h.mean(), 5.05e-3, 1e-10) || h.min() != 1e-4 || h.max() != 1e-2)
+    {
+        output_screen("FAIL! The statistics are count " << h.count() << ", total " << h.total() << ", mean " << h.mean() << ", min " << h.min() << ", max " << h.max() << "." << std::endl);
+        res = 0;
+    }
+
+    const double q[4] = {0.5, 0.9, 0.99, 1};
+    const double exactQ[4] = {5e-3, 9e-3, 9.9e-3, 1e-2};
+    for(int i = 0; i < 4; ++i)
+    {
+        const double estimate = h.quantile(q[i]);
+        output_screen1("Quantile " << q[i] << ": " << estimate << ", exact " << exactQ[i] << std::endl);
+        if(std::abs(estimate / exactQ[i] - 1) > 0.2)
+        {
+            output_screen("FAIL! The quantile " << q[i] << " is estimated as " << estimate << ", expected " << exactQ[i] << "." << std::endl);
+            res = 0;
+        }
+    }
+
+    first.merge(second);
+    bool sameBins = true;
+    for(int i = 0; i < h.nBins(); ++i)
+        sameBins = sameBins && (first.binCount(i) == h.binCount(i));
+    if(!sameBins || first.count() != h.count() || first.min() != h.min() || first.max() != h.max() || first.quantile(0.9) != h.quantile(0.9))
+    {
+        output_screen("FAIL! The merged histogram is different from the one with all of the durations." << std::endl);
+        res = 0;
+    }
+
+    // the output files of a run with 50 exact calls and 10 repeated ones
+    const int nOut = 3;
+    LearnAsYouGoTestFunc f(nOut);
+    LearnAsYouGoTestErrorFunc errorFunc;
+    LearnAsYouGo layg(2, nOut, f, errorFunc, 1000, 0.1);
+    layg.setTelemetry(true);
+
+    Math::UniformRealGenerator gen(8901, -1, 1);
+    std::vector<std::vector<double> > points(50, std::vector<double>(2));
+    std::vector<double> v;
+    for(unsigned long i = 0; i < points.size(); ++i)
+    {
+        points[i][0] = gen.generate();
+        points[i][1] = gen.generate();
+        layg.evaluate(points[i], &v);
+    }
+    for(unsigned long i = 0; i < 10; ++i)
+        layg.evaluate(points[i], &v);
+
+    const char* fileNameBase = "test_learn_as_you_go_telemetry";
+    const std::string csvName = std::string(fileNameBase) + ".csv", jsonName = std::string(fileNameBase) + ".json";
+    layg.writeTelemetry(fileNameBase);
+
+    std::vector<std::string> lines;
+    {
+        std::ifstream in(csvName.c_str());
+        std::string line;
+        while(std::getline(in, line))
+            lines.push_back(line);
+    }
+
+    // the summary of the timings, the sizes of the training set and the updates, separated by empty lines
+    const int nEmpty = std::count(lines.begin(), lines.end(), std::string());
+    if(lines.size() < 2 + LearnAsYouGoTelemetry::TIMING_MAX || lines[0] != "timing,count,total,mean,min,p50,p90,p99,max" || lines[1].find("exact,50,") != 0 || lines[2].find("repeated,10,") != 0 || nEmpty != 2)
+    {
+        output_screen("FAIL! The CSV file " << csvName << " has unexpected contents." << std::endl);
+        res = 0;
+    }
+    else
+    {
+        // the sizes table has a sample for every 1% growth of the training set, the last one is the full size
+        const unsigned long sizesEnd = std::find(lines.begin() + LearnAsYouGoTelemetry::TIMING_MAX + 3, lines.end(), std::string()) - lines.begin();
+        if(lines[LearnAsYouGoTelemetry::TIMING_MAX + 2] != "time,calls,training_size" || lines[sizesEnd - 1].find(",50,50") == std::string::npos || lines[sizesEnd + 1] != "retrain_time,training_size,duration,background" || sizesEnd + 2 != lines.size())
+        {
+            output_screen("FAIL! The sizes or the updates in the CSV file " << csvName << " are wrong." << std::endl);
+            res = 0;
+        }
+    }
+
+    std::string json;
+    {
+        std::ifstream in(jsonName.c_str());
+        json.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    }
+
+    // the brackets are balanced and the counts of the bins add up to the number of calls
+    int depth = 0;
+    bool balanced = true;
+    for(unsigned long i = 0; i < json.size(); ++i)
+    {
+        if(json[i] == '{' || json[i] == '[')
+            ++depth;
+        if(json[i] == '}' || json[i] == ']')
+            --depth;
+        balanced = balanced && (depth >= 0);
+    }
+
+    unsigned long binsTotal = 0;
+    const std::string exactKey = "\"exact\": {\"count\": 50,";
+    const unsigned long exactPos = json.find(exactKey);
+    if(exactPos != std::string::npos)
+    {
+        const unsigned long binsBegin = json.find("\"bins\": [", exactPos);
+        const unsigned long binsEnd = json.find("]]", binsBegin);
+        std::stringstream bins(json.substr(binsBegin + 9, binsEnd - binsBegin - 8));
+        char c;
+        double lower;
+        unsigned long count;
+        while(bins >> c >> lower >> c >> count >> c)
+        {
+            binsTotal += count;
+            bins >> c;
+        }
+    }
+
+    if(!balanced || depth != 0 || json.empty() || json[0] != '{' || exactPos == std::string::npos || json.find("\"repeated\": {\"count\": 10,") == std::string::npos || json.find("\"retrains\": []") == std::string::npos || binsTotal != 50)
+    {
+        output_screen("FAIL! The JSON file " << jsonName << " has unexpected contents." << std::endl);
+        res = 0;
+    }
+
+    std::remove(csvName.c_str());
+    std::remove(jsonName.c_str());
+}
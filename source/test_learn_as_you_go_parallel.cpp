@@ -0,0 +1,149 @@
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <macros.hpp>
+#include <exception_handler.hpp>
+#include <cosmo_mpi.hpp>
+#include <random.hpp>
+#include <learn_as_you_go.hpp>
+#include <test_learn_as_you_go_parallel.hpp>
+
+std::string
+TestLearnAsYouGoParallel::name() const
+{
+    return std::string("LEARN AS YOU GO PARALLEL TESTER");
+}
+
+unsigned int
+TestLearnAsYouGoParallel::numberOfSubtests() const
+{
+    return 1;
+}
+
+void
+TestLearnAsYouGoParallel::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 1, "invalid index " << i);
+
+    switch(i)
+    {
+    case 0:
+        runSubTest0(res, expected, subTestName);
+        break;
+    default:
+        check(false, "");
+        break;
+    }
+}
+
+namespace
+{
+
+// counts the calls
+class LearnAsYouGoParallelTestFunc : public Math::RealFunctionMultiToMulti
+{
+public:
+    LearnAsYouGoParallelTestFunc() : count_(0) {}
+
+    virtual void evaluate(const std::vector<double>& x, std::vector<double>* res) const
+    {
+        ++count_;
+        res->resize(3);
+        for(int j = 0; j < 3; ++j)
+            (*res)[j] = (1 + j) * x[0] * x[0] + j * x[1];
+    }
+
+    unsigned long count() const { return count_; }
+
+private:
+    mutable unsigned long count_;
+};
+
+class LearnAsYouGoParallelTestErrorFunc : public Math::RealFunctionMultiDim
+{
+public:
+    virtual double evaluate(const std::vector<double>& v) const { return v[0]; }
+};
+
+} // namespace
+
+void
+TestLearnAsYouGoParallel::runSubTest0(double& res, double& expected, std::string& subTestName)
+{
+    res = 1;
+    expected = 1;
+    subTestName = "collective";
+
+    const int nProcesses = CosmoMPI::create().numProcesses();
+    const int processId = CosmoMPI::create().processId();
+
+    const char* fileName = "test_learn_as_you_go_collective.dat";
+    const std::string snapshotName = std::string(fileName) + ".snapshot";
+    if(processId == 0)
+    {
+        std::remove(fileName);
+        std::remove(snapshotName.c_str());
+    }
+    CosmoMPI::create().barrier();
+
+    // all of the processes generate the same points and each one evaluates its share
+    Math::UniformRealGenerator gen(7890, -1, 1);
+    std::vector<std::vector<double> > training(3000, std::vector<double>(2));
+    for(unsigned long i = 0; i < training.size(); ++i)
+    {
+        training[i][0] = gen.generate();
+        training[i][1] = gen.generate();
+    }
+
+    const unsigned long minCount = 2000;
+    std::vector<double> v;
+
+    // evaluateExact does not take part in the exchange, so all of the points are exchanged in the destructor
+    // with more than one process none of them has minCount points before that, and the fast approximator must not be constructed during the shutdown
+    {
+        LearnAsYouGoParallelTestFunc f;
+        LearnAsYouGoParallelTestErrorFunc errorFunc;
+        LearnAsYouGo layg(2, 3, f, errorFunc, minCount, 1e10, fileName);
+        layg.setCommunicationMode(LearnAsYouGo::COLLECTIVE);
+
+        for(unsigned long i = processId; i < training.size(); i += nProcesses)
+            layg.evaluateExact(training[i], &v);
+    }
+    CosmoMPI::create().barrier();
+
+    if(nProcesses > 1)
+    {
+        std::ifstream snapshot(snapshotName.c_str());
+        if(snapshot)
+        {
+            output_screen("FAIL! The fast approximator was constructed during the shutdown." << std::endl);
+            res = 0;
+        }
+    }
+
+    // the points of all of the processes have been written into the file
+    {
+        LearnAsYouGoParallelTestFunc f;
+        LearnAsYouGoParallelTestErrorFunc errorFunc;
+        LearnAsYouGo layg(2, 3, f, errorFunc, minCount, 1e10, fileName);
+        layg.setCommunicationMode(LearnAsYouGo::COLLECTIVE);
+
+        for(unsigned long i = 0; i < training.size(); ++i)
+            layg.evaluate(training[i], &v);
+
+        if(f.count() != 0)
+        {
+            output_screen("FAIL! The function was called " << f.count() << " times, all of the training points should have been read from the file." << std::endl);
+            res = 0;
+        }
+    }
+    CosmoMPI::create().barrier();
+
+    if(processId == 0)
+    {
+        std::remove(fileName);
+        std::remove(snapshotName.c_str());
+    }
+}
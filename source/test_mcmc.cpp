@@ -1,9 +1,15 @@
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
 
 #include <test_mcmc.hpp>
 #include <mcmc.hpp>
 #include <markov_chain.hpp>
+#include <binary_chain.hpp>
+#include <cosmo_mpi.hpp>
 #include <numerics.hpp>
 
 std::string
@@ -15,7 +21,7 @@ TestMCMCFast::name() const
 unsigned int
 TestMCMCFast::numberOfSubtests() const
 {
-    return 1;
+    return 8;
 }
 
 class MCMCFastTestLikelihood : public Math::LikelihoodFunction
@@ -42,19 +48,102 @@ private:
     const double x0_, y0_, sigmaX_, sigmaY_;
 };
 
+// the approximate likelihood is biased, the exact one is the same as MCMCFastTestLikelihood
+class MCMCApproximateTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    MCMCApproximateTestLikelihood(double x0 = 0, double y0 = 0, double sigmaX = 1, double sigmaY = 1) : exact_(x0, y0, sigmaX, sigmaY), approx_(x0 + 0.5 * sigmaX, y0 - 0.3 * sigmaY, 1.3 * sigmaX, 0.8 * sigmaY)
+    {
+    }
+
+    ~MCMCApproximateTestLikelihood() {}
+
+    virtual double calculate(double* params, int nParams) { return approx_.calculate(params, nParams); }
+    virtual double calculateExact(double* params, int nParams) { return exact_.calculate(params, nParams); }
+
+private:
+    MCMCFastTestLikelihood exact_, approx_;
+};
+
+// a 2 dimensional Gaussian with unit variances and correlation rho
+class MCMCCorrelatedTestLikelihood : public Math::LikelihoodFunction
+{
+public:
+    MCMCCorrelatedTestLikelihood(double rho) : rho_(rho)
+    {
+        check(rho > -1 && rho < 1, "");
+    }
+
+    ~MCMCCorrelatedTestLikelihood() {}
+
+    virtual double calculate(double* params, int nParams)
+    {
+        check(nParams == 2, "");
+        const double x = params[0], y = params[1];
+
+        return (x * x - 2 * rho_ * x * y + y * y) / (1 - rho_ * rho_);
+    }
+
+private:
+    const double rho_;
+};
 
 void
 TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
 {
-    check(i >= 0 && i < 1, "invalid index " << i);
+    check(i >= 0 && i < 8, "invalid index " << i);
+
+    switch(i)
+    {
+    case 5:
+        runBinaryConvertSubTest(res, expected, subTestName);
+        break;
+    case 6:
+        runResumeSubTest(res, expected, subTestName);
+        break;
+    case 7:
+        runDraggingSubTest(res, expected, subTestName);
+        break;
+    default:
+        runGaussSubTest(i, res, expected, subTestName);
+        break;
+    }
+}
+
+namespace
+{
+
+// the name of the chain file of the master process
+std::string chainFileName(const std::string& root, int nChains, const char* extension)
+{
+    std::stringstream fileName;
+    fileName << root;
+    if(nChains > 1)
+        fileName << "_0";
+    fileName << extension;
+    return fileName.str();
+}
+
+std::string readWholeFile(const std::string& fileName)
+{
+    std::ifstream in(fileName.c_str(), std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+} // namespace
+
+void
+TestMCMCFast::runGaussSubTest(unsigned int i, double& res, double& expected, std::string& subTestName)
+{
+    check(i >= 0 && i < 5, "invalid index " << i);
     
     using namespace Math;
 
     MCMCFastTestLikelihood l1(5, -4, 2, 3);
-    MCMCFastTestLikelihood l2(5, -4, 2, 3);
+    MCMCApproximateTestLikelihood l2(5, -4, 2, 3);
     std::stringstream root1;
     root1 << "test_files/mcmc_fast_test_" << i;
-    MetropolisHastings mh1(2, l1, root1.str());
+    MetropolisHastings mh1(2, (i == 3 ? static_cast<LikelihoodFunction&>(l2) : static_cast<LikelihoodFunction&>(l1)), root1.str());
 
     const double xMin = -20, xMax = 20, yMin = -20, yMax = 20;
     mh1.setParam(0, "x", xMin, xMax, 0, 2, 0.5, 0.1);
@@ -62,9 +151,25 @@ TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::str
     const unsigned long burnin = 100;
     const unsigned int thin = 2;
 
+    if(i == 1)
+        mh1.setChainFormat(MetropolisHastings::BINARY_CHAIN, 1000);
+    if(i == 2)
+        mh1.setAsyncOutput(true);
+    if(i == 3)
+        mh1.setDelayedAcceptance(true);
+    if(i == 4)
+    {
+        // x is slow and y is fast
+        std::vector<int> speeds(2);
+        speeds[0] = 1;
+        speeds[1] = 5;
+        mh1.setBlockSpeeds(speeds, 3);
+    }
+
     const int nChains = mh1.run(1000000, 0, burnin, MetropolisHastings::GELMAN_RUBIN, 0.001, true);
 
-    subTestName = std::string("2_param_gauss");
+    const char* subTestNames[] = {"2_param_gauss", "2_param_gauss_binary", "2_param_gauss_async", "2_param_gauss_delayed_acceptance", "2_param_gauss_fast_slow"};
+    subTestName = std::string(subTestNames[i]);
 
     res = 1;
     expected = 1;
@@ -147,3 +252,226 @@ TestMCMCFast::runSubTest(unsigned int i, double& res, double& expected, std::str
         res = 0;
     }
 }
+
+void
+TestMCMCFast::runBinaryConvertSubTest(double& res, double& expected, std::string& subTestName)
+{
+    using namespace Math;
+
+    subTestName = "binary_convert";
+    res = 1;
+    expected = 1;
+
+    // the same seed in the text and the binary formats, the accuracies are never reached so that the chains have the full length
+    const std::string textRoot = "test_files/mcmc_fast_test_convert_text", binaryRoot = "test_files/mcmc_fast_test_convert_binary";
+    const unsigned long length = 2000;
+
+    // a text chain left from an earlier run next to the binary one
+    const int nProcesses = CosmoMPI::create().numProcesses();
+    const std::string staleName = chainFileName(binaryRoot, nProcesses, ".txt");
+    if(isMaster())
+    {
+        std::ofstream stale(staleName.c_str());
+        stale << "1   1   1   1" << std::endl;
+    }
+    CosmoMPI::create().barrier();
+
+    MCMCFastTestLikelihood like(5, -4, 2, 3);
+    int nChains = 1;
+    for(int k = 0; k < 2; ++k)
+    {
+        MetropolisHastings mh(2, like, (k == 0 ? textRoot : binaryRoot), 1234);
+        mh.setParam(0, "x", -20, 20, 0, 2, 0.5, 1e-10);
+        mh.setParam(1, "y", -20, 20, 0, 2, 0.5, 1e-10);
+        if(k == 1)
+            mh.setChainFormat(MetropolisHastings::BINARY_CHAIN, 100);
+        nChains = mh.run(length, 0, 0, MetropolisHastings::ACCURACY, 0.01, false);
+    }
+
+    if(!isMaster())
+        return;
+
+    const std::string textName = chainFileName(textRoot, nChains, ".txt"), binaryName = chainFileName(binaryRoot, nChains, ".bin"), convertedName = chainFileName(binaryRoot, nChains, "_converted.txt");
+
+    if(std::ifstream(staleName.c_str()))
+    {
+        output_screen("FAIL: The text chain " << staleName << " left from an earlier run was not removed." << std::endl);
+        res = 0;
+    }
+
+    BinaryChainWriter::convertToText(binaryName.c_str(), convertedName.c_str());
+
+    const std::string text = readWholeFile(textName), converted = readWholeFile(convertedName);
+    const unsigned long nLines = std::count(text.begin(), text.end(), '\n');
+    if(nLines != length)
+    {
+        output_screen("FAIL: The text chain has " << nLines << " elements, expected " << length << "." << std::endl);
+        res = 0;
+    }
+
+    if(converted != text)
+    {
+        output_screen("FAIL: The converted binary chain " << convertedName << " is different from the text chain " << textName << "." << std::endl);
+        res = 0;
+    }
+
+    std::remove(convertedName.c_str());
+}
+
+void
+TestMCMCFast::runResumeSubTest(double& res, double& expected, std::string& subTestName)
+{
+    using namespace Math;
+
+    subTestName = "resume";
+    res = 1;
+    expected = 1;
+
+    const std::string root = "test_files/mcmc_fast_test_resume";
+    const unsigned long length = 2000;
+    const int resumeEvery = 300;
+
+    // each process starts from scratch
+    const int nProcesses = CosmoMPI::create().numProcesses(), processId = CosmoMPI::create().processId();
+    std::stringstream resumeName;
+    resumeName << root << "resume";
+    if(nProcesses > 1)
+        resumeName << '_' << processId;
+    resumeName << ".dat";
+    std::remove(resumeName.str().c_str());
+
+    // the first run goes to the end, the last resume information is written at 1800 elements
+    // the second run then resumes from there as after a crash, dropping the 200 elements after the checkpoint and generating them again
+    MCMCFastTestLikelihood like(5, -4, 2, 3);
+    int nChains = 1;
+    std::string firstRun;
+    for(int k = 0; k < 2; ++k)
+    {
+        MetropolisHastings mh(2, like, root, 4321 + k);
+        mh.setParam(0, "x", -20, 20, 0, 2, 0.5, 1e-10);
+        mh.setParam(1, "y", -20, 20, 0, 2, 0.5, 1e-10);
+        mh.setChainFormat(MetropolisHastings::BINARY_CHAIN, 100);
+        nChains = mh.run(length, resumeEvery, 0, MetropolisHastings::ACCURACY, 0.01, false);
+
+        if(k == 0 && isMaster())
+            firstRun = readWholeFile(chainFileName(root, nChains, ".bin"));
+    }
+
+    std::remove(resumeName.str().c_str());
+
+    if(!isMaster())
+        return;
+
+    const std::string binaryName = chainFileName(root, nChains, ".bin");
+    const std::string secondRun = readWholeFile(binaryName);
+
+    unsigned long headerSize, elements = 0;
+    {
+        BinaryChainReader reader(binaryName.c_str());
+        headerSize = reader.headerSize();
+        double prob, l;
+        std::vector<double> params;
+        while(reader.read(&prob, &l, &params))
+            ++elements;
+    }
+
+    const unsigned long recordSize = 4 * sizeof(double);
+    const unsigned long checkpoint = (length / resumeEvery) * resumeEvery;
+    if(firstRun.size() != headerSize + length * recordSize)
+    {
+        output_screen("FAIL: The first run has " << (firstRun.size() - headerSize) / recordSize << " elements, expected " << length << "." << std::endl);
+        res = 0;
+    }
+
+    if(elements != length || secondRun.size() != headerSize + length * recordSize)
+    {
+        output_screen("FAIL: The resumed run has " << elements << " elements, expected " << length << "." << std::endl);
+        res = 0;
+    }
+
+    // the elements up to the checkpoint are kept as they were
+    const unsigned long kept = headerSize + checkpoint * recordSize;
+    if(secondRun.compare(0, kept, firstRun, 0, kept) != 0)
+    {
+        output_screen("FAIL: The elements before the checkpoint changed after resuming." << std::endl);
+        res = 0;
+    }
+}
+
+void
+TestMCMCFast::runDraggingSubTest(double& res, double& expected, std::string& subTestName)
+{
+    using namespace Math;
+
+    subTestName = "correlated_fast_slow_dragging";
+    res = 1;
+    expected = 1;
+
+    // x is slow and y is fast, with the correlation of 0.98 a slow step of 0.5 is 2.5 conditional sigmas, so it is almost always rejected unless y is dragged along
+    const double rho = 0.98;
+    const std::string root = "test_files/mcmc_fast_test_dragging";
+    const unsigned long length = 20000, burnin = 1000;
+
+    MCMCCorrelatedTestLikelihood like(rho);
+    MetropolisHastings mh(2, like, root, 5678);
+    mh.setParam(0, "x", -10, 10, 0, 1, 0.5, 1e-10);
+    mh.setParam(1, "y", -10, 10, 0, 1, 0.1, 1e-10);
+
+    std::vector<int> speeds(2);
+    speeds[0] = 1;
+    speeds[1] = 5;
+    mh.setBlockSpeeds(speeds, 10);
+
+    // the adaptive proposal would learn the correlation by itself
+    const int nChains = mh.run(length, 0, burnin, MetropolisHastings::ACCURACY, 0.01, false);
+
+    if(!isMaster())
+        return;
+
+    std::ifstream in(chainFileName(root, nChains, ".txt").c_str());
+    double weight, l, x, y;
+    double sumW = 0, sumX = 0, sumY = 0, sumXX = 0, sumYY = 0, sumXY = 0;
+    unsigned long n = 0;
+    while(in >> weight >> l >> x >> y)
+    {
+        if(n++ < burnin)
+            continue;
+
+        sumW += weight;
+        sumX += weight * x;
+        sumY += weight * y;
+        sumXX += weight * x * x;
+        sumYY += weight * y * y;
+        sumXY += weight * x * y;
+    }
+
+    const double meanX = sumX / sumW, meanY = sumY / sumW;
+    const double varX = sumXX / sumW - meanX * meanX, varY = sumYY / sumW - meanY * meanY;
+    const double cor = (sumXY / sumW - meanX * meanY) / std::sqrt(varX * varY);
+
+    output_screen1("Dragging: mean x = " << meanX << ", mean y = " << meanY << ", var x = " << varX << ", var y = " << varY << ", correlation = " << cor << std::endl);
+
+    if(n != length)
+    {
+        output_screen("FAIL: The chain has " << n << " elements, expected " << length << "." << std::endl);
+        res = 0;
+    }
+
+    if(std::abs(meanX) > 0.3 || std::abs(meanY) > 0.3)
+    {
+        output_screen("FAIL: Expected the means to be 0, the results are " << meanX << " and " << meanY << "." << std::endl);
+        res = 0;
+    }
+
+    if(!Math::areEqual(1.0, varX, 0.25) || !Math::areEqual(1.0, varY, 0.25))
+    {
+        output_screen("FAIL: Expected the variances to be 1, the results are " << varX << " and " << varY << "." << std::endl);
+        res = 0;
+    }
+
+    if(std::abs(cor - rho) > 0.01)
+    {
+        output_screen("FAIL: Expected the correlation to be " << rho << ", the result is " << cor << "." << std::endl);
+        res = 0;
+    }
+}